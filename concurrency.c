@@ -1,19 +1,436 @@
 /* system includes */
+#ifdef __linux__
+/* CPU affinity (sched_getaffinity(), CPU_SET() and
+   pthread_setaffinity_np()) is a GNU extension */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <errno.h>
+
+/* 3rd party includes */
+#include "confuse.h"
 
 /* project includes */
 #include "concurrency.h"
 #include "log.h"
 
-void concurrency_setup(void)
+typedef enum {
+    CONCURRENCY_MODEL_FORK,
+    CONCURRENCY_MODEL_PREFORK,
+    CONCURRENCY_MODEL_EVENT,
+    CONCURRENCY_MODEL_THREAD
+} concurrency_model;
+
+#define CFG_CONCURRENCY_MODEL "concurrency_model"
+#define CFG_CONCURRENCY_MODEL_DEFAULT CONCURRENCY_MODEL_FORK
+
+#define CFG_PREFORK_WORKERS "prefork_workers"
+#define CFG_PREFORK_WORKERS_DEFAULT 8
+
+#define CFG_EVENT_WORKERS "event_workers"
+#define CFG_EVENT_WORKERS_DEFAULT 1
+
+#define CFG_THREAD_WORKERS "thread_workers"
+#define CFG_THREAD_WORKERS_DEFAULT 0
+
+#define CFG_THREAD_AFFINITY "thread_affinity"
+#define CFG_THREAD_AFFINITY_DEFAULT cfg_false
+
+static concurrency_model model;
+static int listen_fd = -1;
+static int *listen_fds = 0;
+static concurrency_handler handler = 0;
+static concurrency_multiplexer multiplexer = 0;
+
+static pid_t *workers = 0;
+static int worker_count = 0;
+static short tearing_down;
+
+/**
+ * A reactor thread, running the multiplexer on its own listening socket.
+ */
+typedef struct {
+    pthread_t thread;
+    int index;
+    short started;
+} reactor;
+
+static reactor *reactors = 0;
+static short thread_affinity;
+
+/** readable once workers should stop; written by a signal handler in the
+    event model, and by concurrency_teardown() in the thread model */
+static int stop_pipe[2] = { -1, -1 };
+
+static int concurrency_initialize(cfg_t * configuration)
+{
+    model = cfg_getint(configuration, CFG_CONCURRENCY_MODEL);
+    switch (model) {
+    case CONCURRENCY_MODEL_PREFORK:
+        worker_count = cfg_getint(configuration, CFG_PREFORK_WORKERS);
+        break;
+    case CONCURRENCY_MODEL_EVENT:
+        worker_count = cfg_getint(configuration, CFG_EVENT_WORKERS);
+        break;
+    case CONCURRENCY_MODEL_THREAD:
+        worker_count = cfg_getint(configuration, CFG_THREAD_WORKERS);
+        thread_affinity = cfg_getbool(configuration, CFG_THREAD_AFFINITY);
+        if (worker_count == 0) {
+            /* one reactor per core */
+            worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        break;
+    case CONCURRENCY_MODEL_FORK:
+        return 1;
+    };
+
+    if (worker_count <= 0) {
+        worker_count = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Handle a single connection from beginning to end, then close it.
+ *
+ * @param[in] connection_fd Connected file descriptor
+ * @param[in] connection_addr Structure describing the connection
+ * @param[in] accepted Time at which the connection was accepted
+ */
+static void handle(int connection_fd, struct sockaddr_in *connection_addr,
+                   struct timeval *accepted)
+{
+    lo(LOG_DEBUG, "concurrency: handling connection on fd %d",
+       connection_fd);
+
+    handler(connection_fd, connection_addr, accepted);
+    shutdown(connection_fd, SHUT_RDWR);
+    close(connection_fd);
+
+    lo(LOG_DEBUG, "concurrency: finished work on fd %d", connection_fd);
+}
+
+static short worker_dead;
+static void worker_sigterm_handler(int sig)
+{
+    worker_dead = 1;
+    if (stop_pipe[1] != -1) {
+        /* wakes the multiplexer, if there is one */
+        if (write(stop_pipe[1], "", 1) == -1) {
+            return;
+        }
+    }
+}
+
+/**
+ * Create the pipe used to tell multiplexers when to stop.
+ *
+ * @return 1 on success, 0 on failure (and errno will be set)
+ */
+static int stop_pipe_open(void)
+{
+    if (pipe(stop_pipe) == -1) {
+        return 0;
+    }
+    if ((fcntl(stop_pipe[0], F_SETFL, O_NONBLOCK) == -1)
+        || (fcntl(stop_pipe[1], F_SETFL, O_NONBLOCK) == -1)) {
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+        stop_pipe[0] = stop_pipe[1] = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Close the stop pipe, if it's open.
+ */
+static void stop_pipe_close(void)
 {
+    if (stop_pipe[0] != -1) {
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+        stop_pipe[0] = stop_pipe[1] = -1;
+    }
+}
+
+/**
+ * Main loop of a worker. An event worker hands the shared listening socket
+ * to the multiplexer; a prefork worker accepts connections on it and handles
+ * them one after another until asked to stop. A SIGTERM lets the work in
+ * progress finish before the worker exits.
+ */
+static void worker(void)
+{
+    long handled = 0;
+
+    log_reopen();
+    lo(LOG_DEBUG, "concurrency: worker started");
+
+    worker_dead = 0;
+    if (model == CONCURRENCY_MODEL_EVENT) {
+        /* a vanished client must not take every other session with it */
+        signal(SIGPIPE, SIG_IGN);
+        if (!stop_pipe_open()) {
+            lo(LOG_ERROR, "concurrency: worker can't create pipe: %s",
+               strerror(errno));
+            exit(1);
+        }
+        if (!worker_dead) {
+            multiplexer(listen_fd, stop_pipe[0]);
+        }
+        lo(LOG_DEBUG, "concurrency: worker exiting");
+        exit(0);
+    }
+
+    while (!worker_dead) {
+        struct pollfd listen_poll;
+
+        listen_poll.fd = listen_fd;
+        listen_poll.events = POLLIN;
+        listen_poll.revents = 0;
+
+        if (poll(&listen_poll, 1, -1) <= 0) {
+            continue;
+        }
+
+        struct sockaddr_in connection_addr;
+        socklen_t connection_addr_length = sizeof(connection_addr);
+        int connection_fd =
+            accept(listen_fd, (struct sockaddr *)&connection_addr,
+                   &connection_addr_length);
+        if (connection_fd == -1) {
+            /* another worker won the race for this connection */
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)
+                || (errno == EINTR) || (errno == ECONNABORTED)) {
+                continue;
+            }
+            lo(LOG_ERROR, "concurrency: worker can't accept: %s",
+               strerror(errno));
+            break;
+        }
+
+        struct timeval accepted;
+        gettimeofday(&accepted, NULL);
+
+        /* some systems pass O_NONBLOCK on from the listening socket */
+        if (fcntl(connection_fd, F_SETFL, 0) == -1) {
+            lo(LOG_ERROR, "concurrency: can't make fd %d blocking: %s",
+               connection_fd, strerror(errno));
+            close(connection_fd);
+            continue;
+        }
+
+        handle(connection_fd, &connection_addr, &accepted);
+        ++handled;
+    }
+
+    lo(LOG_DEBUG, "concurrency: worker exiting after %ld connections",
+       handled);
+    exit(0);
+}
+
+/**
+ * Fork a new prefork worker.
+ *
+ * @return the worker's pid, or -1 on failure (and errno will be set)
+ */
+static pid_t worker_spawn(void)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+
+    /* hold SIGTERM until the worker has its own handler installed */
+    sigprocmask(SIG_BLOCK, &set, 0);
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGTERM, worker_sigterm_handler);
+        signal(SIGCHLD, SIG_DFL);
+        sigprocmask(SIG_UNBLOCK, &set, 0);
+        worker();
+    }
+    sigprocmask(SIG_UNBLOCK, &set, 0);
+
+    return pid;
+}
+
+/**
+ * Main loop of a reactor thread: multiplex connections from the thread's own
+ * listening socket until the stop pipe becomes readable.
+ *
+ * @param[in] arg the reactor
+ * @return nothing
+ */
+static void *reactor_main(void *arg)
+{
+    reactor *r = (reactor *) arg;
+
+    lo(LOG_DEBUG, "concurrency: reactor %d started", r->index);
+    multiplexer(listen_fds[r->index], stop_pipe[0]);
+    lo(LOG_DEBUG, "concurrency: reactor %d exiting", r->index);
+    return 0;
+}
+
+/**
+ * Pin a reactor thread to a single CPU. Reactors are spread round-robin over
+ * the CPUs which this process is allowed to use.
+ *
+ * @param[in] r the (running) reactor
+ */
+static void reactor_pin(reactor * r)
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        lo(LOG_ERROR, "concurrency: can't get cpu affinity: %s",
+           strerror(errno));
+        return;
+    }
+
+    int n = r->index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && (n-- == 0)) {
+            cpu_set_t pinned;
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+
+            int error =
+                pthread_setaffinity_np(r->thread, sizeof(pinned), &pinned);
+            if (error) {
+                lo(LOG_ERROR, "concurrency: can't pin reactor %d: %s",
+                   r->index, strerror(error));
+            } else {
+                lo(LOG_DEBUG, "concurrency: reactor %d pinned to cpu %d",
+                   r->index, cpu);
+            }
+            return;
+        }
+    }
+#else
+    lo(LOG_INFO, "concurrency: thread_affinity isn't supported here");
+#endif
+}
+
+/**
+ * Start the reactor threads.
+ *
+ * @return 1 on success, 0 on failure (and errno will be set)
+ */
+static int reactors_start(void)
+{
+    /* a vanished client must not take the whole process with it */
+    signal(SIGPIPE, SIG_IGN);
+    if (!stop_pipe_open()) {
+        return 0;
+    }
+
+    reactors = malloc(sizeof(reactor) * worker_count);
+    if (!reactors) {
+        return 0;
+    }
+    for (int i = 0; i < worker_count; ++i) {
+        reactors[i].index = i;
+        reactors[i].started = 0;
+    }
+
+    /* signals are for the main thread: reactors inherit this mask */
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    int error = 0;
+    for (int i = 0; (i < worker_count) && !error; ++i) {
+        error = pthread_create(&reactors[i].thread, 0, reactor_main,
+                               &reactors[i]);
+        if (!error) {
+            reactors[i].started = 1;
+            if (thread_affinity) {
+                reactor_pin(&reactors[i]);
+            }
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    if (error) {
+        errno = error;
+        return 0;
+    }
+    return 1;
+}
+
+int concurrency_listen_sockets(void)
+{
+    if (model == CONCURRENCY_MODEL_THREAD) {
+        return worker_count;
+    }
+    return 1;
+}
+
+int concurrency_setup(int *socket_fds,
+                      concurrency_handler connection_handler,
+                      concurrency_multiplexer connection_multiplexer)
+{
+    listen_fds = socket_fds;
+    listen_fd = socket_fds[0];
+    handler = connection_handler;
+    multiplexer = connection_multiplexer;
+    tearing_down = 0;
+
+    if (model == CONCURRENCY_MODEL_FORK) {
+        return 1;
+    }
+
+    /* workers all poll the same socket, but only one wins each accept() */
+    for (int i = 0; i < concurrency_listen_sockets(); ++i) {
+        if (fcntl(listen_fds[i], F_SETFL, O_NONBLOCK) == -1) {
+            return 0;
+        }
+    }
+
+    if (model == CONCURRENCY_MODEL_THREAD) {
+        return reactors_start();
+    }
+
+    workers = malloc(sizeof(pid_t) * worker_count);
+    if (!workers) {
+        return 0;
+    }
+    for (int i = 0; i < worker_count; ++i) {
+        workers[i] = -1;
+    }
+
+    for (int i = 0; i < worker_count; ++i) {
+        workers[i] = worker_spawn();
+        if (workers[i] == -1) {
+            return 0;
+        }
+        lo(LOG_DEBUG, "concurrency_setup: started worker pid %d",
+           workers[i]);
+    }
+    return 1;
+}
+
+short concurrency_parent_accepts(void)
+{
+    return model == CONCURRENCY_MODEL_FORK;
 }
 
 void concurrency_teardown(void)
@@ -21,6 +438,28 @@ void concurrency_teardown(void)
     int status;
     pid_t pid;
 
+    tearing_down = 1;
+    if (reactors) {
+        /* never drained, so every reactor sees it */
+        if (write(stop_pipe[1], "", 1) == -1) {
+            lo(LOG_ERROR, "concurrency: can't stop reactors: %s",
+               strerror(errno));
+        }
+        for (int i = 0; i < worker_count; ++i) {
+            if (reactors[i].started) {
+                pthread_join(reactors[i].thread, 0);
+                reactors[i].started = 0;
+            }
+        }
+    }
+    if (workers) {
+        for (int i = 0; i < worker_count; ++i) {
+            if (workers[i] > 0) {
+                kill(workers[i], SIGTERM);
+            }
+        }
+    }
+
     do {
         pid = wait3(&status, 0, 0);
         if (pid > 0) {
@@ -31,7 +470,7 @@ void concurrency_teardown(void)
 
 int concurrency_handle_connection(int connection_fd,
                                   struct sockaddr_in *connection_addr,
-                                  void (*handler) (int, struct sockaddr_in *))
+                                  struct timeval *accepted)
 {
     pid_t child_pid = fork();
 
@@ -41,14 +480,7 @@ int concurrency_handle_connection(int connection_fd,
     case 0:
         signal(SIGTERM, SIG_DFL);
         log_reopen();
-        lo(LOG_DEBUG, "concurrency_handle_connection: handling connection on "
-           "fd %d", connection_fd);
-
-        handler(connection_fd, connection_addr);
-        shutdown(connection_fd, SHUT_RDWR);
-        close(connection_fd);
-        lo(LOG_DEBUG, "concurrency_handle_connection: finished work on fd %d",
-           connection_fd);
+        handle(connection_fd, connection_addr, accepted);
         exit(0);
     }
 
@@ -56,6 +488,32 @@ int concurrency_handle_connection(int connection_fd,
     return 0;
 }
 
+/**
+ * Replace a prefork worker which has exited.
+ *
+ * @param[in] pid the pid of the worker which exited
+ */
+static void worker_replace(pid_t pid)
+{
+    if (!workers || tearing_down) {
+        return;
+    }
+
+    for (int i = 0; i < worker_count; ++i) {
+        if (workers[i] == pid) {
+            workers[i] = worker_spawn();
+            if (workers[i] == -1) {
+                lo(LOG_ERROR, "concurrency: unable to replace worker: %s",
+                   strerror(errno));
+            } else {
+                lo(LOG_INFO, "concurrency: replaced worker %d with %d", pid,
+                   workers[i]);
+            }
+            return;
+        }
+    }
+}
+
 void concurrency_join_finished(void)
 {
     int status;
@@ -65,6 +523,66 @@ void concurrency_join_finished(void)
         pid = wait3(&status, WNOHANG, 0);
         if (pid > 0) {
             lo(LOG_DEBUG, "concurrency_join_finished: joined pid %d", pid);
+            worker_replace(pid);
         }
     } while (pid > 0);
 }
+
+static void concurrency_shutdown(void)
+{
+    if (workers) {
+        free(workers);
+        workers = 0;
+    }
+    if (reactors) {
+        free(reactors);
+        reactors = 0;
+    }
+    stop_pipe_close();
+    worker_count = 0;
+}
+
+/**
+ * Convert from a string to a concurrency model enumeration.
+ *
+ * @param[in] string A string description of a concurrency model.
+ * @return a concurrency_model value (fork is the default)
+ */
+static concurrency_model concurrency_model_from_string(const char *string)
+{
+    if (strcasecmp(string, "prefork") == 0) {
+        return CONCURRENCY_MODEL_PREFORK;
+    }
+    if (strcasecmp(string, "event") == 0) {
+        return CONCURRENCY_MODEL_EVENT;
+    }
+    if (strcasecmp(string, "thread") == 0) {
+        return CONCURRENCY_MODEL_THREAD;
+    }
+    return CONCURRENCY_MODEL_FORK;
+}
+
+static int concurrency_model_parser(cfg_t * cfg, cfg_opt_t * opt,
+                                    const char *value, void *result)
+{
+    *(int *)result = concurrency_model_from_string(value);
+    return 0;
+}
+
+static cfg_opt_t concurrency_options[] = {
+    CFG_INT_CB(CFG_CONCURRENCY_MODEL, CFG_CONCURRENCY_MODEL_DEFAULT, 0,
+               concurrency_model_parser),
+    CFG_INT(CFG_PREFORK_WORKERS, CFG_PREFORK_WORKERS_DEFAULT, 0),
+    CFG_INT(CFG_EVENT_WORKERS, CFG_EVENT_WORKERS_DEFAULT, 0),
+    CFG_INT(CFG_THREAD_WORKERS, CFG_THREAD_WORKERS_DEFAULT, 0),
+    CFG_BOOL(CFG_THREAD_AFFINITY, CFG_THREAD_AFFINITY_DEFAULT, 0),
+    CFG_END()
+};
+
+/** @ingroup components */
+component concurrency_component = {
+    concurrency_initialize,
+    concurrency_shutdown,
+    concurrency_options,
+    SUBCOMPONENTS_NONE
+};
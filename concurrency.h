@@ -8,17 +8,73 @@
  * A simple API which (hopefully) keeps the nuts and bolts of managing a bunch
  * of concurrent network connections abstract enough that the implementation
  * can be varied in the future if need be.
+ *
+ * Four models are available, selected by the concurrency_model option:
+ *  - "fork": the main process accepts each connection and forks a child to
+ *    handle it (the default).
+ *  - "prefork": prefork_workers long-lived children accept connections from
+ *    the shared listening socket themselves, handling one after another.
+ *  - "event": event_workers long-lived children (one, by default) each
+ *    accept and multiplex many connections in a single event loop.
+ *  - "thread": thread_workers reactor threads (one per core, by default) in
+ *    the main process, each multiplexing connections from its own
+ *    SO_REUSEPORT listening socket; with thread_affinity, each thread is
+ *    pinned to a core. Threads share only read-only configuration.
  */
 
+#include <sys/time.h>
 #include <netinet/in.h>
 
+#include "component.h"
+
+/** @cond */
+DECLARE_COMPONENT(concurrency);
+/** @endcond */
+
+/**
+ * connection handler function type: connected fd, peer address and the time
+ * at which the connection was accepted.
+ */
+typedef void (*concurrency_handler) (int, struct sockaddr_in *,
+                                     struct timeval *);
+
+/**
+ * connection multiplexer function type: non-blocking listening socket, and
+ * a file descriptor which becomes readable when it's time to stop.
+ */
+typedef void (*concurrency_multiplexer) (int, int);
+
 /**
- * Set up concurrency strategy
+ * How many listening sockets does the configured model need? When there's
+ * more than one, they should all share the listening port (SO_REUSEPORT) so
+ * that the kernel spreads connections between them.
+ *
+ * @return the number of listening sockets to pass to concurrency_setup()
+ */
+int concurrency_listen_sockets(void);
+
+/**
+ * Set up concurrency strategy.
+ *
+ * @param[in] listen_fds concurrency_listen_sockets() listening sockets,
+ *   which must stay open until concurrency_teardown()
+ * @param[in] handler function which will handle each connection
+ * @param[in] multiplexer function which will handle many connections at once
+ * @return 1 on success, 0 on failure (and errno will be set)
+ */
+int concurrency_setup(int *listen_fds, concurrency_handler handler,
+                      concurrency_multiplexer multiplexer);
+
+/**
+ * Does the main process accept connections itself (and hand them to
+ * concurrency_handle_connection()), or do the concurrent contexts accept?
+ *
+ * @return 1 if the main process should accept; 0 otherwise.
  */
-void concurrency_setup(void);
+short concurrency_parent_accepts(void);
 
 /**
- * Clean up concurrent work (joins all children).
+ * Clean up concurrent work (joins all children and threads).
  */
 void concurrency_teardown(void);
 
@@ -27,18 +83,17 @@ void concurrency_teardown(void);
  *
  * @param[in] connection_fd Connected file descriptor
  * @param[in] connection_addr Structure describing the connection
- * @param[in] handler Function which will be called in the a concurrent context
+ * @param[in] accepted Time at which the connection was accepted
  * @return A unique identifier for the child's context. On failure, returns -1
  *   and sets errno.
  */
 int concurrency_handle_connection(int connection_fd,
                                   struct sockaddr_in *connection_addr,
-                                  void (*handler) (int,
-                                                   struct sockaddr_in *));
+                                  struct timeval *accepted);
 
 /**
  * Join all children which have finished work, i.e. those which can be
- * joined without waiting.
+ * joined without waiting. Prefork workers which exit are replaced.
  */
 void concurrency_join_finished(void);
 
@@ -3,40 +3,80 @@
 #include "db_driver.h"
 #include "mysql_driver.h"
 
+void *(*db_driver_session_new) (void) = 0;
+void (*db_driver_session_set) (void *) = 0;
+void (*db_driver_session_delete) (void *) = 0;
 short (*db_driver_initialize) (delegate_id) = 0;
 short (*db_driver_done) (void) = 0;
 short (*db_driver_expect_commands) (void) = 0;
 short (*db_driver_expect_replies) (void) = 0;
 short (*db_driver_got_error) (void);
 packet *(*db_driver_error_packet) (void);
+packet *(*db_driver_local_reply) (void) = 0;
 delegate_filter db_driver_delegate_filter = 0;
+delegate_filter db_driver_delegate_releasable = 0;
+int (*db_driver_login_packet) (packet *, packet *, const char *, const char *,
+                               const char *) = 0;
+short (*db_driver_login_ok) (packet *) = 0;
+packet *(*db_driver_replay_command) (int) = 0;
+packet *(*db_driver_reset_command) (void) = 0;
+packet *(*db_driver_prepare_command) (int, void **) = 0;
+short (*db_driver_prepare_reply) (packet *, void **) = 0;
+void (*db_driver_forget_connection) (void *) = 0;
+packet *(*db_driver_query_command) (const char *) = 0;
+db_driver_row(*db_driver_query_row) (packet *, int *, char **, int) = 0;
 packet_reader db_driver_get_packet = 0;
 packet_writer db_driver_put_packet = 0;
 db_driver_command_type(*db_driver_command) (packet *) = 0;
 void (*db_driver_command_done) (delegate_filter *) = 0;
+void (*db_driver_pin_delegates) (void) = 0;
+void (*db_driver_merge) (sql_merge *) = 0;
 void (*db_driver_reply) (delegate_id, packet *);
 packet *(*db_driver_reduce_replies) (packet_set *) = 0;
-int (*db_driver_rewrite_command) (packet *, packet *, const char *) = 0;
+int (*db_driver_rewrite_command) (delegate_id, packet *, packet *,
+                                  const char *, void **) = 0;
+short (*db_driver_delegate_sql) (delegate_id, const char *) = 0;
 char *(*db_driver_sql_extract) (packet *) = 0;
+char *(*db_driver_param_extract) (packet *, int) = 0;
+void (*db_driver_refuse) (const char *) = 0;
 char *(*db_driver_table_extract) (packet *) = 0;
 
 static int db_driver_load(cfg_t * configuration)
 {
+    db_driver_session_new = mysql_driver_session_new;
+    db_driver_session_set = mysql_driver_session_set;
+    db_driver_session_delete = mysql_driver_session_delete;
     db_driver_initialize = mysql_driver_initialize;
     db_driver_done = mysql_driver_done;
     db_driver_expect_commands = mysql_driver_expect_commands;
     db_driver_expect_replies = mysql_driver_expect_replies;
     db_driver_got_error = mysql_driver_got_error;
     db_driver_error_packet = mysql_driver_error_packet;
+    db_driver_local_reply = mysql_driver_local_reply;
     db_driver_delegate_filter = mysql_driver_delegate_filter;
+    db_driver_delegate_releasable = mysql_driver_delegate_releasable;
+    db_driver_login_packet = mysql_driver_login_packet;
+    db_driver_login_ok = mysql_driver_login_ok;
+    db_driver_replay_command = mysql_driver_replay_command;
+    db_driver_reset_command = mysql_driver_reset_command;
+    db_driver_prepare_command = mysql_driver_prepare_command;
+    db_driver_prepare_reply = mysql_driver_prepare_reply;
+    db_driver_forget_connection = mysql_driver_forget_connection;
+    db_driver_query_command = mysql_driver_query_command;
+    db_driver_query_row = mysql_driver_query_row;
     db_driver_get_packet = mysql_driver_get_packet;
     db_driver_put_packet = mysql_driver_put_packet;
     db_driver_command = mysql_driver_command;
     db_driver_command_done = mysql_driver_command_done;
+    db_driver_pin_delegates = mysql_driver_pin_delegates;
+    db_driver_merge = mysql_driver_merge;
     db_driver_reply = mysql_driver_reply;
     db_driver_reduce_replies = mysql_driver_reduce_replies;
     db_driver_rewrite_command = mysql_driver_rewrite_command;
+    db_driver_delegate_sql = mysql_driver_delegate_sql;
     db_driver_sql_extract = mysql_driver_sql_extract;
+    db_driver_param_extract = mysql_driver_param_extract;
+    db_driver_refuse = mysql_driver_refuse;
     db_driver_table_extract = mysql_driver_table_extract;
 
     return 1;
@@ -50,10 +90,15 @@ static cfg_opt_t db_driver_options[] = {
     CFG_END()
 };
 
+static component *db_driver_subcomponents[] = {
+    SUBCOMPONENT(mysql_driver),
+    SUBCOMPONENT_END()
+};
+
 /** @ingroup components */
 component db_driver_component = {
     db_driver_load,
     SHUTDOWN_NONE,
     db_driver_options,
-    SUBCOMPONENTS_NONE
+    db_driver_subcomponents
 };
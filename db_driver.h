@@ -14,6 +14,7 @@
 #include "packet.h"
 #include "component.h"
 #include "delegate_filter.h"
+#include "sql.h"
 
 /** @cond */
 DECLARE_COMPONENT(db_driver);
@@ -23,9 +24,28 @@ typedef enum {
     DB_DRIVER_COMMAND_TYPE_SQL,
     DB_DRIVER_COMMAND_TYPE_TABLE_META,
     DB_DRIVER_COMMAND_TYPE_UNSUPPORTED,
+    DB_DRIVER_COMMAND_TYPE_LOGIN,
+    DB_DRIVER_COMMAND_TYPE_QUIT,
+    DB_DRIVER_COMMAND_TYPE_SESSION_STATE,
+    DB_DRIVER_COMMAND_TYPE_LOCAL,
+    DB_DRIVER_COMMAND_TYPE_CHANGE_USER,
+    DB_DRIVER_COMMAND_TYPE_RESET,
+    DB_DRIVER_COMMAND_TYPE_PREPARE,
+    DB_DRIVER_COMMAND_TYPE_EXECUTE,
     DB_DRIVER_COMMAND_TYPE_OTHER
 } db_driver_command_type;
 
+/** What a packet of the reply to db_driver_query_command() was. */
+typedef enum {
+    DB_DRIVER_ROW,              /**< a row, whose values have been read */
+    DB_DRIVER_ROW_MORE,         /**< something else; more follows */
+    DB_DRIVER_ROW_DONE,         /**< the end of the reply */
+    DB_DRIVER_ROW_ERROR         /**< an error */
+} db_driver_row;
+
+extern void *(*db_driver_session_new) (void);
+extern void (*db_driver_session_set) (void *);
+extern void (*db_driver_session_delete) (void *);
 extern short (*db_driver_initialize) (delegate_id);
 
 extern short (*db_driver_done) (void);
@@ -37,15 +57,34 @@ extern packet_reader db_driver_get_packet;
 extern packet_writer db_driver_put_packet;
 
 extern delegate_filter db_driver_delegate_filter;
+extern delegate_filter db_driver_delegate_releasable;
+
+extern int (*db_driver_login_packet) (packet *, packet *, const char *,
+                                      const char *, const char *);
+extern short (*db_driver_login_ok) (packet *);
+extern packet *(*db_driver_replay_command) (int);
+extern packet *(*db_driver_reset_command) (void);
+extern packet *(*db_driver_prepare_command) (int, void **);
+extern short (*db_driver_prepare_reply) (packet *, void **);
+extern void (*db_driver_forget_connection) (void *);
+extern packet *(*db_driver_query_command) (const char *);
+extern db_driver_row(*db_driver_query_row) (packet *, int *, char **, int);
 
 extern db_driver_command_type(*db_driver_command) (packet *);
-extern int (*db_driver_rewrite_command) (packet *, packet *, const char *);
+extern int (*db_driver_rewrite_command) (delegate_id, packet *, packet *,
+                                         const char *, void **);
+extern short (*db_driver_delegate_sql) (delegate_id, const char *);
 extern void (*db_driver_command_done) (delegate_filter *);
+extern void (*db_driver_pin_delegates) (void);
+extern void (*db_driver_merge) (sql_merge *);
 
 extern void (*db_driver_reply) (delegate_id, packet *);
 extern char *(*db_driver_sql_extract) (packet *);
+extern char *(*db_driver_param_extract) (packet *, int);
+extern void (*db_driver_refuse) (const char *);
 extern char *(*db_driver_table_extract) (packet *);
 extern packet *(*db_driver_reduce_replies) (packet_set *);
 extern packet *(*db_driver_error_packet) (void);
+extern packet *(*db_driver_local_reply) (void);
 
 #endif
@@ -1,5 +1,6 @@
 /* system includes */
 #include <arpa/inet.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -14,19 +15,125 @@
 
 /* project includes */
 #include "delegate.h"
+#include "event.h"
 #include "log.h"
 #include "packet.h"
+#include "uring.h"
 
+/**
+ * Configuration of a single delegate.
+ */
 typedef struct {
     int partition_id;
-    int fd;
-    short connected;
     int port;
     struct in_addr ip;
+    char address[INET_ADDRSTRLEN];      /**< ip, formatted for logging */
     char *name;
-    void *driver_state;
+    char *user;               /**< pdb's own login, for pooled connections */
+    char *password;
 } delegate;
 
+/**
+ * Where pdb is up to in logging itself in to a delegate.
+ */
+typedef enum {
+    LOGIN_NONE,
+    LOGIN_CONNECTING,
+    LOGIN_GREETING,           /**< waiting for the delegate's greeting */
+    LOGIN_SENDING,            /**< sending the login packet */
+    LOGIN_RESULT,             /**< waiting to hear whether it worked */
+    LOGIN_ATTACHING,          /**< handed a pooled connection */
+    LOGIN_RESETTING,          /**< clearing another client's session state */
+    LOGIN_RESET_RESULT,
+    LOGIN_REPLAYING,          /**< restoring the client's session state */
+    LOGIN_REPLAY_RESULT,
+    LOGIN_PREPARING,          /**< doing what the driver needs done before
+                                   the command */
+    LOGIN_PREPARE_RESULT
+} login_stage;
+
+typedef struct delegate_connection delegate_connection;
+
+/**
+ * A session's connection to a single delegate.
+ */
+struct delegate_connection {
+    int fd;
+    short connected;
+    short pending; /**< still has work to do in the current operation */
+    int sent;      /**< bytes of the current command written so far */
+    short pooled;  /**< fd was borrowed from this thread's pool */
+    short dirty;   /**< fd has another client's session state */
+    login_stage login;
+    packet *login_packet;     /**< greeting, login or reply in flight */
+    int replayed;             /**< session state commands replayed */
+    int prepared;             /**< ...and commands sent before the current
+                                   command */
+    void *driver_data;        /**< what the driver keeps with the connection
+                                   (see delegate_login) */
+    packet_buffer in;         /**< received from fd, not yet read */
+    int watched_fd;           /**< fd registered with the session's events */
+    short watched_events;     /**< ...and the interest registered */
+    delegate_session *owner;
+    short waiting;            /**< queued for a pooled connection */
+    struct timeval waiting_since;
+    delegate_connection *next_waiter;
+};
+
+/**
+ * Kinds of parallel I/O operation.
+ */
+typedef enum {
+    DELEGATE_OP_NONE,
+    DELEGATE_OP_CONNECT,
+    DELEGATE_OP_ACQUIRE,
+    DELEGATE_OP_PUT,
+    DELEGATE_OP_GET
+} delegate_op;
+
+struct delegate_session {
+    delegate_connection *connections;
+    delegate_op op;           /**< operation in progress */
+    int pending;              /**< delegates yet to finish the operation */
+    int delivered;            /**< delegates a read has had a packet from */
+    packet_set *packets;      /**< commands being written / replies read */
+    packet_reader get_packet;
+    packet_writer put_packet;
+    void (*wake) (void *);    /**< see delegate_session_wake() */
+    void *wake_data;
+    event_set *events;        /**< delegate_io()'s, made on first use */
+    event *ready;             /**< delegate_io()'s notifications */
+};
+
+/**
+ * An idle pooled connection.
+ */
+typedef struct {
+    int fd;
+    short dirty;              /**< last used by a client with session state */
+    void *driver_data;        /**< see delegate_connection */
+    struct timeval idle_since;
+} pool_entry;
+
+/**
+ * A thread's pool of logged-in connections to a single delegate.
+ */
+typedef struct {
+    pool_entry *idle;         /**< most recently released last */
+    int idle_count;
+    int open;                 /**< idle, borrowed, or still logging in */
+    delegate_connection *waiters;       /**< sessions queued, oldest first */
+    delegate_connection *last_waiter;
+
+    long acquired;            /**< connections handed to sessions */
+    long hits;                /**< ...which were already idle */
+    long resets;              /**< ...which had to have their state cleared */
+    long waits;               /**< ...for which the session had to queue */
+    long wait_usec;           /**< total time spent queued */
+    long reaped;              /**< idle connections closed */
+    struct timeval reported;
+} delegate_pool;
+
 #define MASTER_PARTITION_ID -1
 #define MASTER_PARTITION "master"
 
@@ -44,8 +151,48 @@ typedef struct {
 #define CFG_NAME "name"
 #define CFG_NAME_DEFAULT "pdb"
 
+#define CFG_USER "user"
+#define CFG_USER_DEFAULT 0
+
+#define CFG_PASSWORD "password"
+#define CFG_PASSWORD_DEFAULT ""
+
+#define CFG_POOL_MIN "pool_min"
+#define CFG_POOL_MIN_DEFAULT 0
+
+#define CFG_POOL_MAX "pool_max"
+#define CFG_POOL_MAX_DEFAULT 0
+
+#define CFG_POOL_IDLE_TIMEOUT "pool_idle_timeout"
+#define CFG_POOL_IDLE_TIMEOUT_DEFAULT 60
+
+#define CFG_IO_URING "io_uring"
+#define CFG_IO_URING_DEFAULT cfg_false
+
+/** how often (in seconds) to log each pool's counters */
+#define POOL_REPORT_INTERVAL 60
+
+/** completions handled per wait, when using io_uring */
+#define URING_BATCH 64
+
+/* the configuration is only written while components are configured, after
+   which any thread may read it */
 static delegate *delegates = 0;
 static int delegate_count = 0;
+static int pool_min = 0;
+static int pool_max = 0;
+static int pool_idle_timeout = 0;
+static short io_uring = 0;
+
+/** the session currently being worked on by this thread */
+static __thread delegate_session *session = 0;
+
+/** this thread's pools, one per delegate, when pooling */
+static __thread delegate_pool *pools = 0;
+/** how this thread logs in to delegates */
+static __thread delegate_login driver_login;
+/** has this thread tried to open its io_uring? */
+static __thread short uring_tried = 0;
 
 /**
  * Component initialization for the delegate component.
@@ -55,8 +202,19 @@ static int delegate_count = 0;
  */
 static int delegate_initialize(cfg_t * configuration)
 {
+    pool_min = cfg_getint(configuration, CFG_POOL_MIN);
+    pool_max = cfg_getint(configuration, CFG_POOL_MAX);
+    pool_idle_timeout = cfg_getint(configuration, CFG_POOL_IDLE_TIMEOUT);
+    io_uring = cfg_getbool(configuration, CFG_IO_URING);
+    if ((pool_max < 0) || (pool_min < 0) || (pool_min > pool_max)) {
+        lo(LOG_ERROR, "delegate_initialize: bad pool size %d-%d", pool_min,
+           pool_max);
+        return 0;
+    }
+
     delegate_count = cfg_size(configuration, CFG_DELEGATE);
-    delegates = malloc(sizeof(delegate) * delegate_count);
+    /* zeroed, so that delegate_shutdown() can clean up after a failure */
+    delegates = calloc(delegate_count, sizeof(delegate));
     if (!delegates) {
         delegate_count = 0;
         return 0;
@@ -67,14 +225,34 @@ static int delegate_initialize(cfg_t * configuration)
 
         delegates[i].partition_id = cfg_getint(delegate_config,
                                                CFG_PARTITION_ID);
-        delegates[i].fd = -1;
-        delegates[i].connected = 0;
         delegates[i].port = cfg_getint(delegate_config, CFG_PORT);
         delegates[i].ip.s_addr = cfg_getint(delegate_config, CFG_HOSTNAME);
+        if (!inet_ntop(AF_INET, &delegates[i].ip, delegates[i].address,
+                       sizeof(delegates[i].address))) {
+            return 0;
+        }
         delegates[i].name = strdup(cfg_getstr(delegate_config, CFG_NAME));
         if (!delegates[i].name) {
             return 0;
         }
+
+        char *user = cfg_getstr(delegate_config, CFG_USER);
+        if (user) {
+            delegates[i].user = strdup(user);
+            if (!delegates[i].user) {
+                return 0;
+            }
+        } else if (pool_max > 0) {
+            lo(LOG_ERROR, "delegate_initialize: pooling needs a user for %s",
+               delegates[i].name);
+            return 0;
+        }
+        delegates[i].password =
+            strdup(cfg_getstr(delegate_config, CFG_PASSWORD));
+        if (!delegates[i].password) {
+            return 0;
+        }
+
         lo(LOG_DEBUG, "delegate_initialize: %s(%d) at %d:%d",
            delegates[i].name, delegates[i].partition_id,
            delegates[i].ip.s_addr, delegates[i].port);
@@ -97,282 +275,1472 @@ delegate_id delegate_master_id(void)
     return USHRT_MAX;           /* XX: this should never happen... */
 }
 
-/**
- * Per-delegate information used by delegate_io when multiplexing I/O work
- * across the set of delegates.
- */
-typedef struct {
-    short pending;
-    int poll_index;
-} delegate_io_info;
+int delegate_partition(int partition_id)
+{
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        if (delegates[i].partition_id == partition_id) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-/**
- * This higher-order function orchestrates I/O work across the set of delegates
- * using a worker function to perform actual I/O.
- * 
- * @param[in] event the set of poll(2) events which this worker cares about
- * @param[in] worker the worker function
- * @param[in,out] worker_args extra arguments to the worker function
- * @return 0 on failure, 1 on success
- */
-static int delegate_io(short event,
-                       packet_status(*worker) (delegate_id, void *),
-                       void *worker_args, delegate_filter * filters)
+int delegate_fd(delegate_id id)
+{
+    return session->connections[id].fd;
+}
+
+short delegate_pooled(void)
 {
-    delegate_io_info *info =
-        malloc(sizeof(delegate_io_info) * delegate_count);
-    if (!info) {
+    return pool_max > 0;
+}
+
+delegate_session *delegate_session_new(void)
+{
+    delegate_session *s = malloc(sizeof(delegate_session));
+    if (!s) {
         return 0;
     }
 
-    int pending = 0;
+    s->connections = malloc(sizeof(delegate_connection) * delegate_count);
+    if (!s->connections) {
+        free(s);
+        return 0;
+    }
     for (delegate_id i = 0; i < delegate_count; ++i) {
-        if (delegate_filter_reduce(filters, i) == DELEGATE_FILTER_USE) {
-            ++pending;
-            info[i].pending = 1;
-            info[i].poll_index = -1;
-        } else {
-            info[i].pending = 0;
-        }
+        delegate_connection *c = &s->connections[i];
+        c->fd = -1;
+        packet_buffer_init(&c->in, -1);
+        c->connected = 0;
+        c->pending = 0;
+        c->sent = 0;
+        c->pooled = 0;
+        c->dirty = 0;
+        c->login = LOGIN_NONE;
+        c->login_packet = 0;
+        c->replayed = 0;
+        c->prepared = 0;
+        c->driver_data = 0;
+        c->watched_fd = -1;
+        c->watched_events = 0;
+        c->owner = s;
+        c->waiting = 0;
+        c->next_waiter = 0;
     }
 
-    while (pending > 0) {
-        struct pollfd *pending_poll = malloc(sizeof(struct pollfd) * pending);
-        if (!pending_poll) {
-            free(info);
-            return 0;
-        }
+    s->op = DELEGATE_OP_NONE;
+    s->pending = 0;
+    s->packets = 0;
+    s->get_packet = 0;
+    s->put_packet = 0;
+    s->wake = 0;
+    s->wake_data = 0;
+    s->events = 0;
+    s->ready = 0;
+    return s;
+}
 
-        for (delegate_id i = 0, j = 0; i < delegate_count; ++i) {
-            if (info[i].pending) {
-                pending_poll[j].fd = delegates[i].fd;
-                pending_poll[j].events = event;
-                pending_poll[j].revents = 0;
-                info[i].poll_index = j;
-                ++j;
-            }
+void delegate_session_set(delegate_session * s)
+{
+    session = s;
+}
+
+void delegate_session_wake(delegate_session * s, void (*wake) (void *),
+                           void *data)
+{
+    s->wake = wake;
+    s->wake_data = data;
+}
+
+void delegate_session_delete(delegate_session * s)
+{
+    if (s) {
+        delegate_session *current = session;
+        session = s;
+        delegate_disconnect();
+        session = (current == s) ? 0 : current;
+
+        for (delegate_id i = 0; i < delegate_count; ++i) {
+            packet_buffer_free(&s->connections[i].in);
         }
+        if (s->events) {
+            event_set_delete(s->events);
+        }
+        free(s->ready);
+        free(s->connections);
+        free(s);
+    }
+}
 
-        if (poll(pending_poll, pending, -1) <= 0) {
-            free(pending_poll);
-            free(info);
-            return 0;
+/**
+ * Begin a parallel operation on the current session.
+ *
+ * @param[in] op the operation
+ * @param[in] filters set of filters to apply to the list of delegates
+ */
+static void delegate_io_begin(delegate_op op, delegate_filter * filters)
+{
+    session->op = op;
+    session->pending = 0;
+    session->delivered = 0;
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        session->connections[i].sent = 0;
+        if (delegate_filter_reduce(filters, i) == DELEGATE_FILTER_USE) {
+            session->connections[i].pending = 1;
+            ++session->pending;
+        } else {
+            session->connections[i].pending = 0;
         }
+    }
+}
 
-        for (delegate_id i = 0; i < delegate_count; ++i) {
-            if (info[i].pending) {
-                if (pending_poll[info[i].poll_index].revents & event) {
-                    switch (worker(i, worker_args)) {
-                    case PACKET_ERROR:
-                    case PACKET_EOF:
-                        free(pending_poll);
-                        free(info);
-                        return 0;
-                    case PACKET_INCOMPLETE:
-                        break;
-                    case PACKET_COMPLETE:
-                        --pending;
-                        info[i].pending = 0;
-                        break;
-                    };
-                }
-            }
+/**
+ * Abandon the operation in progress, if any.
+ */
+static void delegate_io_end(void)
+{
+    if (session->packets) {
+        packet_set_delete(session->packets);
+        session->packets = 0;
+    }
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        session->connections[i].pending = 0;
+    }
+    session->pending = 0;
+    session->op = DELEGATE_OP_NONE;
+}
+
+/**
+ * Mark a delegate's part of the operation in progress as done.
+ *
+ * @param[in] s the session
+ * @param[in,out] c the delegate's connection
+ */
+static void delegate_io_complete(delegate_session * s,
+                                 delegate_connection * c)
+{
+    if (c->pending) {
+        c->pending = 0;
+        --s->pending;
+        if (s->op == DELEGATE_OP_GET) {
+            ++s->delivered;
         }
+    }
+}
 
-        free(pending_poll);
+short delegate_io_events(delegate_id id)
+{
+    delegate_connection *c = &session->connections[id];
+
+    if (!c->pending) {
+        return 0;
     }
 
-    free(info);
-    return 1;
+    switch (session->op) {
+    case DELEGATE_OP_CONNECT:
+    case DELEGATE_OP_PUT:
+        return POLLOUT;
+    case DELEGATE_OP_GET:
+        return POLLIN;
+    case DELEGATE_OP_ACQUIRE:
+        switch (c->login) {
+        case LOGIN_CONNECTING:
+        case LOGIN_SENDING:
+        case LOGIN_ATTACHING:
+        case LOGIN_RESETTING:
+        case LOGIN_REPLAYING:
+        case LOGIN_PREPARING:
+            return POLLOUT;
+        case LOGIN_GREETING:
+        case LOGIN_RESULT:
+        case LOGIN_RESET_RESULT:
+        case LOGIN_REPLAY_RESULT:
+        case LOGIN_PREPARE_RESULT:
+            return POLLIN;
+        case LOGIN_NONE:
+            /* queued for a pooled connection */
+            break;
+        };
+        break;
+    case DELEGATE_OP_NONE:
+        break;
+    };
+    return 0;
+}
+
+short delegate_io_done(void)
+{
+    /* a read needn't wait for the slowest delegate */
+    return (session->pending == 0)
+        || ((session->op == DELEGATE_OP_GET) && (session->delivered > 0));
 }
 
 /**
- * I/O 'worker' function for asynchronously connecting to a delegate
+ * Format elapsed time since a given time in microseconds.
  *
- * @param delegate_index index of the current delegate
- * @param void_args unused
- * @return PACKET_COMPLETE
+ * @param[in] since the starting time
+ * @return microseconds since then
  */
-static packet_status delegate_connect_worker(delegate_id delegate_index,
-                                             void *void_args)
+static long usec_since(struct timeval *since)
 {
-    /* The connect() has already been issued; this function will only be
-       called when the connection completes (according to poll()) */
-    delegates[delegate_index].connected = 1;
-    lo(LOG_DEBUG, "delegate_connect_worker: connection to %s:%d completed",
-       inet_ntoa(delegates[delegate_index].ip),
-       delegates[delegate_index].port);
-    return PACKET_COMPLETE;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000000L +
+        (now.tv_usec - since->tv_usec);
 }
 
-int delegate_connect(void)
+/**
+ * Log a pool's counters.
+ *
+ * @param[in] id the delegate
+ */
+static void pool_report(delegate_id id)
 {
-    if (delegate_count == 0) {
-        errno = EINVAL;
-        return -1;
+    delegate_pool *pool = &pools[id];
+
+    long hit_rate = 0;
+    long wait_average = 0;
+    if (pool->acquired) {
+        hit_rate = pool->hits * 100 / pool->acquired;
+    }
+    if (pool->waits) {
+        wait_average = pool->wait_usec / pool->waits;
     }
 
-    for (delegate_id i = 0; i < delegate_count; ++i) {
-        delegates[i].fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (delegates[i].fd == -1) {
-            delegate_disconnect();
-            return -1;
-        }
+    lo(LOG_INFO, "delegate_pool: %s: %ld acquired, %ld%% hits, %ld waits "
+       "averaging %ld usec, %ld resets, %ld reaped, %d open, %d idle",
+       delegates[id].name, pool->acquired, hit_rate, pool->waits,
+       wait_average, pool->resets, pool->reaped, pool->open,
+       pool->idle_count);
+    gettimeofday(&pool->reported, NULL);
+}
 
-        /* set the socket to non-blocking */
-        if (fcntl(delegates[i].fd, F_SETFL, O_NONBLOCK) == -1) {
-            delegate_disconnect();
-            return -1;
-        }
+/**
+ * Free what the driver kept with a connection, once the connection has been
+ * closed or reset.
+ *
+ * @param[in,out] driver_data what the driver kept
+ */
+static void forget_driver_data(void **driver_data)
+{
+    if (*driver_data) {
+        driver_login.forget_connection(*driver_data);
+        *driver_data = 0;
+    }
+}
 
-        struct sockaddr_in connect_addr;
+/**
+ * Start connecting to a delegate on behalf of a session: the connection
+ * completes its login as part of the session's acquire operation.
+ *
+ * @param[in] id the delegate
+ * @param[in,out] c the session's connection to the delegate
+ * @return 1 on success, 0 on failure (and errno will be set)
+ */
+static int delegate_connection_start(delegate_id id,
+                                     delegate_connection * c)
+{
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd == -1) {
+        return 0;
+    }
+    if (fcntl(c->fd, F_SETFL, O_NONBLOCK) == -1) {
+        close(c->fd);
+        c->fd = -1;
+        return 0;
+    }
+    packet_buffer_attach(&c->in, c->fd);
 
-        connect_addr.sin_family = AF_INET;
-        connect_addr.sin_port = htons(delegates[i].port);
-        connect_addr.sin_addr = delegates[i].ip;
+    struct sockaddr_in connect_addr;
+    connect_addr.sin_family = AF_INET;
+    connect_addr.sin_port = htons(delegates[id].port);
+    connect_addr.sin_addr = delegates[id].ip;
 
-        lo(LOG_DEBUG, "delegate_connect: starting connection to %s:%d",
-           inet_ntoa(delegates[i].ip), delegates[i].port);
+    lo(LOG_DEBUG, "delegate_connection_start: connecting to %s:%d",
+       delegates[id].address, delegates[id].port);
 
-        if (connect(delegates[i].fd, (struct sockaddr *)&connect_addr,
-                    sizeof(connect_addr)) == -1) {
-            if (errno != EINPROGRESS) {
-                delegate_disconnect();
-                return -1;
-            }
-        } else {
-            delegates[i].connected = 1;
+    c->connected = 0;
+    c->login = LOGIN_CONNECTING;
+    if (connect(c->fd, (struct sockaddr *)&connect_addr,
+                sizeof(connect_addr)) == -1) {
+        if (errno != EINPROGRESS) {
+            close(c->fd);
+            c->fd = -1;
+            packet_buffer_attach(&c->in, -1);
+            c->login = LOGIN_NONE;
+            return 0;
         }
+    } else {
+        c->connected = 1;
+        c->login = LOGIN_GREETING;
     }
+    return 1;
+}
 
-    /* Block until all delegates are connected */
-    if (!delegate_io(POLLOUT, delegate_connect_worker, 0, NULL)) {
-        delegate_disconnect();
-        return -1;
+/**
+ * Start opening a new pooled connection on behalf of a session.
+ *
+ * @param[in] id the delegate
+ * @param[in,out] c the session's connection to the delegate
+ * @return 1 on success, 0 on failure (and errno will be set)
+ */
+static int pool_connection_start(delegate_id id, delegate_connection * c)
+{
+    if (!delegate_connection_start(id, c)) {
+        return 0;
     }
 
-    return 0;
+    c->pooled = 1;
+    ++pools[id].open;
+    ++pools[id].acquired;
+    return 1;
 }
 
-void delegate_disconnect(void)
+/**
+ * Take the oldest session queued for a delegate's pool off the queue.
+ *
+ * @param[in] id the delegate
+ * @return the queued connection, or 0 if nobody's waiting
+ */
+static delegate_connection *pool_waiter_next(delegate_id id)
 {
-    for (delegate_id i = 0; i < delegate_count; ++i) {
-        if (delegates[i].fd > 0) {
-            if (delegates[i].connected) {
-                shutdown(delegates[i].fd, SHUT_RDWR);
-                delegates[i].connected = 0;
-            }
-            close(delegates[i].fd);
-            delegates[i].fd = -1;
+    delegate_pool *pool = &pools[id];
+    delegate_connection *c = pool->waiters;
+
+    if (c) {
+        pool->waiters = c->next_waiter;
+        if (!pool->waiters) {
+            pool->last_waiter = 0;
         }
+        c->next_waiter = 0;
+        c->waiting = 0;
+        pool->wait_usec += usec_since(&c->waiting_since);
     }
+    return c;
 }
 
 /**
- * Arguments to gather_replies_worker
+ * Remove a connection from its pool's queue.
+ *
+ * @param[in] id the delegate
+ * @param[in,out] c the queued connection
  */
-typedef struct {
-    packet_set *replies;
-    packet_reader get_packet;
-} gather_replies_worker_args;
+static void pool_waiter_cancel(delegate_id id, delegate_connection * c)
+{
+    delegate_pool *pool = &pools[id];
+    delegate_connection *previous = 0;
+
+    for (delegate_connection * w = pool->waiters; w; w = w->next_waiter) {
+        if (w == c) {
+            if (previous) {
+                previous->next_waiter = c->next_waiter;
+            } else {
+                pool->waiters = c->next_waiter;
+            }
+            if (pool->last_waiter == c) {
+                pool->last_waiter = previous;
+            }
+            break;
+        }
+        previous = w;
+    }
+    c->next_waiter = 0;
+    c->waiting = 0;
+}
 
 /**
- * I/O 'worker' function for reading replies from a delegate.
+ * Give a pooled connection back. The oldest session queued for one gets it
+ * straight away, and sets it up for its client once woken; otherwise it
+ * goes on the idle list.
  *
- * @param delgate_index index of the current delegate
- * @param void_args arguments as a void pointer
- * @return status of the operation
+ * @param[in] id the delegate
+ * @param[in] fd the connection
+ * @param[in] dirty 1 if the connection has a client's session state
+ * @param[in] driver_data what the driver keeps with the connection
  */
-static packet_status gather_replies_worker(delegate_id delegate_index,
-                                           void *void_args)
+static void pool_release(delegate_id id, int fd, short dirty,
+                         void *driver_data)
 {
-    gather_replies_worker_args *args =
-        (gather_replies_worker_args *) void_args;
-    return args->get_packet(delegates[delegate_index].fd,
-                            packet_set_get(args->replies, delegate_index));
+    delegate_pool *pool = &pools[id];
+    delegate_connection *waiter = pool_waiter_next(id);
+
+    if (waiter) {
+        ++pool->acquired;
+        waiter->fd = fd;
+        packet_buffer_attach(&waiter->in, fd);
+        waiter->pooled = 1;
+        waiter->connected = 1;
+        waiter->dirty = dirty;
+        waiter->driver_data = driver_data;
+        waiter->login = LOGIN_ATTACHING;
+        waiter->owner->wake(waiter->owner->wake_data);
+        return;
+    }
+
+    pool->idle[pool->idle_count].fd = fd;
+    pool->idle[pool->idle_count].dirty = dirty;
+    pool->idle[pool->idle_count].driver_data = driver_data;
+    gettimeofday(&pool->idle[pool->idle_count].idle_since, NULL);
+    ++pool->idle_count;
+
+    if (usec_since(&pool->reported) >= POOL_REPORT_INTERVAL * 1000000L) {
+        pool_report(id);
+    }
 }
 
-packet_set *delegate_get(delegate_filter * filters, packet_reader get_packet)
+/**
+ * Account for a pooled connection which has been closed. A session queued
+ * for the pool can now open a connection of its own.
+ *
+ * @param[in] id the delegate
+ */
+static void pool_forget(delegate_id id)
 {
-    packet_set *replies = packet_set_new(delegate_count);
-    if (!replies) {
-        return 0;
-    }
+    --pools[id].open;
 
-    /* read from all delegates in parallel */
-    gather_replies_worker_args args;
-    args.replies = replies;
-    args.get_packet = get_packet;
-    if (delegate_io(POLLIN, gather_replies_worker, &args, filters) == 0) {
-        return 0;
+    delegate_connection *waiter = pool_waiter_next(id);
+    if (waiter) {
+        if (pool_connection_start(id, waiter)) {
+            waiter->owner->wake(waiter->owner->wake_data);
+        } else {
+            lo(LOG_ERROR, "delegate_pool: %s: can't connect: %s",
+               delegates[id].name, strerror(errno));
+            /* leave it at the front of the queue */
+            waiter->waiting = 1;
+            gettimeofday(&waiter->waiting_since, NULL);
+            waiter->next_waiter = pools[id].waiters;
+            pools[id].waiters = waiter;
+            if (!pools[id].last_waiter) {
+                pools[id].last_waiter = waiter;
+            }
+        }
     }
+}
 
-    return replies;
+/**
+ * Get a connection the session holds ready for the current command, by
+ * sending whatever the driver needs done on it first.
+ *
+ * @param[in,out] c the session's connection
+ * @return PACKET_COMPLETE if there was nothing to do, or PACKET_INCOMPLETE
+ */
+static packet_status connection_prepare(delegate_connection * c)
+{
+    c->sent = 0;
+    c->prepared = 0;
+    if (driver_login.prepare_command(0, &c->driver_data)) {
+        c->login = LOGIN_PREPARING;
+        return PACKET_INCOMPLETE;
+    }
+    c->login = LOGIN_NONE;
+    return PACKET_COMPLETE;
 }
 
 /**
- * Arguments to proxy_command_worker.
+ * Set a connection which is already logged in up for the current session:
+ * clear any other client's session state, then replay the session's own,
+ * then get it ready for the current command.
+ *
+ * @param[in,out] c the session's connection
+ * @return PACKET_COMPLETE if there was nothing to do, or PACKET_INCOMPLETE
  */
-typedef struct {
-    int *sent_list;
-    packet_writer put_packet;
-    packet_set *commands;
-} proxy_command_worker_args;
+static packet_status connection_attach(delegate_connection * c)
+{
+    c->sent = 0;
+    if (c->dirty) {
+        c->login = LOGIN_RESETTING;
+        return PACKET_INCOMPLETE;
+    }
+    if (driver_login.replay_command(0)) {
+        c->replayed = 0;
+        c->login = LOGIN_REPLAYING;
+        return PACKET_INCOMPLETE;
+    }
+    return connection_prepare(c);
+}
 
 /**
- * I/O 'worker' function for writing command to a delegate.
+ * Is an idle pooled connection still usable? A delegate has nothing to say
+ * on an idle connection unless it's closing it.
  *
- * @param delegate_index index of the current delegate
- * @param void_args arguments, cast as a void pointer
- * @return status of the current write
+ * @param[in] fd the connection
+ * @return 1 if so; 0 otherwise.
  */
-static packet_status proxy_command_worker(delegate_id delegate_index,
-                                          void *void_args)
+static short pool_connection_alive(int fd)
 {
-    proxy_command_worker_args *args = (proxy_command_worker_args *) void_args;
-    return args->put_packet(delegates[delegate_index].fd,
-                            packet_set_get(args->commands, delegate_index),
-                            &(args->sent_list[delegate_index]));
+    struct pollfd check;
+    check.fd = fd;
+    check.events = POLLIN;
+    check.revents = 0;
+    return poll(&check, 1, 0) == 0;
 }
 
-int delegate_put(delegate_filter * filters, packet_writer put_packet,
-                 int (*rewrite_command) (packet *, packet *, const char *),
-                 packet * command)
+/**
+ * Find a pooled connection for the current session: an idle one if
+ * possible, else a new one if the pool has room, else a place in the
+ * pool's queue.
+ *
+ * @param[in] id the delegate
+ * @return 1 on success, 0 on failure (and errno will be set)
+ */
+static int pool_acquire(delegate_id id)
 {
-    int *sent_list = malloc(sizeof(int) * delegate_count);
-    if (!sent_list) {
-        return 0;
+    delegate_pool *pool = &pools[id];
+    delegate_connection *c = &session->connections[id];
+
+    /* the most recently used connection is the least likely to be stale */
+    while (pool->idle_count > 0) {
+        pool_entry *entry = &pool->idle[--pool->idle_count];
+        int fd = entry->fd;
+        if (pool_connection_alive(fd)) {
+            ++pool->acquired;
+            ++pool->hits;
+            c->fd = fd;
+            packet_buffer_attach(&c->in, fd);
+            c->pooled = 1;
+            c->connected = 1;
+            c->dirty = entry->dirty;
+            c->driver_data = entry->driver_data;
+            if (connection_attach(c) == PACKET_COMPLETE) {
+                delegate_io_complete(session, c);
+            }
+            return 1;
+        }
+
+        lo(LOG_INFO, "delegate_pool: %s: dropping a dead connection",
+           delegates[id].name);
+        close(fd);
+        forget_driver_data(&entry->driver_data);
+        --pool->open;
+    }
+
+    if (pool->open < pool_max) {
+        return pool_connection_start(id, c);
     }
 
-    packet_set *commands = packet_set_new(delegate_count);
-    if (!commands) {
-        free(sent_list);
+    /* only a multiplexed session can wait for another to finish */
+    if (!session->wake) {
+        errno = EAGAIN;
         return 0;
     }
 
-    for (delegate_id i = 0; i < delegate_count; ++i) {
-        if (!rewrite_command(command, packet_set_get(commands, i),
-                             delegates[i].name)) {
-            packet_set_delete(commands);
-            free(sent_list);
-            return 0;
-        }
-        sent_list[i] = 0;
+    lo(LOG_DEBUG, "delegate_pool: %s: all %d connections busy",
+       delegates[id].name, pool->open);
+    ++pool->waits;
+    c->waiting = 1;
+    gettimeofday(&c->waiting_since, NULL);
+    c->next_waiter = 0;
+    if (pool->last_waiter) {
+        pool->last_waiter->next_waiter = c;
+    } else {
+        pool->waiters = c;
+    }
+    pool->last_waiter = c;
+    return 1;
+}
+
+/**
+ * I/O 'worker' function for asynchronously connecting to a delegate
+ *
+ * @param delegate_index index of the current delegate
+ * @return PACKET_COMPLETE, or PACKET_ERROR if the connection failed
+ */
+static packet_status delegate_connect_worker(delegate_id delegate_index)
+{
+    /* The connect() has already been issued; this function will only be
+       called when the connection completes (according to poll()) */
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    if ((getsockopt(session->connections[delegate_index].fd, SOL_SOCKET,
+                    SO_ERROR, &error, &error_length) == -1) || error) {
+        if (error) {
+            errno = error;
+        }
+        return PACKET_ERROR;
+    }
+
+    session->connections[delegate_index].connected = 1;
+    lo(LOG_DEBUG, "delegate_connect_worker: connection to %s:%d completed",
+       delegates[delegate_index].address, delegates[delegate_index].port);
+    return PACKET_COMPLETE;
+}
+
+/**
+ * I/O 'worker' function for logging in to a delegate on a new connection,
+ * or for setting a pooled one up for the session, then replaying the
+ * client's session state, then sending whatever the driver needs done
+ * before the command.
+ *
+ * @param[in] id the delegate
+ * @return PACKET_COMPLETE once logged in, PACKET_INCOMPLETE if there's more
+ * to do, or PACKET_ERROR / PACKET_EOF on failure
+ */
+static packet_status delegate_login_worker(delegate_id id)
+{
+    delegate_connection *c = &session->connections[id];
+    packet_status status = PACKET_INCOMPLETE;
+    packet *command;
+    short more;
+
+    switch (c->login) {
+    case LOGIN_CONNECTING:
+        status = delegate_connect_worker(id);
+        if (status == PACKET_COMPLETE) {
+            c->login = LOGIN_GREETING;
+            status = PACKET_INCOMPLETE;
+        }
+        break;
+    case LOGIN_GREETING:
+        if (!c->login_packet) {
+            c->login_packet = packet_new();
+            if (!c->login_packet) {
+                return PACKET_ERROR;
+            }
+        }
+        status = driver_login.get_packet(&c->in, c->login_packet);
+        if (status == PACKET_COMPLETE) {
+            packet *login = packet_new();
+            if (!login) {
+                return PACKET_ERROR;
+            }
+            if (!driver_login.login_packet(c->login_packet, login,
+                                           delegates[id].user,
+                                           delegates[id].password,
+                                           delegates[id].name)) {
+                packet_delete(login);
+                return PACKET_ERROR;
+            }
+            packet_delete(c->login_packet);
+            c->login_packet = login;
+            c->sent = 0;
+            c->login = LOGIN_SENDING;
+            status = PACKET_INCOMPLETE;
+        }
+        break;
+    case LOGIN_SENDING:
+        status = driver_login.put_packet(c->fd, c->login_packet, &c->sent);
+        if (status == PACKET_COMPLETE) {
+            packet_delete(c->login_packet);
+            c->login_packet = packet_new();
+            if (!c->login_packet) {
+                return PACKET_ERROR;
+            }
+            c->login = LOGIN_RESULT;
+            status = PACKET_INCOMPLETE;
+        }
+        break;
+    case LOGIN_RESULT:
+        status = driver_login.get_packet(&c->in, c->login_packet);
+        if (status == PACKET_COMPLETE) {
+            short ok = driver_login.login_ok(c->login_packet);
+            packet_delete(c->login_packet);
+            c->login_packet = 0;
+            c->login = LOGIN_NONE;
+            if (!ok) {
+                errno = EACCES;
+                return PACKET_ERROR;
+            }
+            lo(LOG_DEBUG, "delegate_login_worker: %s: logged in",
+               delegates[id].name);
+            status = connection_attach(c);
+        }
+        break;
+    case LOGIN_ATTACHING:
+        status = connection_attach(c);
+        break;
+    case LOGIN_RESETTING:
+        status = driver_login.put_packet(c->fd, driver_login.reset_command(),
+                                         &c->sent);
+        if (status == PACKET_COMPLETE) {
+            c->login_packet = packet_new();
+            if (!c->login_packet) {
+                return PACKET_ERROR;
+            }
+            c->login = LOGIN_RESET_RESULT;
+            status = PACKET_INCOMPLETE;
+        }
+        break;
+    case LOGIN_RESET_RESULT:
+        status = driver_login.get_packet(&c->in, c->login_packet);
+        if (status == PACKET_COMPLETE) {
+            short ok = driver_login.login_ok(c->login_packet);
+            packet_delete(c->login_packet);
+            c->login_packet = 0;
+            if (!ok) {
+                errno = EPROTO;
+                return PACKET_ERROR;
+            }
+            ++pools[id].resets;
+            c->dirty = 0;
+            /* whatever the driver kept is gone with the reset */
+            forget_driver_data(&c->driver_data);
+            status = connection_attach(c);
+        }
+        break;
+    case LOGIN_REPLAYING:
+        command = driver_login.replay_command(c->replayed);
+        status = driver_login.put_packet(c->fd, command, &c->sent);
+        if (status == PACKET_COMPLETE) {
+            c->login_packet = packet_new();
+            if (!c->login_packet) {
+                return PACKET_ERROR;
+            }
+            c->login = LOGIN_REPLAY_RESULT;
+            status = PACKET_INCOMPLETE;
+        }
+        break;
+    case LOGIN_REPLAY_RESULT:
+        status = driver_login.get_packet(&c->in, c->login_packet);
+        if (status == PACKET_COMPLETE) {
+            if (!driver_login.login_ok(c->login_packet)) {
+                /* carry on without it, as the client would have */
+                lo(LOG_INFO, "delegate_login_worker: %s: couldn't restore "
+                   "session state", delegates[id].name);
+            }
+            packet_delete(c->login_packet);
+            c->login_packet = 0;
+
+            ++c->replayed;
+            if (driver_login.replay_command(c->replayed)) {
+                c->sent = 0;
+                c->login = LOGIN_REPLAYING;
+                status = PACKET_INCOMPLETE;
+            } else {
+                lo(LOG_DEBUG, "delegate_login_worker: %s: replayed %d "
+                   "commands", delegates[id].name, c->replayed);
+                status = connection_prepare(c);
+            }
+        }
+        break;
+    case LOGIN_PREPARING:
+        command = driver_login.prepare_command(c->prepared, &c->driver_data);
+        status = driver_login.put_packet(c->fd, command, &c->sent);
+        if (status == PACKET_COMPLETE) {
+            c->login = LOGIN_PREPARE_RESULT;
+            status = PACKET_INCOMPLETE;
+        }
+        break;
+    case LOGIN_PREPARE_RESULT:
+        /* a reply of several packets may well arrive all at once */
+        do {
+            if (!c->login_packet) {
+                c->login_packet = packet_new();
+                if (!c->login_packet) {
+                    return PACKET_ERROR;
+                }
+            }
+            status = driver_login.get_packet(&c->in, c->login_packet);
+            if (status != PACKET_COMPLETE) {
+                break;
+            }
+            more = driver_login.prepare_reply(c->login_packet,
+                                              &c->driver_data);
+            packet_delete(c->login_packet);
+            c->login_packet = 0;
+        } while (more);
+
+        if (status == PACKET_COMPLETE) {
+            ++c->prepared;
+            c->sent = 0;
+            if (driver_login.prepare_command(c->prepared, &c->driver_data)) {
+                c->login = LOGIN_PREPARING;
+                status = PACKET_INCOMPLETE;
+            } else {
+                c->login = LOGIN_NONE;
+            }
+        }
+        break;
+    case LOGIN_NONE:
+        /* still queued */
+        break;
+    };
+    return status;
+}
+
+packet_status delegate_io_ready(delegate_id id)
+{
+    delegate_connection *c = &session->connections[id];
+    packet_status status;
+
+    if (!c->pending) {
+        return PACKET_COMPLETE;
+    }
+
+    switch (session->op) {
+    case DELEGATE_OP_CONNECT:
+        status = delegate_connect_worker(id);
+        break;
+    case DELEGATE_OP_ACQUIRE:
+        status = delegate_login_worker(id);
+        break;
+    case DELEGATE_OP_PUT:
+        status = session->put_packet(c->fd,
+                                     packet_set_get(session->packets, id),
+                                     &c->sent);
+        break;
+    case DELEGATE_OP_GET:
+        status = session->get_packet(&c->in,
+                                     packet_set_get(session->packets, id));
+        break;
+    default:
+        status = PACKET_ERROR;
+        break;
+    };
+
+    if (status == PACKET_COMPLETE) {
+        delegate_io_complete(session, c);
+    }
+    return status;
+}
+
+/**
+ * Bring a connection's registration with the session's event set into line
+ * with what the operation in progress needs from it. Registrations last as
+ * long as the connection; only changes of interest cost a system call.
+ *
+ * @param[in] id the delegate
+ * @return 1 on success, 0 on failure
+ */
+static int delegate_watch(delegate_id id)
+{
+    delegate_connection *c = &session->connections[id];
+    short events = delegate_io_events(id);
+
+    if (c->watched_fd != c->fd) {
+        if (c->watched_fd != -1) {
+            event_set_remove(session->events, c->watched_fd);
+            c->watched_fd = -1;
+        }
+        if (c->fd != -1) {
+            if (!event_set_add(session->events, c->fd, events, c)) {
+                return 0;
+            }
+            c->watched_fd = c->fd;
+            c->watched_events = events;
+        }
+    } else if ((c->fd != -1) && (c->watched_events != events)) {
+        if (!event_set_modify(session->events, c->fd, events, c)) {
+            return 0;
+        }
+        c->watched_events = events;
+    }
+    return 1;
+}
+
+/**
+ * Stop watching a connection, before its file descriptor is closed or given
+ * back to the pool.
+ *
+ * @param[in,out] c the connection
+ */
+static void delegate_unwatch(delegate_connection * c)
+{
+    uring_forget(c->fd);
+    if (c->watched_fd != -1) {
+        event_set_remove(c->owner->events, c->watched_fd);
+        c->watched_fd = -1;
+        c->watched_events = 0;
+    }
+}
+
+/**
+ * Parse whatever a delegate has sent, then make sure the socket is armed
+ * for more if the delegate's reply is still incomplete.
+ *
+ * @param[in] id the delegate
+ * @return 0 on failure, 1 on success
+ */
+static int delegate_uring_read(delegate_id id)
+{
+    delegate_connection *c = &session->connections[id];
+
+    while (c->pending && (uring_buffered(c->fd) > 0)) {
+        switch (delegate_io_ready(id)) {
+        case PACKET_ERROR:
+        case PACKET_EOF:
+            return 0;
+        case PACKET_INCOMPLETE:
+        case PACKET_COMPLETE:
+            break;
+        };
+    }
+    return !c->pending || uring_receive(c->fd, c);
+}
+
+/**
+ * delegate_io() for writes and reads, through this thread's io_uring: every
+ * delegate's command goes out in one submission, and replies are received
+ * without waiting for readiness first.
+ *
+ * @return 0 on failure, 1 on success
+ */
+static int delegate_io_uring(void)
+{
+    uring_completion done[URING_BATCH];
+
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        delegate_connection *c = &session->connections[i];
+        if (!c->pending) {
+            continue;
+        }
+        if (session->op == DELEGATE_OP_PUT) {
+            packet *p = packet_set_get(session->packets, i);
+            if (!uring_send(c->fd, p->bytes + c->sent, p->size - c->sent,
+                            c)) {
+                return 0;
+            }
+        } else if (!delegate_uring_read(i)) {
+            return 0;
+        }
+    }
+
+    while (!delegate_io_done()) {
+        int n = uring_wait(done, URING_BATCH);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+
+        for (int j = 0; j < n; ++j) {
+            delegate_connection *c = done[j].data;
+            delegate_id i = c - session->connections;
+
+            if (!c->pending || (c->fd != done[j].fd)) {
+                /* early data; it'll keep until it's asked for */
+                continue;
+            }
+            if (done[j].kind == URING_SENT) {
+                if (done[j].result < 0) {
+                    errno = -done[j].result;
+                    return 0;
+                }
+                c->sent += done[j].result;
+                delegate_io_complete(session, c);
+            } else if (!delegate_uring_read(i)) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Block until the operation in progress is done; see delegate_io_done().
+ *
+ * @return 0 on failure, 1 on success
+ */
+static int delegate_io(void)
+{
+    if (io_uring && !uring_tried) {
+        uring_tried = 1;
+        if (!uring_open()) {
+            lo(LOG_INFO, "delegate_io: io_uring unavailable (%s), polling",
+               strerror(errno));
+        }
+    }
+    if (uring_active() && ((session->op == DELEGATE_OP_PUT)
+                           || (session->op == DELEGATE_OP_GET))) {
+        if (delegate_io_uring()) {
+            return 1;
+        }
+
+        /* nothing can be left in flight once the operation is abandoned */
+        int error = errno;
+        for (delegate_id i = 0; i < delegate_count; ++i) {
+            if (session->connections[i].pending) {
+                uring_forget(session->connections[i].fd);
+            }
+        }
+        errno = error;
+        return 0;
+    }
+
+    if (!session->events) {
+        session->events = event_set_new(delegate_count);
+        session->ready = malloc(sizeof(event) * delegate_count);
+        if (!session->events || !session->ready) {
+            return 0;
+        }
+    }
+
+    /* after this, only delegates which were ready can change interest */
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        if (!delegate_watch(i)) {
+            return 0;
+        }
+    }
+
+    while (!delegate_io_done()) {
+        int n = event_set_wait(session->events, session->ready,
+                               delegate_count, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+
+        for (int j = 0; j < n; ++j) {
+            delegate_connection *c = session->ready[j].data;
+            delegate_id i = c - session->connections;
+
+            if (session->ready[j].events & c->watched_events) {
+                switch (delegate_io_ready(i)) {
+                case PACKET_ERROR:
+                case PACKET_EOF:
+                    return 0;
+                case PACKET_INCOMPLETE:
+                case PACKET_COMPLETE:
+                    break;
+                };
+                if (!delegate_watch(i)) {
+                    return 0;
+                }
+            } else if (session->ready[j].events & (POLLERR | POLLHUP)) {
+                if (c->pending) {
+                    return 0;
+                }
+                /* not needed now; it'll fail when it is */
+                delegate_unwatch(c);
+            }
+        }
+    }
+
+    return 1;
+}
+
+int delegate_connect_start(delegate_filter * filters)
+{
+    if (delegate_count == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    delegate_io_begin(DELEGATE_OP_CONNECT, filters);
+
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        delegate_connection *c = &session->connections[i];
+        if (!c->pending) {
+            continue;
+        }
+
+        c->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (c->fd == -1) {
+            delegate_disconnect();
+            return -1;
+        }
+
+        /* set the socket to non-blocking */
+        if (fcntl(c->fd, F_SETFL, O_NONBLOCK) == -1) {
+            delegate_disconnect();
+            return -1;
+        }
+        packet_buffer_attach(&c->in, c->fd);
+
+        struct sockaddr_in connect_addr;
+
+        connect_addr.sin_family = AF_INET;
+        connect_addr.sin_port = htons(delegates[i].port);
+        connect_addr.sin_addr = delegates[i].ip;
+
+        lo(LOG_DEBUG, "delegate_connect: starting connection to %s:%d",
+           delegates[i].address, delegates[i].port);
+
+        if (connect(c->fd, (struct sockaddr *)&connect_addr,
+                    sizeof(connect_addr)) == -1) {
+            if (errno != EINPROGRESS) {
+                delegate_disconnect();
+                return -1;
+            }
+        } else {
+            c->connected = 1;
+            delegate_io_complete(session, c);
+        }
+    }
+
+    return 0;
+}
+
+int delegate_connect(delegate_filter * filters)
+{
+    if (delegate_connect_start(filters) == -1) {
+        return -1;
+    }
+
+    /* Block until all delegates are connected */
+    if (!delegate_io()) {
+        delegate_disconnect();
+        return -1;
+    }
+
+    delegate_io_end();
+    return 0;
+}
+
+int delegate_acquire_start(delegate_filter * filters)
+{
+    delegate_io_begin(DELEGATE_OP_ACQUIRE, filters);
+
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        delegate_connection *c = &session->connections[i];
+        if (!c->pending) {
+            continue;
+        }
+
+        if (c->fd != -1) {
+            /* still held from an earlier command; whatever the driver
+               sends on it first is answered by readiness, not through the
+               io_uring */
+            if (connection_prepare(c) == PACKET_COMPLETE) {
+                delegate_io_complete(session, c);
+            } else {
+                uring_forget(c->fd);
+            }
+        } else if (pools) {
+            if (!pool_acquire(i)) {
+                return 0;
+            }
+        } else if (!delegate_connection_start(i, c)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void delegate_acquire_finish(void)
+{
+    delegate_io_end();
+}
+
+int delegate_acquire(delegate_filter * filters)
+{
+    if (!delegate_acquire_start(filters)) {
+        return 0;
+    }
+
+    /* log in to new delegate connections in parallel */
+    if (!delegate_io()) {
+        delegate_io_end();
+        return 0;
+    }
+
+    delegate_acquire_finish();
+    return 1;
+}
+
+void delegate_release(delegate_filter * filters)
+{
+    if (!pools) {
+        return;
+    }
+
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        delegate_connection *c = &session->connections[i];
+        if ((c->fd == -1) || (c->login != LOGIN_NONE)
+            || (delegate_filter_reduce(filters, i) != DELEGATE_FILTER_USE)) {
+            continue;
+        }
+
+        delegate_unwatch(c);
+        if (c->pooled) {
+            /* the session's state stays behind until it's reset */
+            pool_release(i, c->fd, driver_login.replay_command(0) != 0,
+                         c->driver_data);
+            c->driver_data = 0;
+        } else {
+            /* the session's own connection, used to log the client in */
+            if (c->connected) {
+                shutdown(c->fd, SHUT_RDWR);
+            }
+            close(c->fd);
+            forget_driver_data(&c->driver_data);
+        }
+        c->fd = -1;
+        packet_buffer_attach(&c->in, -1);
+        c->connected = 0;
+        c->pooled = 0;
+        c->dirty = 0;
+    }
+}
+
+void delegate_disconnect(void)
+{
+    delegate_io_end();
+
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        delegate_connection *c = &session->connections[i];
+
+        if (c->waiting) {
+            pool_waiter_cancel(i, c);
+        }
+        if (c->login_packet) {
+            packet_delete(c->login_packet);
+            c->login_packet = 0;
+        }
+        c->login = LOGIN_NONE;
+        delegate_unwatch(c);
+
+        if (c->fd > 0) {
+            if (c->connected) {
+                shutdown(c->fd, SHUT_RDWR);
+                c->connected = 0;
+            }
+            close(c->fd);
+            c->fd = -1;
+            packet_buffer_attach(&c->in, -1);
+            forget_driver_data(&c->driver_data);
+
+            /* a pooled connection still held may be mid-transaction, or
+               broken, so it's closed rather than given back */
+            if (c->pooled) {
+                c->pooled = 0;
+                c->dirty = 0;
+                pool_forget(i);
+            }
+        }
+    }
+}
+
+void delegate_login_set(delegate_login * login)
+{
+    driver_login = *login;
+}
+
+int delegate_pool_open(void)
+{
+    if (!delegate_pooled() || pools) {
+        return 1;
+    }
+
+    pools = calloc(delegate_count, sizeof(delegate_pool));
+    if (!pools) {
+        return 0;
+    }
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        pools[i].idle = malloc(sizeof(pool_entry) * pool_max);
+        if (!pools[i].idle) {
+            delegate_pool_close();
+            return 0;
+        }
+        gettimeofday(&pools[i].reported, NULL);
+    }
+
+    /* warm the pools up: pool_min sessions each log in to every delegate at
+       once, then give their connections back */
+    delegate_session *current = session;
+    delegate_session **warm = calloc(pool_min + 1,
+                                     sizeof(delegate_session *));
+    short ok = (warm != 0);
+    for (int n = 0; ok && (n < pool_min); ++n) {
+        warm[n] = delegate_session_new();
+        session = warm[n];
+        ok = session && delegate_acquire(NULL);
+        if (!ok) {
+            lo(LOG_ERROR, "delegate_pool_open: can't fill pool: %s",
+               strerror(errno));
+            delegate_session_delete(warm[n]);
+            warm[n] = 0;
+        }
+    }
+    for (int n = 0; warm && (n < pool_min); ++n) {
+        if (warm[n]) {
+            session = warm[n];
+            delegate_release(NULL);
+            delegate_session_delete(warm[n]);
+        }
+    }
+    free(warm);
+    session = current;
+
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        pools[i].acquired = 0;
+    }
+    return ok;
+}
+
+void delegate_pool_close(void)
+{
+    /* the thread's sessions are gone, so nothing is left in flight */
+    uring_close();
+    uring_tried = 0;
+
+    if (!pools) {
+        return;
+    }
+
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        if (pools[i].idle) {
+            pool_report(i);
+            for (int n = 0; n < pools[i].idle_count; ++n) {
+                close(pools[i].idle[n].fd);
+                forget_driver_data(&pools[i].idle[n].driver_data);
+            }
+            free(pools[i].idle);
+        }
+    }
+    free(pools);
+    pools = 0;
+}
+
+int delegate_pool_timeout(void)
+{
+    long timeout = -1;
+
+    if (!pools) {
+        return -1;
+    }
+
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        delegate_pool *pool = &pools[i];
+        if ((pool->idle_count > 0) && (pool->open > pool_min)) {
+            /* the oldest idle connection is the next to go */
+            long due = pool_idle_timeout * 1000L -
+                usec_since(&pool->idle[0].idle_since) / 1000;
+            if (due < 0) {
+                due = 0;
+            }
+            if ((timeout == -1) || (due < timeout)) {
+                timeout = due;
+            }
+        }
+    }
+    return timeout;
+}
+
+void delegate_pool_reap(void)
+{
+    if (!pools) {
+        return;
+    }
+
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        delegate_pool *pool = &pools[i];
+        int reap = 0;
+        while ((reap < pool->idle_count) && (pool->open - reap > pool_min)
+               && (usec_since(&pool->idle[reap].idle_since) >=
+                   pool_idle_timeout * 1000000L)) {
+            close(pool->idle[reap].fd);
+            forget_driver_data(&pool->idle[reap].driver_data);
+            ++reap;
+        }
+
+        if (reap) {
+            lo(LOG_DEBUG, "delegate_pool: %s: closed %d idle connections",
+               delegates[i].name, reap);
+            pool->idle_count -= reap;
+            memmove(pool->idle, pool->idle + reap,
+                    sizeof(pool_entry) * pool->idle_count);
+            pool->open -= reap;
+            pool->reaped += reap;
+        }
+    }
+}
+
+int delegate_get_start(delegate_filter * filters, packet_reader get_packet)
+{
+    session->packets = packet_set_new(delegate_count);
+    if (!session->packets) {
+        return 0;
+    }
+
+    session->get_packet = get_packet;
+    delegate_io_begin(DELEGATE_OP_GET, filters);
+
+    /* replies which arrived with earlier ones won't make fds ready */
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        if (session->connections[i].pending
+            && session->connections[i].in.ready) {
+            delegate_io_ready(i);
+        }
+    }
+    return 1;
+}
+
+packet_set *delegate_get_finish(void)
+{
+    packet_set *replies = session->packets;
+    session->packets = 0;
+    delegate_io_end();
+    return replies;
+}
+
+packet_set *delegate_get(delegate_filter * filters, packet_reader get_packet)
+{
+    if (!delegate_get_start(filters, get_packet)) {
+        return 0;
+    }
+
+    /* read from all delegates in parallel */
+    if (!delegate_io()) {
+        delegate_io_end();
+        return 0;
+    }
+
+    return delegate_get_finish();
+}
+
+short delegate_received(delegate_filter * filters)
+{
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        if (session->connections[i].in.ready
+            && (delegate_filter_reduce(filters, i) == DELEGATE_FILTER_USE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int delegate_put_start(delegate_filter * filters, packet_writer put_packet,
+                       int (*rewrite_command) (delegate_id, packet *,
+                                               packet *, const char *,
+                                               void **), packet * command)
+{
+    session->packets = packet_set_new(delegate_count);
+    if (!session->packets) {
+        return 0;
+    }
+
+    session->put_packet = put_packet;
+    delegate_io_begin(DELEGATE_OP_PUT, filters);
+
+    /* only the delegates the command is going to need their own version */
+    for (delegate_id i = 0; i < delegate_count; ++i) {
+        if (session->connections[i].pending
+            && !rewrite_command(i, command,
+                                packet_set_get(session->packets, i),
+                                delegates[i].name,
+                                &session->connections[i].driver_data)) {
+            delegate_io_end();
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void delegate_put_finish(void)
+{
+    delegate_io_end();
+}
+
+int delegate_put(delegate_filter * filters, packet_writer put_packet,
+                 int (*rewrite_command) (delegate_id, packet *, packet *,
+                                         const char *, void **),
+                 packet * command)
+{
+    if (!delegate_put_start(filters, put_packet, rewrite_command, command)) {
+        return 0;
     }
 
     /* write to all delegates in parallel */
-    proxy_command_worker_args args;
-    args.sent_list = sent_list;
-    args.put_packet = put_packet;
-    args.commands = commands;
-    if (!delegate_io(POLLOUT, proxy_command_worker, &args, filters)) {
-        packet_set_delete(commands);
-        free(sent_list);
+    if (!delegate_io()) {
+        delegate_io_end();
         return 0;
     }
 
-    packet_set_delete(commands);
-    free(sent_list);
+    delegate_put_finish();
     return 1;
 }
 
@@ -384,6 +1752,8 @@ static void delegate_shutdown(void)
                 free(delegates[i].name);
                 delegates[i].name = 0;
             }
+            free(delegates[i].user);
+            free(delegates[i].password);
         }
         free(delegates);
         delegates = 0;
@@ -420,11 +1790,17 @@ static cfg_opt_t delegate_options[] = {
                partition_id_parser),
     CFG_INT(CFG_PORT, CFG_PORT_DEFAULT, 0),
     CFG_STR(CFG_NAME, CFG_NAME_DEFAULT, 0),
+    CFG_STR(CFG_USER, CFG_USER_DEFAULT, 0),
+    CFG_STR(CFG_PASSWORD, CFG_PASSWORD_DEFAULT, 0),
     CFG_END()
 };
 
 static cfg_opt_t options[] = {
     CFG_SEC(CFG_DELEGATE, delegate_options, CFGF_TITLE | CFGF_MULTI),
+    CFG_INT(CFG_POOL_MIN, CFG_POOL_MIN_DEFAULT, 0),
+    CFG_INT(CFG_POOL_MAX, CFG_POOL_MAX_DEFAULT, 0),
+    CFG_INT(CFG_POOL_IDLE_TIMEOUT, CFG_POOL_IDLE_TIMEOUT_DEFAULT, 0),
+    CFG_BOOL(CFG_IO_URING, CFG_IO_URING_DEFAULT, 0),
     CFG_END()
 };
 
@@ -4,10 +4,42 @@
 /**
  * @file delegate.h
  * @brief Communication with delegate databases.
- * 
+ *
  * This API hides the details of managing the pool of delegate database
  * connections.
  *
+ * Connections belong to a delegate_session; all of the functions below work
+ * on the current session, chosen with delegate_session_set(). Parallel I/O
+ * is available either as blocking calls (delegate_connect(), delegate_put(),
+ * delegate_get()), or as operations which are started, then advanced by the
+ * caller whenever a delegate's file descriptor is ready, then finished. Only
+ * one operation is in progress per session at a time. When io_uring is set,
+ * blocking writes and reads go through the thread's io_uring instead (see
+ * uring.h), if the kernel has it.
+ *
+ * A session connects to a delegate the first time a command is routed to it:
+ * delegate_acquire() logs the new connection in, then replays the commands
+ * which set up the client's session state. Before every command, it also
+ * sends whatever the driver needs done on a connection first (preparing a
+ * statement there, say); the driver keeps what it knows about a connection
+ * with it, for as long as the connection stays open.
+ *
+ * When pool_max is set, each thread (or worker process) keeps a pool of
+ * connections to every delegate, logged in as the delegate's configured user.
+ * A session borrows pooled connections with delegate_acquire() for as long as
+ * it needs them - for a command, or for a whole transaction - and gives them
+ * back with delegate_release(). A borrowed connection is reset first if its
+ * last borrower left session state behind, then given the session's own.
+ *
+ * Only SET statements are replayed that way. A session which leaves any
+ * other state on a connection - an insert id, a temporary table, a lock, a
+ * statement prepared with PREPARE, a user variable assigned with := or
+ * INTO, or anything else the server says changed - keeps the connection
+ * until it ends, taking it out of the pool; so pool_max bounds the sessions
+ * which do, rather than the clients. ROW_COUNT() and FOUND_ROWS() pin the
+ * connections they're sent to from then on, but the first of them may see
+ * another session's statement (SQL_CALC_FOUND_ROWS pins beforehand).
+ *
  * The delegate component should be exclusively used by the server component.
  */
 
@@ -20,11 +52,135 @@ DECLARE_COMPONENT(delegate);
 /** @endcond */
 
 /**
- * Connect to all delegates.
+ * Opaque set of connections to the delegates, one per client connection.
+ */
+typedef struct delegate_session delegate_session;
+
+/**
+ * How to log in to a delegate on a new connection; supplied by the database
+ * driver.
+ */
+typedef struct {
+    packet_reader get_packet;
+    packet_writer put_packet;
+    /** build a login packet answering a greeting; see db_driver.h */
+    int (*login_packet) (packet *, packet *, const char *, const char *,
+                         const char *);
+    /** did the login (or a replayed command) work? */
+    short (*login_ok) (packet *);
+    /** the current client's nth session state command, or 0 */
+    packet *(*replay_command) (int);
+    /** command which clears a connection's session state */
+    packet *(*reset_command) (void);
+    /** the nth command to send on a connection before the current command,
+        or 0; given what the driver keeps with the connection */
+    packet *(*prepare_command) (int, void **);
+    /** take in a packet of the reply to one: 1 if more of it follows */
+    short (*prepare_reply) (packet *, void **);
+    /** free what the driver kept with a connection which has been closed or
+        reset */
+    void (*forget_connection) (void *);
+} delegate_login;
+
+/**
+ * Set how this thread logs in to delegates.
+ *
+ * @param[in] login how to log in to a delegate
+ */
+void delegate_login_set(delegate_login * login);
+
+/**
+ * Is connection pooling configured?
+ *
+ * @return 1 if so; 0 otherwise.
+ */
+short delegate_pooled(void);
+
+/**
+ * Open this thread's connection pools (if pooling is configured), logging
+ * in pool_min connections to every delegate. See delegate_login_set().
+ *
+ * @return 1 on success, 0 on failure
+ */
+int delegate_pool_open(void);
+
+/**
+ * Close this thread's connection pools, along with their idle connections.
+ */
+void delegate_pool_close(void);
+
+/**
+ * How long until an idle pooled connection is due to be closed?
+ *
+ * @return milliseconds, or -1 if none is
+ */
+int delegate_pool_timeout(void);
+
+/**
+ * Close pooled connections which have been idle for pool_idle_timeout
+ * seconds, keeping at least pool_min per delegate.
+ */
+void delegate_pool_reap(void);
+
+/**
+ * Allocate a new, disconnected, session.
+ *
+ * @return freshly allocated session, or 0 on failure
+ */
+delegate_session *delegate_session_new(void);
+
+/**
+ * Choose the session which subsequent calls work on.
+ *
+ * @param[in] s a session
+ */
+void delegate_session_set(delegate_session * s);
+
+/**
+ * Set the function to call when a pooled connection the session has been
+ * queued for becomes available; see delegate_acquire_start(). Only a
+ * session with one can queue.
+ *
+ * @param[in,out] s a session
+ * @param[in] wake the function
+ * @param[in] data passed to wake
+ */
+void delegate_session_wake(delegate_session * s, void (*wake) (void *),
+                           void *data);
+
+/**
+ * Delete a session (disconnecting it first, if need be).
+ *
+ * @param[in,out] s a session
+ */
+void delegate_session_delete(delegate_session * s);
+
+/**
+ * Connect to a set of delegates, as the session's own connections.
  *
+ * @param[in] filters set of filters to apply to the list of delegates
  * @return 0 on success, -1 on failure (and errno will be set)
  */
-int delegate_connect(void);
+int delegate_connect(delegate_filter * filters);
+
+/**
+ * Make sure the session has a connection to each of a set of delegates,
+ * borrowing them from the pool if pooling, or else connecting. New
+ * connections are logged in. Delegates the session already holds a
+ * connection to are left alone.
+ *
+ * @param[in] filters set of filters to apply to the list of delegates
+ * @return 1 on success, 0 on failure (and errno will be set)
+ */
+int delegate_acquire(delegate_filter * filters);
+
+/**
+ * Give connections back: pooled ones go back to the pool, and the session's
+ * own are closed. Does nothing unless pooling.
+ *
+ * @param[in] filters set of filters to apply to the list of delegates
+ */
+void delegate_release(delegate_filter * filters);
 
 /**
  * Get delegate count.
@@ -41,17 +197,50 @@ delegate_id delegate_get_count(void);
 delegate_id delegate_master_id(void);
 
 /**
- * Parallel read of a set of packets from a set of delegate servers.
+ * Find the delegate which holds a partition.
+ *
+ * @param[in] partition_id the partition's id
+ * @return its delegate_id, or -1 if no delegate holds it
+ */
+int delegate_partition(int partition_id);
+
+/**
+ * Get the file descriptor of the connection to a delegate.
+ *
+ * @param[in] id delegate identifier
+ * @return the file descriptor, or -1 if not connected
+ */
+int delegate_fd(delegate_id id);
+
+/**
+ * Parallel read of the next packet from each of a set of delegate servers.
+ * Reads aren't in lockstep: the read is over as soon as any delegate has
+ * delivered a packet, along with any others which arrived at the same time,
+ * and the rest are left to deliver theirs to a later read.
  *
  * @param[in] filters set of filters to apply to the list of delegates
  * @param[in] get_packet function for reading a single packet
- * @return a list of replies gathered from delegate servers; the caller is
- * responsible for freeing this list!
+ * @return a list of replies gathered from delegate servers, empty for the
+ * delegates which had nothing yet; the caller is responsible for freeing
+ * this list!
  */
 packet_set *delegate_get(delegate_filter * filters, packet_reader get_packet);
 
 /**
- * Parallel write of a packet to a set of delegate servers.
+ * Has any of a set of delegates sent a packet which hasn't been read yet, so
+ * that delegate_get() won't have to wait?
+ *
+ * @param[in] filters set of filters to apply to the list of delegates
+ * @return 1 if so; 0 otherwise.
+ */
+short delegate_received(delegate_filter * filters);
+
+/**
+ * Parallel write of a packet to a set of delegate servers. The command is
+ * only rewritten for the delegates it's written to, and a rewrite may just
+ * be a slice of it (see packet_slice()), so it must not change until the
+ * write is finished. A rewrite is also given what the driver keeps with the
+ * delegate's connection (see delegate_login).
  *
  * @param[in] filters set of filters to apply to the list of delegates
  * @param[in] put_packet function for writing a single packet.
@@ -60,7 +249,8 @@ packet_set *delegate_get(delegate_filter * filters, packet_reader get_packet);
  * @return 1 on success, 0 on failure
  */
 int delegate_put(delegate_filter * filters, packet_writer put_packet,
-                 int (*rewrite_command) (packet *, packet *, const char *),
+                 int (*rewrite_command) (delegate_id, packet *, packet *,
+                                         const char *, void **),
                  packet * command);
 
 /**
@@ -68,4 +258,93 @@ int delegate_put(delegate_filter * filters, packet_writer put_packet,
  */
 void delegate_disconnect(void);
 
+/**
+ * Start connecting to a set of delegates without waiting.
+ *
+ * @param[in] filters set of filters to apply to the list of delegates
+ * @return 0 on success, -1 on failure (and errno will be set)
+ */
+int delegate_connect_start(delegate_filter * filters);
+
+/**
+ * Start acquiring connections; see delegate_acquire(). A delegate
+ * whose pool is exhausted has no events until another session releases a
+ * connection, at which point the session's wake function is called.
+ *
+ * @param[in] filters set of filters to apply to the list of delegates
+ * @return 1 on success, 0 on failure (and errno will be set)
+ */
+int delegate_acquire_start(delegate_filter * filters);
+
+/**
+ * Finish acquiring connections.
+ */
+void delegate_acquire_finish(void);
+
+/**
+ * Start a parallel read; see delegate_get(). Replies which have already
+ * been received are read straight away, so the read may be done (see
+ * delegate_io_done()) as soon as it has started.
+ *
+ * @param[in] filters set of filters to apply to the list of delegates
+ * @param[in] get_packet function for reading a single packet
+ * @return 1 on success, 0 on failure
+ */
+int delegate_get_start(delegate_filter * filters, packet_reader get_packet);
+
+/**
+ * Finish a parallel read started with delegate_get_start().
+ *
+ * @return a list of replies gathered from delegate servers; the caller is
+ * responsible for freeing this list!
+ */
+packet_set *delegate_get_finish(void);
+
+/**
+ * Start a parallel write; see delegate_put().
+ *
+ * @param[in] filters set of filters to apply to the list of delegates
+ * @param[in] put_packet function for writing a single packet.
+ * @param[in] rewrite_command function for per-delegate command rewriting.
+ * @param[in] command the packet to write to all delegates.
+ * @return 1 on success, 0 on failure
+ */
+int delegate_put_start(delegate_filter * filters, packet_writer put_packet,
+                       int (*rewrite_command) (delegate_id, packet *,
+                                               packet *, const char *,
+                                               void **), packet * command);
+
+/**
+ * Finish a parallel write started with delegate_put_start().
+ */
+void delegate_put_finish(void);
+
+/**
+ * Which poll(2) events does the operation in progress need from a delegate?
+ *
+ * @param[in] id delegate identifier
+ * @return POLLIN, POLLOUT, or 0 if the delegate has nothing left to do
+ */
+short delegate_io_events(delegate_id id);
+
+/**
+ * Advance the operation in progress on a delegate whose file descriptor is
+ * ready.
+ *
+ * @param[in] id delegate identifier
+ * @return PACKET_COMPLETE once this delegate's part of the operation is done,
+ * PACKET_INCOMPLETE if there's more to do, or PACKET_ERROR / PACKET_EOF on
+ * failure.
+ */
+packet_status delegate_io_ready(delegate_id id);
+
+/**
+ * Is the operation in progress done? That's once every delegate has finished
+ * its part, except that a read is done once any delegate has delivered a
+ * packet.
+ *
+ * @return 1 if so; 0 otherwise.
+ */
+short delegate_io_done(void);
+
 #endif
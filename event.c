@@ -0,0 +1,256 @@
+/* system includes */
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+/* project includes */
+#include "event.h"
+
+#ifdef __linux__
+
+struct event_set {
+    int epoll_fd;
+    struct epoll_event *buffer;
+    int buffer_size;
+};
+
+event_set *event_set_new(int size_hint)
+{
+    event_set *set = malloc(sizeof(event_set));
+    if (!set) {
+        return 0;
+    }
+
+    set->buffer_size = (size_hint > 0) ? size_hint : 1;
+    set->buffer = malloc(sizeof(struct epoll_event) * set->buffer_size);
+    if (!set->buffer) {
+        free(set);
+        return 0;
+    }
+
+    set->epoll_fd = epoll_create(set->buffer_size);
+    if (set->epoll_fd == -1) {
+        free(set->buffer);
+        free(set);
+        return 0;
+    }
+    return set;
+}
+
+void event_set_delete(event_set * set)
+{
+    if (set) {
+        close(set->epoll_fd);
+        free(set->buffer);
+        free(set);
+    }
+}
+
+/**
+ * Shared implementation of event_set_add() and event_set_modify().
+ *
+ * @param[in,out] set an event set
+ * @param[in] op EPOLL_CTL_ADD or EPOLL_CTL_MOD
+ * @param[in] fd the file descriptor
+ * @param[in] events poll(2) events of interest
+ * @param[in] data returned with each notification for this descriptor
+ * @return 1 on success, 0 on failure
+ */
+static int event_set_control(event_set * set, int op, int fd, short events,
+                             void *data)
+{
+    struct epoll_event e;
+
+    e.events = 0;
+    if (events & POLLIN) {
+        e.events |= EPOLLIN;
+    }
+    if (events & POLLOUT) {
+        e.events |= EPOLLOUT;
+    }
+    e.data.ptr = data;
+
+    return epoll_ctl(set->epoll_fd, op, fd, &e) == 0;
+}
+
+int event_set_add(event_set * set, int fd, short events, void *data)
+{
+    return event_set_control(set, EPOLL_CTL_ADD, fd, events, data);
+}
+
+int event_set_modify(event_set * set, int fd, short events, void *data)
+{
+    return event_set_control(set, EPOLL_CTL_MOD, fd, events, data);
+}
+
+int event_set_remove(event_set * set, int fd)
+{
+    /* a non-null event pointer keeps pre-2.6.9 kernels happy */
+    struct epoll_event e;
+    return epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL, fd, &e) == 0;
+}
+
+int event_set_wait(event_set * set, event * ready, int max, int timeout)
+{
+    if (max > set->buffer_size) {
+        struct epoll_event *buffer =
+            realloc(set->buffer, sizeof(struct epoll_event) * max);
+        if (!buffer) {
+            return -1;
+        }
+        set->buffer = buffer;
+        set->buffer_size = max;
+    }
+
+    int n = epoll_wait(set->epoll_fd, set->buffer, max, timeout);
+    for (int i = 0; i < n; ++i) {
+        ready[i].data = set->buffer[i].data.ptr;
+        ready[i].events = 0;
+        if (set->buffer[i].events & EPOLLIN) {
+            ready[i].events |= POLLIN;
+        }
+        if (set->buffer[i].events & EPOLLOUT) {
+            ready[i].events |= POLLOUT;
+        }
+        if (set->buffer[i].events & EPOLLERR) {
+            ready[i].events |= POLLERR;
+        }
+        if (set->buffer[i].events & EPOLLHUP) {
+            ready[i].events |= POLLHUP;
+        }
+    }
+    return n;
+}
+
+#else
+
+struct event_set {
+    struct pollfd *fds;
+    void **data;
+    int count;
+    int allocated;
+};
+
+event_set *event_set_new(int size_hint)
+{
+    event_set *set = malloc(sizeof(event_set));
+    if (!set) {
+        return 0;
+    }
+
+    set->count = 0;
+    set->allocated = (size_hint > 0) ? size_hint : 1;
+    set->fds = malloc(sizeof(struct pollfd) * set->allocated);
+    set->data = malloc(sizeof(void *) * set->allocated);
+    if (!set->fds || !set->data) {
+        event_set_delete(set);
+        return 0;
+    }
+    return set;
+}
+
+void event_set_delete(event_set * set)
+{
+    if (set) {
+        free(set->fds);
+        free(set->data);
+        free(set);
+    }
+}
+
+/**
+ * Find the index of a watched file descriptor.
+ *
+ * @param[in] set an event set
+ * @param[in] fd the file descriptor
+ * @return the index, or -1 if the descriptor isn't watched
+ */
+static int event_set_find(event_set * set, int fd)
+{
+    for (int i = 0; i < set->count; ++i) {
+        if (set->fds[i].fd == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int event_set_add(event_set * set, int fd, short events, void *data)
+{
+    if (event_set_find(set, fd) != -1) {
+        errno = EEXIST;
+        return 0;
+    }
+
+    if (set->count == set->allocated) {
+        int allocated = set->allocated * 2;
+        struct pollfd *fds = realloc(set->fds,
+                                     sizeof(struct pollfd) * allocated);
+        if (!fds) {
+            return 0;
+        }
+        set->fds = fds;
+
+        void **d = realloc(set->data, sizeof(void *) * allocated);
+        if (!d) {
+            return 0;
+        }
+        set->data = d;
+        set->allocated = allocated;
+    }
+
+    set->fds[set->count].fd = fd;
+    set->fds[set->count].events = events;
+    set->fds[set->count].revents = 0;
+    set->data[set->count] = data;
+    ++set->count;
+    return 1;
+}
+
+int event_set_modify(event_set * set, int fd, short events, void *data)
+{
+    int i = event_set_find(set, fd);
+    if (i == -1) {
+        errno = ENOENT;
+        return 0;
+    }
+    set->fds[i].events = events;
+    set->data[i] = data;
+    return 1;
+}
+
+int event_set_remove(event_set * set, int fd)
+{
+    int i = event_set_find(set, fd);
+    if (i == -1) {
+        errno = ENOENT;
+        return 0;
+    }
+    --set->count;
+    set->fds[i] = set->fds[set->count];
+    set->data[i] = set->data[set->count];
+    return 1;
+}
+
+int event_set_wait(event_set * set, event * ready, int max, int timeout)
+{
+    if (poll(set->fds, set->count, timeout) == -1) {
+        return -1;
+    }
+
+    int n = 0;
+    for (int i = 0; (i < set->count) && (n < max); ++i) {
+        if (set->fds[i].revents) {
+            ready[n].data = set->data[i];
+            ready[n].events = set->fds[i].revents;
+            ++n;
+        }
+    }
+    return n;
+}
+
+#endif
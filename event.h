@@ -0,0 +1,88 @@
+#ifndef __EVENT_H
+#define __EVENT_H
+
+/**
+ * @file event.h
+ * @brief Persistent readiness notification for sets of file descriptors.
+ *
+ * An event_set keeps file descriptors registered for as long as the caller
+ * wants them watched, so that waiting costs O(ready descriptors) rather than
+ * rebuilding a poll(2) array every time. Interest is expressed with the
+ * poll(2) event bits (POLLIN, POLLOUT), and can be toggled without
+ * unregistering. On Linux this is backed by epoll(7); elsewhere it falls back
+ * to poll(2).
+ */
+
+/**
+ * Opaque set of watched file descriptors.
+ */
+typedef struct event_set event_set;
+
+/**
+ * A single readiness notification.
+ */
+typedef struct {
+    void *data;   /**< the data registered with the descriptor */
+    short events; /**< poll(2) style events that occurred */
+} event;
+
+/**
+ * Allocate a new event set.
+ *
+ * @param[in] size_hint expected number of descriptors
+ * @return freshly allocated event set, or 0 on failure
+ */
+event_set *event_set_new(int size_hint);
+
+/**
+ * Delete an event set. Registered descriptors are not closed.
+ *
+ * @param[in,out] set an event set
+ */
+void event_set_delete(event_set * set);
+
+/**
+ * Start watching a file descriptor.
+ *
+ * @param[in,out] set an event set
+ * @param[in] fd the file descriptor
+ * @param[in] events poll(2) events of interest (may be 0)
+ * @param[in] data returned with each notification for this descriptor
+ * @return 1 on success, 0 on failure (and errno will be set)
+ */
+int event_set_add(event_set * set, int fd, short events, void *data);
+
+/**
+ * Change the events of interest for a watched file descriptor.
+ *
+ * @param[in,out] set an event set
+ * @param[in] fd the file descriptor
+ * @param[in] events poll(2) events of interest (may be 0)
+ * @param[in] data returned with each notification for this descriptor
+ * @return 1 on success, 0 on failure (and errno will be set)
+ */
+int event_set_modify(event_set * set, int fd, short events, void *data);
+
+/**
+ * Stop watching a file descriptor.
+ *
+ * @param[in,out] set an event set
+ * @param[in] fd the file descriptor
+ * @return 1 on success, 0 on failure (and errno will be set)
+ */
+int event_set_remove(event_set * set, int fd);
+
+/**
+ * Wait for watched descriptors to become ready. Errors and hangups are
+ * always reported (as POLLERR and POLLHUP), whatever the interest.
+ *
+ * @param[in,out] set an event set
+ * @param[out] ready array to fill with notifications
+ * @param[in] max size of the ready array
+ * @param[in] timeout milliseconds to wait, or -1 to wait indefinitely
+ * @return the number of notifications, or -1 on failure (and errno will be
+ * set)
+ */
+int event_set_wait(event_set * set, event * ready, int max, int timeout);
+
+#endif
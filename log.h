@@ -5,8 +5,11 @@
  * @file log.h
  * @brief Logging API
  *
- * This is a very simple logging subsystem. It uses a global handle, so isn't
- * thread-safe, but this makes it easy to use from any code...
+ * This is a very simple logging subsystem. It uses a global handle, which
+ * makes it easy to use from any code... lo() may be called from several
+ * threads at once, as each line is written under the file's lock, but
+ * log_reopen() must only be called while there's just one thread (e.g. just
+ * after forking).
  */
 
 #include <sys/types.h>
@@ -1,8 +1,53 @@
 
 /* system includes */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 /* project includes */
 #include "map.h"
+#include "log.h"
+
+/**
+ * A number, as its digits: which, unlike a floating point one, tells any two
+ * keys apart, however long.
+ */
+typedef struct {
+    short sign;            /**< -1, 0 or 1 */
+    const char *whole;     /**< the digits before the point, less leading
+                              zeros */
+    size_t whole_length;
+    const char *fraction;  /**< those after it, less trailing zeros */
+    size_t fraction_length;
+} map_number;
+
+/**
+ * Which partition holds the rows with one value of a key.
+ */
+typedef struct {
+    char *value;
+    map_number number;  /**< the value, if it's a number */
+    short numeric;
+    int partition_id;
+} map_entry;
+
+/**
+ * A map of a key's values, read from a table on the master; or else of
+ * ranges of them, each starting at an entry's value and held by the entry's
+ * partition, with first_partition_id holding the values before them all.
+ */
+typedef struct {
+    char *name;
+    char *key;
+    char *partition_id;
+    map_entry *entries;  /**< in order of value, once loaded */
+    int entry_count;
+    short ranged;
+    int first_partition_id;
+} map_table;
 
 #define CFG_MAP_TABLE "map_table"
 
@@ -12,18 +57,402 @@
 #define CFG_PARTITION_ID "partition_id"
 #define CFG_PARTITION_ID_DEFAULT "partition_id"
 
+#define CFG_RANGE_BOUNDS "range_bounds"
+#define CFG_RANGE_PARTITION_IDS "range_partition_ids"
+
+static map_table *map_tables = 0;
+static int map_table_count = 0;
+
+int map_count(void)
+{
+    return map_table_count;
+}
+
+char *map_query(int map)
+{
+    map_table *m = &map_tables[map];
+    size_t size = sizeof("SELECT , FROM ") + strlen(m->key)
+        + strlen(m->partition_id) + strlen(m->name);
+    char *sql = malloc(size);
+
+    if (sql) {
+        snprintf(sql, size, "SELECT %s,%s FROM %s", m->key,
+                 m->partition_id, m->name);
+    }
+    return sql;
+}
+
+/**
+ * Read a value as a number, if it is one: digits, perhaps with a sign and a
+ * decimal point, but no exponent.
+ *
+ * @param[in] value the value
+ * @param[out] number the number, pointing into the value
+ * @return 1 if it's a number; 0 otherwise.
+ */
+static short read_number(const char *value, map_number * number)
+{
+    const char *p = value;
+    size_t digits;
+
+    number->sign = (*p == '-') ? -1 : 1;
+    if ((*p == '-') || (*p == '+')) {
+        ++p;
+    }
+    digits = strspn(p, "0123456789");
+    number->whole = p;
+    number->whole_length = digits;
+    while (number->whole_length && (*number->whole == '0')) {
+        ++number->whole;
+        --number->whole_length;
+    }
+    p += digits;
+
+    number->fraction = "";
+    number->fraction_length = 0;
+    if (*p == '.') {
+        number->fraction = ++p;
+        number->fraction_length = strspn(p, "0123456789");
+        p += number->fraction_length;
+        digits += number->fraction_length;
+        while (number->fraction_length
+               && (number->fraction[number->fraction_length - 1] == '0')) {
+            --number->fraction_length;
+        }
+    }
+    if (*p || !digits) {
+        return 0;
+    }
+    if (!number->whole_length && !number->fraction_length) {
+        number->sign = 0;
+    }
+    return 1;
+}
+
+/**
+ * Compare two numbers.
+ *
+ * @return less than, equal to or greater than 0, as the first is less than,
+ * the same as or greater than the second
+ */
+static int compare_numbers(const map_number * a, const map_number * b)
+{
+    int difference;
+    size_t shorter = (a->fraction_length < b->fraction_length)
+        ? a->fraction_length : b->fraction_length;
+
+    if (a->sign != b->sign) {
+        return (a->sign > b->sign) - (a->sign < b->sign);
+    }
+    /* equal signs: compare the magnitudes, the wrong way round if negative */
+    if (a->whole_length != b->whole_length) {
+        difference = (a->whole_length > b->whole_length) ? 1 : -1;
+    } else if (!(difference = memcmp(a->whole, b->whole, a->whole_length))
+               && !(difference = memcmp(a->fraction, b->fraction, shorter))) {
+        difference = (a->fraction_length > b->fraction_length)
+            - (a->fraction_length < b->fraction_length);
+    }
+    return a->sign * ((difference > 0) - (difference < 0));
+}
+
+int map_add(int map, const char *value, const char *partition_id)
+{
+    map_table *m = &map_tables[map];
+    char *end;
+    long partition;
+    map_entry *grown;
+
+    errno = 0;
+    partition = strtol(partition_id, &end, 10);
+    if ((end == partition_id) || *end || errno || (partition < INT_MIN)
+        || (partition > INT_MAX)) {
+        lo(LOG_ERROR, "map_add: %s: partition '%s' of '%s' isn't a number",
+           m->name, partition_id, value);
+        return 0;
+    }
+
+    grown = realloc(m->entries, sizeof(map_entry) * (m->entry_count + 1));
+    if (!grown) {
+        return 0;
+    }
+    m->entries = grown;
+
+    map_entry *e = &m->entries[m->entry_count];
+    e->value = strdup(value);
+    if (!e->value) {
+        return 0;
+    }
+    /* the number points into the entry's own copy of the value */
+    e->numeric = read_number(e->value, &e->number);
+    e->partition_id = partition;
+    ++m->entry_count;
+    return 1;
+}
+
+/**
+ * Compare a value with a map entry's: numbers by number, before anything
+ * else, which goes by its bytes (so dates written as YYYY-MM-DD go in
+ * order).
+ *
+ * @param[in] value the value
+ * @param[in] numeric is it a number...
+ * @param[in] number ...and which one
+ * @param[in] e the entry
+ * @return less than, equal to or greater than 0, as the value comes before,
+ * is the same as or comes after the entry's
+ */
+static int compare_value(const char *value, short numeric,
+                         const map_number * number,
+                         const map_entry * e)
+{
+    if (numeric && e->numeric) {
+        return compare_numbers(number, &e->number);
+    }
+    if (numeric != e->numeric) {
+        return numeric ? -1 : 1;
+    }
+    return strcmp(value, e->value);
+}
+
+/**
+ * qsort(3) comparison of map entries.
+ */
+static int compare_entries(const void *a, const void *b)
+{
+    const map_entry *e = a;
+    return compare_value(e->value, e->numeric, &e->number, b);
+}
+
+void map_loaded(int map)
+{
+    map_table *m = &map_tables[map];
+
+    qsort(m->entries, m->entry_count, sizeof(map_entry), compare_entries);
+    lo(LOG_INFO, "map: %d entries in %s", m->entry_count, m->name);
+}
+
+/**
+ * Count a map's entries whose values come before a value.
+ *
+ * @param[in] m the map
+ * @param[in] value the value
+ * @param[in] or_equal count the entry with the value itself, too
+ * @return how many there are
+ */
+static int entries_before(map_table * m, const char *value, short or_equal)
+{
+    map_number number;
+    short numeric = read_number(value, &number);
+    int low = 0;
+    int high = m->entry_count;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+        int difference = compare_value(value, numeric, &number,
+                                       &m->entries[middle]);
+        if ((difference > 0) || (or_equal && !difference)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Can a range map place a value: is it of the same kind (number or not) as
+ * the map's bounds? MySQL compares one of the other kind with the key
+ * differently: to it, '5 ' is the number 5.
+ *
+ * @param[in] m the map
+ * @param[in] numeric is the value a number?
+ * @return 1 if so; 0 otherwise.
+ */
+static short same_kind(map_table * m, short numeric)
+{
+    /* numbers come first */
+    return !m->entry_count || (numeric ? m->entries[0].numeric
+                               : !m->entries[m->entry_count - 1].numeric);
+}
+
+short map_ranged(int map)
+{
+    return map_tables[map].ranged;
+}
+
+int map_find_ranges(const char *key)
+{
+    for (int i = 0; i < map_table_count; ++i) {
+        if (map_tables[i].ranged && !strcasecmp(map_tables[i].key, key)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int map_range_count(int map)
+{
+    return map_tables[map].entry_count + 1;
+}
+
+void map_narrow(int map, const char *value, short upper, short exclusive,
+                int *first, int *last)
+{
+    map_table *m = &map_tables[map];
+    map_number number;
+
+    if (!same_kind(m, read_number(value, &number))) {
+        /* a bound the ranges can't be placed against leaves them all */
+        return;
+    }
+    if (!upper) {
+        /* the range the value is in, whether it's taken in or not */
+        int range = entries_before(m, value, 1);
+        *first = (range > *first) ? range : *first;
+    } else {
+        /* or, below it, the range which takes in the values just below */
+        int range = entries_before(m, value, !exclusive);
+        *last = (range < *last) ? range : *last;
+    }
+}
+
+int map_range_partition(int map, int range)
+{
+    map_table *m = &map_tables[map];
+    return range ? m->entries[range - 1].partition_id
+        : m->first_partition_id;
+}
+
+short map_partition(const char *key, const char *value, int *partition_id)
+{
+    map_number number;
+    short numeric = read_number(value, &number);
+
+    for (int i = 0; i < map_table_count; ++i) {
+        map_table *m = &map_tables[i];
+        int low = 0;
+        int high = m->entry_count;
+
+        if (strcasecmp(m->key, key)) {
+            continue;
+        }
+        if (m->ranged) {
+            if (!same_kind(m, numeric)) {
+                return 0;
+            }
+            *partition_id = map_range_partition(i,
+                                                entries_before(m, value, 1));
+            return 1;
+        }
+        while (low < high) {
+            int middle = (low + high) / 2;
+            int difference = compare_value(value, numeric, &number,
+                                           &m->entries[middle]);
+            if (!difference) {
+                *partition_id = m->entries[middle].partition_id;
+                return 1;
+            }
+            if (difference < 0) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read a range map's configuration: the values each range after the first
+ * starts at, and the partition each range is held by.
+ *
+ * @param[in,out] m the map
+ * @param[in] configuration its map_table section
+ * @return 1 on success, 0 on failure
+ */
+static int read_ranges(map_table * m, cfg_t * configuration)
+{
+    int count = cfg_size(configuration, CFG_RANGE_BOUNDS);
+
+    if (cfg_size(configuration, CFG_RANGE_PARTITION_IDS) != count + 1) {
+        lo(LOG_ERROR, "map: %s: %s needs one more entry than %s", m->name,
+           CFG_RANGE_PARTITION_IDS, CFG_RANGE_BOUNDS);
+        return 0;
+    }
+    m->ranged = 1;
+    m->first_partition_id =
+        cfg_getnint(configuration, CFG_RANGE_PARTITION_IDS, 0);
+
+    for (int i = 0; i < count; ++i) {
+        char partition_id[32];
+
+        snprintf(partition_id, sizeof(partition_id), "%ld",
+                 cfg_getnint(configuration, CFG_RANGE_PARTITION_IDS, i + 1));
+        if (!map_add(m - map_tables,
+                     cfg_getnstr(configuration, CFG_RANGE_BOUNDS, i),
+                     partition_id)) {
+            return 0;
+        }
+        if (i && (compare_entries(&m->entries[i - 1], &m->entries[i]) >= 0)) {
+            lo(LOG_ERROR, "map: %s: %s are out of order", m->name,
+               CFG_RANGE_BOUNDS);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static int map_initialize(cfg_t * configuration)
 {
+    map_table_count = cfg_size(configuration, CFG_MAP_TABLE);
+    map_tables = calloc(map_table_count, sizeof(map_table));
+    if (!map_tables) {
+        map_table_count = 0;
+        return 0;
+    }
+
+    for (int i = 0; i < map_table_count; ++i) {
+        cfg_t *map_table_config =
+            cfg_getnsec(configuration, CFG_MAP_TABLE, i);
+
+        map_tables[i].name = strdup(cfg_title(map_table_config));
+        map_tables[i].key = strdup(cfg_getstr(map_table_config, CFG_KEY));
+        map_tables[i].partition_id =
+            strdup(cfg_getstr(map_table_config, CFG_PARTITION_ID));
+        if (!map_tables[i].name || !map_tables[i].key
+            || !map_tables[i].partition_id) {
+            return 0;
+        }
+        if ((cfg_size(map_table_config, CFG_RANGE_BOUNDS)
+             || cfg_size(map_table_config, CFG_RANGE_PARTITION_IDS))
+            && !read_ranges(&map_tables[i], map_table_config)) {
+            return 0;
+        }
+    }
     return 1;
 }
 
 static void map_shutdown(void)
 {
+    for (int i = 0; i < map_table_count; ++i) {
+        for (int j = 0; j < map_tables[i].entry_count; ++j) {
+            free(map_tables[i].entries[j].value);
+        }
+        free(map_tables[i].entries);
+        free(map_tables[i].name);
+        free(map_tables[i].key);
+        free(map_tables[i].partition_id);
+    }
+    free(map_tables);
+    map_tables = 0;
+    map_table_count = 0;
 }
 
 static cfg_opt_t map_table_options[] = {
     CFG_STR(CFG_KEY, CFG_KEY_DEFAULT, 0),
     CFG_STR(CFG_PARTITION_ID, CFG_PARTITION_ID_DEFAULT, 0),
+    CFG_STR_LIST(CFG_RANGE_BOUNDS, 0, 0),
+    CFG_INT_LIST(CFG_RANGE_PARTITION_IDS, 0, 0),
     CFG_END()
 };
 
@@ -4,7 +4,22 @@
 /**
  * @file map.h
  * @brief partition map
- * 
+ *
+ * Each map_table names a table on the master which says which partition
+ * holds the rows with each value of a key: its key column, and its
+ * partition_id column. The server reads the maps once, at startup, with
+ * the queries map_query() gives it; a statement whose keys are all in a map
+ * can then be sent to just the delegates holding those partitions.
+ *
+ * A map_table with range_bounds is a range map instead, which isn't read
+ * from anywhere: its key's values are split into ranges at each of the
+ * bounds (given in order), and range_partition_ids lists which partition
+ * holds each range, from the one before the first bound to the one from
+ * the last bound on. Numbers go by number, and anything else (a date, say)
+ * by its bytes; a value of the other kind from the bounds isn't in any
+ * range. A statement which only touches a span of values can then be sent
+ * to just the delegates holding the ranges which overlap it.
+ *
  * The map component should be exclusively used by the server component.
  */
 
@@ -14,4 +29,96 @@
 DECLARE_COMPONENT(map);
 /** @endcond */
 
+/**
+ * How many maps are configured?
+ *
+ * @return the number of maps
+ */
+int map_count(void);
+
+/**
+ * Is a map a range map?
+ *
+ * @param[in] map which map
+ * @return 1 if so; 0 if it's read from the master.
+ */
+short map_ranged(int map);
+
+/**
+ * Get the query which reads a map: its key and partition_id columns, in
+ * that order.
+ *
+ * @param[in] map which map, counting from 0
+ * @return freshly allocated SQL, or 0 on failure (no memory)
+ */
+char *map_query(int map);
+
+/**
+ * Add a row read from a map's table.
+ *
+ * @param[in] map which map
+ * @param[in] value a value of the key
+ * @param[in] partition_id the partition which holds it
+ * @return 1 on success, 0 on failure
+ */
+int map_add(int map, const char *value, const char *partition_id);
+
+/**
+ * Finish reading a map, once all of its rows are in.
+ *
+ * @param[in] map which map
+ */
+void map_loaded(int map);
+
+/**
+ * Look up which partition holds a value of a key.
+ *
+ * @param[in] key the key column's name
+ * @param[in] value the value, as written (less quotes)
+ * @param[out] partition_id the partition
+ * @return 1 if a map has the value, or a range map has a range it's in;
+ * 0 otherwise.
+ */
+short map_partition(const char *key, const char *value, int *partition_id);
+
+/**
+ * Find the range map of a key.
+ *
+ * @param[in] key the key column's name
+ * @return which map, or -1 if there isn't one
+ */
+int map_find_ranges(const char *key);
+
+/**
+ * How many ranges does a range map have?
+ *
+ * @param[in] map which map
+ * @return the number of ranges, which are numbered in order from 0
+ */
+int map_range_count(int map);
+
+/**
+ * Narrow a span of a range map's ranges to those which a bound on the key
+ * leaves values in.
+ *
+ * @param[in] map which map
+ * @param[in] value the bound, as written (less quotes)
+ * @param[in] upper is it an upper bound (or a lower one)?
+ * @param[in] exclusive ...which leaves the value itself out?
+ * @param[in,out] first the first range of the span
+ * @param[in,out] last the last range of the span, which ends up before the
+ * first if there are none left
+ */
+void map_narrow(int map, const char *value, short upper, short exclusive,
+                int *first, int *last);
+
+/**
+ * Which partition holds one of a range map's ranges?
+ *
+ * @param[in] map which map
+ * @param[in] range which range
+ * @return the partition
+ */
+int map_range_partition(int map, int range);
+
 #endif
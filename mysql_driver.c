@@ -1,14 +1,20 @@
 /* system includes */
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 
 /* project includes */
 #include "log.h"
 #include "mysql_driver.h"
+#include "sha1.h"
 
 /** XXX: crap that really should be used directly from mysql headers! */
 #define HEADER_SIZE 4
@@ -20,63 +26,785 @@ enum enum_server_command {
     COM_TABLE_DUMP, COM_CONNECT_OUT, COM_REGISTER_SLAVE,
     COM_STMT_PREPARE, COM_STMT_EXECUTE, COM_STMT_SEND_LONG_DATA,
     COM_STMT_CLOSE, COM_STMT_RESET, COM_SET_OPTION, COM_STMT_FETCH,
+    COM_DAEMON, COM_BINLOG_DUMP_GTID, COM_RESET_CONNECTION,
     /* don't forget to update const char *command_name[] in sql_parse.cc */
 
     /* Must be last */
     COM_END
 };
+enum enum_field_types {
+    MYSQL_TYPE_DECIMAL, MYSQL_TYPE_TINY, MYSQL_TYPE_SHORT, MYSQL_TYPE_LONG,
+    MYSQL_TYPE_FLOAT, MYSQL_TYPE_DOUBLE, MYSQL_TYPE_NULL,
+    MYSQL_TYPE_TIMESTAMP, MYSQL_TYPE_LONGLONG, MYSQL_TYPE_INT24,
+    MYSQL_TYPE_DATE, MYSQL_TYPE_TIME, MYSQL_TYPE_DATETIME, MYSQL_TYPE_YEAR,
+    MYSQL_TYPE_NEWDATE, MYSQL_TYPE_VARCHAR, MYSQL_TYPE_BIT,
+    MYSQL_TYPE_NEWDECIMAL = 246, MYSQL_TYPE_ENUM = 247, MYSQL_TYPE_SET = 248,
+    MYSQL_TYPE_TINY_BLOB = 249, MYSQL_TYPE_MEDIUM_BLOB = 250,
+    MYSQL_TYPE_LONG_BLOB = 251, MYSQL_TYPE_BLOB = 252,
+    MYSQL_TYPE_VAR_STRING = 253, MYSQL_TYPE_STRING = 254,
+    MYSQL_TYPE_GEOMETRY = 255
+};
 
-static short done;
-static short waiting_for_client_auth;
-static short command_is_client_auth;
-packet *error_packet;
 
 enum expect_reply_state {
     REP_NONE,
     REP_GREETING,
     REP_SIMPLE,
     REP_TABLE_FIELDS,
-    REP_TABLE_ROWS
+    REP_TABLE_ROWS,
+    REP_PREPARE
 };
 
+/* capability and status flags, from mysql_com.h */
+#define CLIENT_LONG_PASSWORD 0x0001
+#define CLIENT_LONG_FLAG 0x0004
+#define CLIENT_CONNECT_WITH_DB 0x0008
+#define CLIENT_PROTOCOL_41 0x0200
+#define CLIENT_TRANSACTIONS 0x2000
+#define CLIENT_SECURE_CONNECTION 0x8000
+#define SERVER_STATUS_IN_TRANS 0x0001
+#define SERVER_STATUS_AUTOCOMMIT 0x0002
+#define SERVER_SESSION_STATE_CHANGED 0x4000
+
+#define SCRAMBLE_LENGTH 20
+
+/** what pdb's own greeting calls the server */
+#define SERVER_VERSION "5.1.0-pdb"
+/** utf8_general_ci */
+#define SERVER_CHARSET 33
+/** the binary "character set", which compares bytes */
+#define BINARY_CHARSET 63
+/** decimal places AVG() adds to its argument's, and at most how many */
+#define DIV_PRECISION_INCREMENT 4
+#define DECIMAL_MAX_SCALE 30
+/** how many slots a table of groups starts with (a power of 2) */
+#define GROUP_SLOTS 16
+/** how many files groups are spilled to, chosen by their hashes' top bits */
+#define SPILL_PARTITIONS 16
+#define SPILL_PARTITION_SHIFT 28
+/** about how much of a folded result set is passed on at a time */
+#define FOLD_BATCH_SIZE 65536
+/** FNV-1a */
+#define HASH_BASIS 2166136261u
+#define HASH_PRIME 16777619u
+
+#define ER_ACCESS_DENIED_ERROR 1045
+#define ER_UNKNOWN_ERROR 1105
+#define ER_NOT_SUPPORTED_YET 1235
+#define ER_UNKNOWN_STMT_HANDLER 1243
+
+#define CFG_CLIENT_USER "client_user"
+
+#define CFG_PASSWORD_HASH "password_hash"
+#define CFG_PASSWORD_HASH_DEFAULT ""
+
+#define CFG_MERGE_MEMORY_LIMIT "merge_memory_limit"
+#define CFG_MERGE_MEMORY_LIMIT_DEFAULT 65536
+
+#define CFG_STATEMENT_CACHE_SIZE "statement_cache_size"
+#define CFG_STATEMENT_CACHE_SIZE_DEFAULT 64
+
+/**
+ * A client login which pdb checks itself, rather than passing the client's
+ * login on to the delegates.
+ */
+typedef struct {
+    char *name;
+    short has_password;
+    unsigned char stage2[SHA1_DIGEST_SIZE];   /**< SHA1(SHA1(password)) */
+} client_user;
+
+/* the configuration is only written while components are configured, after
+   which any thread may read it */
+static client_user *client_users = 0;
+static int client_user_count = 0;
+/** source of greeting scrambles, when checking logins */
+static int random_fd = -1;
+/** bytes of groups a session holds before spilling them, or 0 for no limit */
+static size_t merge_memory_limit = 0;
+/** statements kept prepared on a delegate connection */
+static int statement_cache_size = 0;
+
 typedef struct {
     short expecting_rows;
     short error;
+    short in_transaction; /**< as of the delegate's last OK or EOF */
+    short pinned;         /**< kept for the rest of the session, for the
+                               state it's left on the connection */
+    short forward;        /**< pass the packet just read on to the client */
+    int fields;           /**< field definitions sent so far */
+    packet head;          /**< next row to merge in order: a slice of the
+                               delegate's receive buffer, which isn't read
+                               again until the row has been passed on */
+    short has_head;
+    int pending_packets;  /**< of a COM_STMT_PREPARE reply, after the first */
     enum expect_reply_state expect_replies;
 } delegate_state;
-delegate_state *delegate_states;
-delegate_id delegate_states_count;
 
-short mysql_driver_initialize(delegate_id delegate_count)
+/**
+ * A statement the client has prepared, under pdb's own id for it. It's
+ * prepared on each delegate connection the first time it's executed there.
+ */
+typedef struct client_statement {
+    unsigned int id;
+    char *sql;
+    int params;
+    char *types;              /**< the parameters' types, as the client last
+                                   bound them, or 0 */
+    struct client_statement *next;
+} client_statement;
+
+/**
+ * A statement prepared on a delegate connection, under the delegate's id.
+ */
+typedef struct {
+    char *sql;
+    char id[4];
+    unsigned long used;       /**< when it was last executed */
+} connection_statement;
+
+/**
+ * The statements prepared on a delegate connection. Once there are
+ * statement_cache_size of them, the least recently executed is closed to
+ * make room for the next.
+ */
+typedef struct {
+    connection_statement *statements;
+    int count;
+    unsigned long clock;
+    packet *command;          /**< preparing a statement, while it's sent */
+    char *preparing;          /**< ...and its SQL, until the reply's in */
+    int replying;             /**< packets of the reply still to come */
+} statement_cache;
+
+/**
+ * A column rows are merged in order of.
+ */
+typedef struct {
+    int column;
+    unsigned char type;
+    int charset;
+    short descending;
+} merge_key;
+
+/**
+ * A column's running aggregate, while the delegates' rows are folded into
+ * one.
+ */
+typedef struct {
+    char *bytes;      /**< 0 for NULL */
+    int length;
+} aggregate_value;
+
+/**
+ * The rows of a group, folded into one.
+ */
+typedef struct {
+    unsigned int hash;        /**< of the group's GROUP BY values */
+    aggregate_value *values;  /**< each column's aggregate, or 0 for an
+                                   empty slot */
+} merge_group;
+
+/**
+ * A folded row, ready to be passed on.
+ */
+typedef struct {
+    packet *row;              /**< every column's value, hidden ones too */
+    int *values;              /**< its order keys' values, as
+                                   mysql_session.values */
+} merged_row;
+
+/**
+ * What an OK packet says.
+ */
+typedef struct {
+    unsigned long long affected_rows;
+    unsigned long long insert_id;
+    int status;
+    int warnings;
+    const char *info;         /**< human readable, to the end of the packet */
+    int info_length;
+} ok_fields;
+
+/**
+ * How the delegates' rows are being folded: into a hash table of groups,
+ * open-addressed, which is spilled to a set of files whenever it grows past
+ * merge_memory_limit. Once every row is in, the groups are finished,
+ * checked against the HAVING conditions, and sorted, then passed on in
+ * batches. Spilled groups are read back a file at a time; if they have to
+ * be sorted, each file's are sorted into a run of its own, and the runs
+ * merged.
+ */
+typedef struct {
+    int columns;
+    short started;            /**< the columns' types are known */
+    merge_key *keys;          /**< each column's type */
+    int *values;              /**< the row being folded: each column's
+                                   offset and length (-1 for NULL) */
+    merge_group *groups;
+    int slots;                /**< a power of 2, at least twice count */
+    int count;
+    size_t memory;            /**< about how much the groups take up */
+    short loading;            /**< reading back spilled groups */
+    short spilled;
+    FILE *spills[SPILL_PARTITIONS];
+    int next_partition;       /**< the next to be read back */
+    merged_row *rows;         /**< finished rows, in order */
+    int *row_values;
+    int row_count;
+    int next_row;
+    FILE *runs[SPILL_PARTITIONS];
+    merged_row heads[SPILL_PARTITIONS];  /**< each run's next row */
+    int run_count;
+    int run;                  /**< whose head is least */
+    long long passed;         /**< rows skipped or passed on so far */
+    short emitting;           /**< 1 while passing rows on, 2 once done */
+} fold_state;
+
+/**
+ * Driver state for a single client connection.
+ */
+typedef struct {
+    short done;
+    short waiting_for_client_auth;
+    short command_is_client_auth;
+    packet *error_packet;
+    delegate_state *delegate_states;
+    delegate_id delegate_states_count;
+    packet *client_auth;      /**< replayed to delegates connected later */
+    packet **state_commands;  /**< ditto, in the order the client sent them */
+    int state_command_count;
+    short state_pending;      /**< the last one has yet to succeed */
+    short pinning;            /**< the command leaves state on the
+                                   connections it's sent to */
+
+    /* the delegates' replies are merged into one for the client */
+    int sequence;             /**< of the next packet sent to the client */
+    int leader;               /**< whose result set header is passed on, or
+                                   -1 if none has started one yet */
+    short header_sent;        /**< the leader's header has been passed on */
+    packet *last_reply;       /**< held back to end the merged reply */
+    short lost_reply;         /**< ...or couldn't be */
+    int columns;              /**< every delegate's result set has, or -1 if
+                                   none has said yet */
+    packet **fields;          /**< the first definition of each column, which
+                                   the others' have to match */
+    int field_count;
+    int fields_allocated;
+    sql_merge *merge;         /**< how to merge result sets, beyond
+                                   concatenating them */
+    short ordering;           /**< rows are merged in order: 1 if so, 0 if
+                                   not, -1 if that's yet to be worked out */
+    merge_key *keys;
+    int key_count;
+    int *values;              /**< each head's key values: offset and length
+                                   (-1 for NULL), by delegate then key */
+    delegate_id *heap;        /**< delegates with heads, least first */
+    int heap_count;
+    delegate_id *merged;      /**< delegates whose heads are passed on next */
+    packet *partial_command;  /**< sent to the delegates instead of the
+                                   client's command, or 0 */
+    packet **delegate_commands; /**< sent to a delegate instead of either
+                                     (by delegate), or 0 */
+    fold_state *fold;         /**< how rows are folded, if they're folded
+                                   into one per group, or 0 */
+    long long passed;         /**< rows counted against the LIMIT so far */
+    packet *early_reply;      /**< ends the merged reply once the LIMIT is
+                                   reached, before the delegates' do */
+    short limited;            /**< ...which it has: the rest of their rows
+                                   are thrown away */
+
+    /* prepared statements */
+    client_statement *statements;
+    unsigned int next_statement_id;
+    client_statement *executing;  /**< by the current command, or 0 */
+    char *prepare_sql;        /**< prepared by the current command, or 0 */
+    statement_cache *preparing;   /**< ...on this delegate connection */
+
+    /* the rest is only used when pdb checks logins itself */
+    unsigned char scramble[SCRAMBLE_LENGTH];  /**< sent in pdb's greeting */
+    char *user;               /**< who the client is logged in as */
+    short has_password;
+    unsigned char stage1[SHA1_DIGEST_SIZE];   /**< SHA1(password) */
+    short refused;            /**< the client's login was refused */
+    packet *local_reply;      /**< pdb's own answer for the client */
+} mysql_session;
+
+/** the session currently being worked on by this thread */
+static __thread mysql_session *session = 0;
+
+void *mysql_driver_session_new(void)
+{
+    mysql_session *s = malloc(sizeof(mysql_session));
+    if (!s) {
+        return 0;
+    }
+    s->done = 0;
+    s->waiting_for_client_auth = 0;
+    s->command_is_client_auth = 0;
+    s->error_packet = 0;
+    s->delegate_states = 0;
+    s->delegate_states_count = 0;
+    s->client_auth = 0;
+    s->state_commands = 0;
+    s->state_command_count = 0;
+    s->state_pending = 0;
+    s->pinning = 0;
+    s->sequence = 0;
+    s->leader = -1;
+    s->header_sent = 0;
+    s->last_reply = 0;
+    s->lost_reply = 0;
+    s->columns = -1;
+    s->fields = 0;
+    s->field_count = 0;
+    s->fields_allocated = 0;
+    s->merge = 0;
+    s->ordering = 0;
+    s->keys = 0;
+    s->key_count = 0;
+    s->values = 0;
+    s->heap = 0;
+    s->heap_count = 0;
+    s->merged = 0;
+    s->partial_command = 0;
+    s->delegate_commands = 0;
+    s->fold = 0;
+    s->passed = 0;
+    s->early_reply = 0;
+    s->limited = 0;
+    s->statements = 0;
+    s->next_statement_id = 1;
+    s->executing = 0;
+    s->prepare_sql = 0;
+    s->preparing = 0;
+    s->user = 0;
+    s->has_password = 0;
+    s->refused = 0;
+    s->local_reply = 0;
+    return s;
+}
+
+void mysql_driver_session_set(void *s)
+{
+    session = (mysql_session *) s;
+}
+
+/**
+ * Forget the client's session state, as a delegate does on
+ * COM_RESET_CONNECTION.
+ *
+ * @param[in,out] s the session
+ */
+static void forget_state_commands(mysql_session * s)
+{
+    for (int i = 0; i < s->state_command_count; ++i) {
+        packet_delete(s->state_commands[i]);
+    }
+    free(s->state_commands);
+    s->state_commands = 0;
+    s->state_command_count = 0;
+    s->state_pending = 0;
+}
+
+/**
+ * Forget the statements the client has prepared.
+ *
+ * @param[in,out] s the session
+ */
+static void forget_statements(mysql_session * s)
+{
+    while (s->statements) {
+        client_statement *doomed = s->statements;
+        s->statements = doomed->next;
+        free(doomed->sql);
+        free(doomed->types);
+        free(doomed);
+    }
+    s->executing = 0;
+    free(s->prepare_sql);
+    s->prepare_sql = 0;
+    s->preparing = 0;
+}
+
+/**
+ * Forget the column definitions of the last merged result set.
+ *
+ * @param[in,out] s the session
+ */
+static void forget_fields(mysql_session * s)
+{
+    for (int i = 0; i < s->field_count; ++i) {
+        packet_delete(s->fields[i]);
+    }
+    s->field_count = 0;
+    s->columns = -1;
+}
+
+/**
+ * Free a group's aggregates.
+ *
+ * @param[in,out] fold how rows are folded
+ * @param[in,out] group the group
+ */
+static void free_group(fold_state * fold, merge_group * group)
+{
+    for (int i = 0; i < fold->columns; ++i) {
+        free(group->values[i].bytes);
+    }
+    free(group->values);
+    group->values = 0;
+}
+
+/**
+ * Free the finished rows waiting to be passed on.
+ *
+ * @param[in,out] fold how rows are folded
+ */
+static void free_rows(fold_state * fold)
+{
+    for (int i = 0; i < fold->row_count; ++i) {
+        packet_delete(fold->rows[i].row);
+    }
+    free(fold->rows);
+    fold->rows = 0;
+    free(fold->row_values);
+    fold->row_values = 0;
+    fold->row_count = 0;
+    fold->next_row = 0;
+}
+
+/**
+ * Free everything to do with folding rows.
+ *
+ * @param[in,out] fold how rows are folded, or 0
+ */
+static void fold_delete(fold_state * fold)
 {
-    done = 0;
-    waiting_for_client_auth = 0;
-    command_is_client_auth = 0;
+    if (!fold) {
+        return;
+    }
+    for (int i = 0; i < fold->slots; ++i) {
+        if (fold->groups[i].values) {
+            free_group(fold, &fold->groups[i]);
+        }
+    }
+    free(fold->groups);
+    free_rows(fold);
+    for (int i = 0; i < SPILL_PARTITIONS; ++i) {
+        if (fold->spills[i]) {
+            fclose(fold->spills[i]);
+        }
+        if (fold->runs[i]) {
+            fclose(fold->runs[i]);
+        }
+        packet_delete(fold->heads[i].row);
+        free(fold->heads[i].values);
+    }
+    free(fold->keys);
+    free(fold->values);
+    free(fold);
+}
+
+/**
+ * Forget how the current command's result sets are merged.
+ *
+ * @param[in,out] s the session
+ */
+static void forget_merge(mysql_session * s)
+{
+    fold_delete(s->fold);
+    s->fold = 0;
+    sql_merge_delete(s->merge);
+    s->merge = 0;
+    s->ordering = 0;
+    free(s->keys);
+    s->keys = 0;
+    s->key_count = 0;
+    free(s->values);
+    s->values = 0;
+    free(s->heap);
+    s->heap = 0;
+    s->heap_count = 0;
+    free(s->merged);
+    s->merged = 0;
+    packet_delete(s->partial_command);
+    s->partial_command = 0;
+    if (s->delegate_commands) {
+        for (delegate_id i = 0; i < s->delegate_states_count; ++i) {
+            packet_delete(s->delegate_commands[i]);
+        }
+        free(s->delegate_commands);
+        s->delegate_commands = 0;
+    }
+    s->passed = 0;
+    packet_delete(s->early_reply);
+    s->early_reply = 0;
+    s->limited = 0;
+    for (delegate_id i = 0; i < s->delegate_states_count; ++i) {
+        s->delegate_states[i].has_head = 0;
+    }
+}
+
+/**
+ * Forget what's been recorded for replaying to delegates.
+ *
+ * @param[in,out] s the session
+ */
+static void forget_replay(mysql_session * s)
+{
+    packet_delete(s->client_auth);
+    s->client_auth = 0;
+    forget_state_commands(s);
+}
+
+void mysql_driver_session_delete(void *s)
+{
+    mysql_session *doomed = (mysql_session *) s;
+    if (doomed) {
+        if (session == doomed) {
+            session = 0;
+        }
+        packet_delete(doomed->error_packet);
+        packet_delete(doomed->last_reply);
+        packet_delete(doomed->local_reply);
+        forget_fields(doomed);
+        free(doomed->fields);
+        forget_merge(doomed);
+        forget_replay(doomed);
+        forget_statements(doomed);
+        free(doomed->user);
+        free(doomed->delegate_states);
+        free(doomed);
+    }
+}
+
+/**
+ * Does pdb check client logins itself?
+ *
+ * @return 1 if so; 0 if logins are passed on to the delegates.
+ */
+static short checking_logins(void)
+{
+    return client_user_count > 0;
+}
+
+/**
+ * Write a packet header.
+ *
+ * @param[out] header where it goes
+ * @param[in] sequence the packet's sequence number
+ * @param[in] length the length of the packet's body
+ */
+static void write_header(char *header, int sequence, int length)
+{
+    header[0] = (unsigned char)(length);
+    header[1] = (unsigned char)(length >> 8);
+    header[2] = (unsigned char)(length >> 16);
+    header[3] = (unsigned char)sequence;
+}
+
+/**
+ * Allocate a zeroed packet, ready to be filled in.
+ *
+ * @param[in] sequence the packet's sequence number
+ * @param[in] length the length of the packet's body
+ * @return the packet, or 0 on failure
+ */
+static packet *new_packet(int sequence, int length)
+{
+    packet *p = packet_new();
+    if (!p) {
+        return 0;
+    }
+    p->bytes = calloc(HEADER_SIZE + length, 1);
+    if (!p->bytes) {
+        packet_delete(p);
+        return 0;
+    }
+    p->size = p->allocated = HEADER_SIZE + length;
+    write_header(p->bytes, sequence, length);
+    return p;
+}
+
+/**
+ * Start merging the delegates' replies to a new command.
+ *
+ * @param[in] sequence the sequence number of the first reply packet
+ */
+static void merge_begin(int sequence)
+{
+    session->sequence = sequence;
+    session->leader = -1;
+    session->header_sent = 0;
+    packet_delete(session->last_reply);
+    session->last_reply = 0;
+    session->lost_reply = 0;
+    forget_fields(session);
+    forget_merge(session);
+    for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+        session->delegate_states[i].fields = 0;
+    }
+}
+
+/**
+ * Build an OK packet, with nothing affected.
+ *
+ * @param[in] sequence the packet's sequence number
+ * @return the packet, or 0 on failure
+ */
+static packet *ok_packet(int sequence)
+{
+    /* header, affected rows, insert id, status, warnings */
+    packet *p = new_packet(sequence, 1 + 1 + 1 + 2 + 2);
+    if (p) {
+        p->bytes[HEADER_SIZE + 3] = SERVER_STATUS_AUTOCOMMIT;
+    }
+    return p;
+}
+
+/**
+ * Build an error packet.
+ *
+ * @param[in] sequence the packet's sequence number
+ * @param[in] code the error number
+ * @param[in] state the five character SQL state
+ * @param[in] message the message
+ * @return the packet, or 0 on failure
+ */
+static packet *error_packet(int sequence, int code, const char *state,
+                            const char *message)
+{
+    packet *p = new_packet(sequence, 1 + 2 + 1 + 5 + strlen(message));
+    if (p) {
+        char *b = p->bytes + HEADER_SIZE;
+        b[0] = (char)0xff;
+        b[1] = (unsigned char)code;
+        b[2] = (unsigned char)(code >> 8);
+        b[3] = '#';
+        memcpy(b + 4, state, 5);
+        memcpy(b + 9, message, strlen(message));
+    }
+    return p;
+}
+
+/**
+ * Build pdb's own greeting for the current session, with a fresh scramble.
+ *
+ * @return the greeting, or 0 on failure
+ */
+static packet *greeting_packet(void)
+{
+    /* random printable characters, as a server would send */
+    if (read(random_fd, session->scramble, SCRAMBLE_LENGTH) !=
+        SCRAMBLE_LENGTH) {
+        lo(LOG_ERROR, "mysql_driver: can't make a scramble: %s",
+           strerror(errno));
+        return 0;
+    }
+    for (int i = 0; i < SCRAMBLE_LENGTH; ++i) {
+        session->scramble[i] = '!' + session->scramble[i] % ('~' - '!');
+    }
 
-    delegate_states = malloc(sizeof(delegate_state) * delegate_count);
-    if (!delegate_states) {
+    /* protocol version, server version, thread id, first 8 bytes of the
+       scramble, filler, capabilities, charset, status, more capabilities,
+       scramble length, 10 reserved bytes, rest of the scramble */
+    packet *p = new_packet(0, 1 + sizeof(SERVER_VERSION) + 4 + 8 + 1 + 2 +
+                           1 + 2 + 2 + 1 + 10 + SCRAMBLE_LENGTH - 8 + 1);
+    if (!p) {
         return 0;
     }
 
-    delegate_states_count = delegate_count;
-    for (delegate_id i = 0; i < delegate_states_count; ++i) {
-        delegate_states[i].error = 0;
-        delegate_states[i].expecting_rows = 0;
-        delegate_states[i].expect_replies = REP_GREETING;
+    unsigned long capabilities = CLIENT_LONG_PASSWORD | CLIENT_LONG_FLAG |
+        CLIENT_CONNECT_WITH_DB | CLIENT_PROTOCOL_41 | CLIENT_TRANSACTIONS |
+        CLIENT_SECURE_CONNECTION;
+    char *b = p->bytes + HEADER_SIZE;
+    *b++ = 10;
+    memcpy(b, SERVER_VERSION, sizeof(SERVER_VERSION));
+    b += sizeof(SERVER_VERSION) + 4;
+    memcpy(b, session->scramble, 8);
+    b += 8 + 1;
+    b[0] = (unsigned char)capabilities;
+    b[1] = (unsigned char)(capabilities >> 8);
+    b[2] = SERVER_CHARSET;
+    b[3] = SERVER_STATUS_AUTOCOMMIT;
+    b[7] = SCRAMBLE_LENGTH + 1;
+    b += 2 + 1 + 2 + 2 + 1 + 10;
+    memcpy(b, session->scramble + 8, SCRAMBLE_LENGTH - 8);
+    return p;
+}
+
+short mysql_driver_initialize(delegate_id delegate_count)
+{
+    session->done = 0;
+    session->waiting_for_client_auth = 0;
+    session->command_is_client_auth = 0;
+    session->refused = 0;
+
+    if (session->error_packet) {
+        packet_delete(session->error_packet);
+        session->error_packet = 0;
+    }
+    packet_delete(session->local_reply);
+    session->local_reply = 0;
+    forget_replay(session);
+    forget_statements(session);
+    session->next_statement_id = 1;
+    free(session->user);
+    session->user = 0;
+
+    /* reuse the state from a previous connection where possible */
+    if (!session->delegate_states
+        || (session->delegate_states_count != delegate_count)) {
+        free(session->delegate_states);
+        session->delegate_states =
+            malloc(sizeof(delegate_state) * delegate_count);
+        if (!session->delegate_states) {
+            session->delegate_states_count = 0;
+            return 0;
+        }
+    }
+
+    session->delegate_states_count = delegate_count;
+    for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+        session->delegate_states[i].error = 0;
+        session->delegate_states[i].expecting_rows = 0;
+        session->delegate_states[i].in_transaction = 0;
+        session->delegate_states[i].pinned = 0;
+        session->delegate_states[i].forward = 0;
+        session->delegate_states[i].expect_replies = REP_GREETING;
+    }
+    merge_begin(0);
+
+    /* pdb greets the client itself, and connects to delegates later */
+    if (checking_logins()) {
+        for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+            session->delegate_states[i].expect_replies = REP_NONE;
+        }
+        session->waiting_for_client_auth = 1;
+        session->local_reply = greeting_packet();
+        if (!session->local_reply) {
+            return 0;
+        }
     }
     return 1;
 }
 
 short mysql_driver_done(void)
 {
-    return done;
+    return session->done;
 }
 
-short mysql_driver_expect_replies(void)
+/**
+ * Is any delegate still replying?
+ *
+ * @return 1 if so; 0 otherwise.
+ */
+static short replying(void)
 {
-    if (!done) {
-        for (delegate_id i = 0; i < delegate_states_count; ++i) {
-            if (delegate_states[i].expect_replies != REP_NONE) {
+    if (!session->done) {
+        for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+            if (session->delegate_states[i].expect_replies != REP_NONE) {
                 return 1;
             }
         }
@@ -84,21 +812,59 @@ short mysql_driver_expect_replies(void)
     return 0;
 }
 
-short mysql_driver_got_error(void)
+/**
+ * Are folded rows still being passed on?
+ *
+ * @return 1 if so; 0 otherwise.
+ */
+static short emitting(void)
+{
+    return session->fold && (session->fold->emitting == 1);
+}
+
+short mysql_driver_expect_replies(void)
+{
+    /* a folded result set is passed on a batch at a time */
+    return replying() || emitting();
+}
+
+/**
+ * Has any delegate's reply gone wrong?
+ *
+ * @return 1 if so; 0 otherwise.
+ */
+static short failed(void)
 {
-    for (delegate_id i = 0; i < delegate_states_count; ++i) {
-        if (delegate_states[i].error == 1) {
+    for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+        if (session->delegate_states[i].error == 1) {
             return 1;
         }
     }
     return 0;
 }
 
+short mysql_driver_got_error(void)
+{
+    /* too late: the client has had its whole reply */
+    if (session->limited) {
+        return 0;
+    }
+    /* an error can't interrupt the leader's header, only follow it */
+    if ((session->leader != -1) && !session->header_sent
+        && !session->fold) {
+        delegate_state *leader = &session->delegate_states[session->leader];
+        if (leader->expecting_rows && (leader->expect_replies != REP_NONE)) {
+            return 0;
+        }
+    }
+    return failed();
+}
+
 short mysql_driver_expect_commands(void)
 {
-    if (!done) {
-        for (delegate_id i = 0; i < delegate_states_count; ++i) {
-            if (delegate_states[i].expect_replies == REP_NONE) {
+    if (!session->done && !emitting()) {
+        for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+            if (session->delegate_states[i].expect_replies == REP_NONE) {
                 return 1;
             }
         }
@@ -108,79 +874,45 @@ short mysql_driver_expect_commands(void)
 
 packet *mysql_driver_error_packet(void)
 {
-    return packet_copy(error_packet);
-}
-
-packet_status mysql_driver_get_packet(int fd, packet * p)
-{
-    if (p->bytes == 0) {
-        p->size = 0;
-        p->allocated = HEADER_SIZE;
-        p->bytes = malloc(p->allocated);
-        if (!p->bytes) {
-            return PACKET_ERROR;
-        }
-    }
-
-    /* reading the header */
-    if (p->size < HEADER_SIZE) {
-        int len = read(fd, p->bytes + p->size, HEADER_SIZE - p->size);
-        if (len <= 0) {
-            free(p->bytes);
-            p->bytes = 0;
-            p->allocated = 0;
-            p->size = 0;
-            return (len == 0) ? PACKET_EOF : PACKET_ERROR;
-        }
-        p->size += len;
-        if (p->size == HEADER_SIZE) {
-            long packet_length =
-                ((unsigned char)p->bytes[0]) +
-                ((unsigned char)p->bytes[1] << 8) +
-                ((unsigned char)p->bytes[2] << 16);
-            lo(LOG_DEBUG, "mysql_driver_get_packet: read header for packet "
-               "number %d, expected to be %ld bytes", p->bytes[3],
-               packet_length);
-        }
-        return PACKET_INCOMPLETE;
+    if (!session->error_packet) {
+        return 0;
     }
-
-    /* reading the body */
-    long packet_length =
-        ((unsigned char)p->bytes[0]) +
-        ((unsigned char)p->bytes[1] << 8) +
-        ((unsigned char)p->bytes[2] << 16);
-
-    if (p->allocated < (packet_length + HEADER_SIZE)) {
-        p->allocated = (packet_length + HEADER_SIZE);
-        p->bytes = realloc(p->bytes, p->allocated);
-        if (!p->bytes) {
-            p->allocated = 0;
-            p->size = 0;
-            return PACKET_ERROR;
-        }
+    packet *p = packet_copy_temporary(session->error_packet);
+    if (p) {
+        /* it may follow rows from the other delegates */
+        p->bytes[3] = (char)session->sequence;
     }
+    return p;
+}
 
-    int len = read(fd, p->bytes + p->size,
-                   packet_length - (p->size - HEADER_SIZE));
-    if (len <= 0) {
-        free(p->bytes);
-        p->bytes = 0;
-        p->allocated = 0;
-        p->size = 0;
-        return (len == 0) ? PACKET_EOF : PACKET_ERROR;
-    }
+packet *mysql_driver_local_reply(void)
+{
+    packet *reply = session->local_reply;
+    session->local_reply = 0;
+    return reply;
+}
 
-    p->size += len;
+/**
+ * Size of a packet (header included), from its header.
+ *
+ * @param[in] header the packet's header
+ * @return the size
+ */
+static int packet_size(const char *header)
+{
+    return HEADER_SIZE + ((unsigned char)header[0]) +
+        ((unsigned char)header[1] << 8) + ((unsigned char)header[2] << 16);
+}
 
-    if (p->size < (packet_length + HEADER_SIZE)) {
-        lo(LOG_DEBUG, "mysql_driver_get_packet: read %ld of %ld bytes",
-           p->size, packet_length + HEADER_SIZE);
-        return PACKET_INCOMPLETE;
+packet_status mysql_driver_get_packet(packet_buffer * in, packet * p)
+{
+    packet_status status = packet_buffer_read(in, HEADER_SIZE, packet_size,
+                                              p);
+    if (status == PACKET_COMPLETE) {
+        lo(LOG_DEBUG, "mysql_driver_get_packet: read packet number %d of "
+           "length %d", (unsigned char)p->bytes[3], p->size);
     }
-    lo(LOG_DEBUG, "mysql_driver_get_packet: completed packet of length %ld",
-       packet_length + HEADER_SIZE);
-    return PACKET_COMPLETE;
+    return status;
 }
 
 packet_status mysql_driver_put_packet(int fd, packet * p, int *sent)
@@ -196,6 +928,9 @@ packet_status mysql_driver_put_packet(int fd, packet * p, int *sent)
     }
 
     int len = write(fd, p->bytes + *sent, p->size - *sent);
+    if ((len == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+        return PACKET_INCOMPLETE;
+    }
     if (len <= 0) {
         return PACKET_ERROR;
     }
@@ -211,141 +946,2825 @@ packet_status mysql_driver_put_packet(int fd, packet * p, int *sent)
     return PACKET_COMPLETE;
 }
 
-db_driver_command_type mysql_driver_command(packet * in_command)
+/**
+ * Does a query only change the state of the client's session (SET
+ * statements: variables, character sets, isolation levels and so on)?
+ *
+ * @param[in] in_command a COM_QUERY packet
+ * @return 1 if so; 0 otherwise.
+ */
+static short is_session_state(packet * in_command)
 {
-    command_is_client_auth = 0;
+    int i = HEADER_SIZE + 1;
+    while ((i < in_command->size)
+           && isspace((unsigned char)in_command->bytes[i])) {
+        ++i;
+    }
+    return (in_command->size - i > 3)
+        && (strncasecmp(in_command->bytes + i, "set", 3) == 0)
+        && isspace((unsigned char)in_command->bytes[i + 3]);
+}
 
-    for (delegate_id i = 0; i < delegate_states_count; ++i) {
-        /* we default to expecting a simple or tabular response with no row
-           data */
-        delegate_states[i].error = 0;
-        delegate_states[i].expecting_rows = 0;
-        delegate_states[i].expect_replies = REP_SIMPLE;
+/**
+ * Keep a copy of a session state command, to replay to delegates which the
+ * session connects to later. It isn't replayed until it has worked, so that
+ * it isn't run twice on a delegate connected in order to run it.
+ *
+ * @param[in] in_command the command
+ */
+static void record_state_command(packet * in_command)
+{
+    packet **commands = realloc(session->state_commands,
+                                sizeof(packet *) *
+                                (session->state_command_count + 1));
+    if (commands) {
+        session->state_commands = commands;
+        commands[session->state_command_count] = packet_copy(in_command);
+        if (commands[session->state_command_count]) {
+            ++session->state_command_count;
+            session->state_pending = 1;
+            return;
+        }
     }
+    lo(LOG_ERROR, "mysql_driver_command: can't record session state");
+}
 
-    if (waiting_for_client_auth) {
-        waiting_for_client_auth = 0;
-        command_is_client_auth = 1;
-        return DB_DRIVER_COMMAND_TYPE_OTHER;
+packet *mysql_driver_replay_command(int n)
+{
+    if (!session
+        || (n >= session->state_command_count - session->state_pending)) {
+        return 0;
     }
+    return session->state_commands[n];
+}
 
-    enum enum_server_command command =
-        (enum enum_server_command)(unsigned char)in_command->bytes[4];
-    lo(LOG_DEBUG, "mysql_driver_command: I've got a %u packet...", command);
+/**
+ * Find the user name and scramble response in a client's login or
+ * COM_CHANGE_USER packet.
+ *
+ * @param[in] p the packet
+ * @param[in] offset where the user name starts
+ * @param[out] user the user name
+ * @param[out] response the response
+ * @param[out] response_length the length of the response
+ * @return 1 on success, 0 if the packet is malformed
+ */
+static short parse_login(packet * p, int offset, char **user,
+                         const unsigned char **response,
+                         int *response_length)
+{
+    if (offset >= p->size) {
+        return 0;
+    }
+    char *user_end = memchr(p->bytes + offset, 0, p->size - offset);
+    if (!user_end || (user_end + 1 - p->bytes >= p->size)) {
+        return 0;
+    }
+    *user = p->bytes + offset;
+    *response_length = (unsigned char)user_end[1];
+    *response = (unsigned char *)user_end + 2;
+    return user_end + 2 + *response_length - p->bytes <= p->size;
+}
 
-    db_driver_command_type type;
+/**
+ * Check a client's response to the current session's scramble, and log the
+ * session in if it's right: mysql_native_password responses are
+ * SHA1(password) XOR SHA1(scramble + SHA1(SHA1(password))).
+ *
+ * @param[in] user the user name
+ * @param[in] response the response
+ * @param[in] response_length the length of the response
+ * @return 1 if the session is logged in; 0 otherwise.
+ */
+static short check_login(const char *user, const unsigned char *response,
+                         int response_length)
+{
+    client_user *u = 0;
+    for (int i = 0; i < client_user_count; ++i) {
+        if (strcmp(client_users[i].name, user) == 0) {
+            u = &client_users[i];
+            break;
+        }
+    }
+    if (!u) {
+        return 0;
+    }
 
-    /* if we see a QUIT command, don't expect the delegates to respond */
-    switch (command) {
-    case COM_QUIT:
-        /* expecting delegates to quietly drop our connection */
-        for (delegate_id i = 0; i < delegate_states_count; ++i) {
-            delegate_states[i].expect_replies = REP_NONE;
+    unsigned char stage1[SHA1_DIGEST_SIZE];
+    if (!u->has_password) {
+        if (response_length != 0) {
+            return 0;
         }
-        done = 1;
-        type = DB_DRIVER_COMMAND_TYPE_OTHER;
-        break;
-    case COM_QUERY:
-        /* expecting row data to follow the initial response */
-        for (delegate_id i = 0; i < delegate_states_count; ++i) {
-            delegate_states[i].expecting_rows = 1;
+    } else {
+        unsigned char mask[SHA1_DIGEST_SIZE];
+        unsigned char stage2[SHA1_DIGEST_SIZE];
+        sha1_context context;
+
+        if (response_length != SHA1_DIGEST_SIZE) {
+            return 0;
+        }
+        sha1_init(&context);
+        sha1_update(&context, session->scramble, SCRAMBLE_LENGTH);
+        sha1_update(&context, u->stage2, SHA1_DIGEST_SIZE);
+        sha1_final(&context, mask);
+        for (int i = 0; i < SHA1_DIGEST_SIZE; ++i) {
+            stage1[i] = response[i] ^ mask[i];
+        }
+        sha1(stage1, SHA1_DIGEST_SIZE, stage2);
+        if (memcmp(stage2, u->stage2, SHA1_DIGEST_SIZE) != 0) {
+            return 0;
         }
-        type = DB_DRIVER_COMMAND_TYPE_SQL;
-        break;
-    case COM_FIELD_LIST:
-        type = DB_DRIVER_COMMAND_TYPE_TABLE_META;
-        break;
-    default:
-        type = DB_DRIVER_COMMAND_TYPE_UNSUPPORTED;
-        break;
     }
 
-    return type;
+    char *name = strdup(user);
+    if (!name) {
+        return 0;
+    }
+    free(session->user);
+    session->user = name;
+    session->has_password = u->has_password;
+    if (u->has_password) {
+        memcpy(session->stage1, stage1, SHA1_DIGEST_SIZE);
+    }
+    return 1;
 }
 
-void mysql_driver_command_done(delegate_filter * filters)
+/**
+ * Answer a client's login or COM_CHANGE_USER without involving the
+ * delegates.
+ *
+ * @param[in] in_command the login or COM_CHANGE_USER packet
+ * @param[in] offset where the user name starts
+ * @return 1 if the session is logged in; 0 otherwise.
+ */
+static short local_login(packet * in_command, int offset)
 {
-    for (delegate_id i = 0; i < delegate_states_count; ++i) {
-        if (delegate_filter_reduce(filters, i) == DELEGATE_FILTER_DONT_USE) {
-            delegate_states[i].expect_replies = REP_NONE;
-        }
+    char *user = 0;
+    const unsigned char *response;
+    int response_length;
+    short ok;
+
+    for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+        session->delegate_states[i].expect_replies = REP_NONE;
+    }
+
+    ok = parse_login(in_command, offset, &user, &response,
+                     &response_length)
+        && check_login(user, response, response_length);
+    if (ok) {
+        lo(LOG_DEBUG, "mysql_driver_command: logged in %s", user);
+        session->local_reply = ok_packet(in_command->bytes[3] + 1);
+    } else {
+        /* Flawfinder: ignore */
+        char message[128];
+        snprintf(message, sizeof(message), "Access denied for user '%.64s'",
+                 user ? user : "");
+        lo(LOG_INFO, "mysql_driver_command: %s", message);
+        session->refused = 1;
+        session->local_reply = error_packet(in_command->bytes[3] + 1,
+                                            ER_ACCESS_DENIED_ERROR, "28000",
+                                            message);
+    }
+
+    /* the client would wait forever for an answer */
+    if (!session->local_reply) {
+        session->done = 1;
     }
+    return ok;
 }
 
-delegate_filter_result mysql_driver_delegate_filter(delegate_id id)
+/**
+ * Read a 4 byte integer.
+ *
+ * @param[in] b where it starts
+ * @return the integer
+ */
+static unsigned int read_int4(const char *b)
 {
-    if (delegate_states[id].expect_replies == REP_NONE) {
-        return DELEGATE_FILTER_DONT_USE;
+    unsigned int value = 0;
+    for (int i = 3; i >= 0; --i) {
+        value = (value << 8) | (unsigned char)b[i];
     }
-    return DELEGATE_FILTER_USE;
+    return value;
 }
 
-void mysql_driver_reply(delegate_id id, packet * p)
+/**
+ * Write a 4 byte integer.
+ *
+ * @param[out] b where it goes
+ * @param[in] value the integer
+ */
+static void write_int4(char *b, unsigned int value)
 {
-    /* have to handle being called unnecessarily */
-    if (delegate_states[id].expect_replies == REP_NONE) {
-        return;
+    for (int i = 0; i < 4; ++i) {
+        b[i] = (unsigned char)(value >> (i * 8));
     }
+}
 
-    /* short-circuit for error packets */
-    if ((unsigned char)(p->bytes[4]) == 0xff) {
-        char *error = malloc(p->size - 7 + 1);
-        if (error) {
-            strncpy(error, p->bytes + 7, p->size - 7);
-            error[p->size - 7] = 0;
-            lo(LOG_INFO, "mysql_driver_reply(%hu): ERROR: %s", id, error);
-            free(error);
+/**
+ * Find the client's prepared statement a COM_STMT_* command is about.
+ *
+ * @param[in] in_command the command
+ * @return the statement, or 0 if there's no such statement
+ */
+static client_statement *find_statement(packet * in_command)
+{
+    if (in_command->size < HEADER_SIZE + 1 + 4) {
+        return 0;
+    }
+    unsigned int id = read_int4(in_command->bytes + HEADER_SIZE + 1);
+    for (client_statement * s = session->statements; s; s = s->next) {
+        if (s->id == id) {
+            return s;
         }
-
-        delegate_states[id].error = 1;
-        delegate_states[id].expect_replies = REP_NONE;
-        delegate_states[id].expecting_rows = 0;
-        error_packet = packet_copy(p);  /* XX: hacky, will probably need fix */
-        return;
     }
-
-    switch (delegate_states[id].expect_replies) {
+    return 0;
+}
+
+/**
+ * Answer a COM_STMT_* command about a statement the client hasn't prepared,
+ * as a delegate would.
+ *
+ * @param[in] in_command the command
+ * @param[in] name what the delegate calls the command
+ * @return DB_DRIVER_COMMAND_TYPE_LOCAL
+ */
+static db_driver_command_type unknown_statement(packet * in_command,
+                                                const char *name)
+{
+    /* Flawfinder: ignore */
+    char message[128];
+    unsigned int id = 0;
+
+    if (in_command->size >= HEADER_SIZE + 1 + 4) {
+        id = read_int4(in_command->bytes + HEADER_SIZE + 1);
+    }
+    snprintf(message, sizeof(message),
+             "Unknown prepared statement handler (%u) given to %s", id, name);
+    lo(LOG_INFO, "mysql_driver_command: %s", message);
+    for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+        session->delegate_states[i].expect_replies = REP_NONE;
+    }
+    session->local_reply = error_packet(in_command->bytes[3] + 1,
+                                        ER_UNKNOWN_STMT_HANDLER, "HY000",
+                                        message);
+    if (!session->local_reply) {
+        session->done = 1;
+    }
+    return DB_DRIVER_COMMAND_TYPE_LOCAL;
+}
+
+/**
+ * Start executing a prepared statement. The parameters' types are only sent
+ * when the client binds new ones, so they're kept for delegate connections
+ * the statement is prepared on later.
+ *
+ * @param[in] in_command the COM_STMT_EXECUTE packet
+ * @return the command type
+ */
+static db_driver_command_type execute_statement(packet * in_command)
+{
+    client_statement *s = find_statement(in_command);
+    if (!s) {
+        return unknown_statement(in_command, "mysqld_stmt_execute");
+    }
+
+    /* id, flags, iteration count and the NULL bitmap, then whether there
+       are new types */
+    int offset = HEADER_SIZE + 1 + 4 + 1 + 4 + (s->params + 7) / 8;
+    if (s->params && (offset < in_command->size)
+        && (in_command->bytes[offset] == 1)) {
+        if (offset + 1 + 2 * s->params > in_command->size) {
+            lo(LOG_ERROR, "mysql_driver_command: short COM_STMT_EXECUTE");
+            return DB_DRIVER_COMMAND_TYPE_UNSUPPORTED;
+        }
+        if (!s->types) {
+            s->types = malloc(2 * s->params);
+            if (!s->types) {
+                return DB_DRIVER_COMMAND_TYPE_UNSUPPORTED;
+            }
+        }
+        memcpy(s->types, in_command->bytes + offset + 1, 2 * s->params);
+    }
+
+    /* binary result sets have rows, like a query's */
+    for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+        session->delegate_states[i].expecting_rows = 1;
+    }
+    session->executing = s;
+    return DB_DRIVER_COMMAND_TYPE_EXECUTE;
+}
+
+/**
+ * Close one of the client's prepared statements. Delegate connections keep
+ * theirs, for whenever the statement is prepared again.
+ *
+ * @param[in] in_command the COM_STMT_CLOSE packet
+ */
+static void close_statement(packet * in_command)
+{
+    client_statement *s = find_statement(in_command);
+    if (!s) {
+        return;
+    }
+    client_statement **link = &session->statements;
+    while (*link != s) {
+        link = &(*link)->next;
+    }
+    *link = s->next;
+    free(s->sql);
+    free(s->types);
+    free(s);
+}
+
+/**
+ * Start keeping track of the statements prepared on a delegate connection.
+ *
+ * @return the connection's statements, or 0 on failure
+ */
+static statement_cache *cache_new(void)
+{
+    statement_cache *cache = calloc(1, sizeof(statement_cache));
+    if (!cache) {
+        return 0;
+    }
+    cache->statements = calloc(statement_cache_size,
+                               sizeof(connection_statement));
+    if (!cache->statements) {
+        free(cache);
+        return 0;
+    }
+    return cache;
+}
+
+/**
+ * Find a statement prepared on a delegate connection.
+ *
+ * @param[in] cache the connection's statements
+ * @param[in] sql the statement
+ * @return its index, or -1 if it isn't prepared there
+ */
+static int cache_find(statement_cache * cache, const char *sql)
+{
+    for (int i = 0; i < cache->count; ++i) {
+        if (strcmp(cache->statements[i].sql, sql) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Note that a delegate connection has prepared a statement.
+ *
+ * @param[in,out] cache the connection's statements, with room for another
+ * @param[in] sql the statement
+ * @param[in] id the delegate's id for it
+ */
+static void cache_insert(statement_cache * cache, const char *sql,
+                         const char *id)
+{
+    connection_statement *statement = &cache->statements[cache->count];
+
+    statement->sql = strdup(sql);
+    if (!statement->sql) {
+        lo(LOG_ERROR, "mysql_driver: can't keep a prepared statement");
+        return;
+    }
+    memcpy(statement->id, id, 4);
+    statement->used = ++cache->clock;
+    ++cache->count;
+}
+
+/**
+ * Forget a statement prepared on a delegate connection.
+ *
+ * @param[in,out] cache the connection's statements
+ * @param[in] n its index
+ */
+static void cache_remove(statement_cache * cache, int n)
+{
+    free(cache->statements[n].sql);
+    cache->statements[n] = cache->statements[--cache->count];
+}
+
+/**
+ * Build the command which prepares a statement on a delegate connection:
+ * COM_STMT_PREPARE, after a COM_STMT_CLOSE (which has no reply) for an older
+ * copy of the statement or, if the connection already has as many as it
+ * keeps, for the one least recently executed.
+ *
+ * @param[in,out] cache the connection's statements
+ * @param[in] sql the statement
+ * @param[in,out] out empty packet to fill
+ * @return 1 on success, 0 on failure
+ */
+static int prepare_packet(statement_cache * cache, const char *sql,
+                          packet * out)
+{
+    size_t length = strlen(sql);
+    int victim = cache_find(cache, sql);
+
+    if (length >= 0xffffff) {
+        return 0;
+    }
+    if ((victim == -1) && (cache->count >= statement_cache_size)) {
+        victim = 0;
+        for (int i = 1; i < cache->count; ++i) {
+            if (cache->statements[i].used < cache->statements[victim].used) {
+                victim = i;
+            }
+        }
+    }
+
+    int close = (victim == -1) ? 0 : HEADER_SIZE + 1 + 4;
+    out->size = out->allocated = close + HEADER_SIZE + 1 + length;
+    out->bytes = malloc(out->size);
+    if (!out->bytes) {
+        out->size = out->allocated = 0;
+        return 0;
+    }
+    if (close) {
+        write_header(out->bytes, 0, 1 + 4);
+        out->bytes[HEADER_SIZE] = COM_STMT_CLOSE;
+        memcpy(out->bytes + HEADER_SIZE + 1, cache->statements[victim].id, 4);
+        cache_remove(cache, victim);
+    }
+    write_header(out->bytes + close, 0, 1 + length);
+    out->bytes[close + HEADER_SIZE] = COM_STMT_PREPARE;
+    memcpy(out->bytes + close + HEADER_SIZE + 1, sql, length);
+    return 1;
+}
+
+db_driver_command_type mysql_driver_command(packet * in_command)
+{
+    session->command_is_client_auth = 0;
+    session->state_pending = 0;
+    session->pinning = 0;
+    session->executing = 0;
+    free(session->prepare_sql);
+    session->prepare_sql = 0;
+    session->preparing = 0;
+
+    if (session->refused) {
+        /* nothing more to say to a client whose login was refused */
+        for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+            session->delegate_states[i].expect_replies = REP_NONE;
+        }
+        session->done = 1;
+        return DB_DRIVER_COMMAND_TYPE_QUIT;
+    }
+
+    merge_begin((unsigned char)in_command->bytes[3] + 1);
+    for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+        /* we default to expecting a simple or tabular response with no row
+           data */
+        session->delegate_states[i].error = 0;
+        session->delegate_states[i].expecting_rows = 0;
+        session->delegate_states[i].expect_replies = REP_SIMPLE;
+    }
+
+    if (session->waiting_for_client_auth) {
+        session->waiting_for_client_auth = 0;
+        if (checking_logins()) {
+            /* capabilities, max packet size, charset and filler first */
+            local_login(in_command, HEADER_SIZE + 4 + 4 + 1 + 23);
+            return DB_DRIVER_COMMAND_TYPE_LOCAL;
+        }
+        session->command_is_client_auth = 1;
+        packet_delete(session->client_auth);
+        session->client_auth = packet_copy(in_command);
+        return DB_DRIVER_COMMAND_TYPE_LOGIN;
+    }
+
+    enum enum_server_command command =
+        (enum enum_server_command)(unsigned char)in_command->bytes[4];
+    lo(LOG_DEBUG, "mysql_driver_command: I've got a %u packet...", command);
+
+    db_driver_command_type type;
+
+    /* if we see a QUIT command, don't expect the delegates to respond */
+    switch (command) {
+    case COM_QUIT:
+        /* expecting delegates to quietly drop our connection */
+        for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+            session->delegate_states[i].expect_replies = REP_NONE;
+        }
+        session->done = 1;
+        type = DB_DRIVER_COMMAND_TYPE_QUIT;
+        break;
+    case COM_QUERY:
+        /* expecting row data to follow the initial response */
+        for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+            session->delegate_states[i].expecting_rows = 1;
+        }
+        type = DB_DRIVER_COMMAND_TYPE_SQL;
+        if (is_session_state(in_command)) {
+            record_state_command(in_command);
+            type = DB_DRIVER_COMMAND_TYPE_SESSION_STATE;
+        }
+        break;
+    case COM_FIELD_LIST:
+        type = DB_DRIVER_COMMAND_TYPE_TABLE_META;
+        break;
+    case COM_CHANGE_USER:
+        /* there's no passing this on unless pdb checks logins itself */
+        type = DB_DRIVER_COMMAND_TYPE_UNSUPPORTED;
+        if (checking_logins()) {
+            if (local_login(in_command, HEADER_SIZE + 1)) {
+                forget_state_commands(session);
+            }
+            type = DB_DRIVER_COMMAND_TYPE_CHANGE_USER;
+        }
+        break;
+    case COM_RESET_CONNECTION:
+        forget_state_commands(session);
+        forget_statements(session);
+        for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+            session->delegate_states[i].pinned = 0;
+        }
+        type = DB_DRIVER_COMMAND_TYPE_RESET;
+        break;
+    case COM_STMT_PREPARE:
+        for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+            session->delegate_states[i].expect_replies = REP_PREPARE;
+            session->delegate_states[i].pending_packets = 0;
+        }
+        session->prepare_sql = mysql_driver_sql_extract(in_command);
+        type = session->prepare_sql ? DB_DRIVER_COMMAND_TYPE_PREPARE :
+            DB_DRIVER_COMMAND_TYPE_UNSUPPORTED;
+        break;
+    case COM_STMT_EXECUTE:
+        type = execute_statement(in_command);
+        break;
+    case COM_STMT_CLOSE:
+        /* which has no reply */
+        close_statement(in_command);
+        for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+            session->delegate_states[i].expect_replies = REP_NONE;
+        }
+        type = DB_DRIVER_COMMAND_TYPE_LOCAL;
+        break;
+    case COM_STMT_RESET:
+        /* there's no long data or cursor to reset */
+        if (!find_statement(in_command)) {
+            type = unknown_statement(in_command, "mysqld_stmt_reset");
+            break;
+        }
+        for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+            session->delegate_states[i].expect_replies = REP_NONE;
+        }
+        session->local_reply = ok_packet(in_command->bytes[3] + 1);
+        if (!session->local_reply) {
+            session->done = 1;
+        }
+        type = DB_DRIVER_COMMAND_TYPE_LOCAL;
+        break;
+    default:
+        type = DB_DRIVER_COMMAND_TYPE_UNSUPPORTED;
+        break;
+    }
+
+    return type;
+}
+
+void mysql_driver_command_done(delegate_filter * filters)
+{
+    int replying = 0;
+
+    for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+        if (delegate_filter_reduce(filters, i) == DELEGATE_FILTER_DONT_USE) {
+            session->delegate_states[i].expect_replies = REP_NONE;
+        } else if (session->delegate_states[i].expect_replies != REP_NONE) {
+            ++replying;
+            if (session->pinning) {
+                session->delegate_states[i].pinned = 1;
+            }
+        }
+    }
+
+    /* a single delegate's result set is as good as merged already, unless
+       it was asked for partial aggregates */
+    if ((replying < 2) && !session->partial_command) {
+        forget_merge(session);
+    }
+}
+
+void mysql_driver_pin_delegates(void)
+{
+    session->pinning = 1;
+}
+
+/**
+ * Build a COM_QUERY packet.
+ *
+ * @param[in] sql the statement
+ * @return the packet, or 0 on failure
+ */
+static packet *query_packet(const char *sql)
+{
+    size_t length = strlen(sql);
+
+    if (length >= 0xffffff) {
+        return 0;
+    }
+    packet *p = new_packet(0, 1 + length);
+    if (p) {
+        p->bytes[HEADER_SIZE] = COM_QUERY;
+        memcpy(p->bytes + HEADER_SIZE + 1, sql, length);
+    }
+    return p;
+}
+
+void mysql_driver_merge(sql_merge * merge)
+{
+    forget_merge(session);
+    session->merge = merge;
+    if (!merge) {
+        return;
+    }
+
+    /* folded rows are put in order once they're all in */
+    if (merge->aggregate_count) {
+        session->fold = calloc(1, sizeof(fold_state));
+        if (session->fold) {
+            session->fold->columns = merge->aggregate_count;
+        }
+        if (merge->statement && session->fold) {
+            session->partial_command = query_packet(merge->statement);
+        }
+        if (!session->fold
+            || (merge->statement && !session->partial_command)) {
+            lo(LOG_ERROR, "mysql_driver: no memory to fold rows");
+            forget_merge(session);
+        }
+    } else {
+        session->ordering = merge->order_count ? -1 : 0;
+        /* without the OFFSET, which pdb applies */
+        if (merge->statement) {
+            session->partial_command = query_packet(merge->statement);
+            if (!session->partial_command) {
+                lo(LOG_ERROR, "mysql_driver: no memory to limit rows");
+                forget_merge(session);
+            }
+        }
+    }
+}
+
+short mysql_driver_delegate_sql(delegate_id id, const char *sql)
+{
+    if (!session->delegate_commands) {
+        session->delegate_commands =
+            calloc(session->delegate_states_count, sizeof(packet *));
+        if (!session->delegate_commands) {
+            return 0;
+        }
+    }
+    packet_delete(session->delegate_commands[id]);
+    session->delegate_commands[id] = query_packet(sql);
+    return session->delegate_commands[id] != 0;
+}
+
+delegate_filter_result mysql_driver_delegate_filter(delegate_id id)
+{
+    delegate_state *state = &session->delegate_states[id];
+
+    if (state->expect_replies == REP_NONE) {
+        return DELEGATE_FILTER_DONT_USE;
+    }
+
+    /* a row waiting to be merged has to go before the next is read */
+    if (state->has_head && !failed()) {
+        return DELEGATE_FILTER_DONT_USE;
+    }
+
+    /* rows have to wait for the leader's header to be passed on */
+    if ((state->expect_replies == REP_TABLE_ROWS) && !session->header_sent
+        && !session->fold && (session->leader != -1)
+        && (session->leader != id)
+        && (session->delegate_states[session->leader].expect_replies !=
+            REP_NONE)
+        && !mysql_driver_got_error()) {
+        return DELEGATE_FILTER_DONT_USE;
+    }
+    return DELEGATE_FILTER_USE;
+}
+
+delegate_filter_result mysql_driver_delegate_releasable(delegate_id id)
+{
+    delegate_state *state = &session->delegate_states[id];
+
+    if ((state->expect_replies == REP_NONE) && !state->in_transaction
+        && !state->pinned) {
+        return DELEGATE_FILTER_USE;
+    }
+    return DELEGATE_FILTER_DONT_USE;
+}
+
+/**
+ * Read a length-encoded integer.
+ *
+ * @param[in] p the packet
+ * @param[in] offset where the integer starts
+ * @param[out] value the integer (0 if it runs off the end of the packet)
+ * @return the offset just past the integer
+ */
+static int read_length_encoded(packet * p, int offset,
+                               unsigned long long *value)
+{
+    int length;
+
+    *value = 0;
+    if (offset >= p->size) {
+        return p->size;
+    }
+    switch ((unsigned char)p->bytes[offset]) {
+    case 0xfc:
+        length = 2;
+        break;
+    case 0xfd:
+        length = 3;
+        break;
+    case 0xfe:
+        length = 8;
+        break;
+    default:
+        *value = (unsigned char)p->bytes[offset];
+        return offset + 1;
+    };
+
+    if (offset + 1 + length <= p->size) {
+        for (int i = length; i > 0; --i) {
+            *value = (*value << 8) | (unsigned char)p->bytes[offset + i];
+        }
+    }
+    return offset + 1 + length;
+}
+
+/**
+ * Skip over a length-encoded integer.
+ *
+ * @param[in] p the packet
+ * @param[in] offset where the integer starts
+ * @return the offset just past the integer
+ */
+static int skip_length_encoded(packet * p, int offset)
+{
+    unsigned long long value;
+    return read_length_encoded(p, offset, &value);
+}
+
+/**
+ * Note whether a delegate is in a transaction, from the server status flags
+ * of the OK or EOF packet which completed its reply; and whether the command
+ * left state on its connection which pdb can't replay elsewhere (an insert
+ * id, or whatever the server says changed), pinning the connection to the
+ * session if so.
+ *
+ * @param[in,out] state the delegate's state
+ * @param[in] p the OK or EOF packet
+ */
+static void note_transaction(delegate_state * state, packet * p)
+{
+    unsigned long long insert_id = 0;
+    int offset;
+
+    if ((unsigned char)p->bytes[4] == 0xfe) {
+        /* EOF: warnings, then status */
+        offset = 7;
+    } else {
+        /* OK: affected rows, last insert id, then status */
+        offset = skip_length_encoded(p, 5);
+        offset = read_length_encoded(p, offset, &insert_id);
+    }
+
+    if (offset + 2 <= p->size) {
+        int status = (unsigned char)p->bytes[offset];
+
+        status |= ((unsigned char)p->bytes[offset + 1]) << 8;
+        state->in_transaction = (status & SERVER_STATUS_IN_TRANS) != 0;
+        /* the client's own SET statements are replayed instead */
+        if ((insert_id || (status & SERVER_SESSION_STATE_CHANGED))
+            && !session->state_pending) {
+            state->pinned = 1;
+        }
+    }
+}
+
+/**
+ * Fail the merged reply because a delegate's result set doesn't look like
+ * the others' (or like the query said it would). The rest of its reply is
+ * still read, and thrown away.
+ *
+ * @param[in] id the delegate
+ * @param[in] message what the client is told
+ */
+static void header_mismatch(delegate_id id, const char *message)
+{
+    lo(LOG_ERROR, "mysql_driver_reply(%hu): %s", id, message);
+
+    /* an error from a delegate says more */
+    if (!failed()) {
+        packet *p = error_packet(0, ER_UNKNOWN_ERROR, "HY000", message);
+        if (!p) {
+            session->lost_reply = 1;
+        }
+        packet_delete(session->error_packet);
+        session->error_packet = p;
+    }
+    session->delegate_states[id].error = 1;
+}
+
+/**
+ * Check how many columns a delegate's result set has against the others.
+ *
+ * @param[in] id the delegate
+ * @param[in] columns the column count
+ */
+static void check_columns(delegate_id id, unsigned long long columns)
+{
+    if (session->fold
+        && ((unsigned long long)session->merge->aggregate_count != columns)) {
+        header_mismatch(id, "result set doesn't match the aggregates");
+    } else if (session->columns == -1) {
+        session->columns = (int)columns;
+    } else if ((unsigned long long)session->columns != columns) {
+        header_mismatch(id, "delegates disagree on result set columns");
+    }
+}
+
+/** field definition strings, in order */
+enum field_string_index {
+    FIELD_CATALOG, FIELD_SCHEMA, FIELD_TABLE, FIELD_ORIGINAL_TABLE,
+    FIELD_NAME, FIELD_ORIGINAL_NAME
+};
+
+/**
+ * Find one of the strings in a field definition.
+ *
+ * @param[in] p the field definition packet
+ * @param[in] n which string
+ * @param[out] length the string's length
+ * @return where the string starts
+ */
+static int field_string(packet * p, enum field_string_index n, int *length)
+{
+    unsigned long long value = 0;
+    int offset = HEADER_SIZE;
+
+    for (int i = 0; i <= (int)n; ++i) {
+        offset = read_length_encoded(p, offset + (int)value, &value);
+    }
+    *length = (int)value;
+    return offset;
+}
+
+/**
+ * Find a column's name and type in its field definition.
+ *
+ * @param[in] p the field definition packet
+ * @param[out] name where the name starts
+ * @param[out] length the name's length
+ * @return where the type is, or -1 if the packet is too short
+ */
+static int field_type_offset(packet * p, int *name, int *length)
+{
+    int original_length;
+
+    *name = field_string(p, FIELD_NAME, length);
+
+    /* fixed fields length, then character set and length */
+    int offset = field_string(p, FIELD_ORIGINAL_NAME, &original_length);
+    offset = skip_length_encoded(p, offset + original_length) + 2 + 4;
+    return (offset < p->size) ? offset : -1;
+}
+
+/**
+ * Do two field definitions describe the same column? Shards may well be
+ * different databases, and hold differently sized values, so only the
+ * column's name and type have to match.
+ *
+ * @param[in] a a field definition
+ * @param[in] b another
+ * @return 1 if so; 0 otherwise.
+ */
+static short same_column(packet * a, packet * b)
+{
+    int a_name, a_length, b_name, b_length;
+    int a_type = field_type_offset(a, &a_name, &a_length);
+    int b_type = field_type_offset(b, &b_name, &b_length);
+
+    if ((a_type == -1) || (b_type == -1)) {
+        return (a->size == b->size)
+            && !memcmp(a->bytes + HEADER_SIZE, b->bytes + HEADER_SIZE,
+                       a->size - HEADER_SIZE);
+    }
+    return (a_length == b_length)
+        && !memcmp(a->bytes + a_name, b->bytes + b_name, a_length)
+        && (a->bytes[a_type] == b->bytes[b_type]);
+}
+
+/**
+ * Check a delegate's next field definition against the first delegate's to
+ * get that far.
+ *
+ * @param[in] id the delegate
+ * @param[in] p the field definition packet
+ */
+static void check_field(delegate_id id, packet * p)
+{
+    int n = session->delegate_states[id].fields++;
+
+    if (n < session->field_count) {
+        if (!same_column(session->fields[n], p)) {
+            header_mismatch(id, "delegates disagree on result set columns");
+        }
+        return;
+    }
+    if (n > session->field_count) {
+        /* one went missing already */
+        return;
+    }
+
+    if (session->field_count == session->fields_allocated) {
+        int allocated = session->fields_allocated ?
+            session->fields_allocated * 2 : 16;
+        packet **fields = realloc(session->fields,
+                                  sizeof(packet *) * allocated);
+        if (!fields) {
+            session->lost_reply = 1;
+            return;
+        }
+        session->fields = fields;
+        session->fields_allocated = allocated;
+    }
+    session->fields[session->field_count] = packet_copy(p);
+    if (!session->fields[session->field_count]) {
+        session->lost_reply = 1;
+        return;
+    }
+    ++session->field_count;
+}
+
+/**
+ * Compare byte strings, a prefix first.
+ *
+ * @return less than, equal to or greater than 0, as a is less than, equal
+ * to or greater than b
+ */
+static int compare_bytes(const char *a, int a_length, const char *b,
+                         int b_length)
+{
+    int c = memcmp(a, b, (a_length < b_length) ? a_length : b_length);
+    if (c) {
+        return (c < 0) ? -1 : 1;
+    }
+    return (a_length > b_length) - (a_length < b_length);
+}
+
+/**
+ * Compare unsigned numbers written out in full: a whole part, ending at a
+ * separator, then any number of digits (such as a fraction) which are
+ * compared a digit at a time, with missing digits counting as 0.
+ *
+ * @return as compare_bytes()
+ */
+static int compare_magnitudes(const char *a, int a_length, const char *b,
+                              int b_length, char separator)
+{
+    const char *a_end = a + a_length;
+    const char *b_end = b + b_length;
+    const char *a_whole = memchr(a, separator, a_length);
+    const char *b_whole = memchr(b, separator, b_length);
+
+    if (!a_whole) {
+        a_whole = a_end;
+    }
+    if (!b_whole) {
+        b_whole = b_end;
+    }
+    while ((a < a_whole - 1) && (*a == '0')) {
+        ++a;
+    }
+    while ((b < b_whole - 1) && (*b == '0')) {
+        ++b;
+    }
+
+    int c = (a_whole - a > b_whole - b) - (a_whole - a < b_whole - b);
+    if (!c) {
+        c = compare_bytes(a, a_whole - a, b, b_whole - b);
+    }
+
+    for (a = a_whole, b = b_whole; !c && ((a < a_end) || (b < b_end));) {
+        while ((a < a_end) && !isdigit((unsigned char)*a)) {
+            ++a;
+        }
+        while ((b < b_end) && !isdigit((unsigned char)*b)) {
+            ++b;
+        }
+        char a_digit = (a < a_end) ? *a++ : '0';
+        char b_digit = (b < b_end) ? *b++ : '0';
+        c = (a_digit > b_digit) - (a_digit < b_digit);
+    }
+    return c;
+}
+
+/**
+ * Compare signed numbers written out in full; see compare_magnitudes().
+ *
+ * @return as compare_bytes()
+ */
+static int compare_numbers(const char *a, int a_length, const char *b,
+                           int b_length, char separator)
+{
+    short a_negative = (a_length > 0) && (*a == '-');
+    short b_negative = (b_length > 0) && (*b == '-');
+
+    if (a_negative) {
+        ++a;
+        --a_length;
+    }
+    if (b_negative) {
+        ++b;
+        --b_length;
+    }
+
+    int c = compare_magnitudes(a, a_length, b, b_length, separator);
+    if (a_negative != b_negative) {
+        /* 0 and -0 are equal */
+        for (int i = 0; !c && (i < a_length); ++i) {
+            if (isdigit((unsigned char)a[i]) && (a[i] != '0')) {
+                c = 1;
+            }
+        }
+        if (!c) {
+            return 0;
+        }
+        return a_negative ? -1 : 1;
+    }
+    return a_negative ? -c : c;
+}
+
+/**
+ * Compare floating point numbers, which may have exponents.
+ *
+ * @return as compare_bytes()
+ */
+static int compare_floats(const char *a, int a_length, const char *b,
+                          int b_length)
+{
+    char a_copy[64];
+    char b_copy[64];
+
+    if ((a_length >= (int)sizeof(a_copy))
+        || (b_length >= (int)sizeof(b_copy))) {
+        return compare_numbers(a, a_length, b, b_length, '.');
+    }
+    memcpy(a_copy, a, a_length);
+    a_copy[a_length] = 0;
+    memcpy(b_copy, b, b_length);
+    b_copy[b_length] = 0;
+
+    double a_value = strtod(a_copy, 0);
+    double b_value = strtod(b_copy, 0);
+    return (a_value > b_value) - (a_value < b_value);
+}
+
+/**
+ * Is a collation binary (comparing characters as they're encoded, rather
+ * than ignoring case and accents)?
+ *
+ * @param[in] charset the collation's number
+ * @return 1 if so; 0 otherwise.
+ */
+static short binary_collation(int charset)
+{
+    switch (charset) {
+    case 46:   /* utf8mb4_bin */
+    case 47:   /* latin1_bin */
+    case 49:   /* latin1_general_cs */
+    case 65:   /* ascii_bin */
+    case 83:   /* utf8_bin */
+        return 1;
+    default:
+        return 0;
+    };
+}
+
+/**
+ * Is a collation for latin1, rather than UTF-8?
+ *
+ * @param[in] charset the collation's number
+ * @return 1 if so; 0 otherwise.
+ */
+static short latin1_collation(int charset)
+{
+    switch (charset) {
+    case 5:
+    case 8:
+    case 15:
+    case 31:
+    case 47:
+    case 48:
+    case 49:
+    case 94:
+        return 1;
+    default:
+        return 0;
+    };
+}
+
+/** what U+00C0 to U+00FF sort as, ignoring case and accents */
+static const unsigned char latin1_weights[64] = {
+    'A', 'A', 'A', 'A', 'A', 'A', 0xc6, 'C',
+    'E', 'E', 'E', 'E', 'I', 'I', 'I', 'I',
+    0xd0, 'N', 'O', 'O', 'O', 'O', 'O', 0xd7,
+    0xd8, 'U', 'U', 'U', 'U', 'Y', 0xde, 'S',
+    'A', 'A', 'A', 'A', 'A', 'A', 0xc6, 'C',
+    'E', 'E', 'E', 'E', 'I', 'I', 'I', 'I',
+    0xd0, 'N', 'O', 'O', 'O', 'O', 'O', 0xf7,
+    0xd8, 'U', 'U', 'U', 'U', 'Y', 0xde, 'Y'
+};
+
+/**
+ * Read the next character of some text, as the collation sorts it.
+ *
+ * @param[in,out] p the character, moved past it
+ * @param[in] end the end of the text
+ * @param[in] charset the collation's number
+ * @return the character's weight
+ */
+static unsigned int collation_weight(const unsigned char **p,
+                                     const unsigned char *end, int charset)
+{
+    unsigned int c = *(*p)++;
+
+    if ((c >= 0xc0) && !latin1_collation(charset)) {
+        int more = (c >= 0xf0) ? 3 : (c >= 0xe0) ? 2 : 1;
+        c &= 0x3f >> more;
+        for (; more && (*p < end); --more) {
+            c = (c << 6) | (*(*p)++ & 0x3f);
+        }
+    }
+
+    if (binary_collation(charset)) {
+        return c;
+    }
+    if (c < 0x80) {
+        return toupper(c);
+    }
+    if ((c >= 0xc0) && (c <= 0xff)) {
+        return latin1_weights[c - 0xc0];
+    }
+    return c;
+}
+
+/**
+ * Compare text as a MySQL collation would: case and accent insensitively
+ * (for Latin letters, as the *_general_ci collations do) unless the
+ * collation is binary, and ignoring trailing spaces.
+ *
+ * @return as compare_bytes()
+ */
+static int compare_text(int charset, const char *a, int a_length,
+                        const char *b, int b_length)
+{
+    const unsigned char *a_next = (const unsigned char *)a;
+    const unsigned char *b_next = (const unsigned char *)b;
+    const unsigned char *a_end = a_next + a_length;
+    const unsigned char *b_end = b_next + b_length;
+
+    while ((a_next < a_end) || (b_next < b_end)) {
+        unsigned int a_weight = (a_next < a_end) ?
+            collation_weight(&a_next, a_end, charset) : ' ';
+        unsigned int b_weight = (b_next < b_end) ?
+            collation_weight(&b_next, b_end, charset) : ' ';
+        if (a_weight != b_weight) {
+            return (a_weight < b_weight) ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Compare two values of a column.
+ *
+ * @param[in] key the column
+ * @return as compare_bytes()
+ */
+static int compare_values(merge_key * key, const char *a, int a_length,
+                          const char *b, int b_length)
+{
+    switch (key->type) {
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_TINY:
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_YEAR:
+    case MYSQL_TYPE_NEWDECIMAL:
+        return compare_numbers(a, a_length, b, b_length, '.');
+    case MYSQL_TYPE_FLOAT:
+    case MYSQL_TYPE_DOUBLE:
+        return compare_floats(a, a_length, b, b_length);
+    case MYSQL_TYPE_TIME:
+        /* hours can run to three digits */
+        return compare_numbers(a, a_length, b, b_length, ':');
+    case MYSQL_TYPE_TIMESTAMP:
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_NEWDATE:
+    case MYSQL_TYPE_BIT:
+        return compare_bytes(a, a_length, b, b_length);
+    default:
+        if (key->charset == BINARY_CHARSET) {
+            return compare_bytes(a, a_length, b, b_length);
+        }
+        return compare_text(key->charset, a, a_length, b, b_length);
+    };
+}
+
+/**
+ * Compare two rows, in the order rows are merged in.
+ *
+ * @param[in] a_row a row
+ * @param[in] a_values its key values: offset and length (-1 for NULL), by
+ * key
+ * @param[in] b_row another
+ * @param[in] b_values its key values
+ * @return as compare_bytes()
+ */
+static int compare_rows(const char *a_row, int *a_values, const char *b_row,
+                        int *b_values)
+{
+    for (int k = 0; k < session->key_count; ++k) {
+        int a_length = a_values[k * 2 + 1];
+        int b_length = b_values[k * 2 + 1];
+        int c;
+
+        /* NULL is least */
+        if ((a_length == -1) || (b_length == -1)) {
+            c = (b_length == -1) - (a_length == -1);
+        } else {
+            c = compare_values(&session->keys[k], a_row + a_values[k * 2],
+                               a_length, b_row + b_values[k * 2], b_length);
+        }
+        if (c) {
+            return session->keys[k].descending ? -c : c;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Compare two delegates' heads, in the order rows are merged in; the first
+ * delegate's goes first if they're equal.
+ *
+ * @param[in] a a delegate with a head
+ * @param[in] b another
+ * @return as compare_bytes()
+ */
+static int compare_heads(delegate_id a, delegate_id b)
+{
+    int c = compare_rows(session->delegate_states[a].head.bytes,
+                         session->values + a * session->key_count * 2,
+                         session->delegate_states[b].head.bytes,
+                         session->values + b * session->key_count * 2);
+    return c ? c : (a > b) - (a < b);
+}
+
+/**
+ * Add a delegate to the heap of delegates with heads.
+ *
+ * @param[in] id the delegate
+ */
+static void heap_push(delegate_id id)
+{
+    int i = session->heap_count++;
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (compare_heads(session->heap[parent], id) <= 0) {
+            break;
+        }
+        session->heap[i] = session->heap[parent];
+        i = parent;
+    }
+    session->heap[i] = id;
+}
+
+/**
+ * Take the delegate with the least head off the heap.
+ *
+ * @return the delegate
+ */
+static delegate_id heap_pop(void)
+{
+    delegate_id least = session->heap[0];
+    delegate_id last = session->heap[--session->heap_count];
+    int i = 0;
+
+    for (;;) {
+        int child = i * 2 + 1;
+        if (child >= session->heap_count) {
+            break;
+        }
+        if ((child + 1 < session->heap_count)
+            && (compare_heads(session->heap[child + 1],
+                              session->heap[child]) < 0)) {
+            ++child;
+        }
+        if (compare_heads(last, session->heap[child]) <= 0) {
+            break;
+        }
+        session->heap[i] = session->heap[child];
+        i = child;
+    }
+    session->heap[i] = last;
+    return least;
+}
+
+/**
+ * Find the column an ORDER BY item refers to.
+ *
+ * @param[in] order the item
+ * @return the column's index, or -1 if there isn't one
+ */
+static int find_column(sql_order * order)
+{
+    if (!order->name) {
+        return ((order->position >= 1)
+                && (order->position <= session->field_count)) ?
+            order->position - 1 : -1;
+    }
+
+    /* by name (or alias), then by the name it was given an alias for */
+    size_t length = strlen(order->name);
+    for (enum field_string_index n = FIELD_NAME; n <= FIELD_ORIGINAL_NAME;
+         ++n) {
+        for (int i = 0; i < session->field_count; ++i) {
+            int name_length;
+            int name = field_string(session->fields[i], n, &name_length);
+            if (((size_t)name_length == length)
+                && (name + name_length <= session->fields[i]->size)
+                && !strncasecmp(session->fields[i]->bytes + name, order->name,
+                                length)) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Find out how a column's values compare, from its field definition.
+ *
+ * @param[in] column the column's index
+ * @param[out] key the column's type and collation
+ * @return 1 on success, 0 if the field definition is too short
+ */
+static int column_key(int column, merge_key * key)
+{
+    packet *field = session->fields[column];
+    int name, length;
+    int type = field_type_offset(field, &name, &length);
+
+    if (type == -1) {
+        return 0;
+    }
+    key->column = column;
+    key->type = (unsigned char)field->bytes[type];
+    key->charset = (unsigned char)field->bytes[type - 6]
+        | ((unsigned char)field->bytes[type - 5] << 8);
+    key->descending = 0;
+    return 1;
+}
+
+/**
+ * Work out which columns rows are put in order of, now that the result
+ * set's columns are known. An ORDER BY of something which isn't one of
+ * them fails the reply, rather than have the rows passed on out of order.
+ *
+ * @return 1 if rows can be put in order; 0 otherwise.
+ */
+static short order_keys(void)
+{
+    sql_merge *merge = session->merge;
+
+    for (int k = 0; k < merge->order_count; ++k) {
+        int column = find_column(&merge->order[k]);
+        if (column == -1) {
+            lo(LOG_INFO, "mysql_driver: ORDER BY %s isn't a column of the "
+               "result set",
+               merge->order[k].name ? merge->order[k].name : "position");
+            header_mismatch(session->leader, "pdb can't merge rows in "
+                            "order of a column they haven't got");
+            return 0;
+        }
+
+        if (!column_key(column, &session->keys[k])) {
+            return 0;
+        }
+        session->keys[k].descending = merge->order[k].descending;
+    }
+    session->key_count = merge->order_count;
+    return 1;
+}
+
+/**
+ * Work out which columns rows are merged in order of, now that the result
+ * set's columns are known.
+ *
+ * @return 1 if rows can be merged in order; 0 otherwise.
+ */
+static short resolve_order(void)
+{
+    sql_merge *merge = session->merge;
+    delegate_id count = session->delegate_states_count;
+
+    session->keys = malloc(sizeof(merge_key) * merge->order_count);
+    session->values = malloc(sizeof(int) * 2 * merge->order_count * count);
+    session->heap = malloc(sizeof(delegate_id) * count);
+    session->merged = malloc(sizeof(delegate_id) * count);
+    if (!session->keys || !session->values || !session->heap
+        || !session->merged) {
+        lo(LOG_ERROR, "mysql_driver: no memory to merge rows in order");
+        return 0;
+    }
+    return order_keys();
+}
+
+/**
+ * Are rows being merged in order? Only once a delegate's result set header
+ * is complete can this be worked out.
+ *
+ * @return 1 if so; 0 otherwise.
+ */
+static short ordering(void)
+{
+    if (session->ordering == -1) {
+        session->ordering = resolve_order();
+    }
+    return session->ordering;
+}
+
+/**
+ * Find a value in a row.
+ *
+ * @param[in] p the row
+ * @param[in] offset where the value starts
+ * @param[out] start where its bytes start
+ * @param[out] length how many there are, or -1 for NULL
+ * @return the offset just past the value, or -1 if it runs off the end of
+ * the row
+ */
+static int row_value(packet * p, int offset, int *start, int *length)
+{
+    unsigned long long value;
+
+    if ((unsigned char)p->bytes[offset] == 0xfb) {
+        *start = offset + 1;
+        *length = -1;
+        return *start;
+    }
+    *start = read_length_encoded(p, offset, &value);
+    if (value > (unsigned long long)(p->size - *start)) {
+        return -1;
+    }
+    *length = (int)value;
+    return *start + *length;
+}
+
+/**
+ * Find a row's order keys' values.
+ *
+ * @param[in] p the row
+ * @param[out] values each key's offset and length (-1 for NULL)
+ */
+static void row_keys(packet * p, int *values)
+{
+    int offset = HEADER_SIZE;
+
+    for (int k = 0; k < session->key_count; ++k) {
+        values[k * 2 + 1] = -1;
+    }
+    for (int column = 0; offset < p->size; ++column) {
+        int start, length;
+        offset = row_value(p, offset, &start, &length);
+        if (offset == -1) {
+            break;
+        }
+        for (int k = 0; k < session->key_count; ++k) {
+            if (session->keys[k].column == column) {
+                values[k * 2] = start;
+                values[k * 2 + 1] = length;
+            }
+        }
+    }
+}
+
+/**
+ * Hold on to a delegate's row until it's time for it to be merged.
+ *
+ * @param[in] id the delegate
+ * @param[in] p the row
+ */
+static void hold_head(delegate_id id, packet * p)
+{
+    delegate_state *state = &session->delegate_states[id];
+
+    packet_slice(&state->head, p);
+    state->has_head = 1;
+    row_keys(p, session->values + id * session->key_count * 2);
+    heap_push(id);
+}
+
+/**
+ * Take as many heads as can be passed on, in order: only while every
+ * delegate which is still sending rows has a head can the least be known.
+ *
+ * @return how many (see session->merged)
+ */
+static int merge_heads(void)
+{
+    int count = 0;
+
+    while (session->heap_count) {
+        for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+            delegate_state *state = &session->delegate_states[i];
+            if ((state->expect_replies != REP_NONE) && !state->has_head) {
+                return count;
+            }
+        }
+        delegate_id id = heap_pop();
+        session->delegate_states[id].has_head = 0;
+        session->merged[count++] = id;
+    }
+    return count;
+}
+
+/**
+ * Have as many rows been passed on as the LIMIT asks for?
+ *
+ * @return 1 if so; 0 otherwise.
+ */
+static short limit_reached(void)
+{
+    sql_merge *merge = session->merge;
+
+    return merge && (merge->limit != -1)
+        && (session->passed >= merge->offset + merge->limit);
+}
+
+/**
+ * Count a row against the query's OFFSET and LIMIT, if it has them.
+ *
+ * @return 1 if the row is passed on; 0 if it's skipped.
+ */
+static short pass_row(void)
+{
+    if (!session->merge || (session->merge->limit == -1)) {
+        return 1;
+    }
+    if (limit_reached()) {
+        return 0;
+    }
+    return ++session->passed > session->merge->offset;
+}
+
+/**
+ * Stop passing on rows, once the LIMIT has been reached: the reply is ended
+ * early, and the rows the delegates have yet to send are thrown away as
+ * they come.
+ */
+static void end_early(void)
+{
+    session->limited = 1;
+    session->heap_count = 0;
+    for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+        session->delegate_states[i].has_head = 0;
+    }
+}
+
+/**
+ * Replace a running aggregate.
+ *
+ * @param[in,out] total the aggregate
+ * @param[in] bytes its new value
+ * @param[in] length the value's length
+ * @return 1 on success, 0 on failure
+ */
+static int set_total(aggregate_value * total, const char *bytes, int length)
+{
+    char *copy = malloc(length ? length : 1);
+    if (!copy) {
+        return 0;
+    }
+    memcpy(copy, bytes, length);
+    session->fold->memory += length - (total->bytes ? total->length : 0);
+    free(total->bytes);
+    total->bytes = copy;
+    total->length = length;
+    return 1;
+}
+
+/**
+ * Split a decimal number into its sign and digits.
+ *
+ * @param[in] a the number
+ * @param[in] length its length
+ * @param[out] negative is it negative?
+ * @param[out] whole where the whole part's digits start
+ * @param[out] whole_length how many there are
+ * @param[out] fraction where the fraction's digits start
+ * @return how many digits the fraction has
+ */
+static int split_decimal(const char *a, int length, short *negative,
+                         const char **whole, int *whole_length,
+                         const char **fraction)
+{
+    const char *end = a + length;
+    const char *point;
+
+    *negative = (a < end) && (*a == '-');
+    if ((a < end) && ((*a == '-') || (*a == '+'))) {
+        ++a;
+    }
+    point = memchr(a, '.', end - a);
+    if (!point) {
+        point = end;
+    }
+    *whole = a;
+    *whole_length = point - a;
+    *fraction = (point < end) ? point + 1 : end;
+    return end - *fraction;
+}
+
+/**
+ * Write out a decimal number from its digits (as values 0-9), dropping
+ * leading zeros.
+ *
+ * @param[out] out where to write it: digits + 3 bytes
+ * @param[in] negative is it negative?
+ * @param[in] digits the whole part's digits, then the fraction's
+ * @param[in] count how many there are
+ * @param[in] scale how many belong to the fraction
+ * @return the number's length
+ */
+static int write_decimal(char *out, short negative,
+                         const unsigned char *digits, int count, int scale)
+{
+    int first = 0;
+    int length = 0;
+
+    while ((first < count - scale - 1) && !digits[first]) {
+        ++first;
+    }
+    for (int i = first; negative && (i < count); ++i) {
+        if (digits[i]) {
+            out[length++] = '-';
+            break;
+        }
+    }
+    if (first == count - scale) {
+        out[length++] = '0';
+    }
+    for (int i = first; i < count; ++i) {
+        if (i == count - scale) {
+            out[length++] = '.';
+        }
+        out[length++] = (char)('0' + digits[i]);
+    }
+    return length;
+}
+
+/**
+ * Add a decimal number (or an integer) to a running sum, exactly.
+ *
+ * @param[in,out] total the sum
+ * @param[in] b the number
+ * @param[in] b_length its length
+ * @return 1 on success, 0 on failure
+ */
+static int add_decimals(aggregate_value * total, const char *b, int b_length)
+{
+    short a_negative, b_negative;
+    const char *a_whole, *b_whole, *a_fraction, *b_fraction;
+    int a_whole_length, b_whole_length;
+    int a_scale = split_decimal(total->bytes, total->length, &a_negative,
+                                &a_whole, &a_whole_length, &a_fraction);
+    int b_scale = split_decimal(b, b_length, &b_negative, &b_whole,
+                                &b_whole_length, &b_fraction);
+    int scale = (a_scale > b_scale) ? a_scale : b_scale;
+    int count = ((a_whole_length > b_whole_length) ? a_whole_length :
+                 b_whole_length) + 1 + scale;
+
+    /* both numbers' digits lined up, then the sum's, then it written out */
+    unsigned char *digits = calloc(count * 4 + 3, 1);
+    if (!digits) {
+        return 0;
+    }
+    unsigned char *a = digits;
+    unsigned char *c = digits + count;
+    unsigned char *sum = digits + count * 2;
+    char *out = (char *)digits + count * 3;
+
+    for (int i = 0; i < a_whole_length; ++i) {
+        a[count - scale - a_whole_length + i] = a_whole[i] - '0';
+    }
+    for (int i = 0; i < a_scale; ++i) {
+        a[count - scale + i] = a_fraction[i] - '0';
+    }
+    for (int i = 0; i < b_whole_length; ++i) {
+        c[count - scale - b_whole_length + i] = b_whole[i] - '0';
+    }
+    for (int i = 0; i < b_scale; ++i) {
+        c[count - scale + i] = b_fraction[i] - '0';
+    }
+
+    /* subtract the lesser magnitude from the greater if the signs differ */
+    short negative = a_negative;
+    if ((a_negative != b_negative) && (memcmp(a, c, count) < 0)) {
+        unsigned char *swap = a;
+        a = c;
+        c = swap;
+        negative = b_negative;
+    }
+    int carry = 0;
+    for (int i = count - 1; i >= 0; --i) {
+        int digit = (a_negative == b_negative) ? a[i] + c[i] + carry :
+            a[i] - c[i] - carry;
+        carry = (digit > 9) || (digit < 0);
+        sum[i] = (unsigned char)((digit + 10) % 10);
+    }
+
+    int ok = set_total(total, out,
+                       write_decimal(out, negative, sum, count, scale));
+    free(digits);
+    return ok;
+}
+
+/**
+ * Copy a number so it can be read with strtod() and the like.
+ *
+ * @param[out] copy where to copy it to
+ * @param[in] size the size of copy
+ * @param[in] a the number
+ * @param[in] length its length
+ * @return 1 on success, 0 if it doesn't fit
+ */
+static int copy_number(char *copy, int size, const char *a, int length)
+{
+    if (length >= size) {
+        return 0;
+    }
+    memcpy(copy, a, length);
+    copy[length] = 0;
+    return 1;
+}
+
+/**
+ * Set a running aggregate to a floating point number, written out in as few
+ * digits as read back as the same number.
+ *
+ * @param[in,out] total the aggregate
+ * @param[in] value the number
+ * @return 1 on success, 0 on failure
+ */
+static int set_float_total(aggregate_value * total, double value)
+{
+    char out[32];
+
+    for (int precision = 1; precision <= 17; ++precision) {
+        snprintf(out, sizeof(out), "%.*g", precision, value);
+        if (strtod(out, 0) == value) {
+            break;
+        }
+    }
+    return set_total(total, out, strlen(out));
+}
+
+/**
+ * Add a floating point number to a running sum.
+ *
+ * @param[in,out] total the sum
+ * @param[in] b the number
+ * @param[in] b_length its length
+ * @return 1 on success, 0 on failure
+ */
+static int add_floats(aggregate_value * total, const char *b, int b_length)
+{
+    char a_copy[64];
+    char b_copy[64];
+
+    if (!copy_number(a_copy, sizeof(a_copy), total->bytes, total->length)
+        || !copy_number(b_copy, sizeof(b_copy), b, b_length)) {
+        return 0;
+    }
+    return set_float_total(total, strtod(a_copy, 0) + strtod(b_copy, 0));
+}
+
+/**
+ * Is a column's type floating point, so that adding up its values needn't
+ * be exact?
+ *
+ * @param[in] key the column
+ * @return 1 if so; 0 otherwise.
+ */
+static short float_column(merge_key * key)
+{
+    return (key->type == MYSQL_TYPE_FLOAT)
+        || (key->type == MYSQL_TYPE_DOUBLE);
+}
+
+/**
+ * Write a length-encoded integer.
+ *
+ * @param[out] b where to write it, or 0 just to find its length
+ * @param[in] value the integer
+ * @return its length
+ */
+static int write_length_encoded(char *b, unsigned long long value)
+{
+    int length;
+
+    if (value < 0xfb) {
+        if (b) {
+            b[0] = (char)value;
+        }
+        return 1;
+    }
+    length = (value <= 0xffff) ? 2 : (value <= 0xffffff) ? 3 : 8;
+    if (b) {
+        b[0] = (char)((length == 2) ? 0xfc : (length == 3) ? 0xfd : 0xfe);
+        for (int i = 0; i < length; ++i) {
+            b[1 + i] = (unsigned char)(value >> (8 * i));
+        }
+    }
+    return 1 + length;
+}
+
+/**
+ * Fold a value for a column into the column's aggregate.
+ *
+ * @param[in,out] values the group's aggregates
+ * @param[in] column the column's index
+ * @param[in] value the value
+ * @param[in] length its length, or -1 for NULL
+ * @return 1 on success, 0 on failure
+ */
+static int fold_value(aggregate_value * values, int column,
+                      const char *value, int length)
+{
+    aggregate_value *total = &values[column];
+    merge_key *key = &session->fold->keys[column];
+
+    /* aggregates leave out NULLs, unless there's nothing else */
+    if (length == -1) {
+        return 1;
+    }
+    if (!total->bytes) {
+        return set_total(total, value, length);
+    }
+
+    switch (session->merge->aggregates[column].function) {
+    case SQL_AGGREGATE_COUNT:
+        return add_decimals(total, value, length);
+    case SQL_AGGREGATE_SUM:
+    case SQL_AGGREGATE_AVG:
+        return float_column(key) ? add_floats(total, value, length) :
+            add_decimals(total, value, length);
+    case SQL_AGGREGATE_MIN:
+        if (compare_values(key, value, length, total->bytes,
+                           total->length) < 0) {
+            return set_total(total, value, length);
+        }
+        return 1;
+    case SQL_AGGREGATE_MAX:
+        if (compare_values(key, value, length, total->bytes,
+                           total->length) > 0) {
+            return set_total(total, value, length);
+        }
+        return 1;
+    case SQL_AGGREGATE_GROUP:
+    case SQL_AGGREGATE_ANY:
+        return 1;
+    };
+    return 1;
+}
+
+/**
+ * Add bytes to a hash.
+ *
+ * @param[in] hash the hash so far
+ * @param[in] p the bytes
+ * @param[in] length how many
+ * @return the new hash
+ */
+static unsigned int hash_bytes(unsigned int hash, const char *p, int length)
+{
+    for (int i = 0; i < length; ++i) {
+        hash = (hash ^ (unsigned char)p[i]) * HASH_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * Add a character's weight to a hash.
+ *
+ * @param[in] hash the hash so far
+ * @param[in] weight the weight
+ * @return the new hash
+ */
+static unsigned int hash_weight(unsigned int hash, unsigned int weight)
+{
+    for (int i = 0; i < 4; ++i) {
+        hash = (hash ^ ((weight >> (8 * i)) & 0xff)) * HASH_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * Add a number written out in full to a hash, so that numbers which are
+ * equal by compare_numbers() hash the same: leading zeros, the fraction's
+ * trailing zeros and the sign of 0 are left out.
+ *
+ * @param[in] hash the hash so far
+ * @param[in] a the number
+ * @param[in] length its length
+ * @param[in] separator what ends its whole part
+ * @return the new hash
+ */
+static unsigned int hash_number(unsigned int hash, const char *a,
+                                int length, char separator)
+{
+    const char *end = a + length;
+    short negative = (a < end) && (*a == '-');
+
+    if (negative) {
+        ++a;
+    }
+    const char *whole = memchr(a, separator, end - a);
+    if (!whole) {
+        whole = end;
+    }
+    while ((a < whole - 1) && (*a == '0')) {
+        ++a;
+    }
+    while ((end > whole)
+           && (!isdigit((unsigned char)end[-1]) || (end[-1] == '0'))) {
+        --end;
+    }
+    if (negative && ((end > whole) || (whole - a > 1) || (*a != '0'))) {
+        hash = hash_bytes(hash, "-", 1);
+    }
+    hash = hash_bytes(hash, a, whole - a);
+    hash = hash_bytes(hash, ".", 1);
+    for (const char *p = whole; p < end; ++p) {
+        if (isdigit((unsigned char)*p)) {
+            hash = hash_bytes(hash, p, 1);
+        }
+    }
+    return hash;
+}
+
+/**
+ * Add a column's value to a hash, so that values which are equal by
+ * compare_values() hash the same.
+ *
+ * @param[in] hash the hash so far
+ * @param[in] key the column
+ * @param[in] a the value
+ * @param[in] length its length, or -1 for NULL
+ * @return the new hash
+ */
+static unsigned int hash_value(unsigned int hash, merge_key * key,
+                               const char *a, int length)
+{
+    if (length == -1) {
+        return hash_bytes(hash, "N", 1);
+    }
+    hash = hash_bytes(hash, "V", 1);
+
+    switch (key->type) {
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_TINY:
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_YEAR:
+    case MYSQL_TYPE_NEWDECIMAL:
+        return hash_number(hash, a, length, '.');
+    case MYSQL_TYPE_FLOAT:
+    case MYSQL_TYPE_DOUBLE:
+        {
+            char copy[64];
+            if (!copy_number(copy, sizeof(copy), a, length)) {
+                return hash_number(hash, a, length, '.');
+            }
+            /* 0 and -0 are equal */
+            double value = strtod(copy, 0);
+            if (value == 0) {
+                value = 0;
+            }
+            return hash_bytes(hash, (const char *)&value, sizeof(value));
+        }
+    case MYSQL_TYPE_TIME:
+        return hash_number(hash, a, length, ':');
+    case MYSQL_TYPE_TIMESTAMP:
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_NEWDATE:
+    case MYSQL_TYPE_BIT:
+        return hash_bytes(hash, a, length);
+    default:
+        if (key->charset == BINARY_CHARSET) {
+            return hash_bytes(hash, a, length);
+        }
+        break;
+    };
+
+    /* trailing spaces are ignored */
+    const unsigned char *p = (const unsigned char *)a;
+    const unsigned char *end = p + length;
+    int spaces = 0;
+    while (p < end) {
+        unsigned int weight = collation_weight(&p, end, key->charset);
+        if (weight == ' ') {
+            ++spaces;
+            continue;
+        }
+        for (; spaces; --spaces) {
+            hash = hash_weight(hash, ' ');
+        }
+        hash = hash_weight(hash, weight);
+    }
+    return hash;
+}
+
+/**
+ * Does the row being folded belong to a group?
+ *
+ * @param[in] p the row
+ * @param[in] group the group
+ * @return 1 if so; 0 otherwise.
+ */
+static short same_group(packet * p, merge_group * group)
+{
+    fold_state *fold = session->fold;
+
+    for (int i = 0; i < fold->columns; ++i) {
+        if (session->merge->aggregates[i].function != SQL_AGGREGATE_GROUP) {
+            continue;
+        }
+        aggregate_value *value = &group->values[i];
+        int length = fold->values[i * 2 + 1];
+        if (!value->bytes || (length == -1)) {
+            if (value->bytes || (length != -1)) {
+                return 0;
+            }
+        } else if (compare_values(&fold->keys[i], value->bytes,
+                                  value->length,
+                                  p->bytes + fold->values[i * 2], length)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Find the slot a group belongs in: its own, or the empty one it goes in.
+ *
+ * @param[in] hash the group's hash
+ * @param[in] p a row of the group, whose values are in fold->values, or 0
+ * to find an empty slot
+ * @return the slot
+ */
+static merge_group *find_group(unsigned int hash, packet * p)
+{
+    fold_state *fold = session->fold;
+    unsigned int mask = fold->slots - 1;
+
+    for (unsigned int i = hash & mask;; i = (i + 1) & mask) {
+        merge_group *group = &fold->groups[i];
+        if (!group->values
+            || (p && (group->hash == hash) && same_group(p, group))) {
+            return group;
+        }
+    }
+}
+
+/**
+ * Make room in the table of groups for another, keeping it at most half
+ * full.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int grow_groups(void)
+{
+    fold_state *fold = session->fold;
+    merge_group *old = fold->groups;
+    int old_slots = fold->slots;
+
+    if ((fold->count + 1) * 2 <= fold->slots) {
+        return 1;
+    }
+    fold->slots = old_slots ? old_slots * 2 : GROUP_SLOTS;
+    fold->groups = calloc(fold->slots, sizeof(merge_group));
+    if (!fold->groups) {
+        fold->groups = old;
+        fold->slots = old_slots;
+        return 0;
+    }
+    for (int i = 0; i < old_slots; ++i) {
+        if (old[i].values) {
+            *find_group(old[i].hash, 0) = old[i];
+        }
+    }
+    free(old);
+    fold->memory += (fold->slots - old_slots) * sizeof(merge_group);
+    return 1;
+}
+
+/**
+ * Build a row from a group's aggregates.
+ *
+ * @param[in] values the aggregates
+ * @param[in] count how many there are
+ * @return the row, or 0 on failure
+ */
+static packet *group_row(aggregate_value * values, int count)
+{
+    long long length = 0;
+
+    for (int i = 0; i < count; ++i) {
+        length += values[i].bytes ? write_length_encoded(0, values[i].length)
+            + values[i].length : 1;
+    }
+    if (length >= 0xffffff) {
+        return 0;
+    }
+
+    packet *p = new_packet(0, (int)length);
+    if (!p) {
+        return 0;
+    }
+    int offset = HEADER_SIZE;
+    for (int i = 0; i < count; ++i) {
+        aggregate_value *value = &values[i];
+        if (!value->bytes) {
+            p->bytes[offset++] = (char)0xfb;
+            continue;
+        }
+        offset += write_length_encoded(p->bytes + offset, value->length);
+        memcpy(p->bytes + offset, value->bytes, value->length);
+        offset += value->length;
+    }
+    return p;
+}
+
+/**
+ * Write a row to a file.
+ *
+ * @param[in] f the file
+ * @param[in] p the row
+ * @return 1 on success, 0 on failure
+ */
+static int write_row(FILE * f, packet * p)
+{
+    return fwrite(p->bytes, 1, p->size, f) == (size_t)p->size;
+}
+
+/**
+ * Read a row written by write_row().
+ *
+ * @param[in] f the file
+ * @param[in,out] p where to read it into, grown to fit
+ * @return 1 on success, 0 at the end of the file, -1 on failure
+ */
+static int read_row(FILE * f, packet * p)
+{
+    unsigned char header[HEADER_SIZE];
+    size_t got = fread(header, 1, HEADER_SIZE, f);
+
+    if (!got && feof(f)) {
+        return 0;
+    }
+    if (got != HEADER_SIZE) {
+        return -1;
+    }
+    int size = HEADER_SIZE + (header[0] | (header[1] << 8)
+                              | (header[2] << 16));
+    if (size > p->allocated) {
+        char *grown = realloc(p->bytes, size);
+        if (!grown) {
+            return -1;
+        }
+        p->bytes = grown;
+        p->allocated = size;
+    }
+    memcpy(p->bytes, header, HEADER_SIZE);
+    p->size = size;
+    return (fread(p->bytes + HEADER_SIZE, 1, size - HEADER_SIZE, f)
+            == (size_t)(size - HEADER_SIZE)) ? 1 : -1;
+}
+
+/**
+ * Spill every group in the table to disk, into the file chosen by the top
+ * bits of its hash, so that a group always goes to the same file.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int spill_groups(void)
+{
+    fold_state *fold = session->fold;
+
+    if (!fold->spilled) {
+        lo(LOG_INFO, "mysql_driver: groups are over merge_memory_limit; "
+           "spilling them to disk");
+        fold->spilled = 1;
+    }
+    for (int i = 0; i < fold->slots; ++i) {
+        merge_group *group = &fold->groups[i];
+        if (!group->values) {
+            continue;
+        }
+        int partition = (group->hash >> SPILL_PARTITION_SHIFT)
+            & (SPILL_PARTITIONS - 1);
+        if (!fold->spills[partition]) {
+            fold->spills[partition] = tmpfile();
+        }
+        packet *p = group_row(group->values, fold->columns);
+        short ok = p && fold->spills[partition]
+            && write_row(fold->spills[partition], p);
+        packet_delete(p);
+        if (!ok) {
+            lo(LOG_ERROR, "mysql_driver: can't spill groups: %s",
+               strerror(errno));
+            return 0;
+        }
+        free_group(fold, group);
+    }
+    fold->count = 0;
+    fold->memory = fold->slots * sizeof(merge_group);
+    return 1;
+}
+
+/**
+ * Find out how the columns' values compare, once the result set's columns
+ * are known.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int fold_start(void)
+{
+    fold_state *fold = session->fold;
+    sql_merge *merge = session->merge;
+
+    if (session->field_count < fold->columns) {
+        return 0;
+    }
+    fold->keys = malloc(sizeof(merge_key) * fold->columns);
+    fold->values = malloc(sizeof(int) * 2 * fold->columns);
+    session->keys = malloc(sizeof(merge_key) * (merge->order_count + 1));
+    if (!fold->keys || !fold->values || !session->keys || !grow_groups()) {
+        return 0;
+    }
+    for (int i = 0; i < fold->columns; ++i) {
+        if (!column_key(i, &fold->keys[i])) {
+            return 0;
+        }
+    }
+    if (!order_keys()) {
+        session->key_count = 0;
+    }
+    fold->started = 1;
+    return 1;
+}
+
+/**
+ * Fold a row into its group's aggregates.
+ *
+ * @param[in] p the row
+ * @return 1 on success, 0 on failure
+ */
+static int fold_row(packet * p)
+{
+    fold_state *fold = session->fold;
+    unsigned int hash = HASH_BASIS;
+    int offset = HEADER_SIZE;
+
+    if (!fold->started && !fold_start()) {
+        return 0;
+    }
+
+    /* all of the group's values, at once */
+    for (int i = 0; i < fold->columns; ++i) {
+        offset = (offset < p->size) ? row_value(p, offset,
+                                                &fold->values[i * 2],
+                                                &fold->values[i * 2 + 1])
+            : -1;
+        if (offset == -1) {
+            return 0;
+        }
+        if (session->merge->aggregates[i].function == SQL_AGGREGATE_GROUP) {
+            hash = hash_value(hash, &fold->keys[i],
+                              p->bytes + fold->values[i * 2],
+                              fold->values[i * 2 + 1]);
+        }
+    }
+
+    if (!grow_groups()) {
+        return 0;
+    }
+    merge_group *group = find_group(hash, p);
+    if (!group->values) {
+        group->values = calloc(fold->columns, sizeof(aggregate_value));
+        if (!group->values) {
+            return 0;
+        }
+        group->hash = hash;
+        ++fold->count;
+        fold->memory += sizeof(aggregate_value) * fold->columns;
+    }
+    for (int i = 0; i < fold->columns; ++i) {
+        int length = fold->values[i * 2 + 1];
+        if (!fold_value(group->values, i, p->bytes + fold->values[i * 2],
+                        length)) {
+            return 0;
+        }
+    }
+
+    if (merge_memory_limit && session->merge->grouped && !fold->loading
+        && (fold->memory > merge_memory_limit)) {
+        return spill_groups();
+    }
+    return 1;
+}
+
+/**
+ * Divide an AVG()'s sum by its count. A decimal average is exact to
+ * DIV_PRECISION_INCREMENT more places than the sum, rounded half up, as
+ * MySQL's own is.
+ *
+ * @param[in,out] sum the sum, which becomes the average
+ * @param[in] count the count
+ * @param[in] key the sum's column
+ * @return 1 on success, 0 on failure
+ */
+static int divide_total(aggregate_value * sum, aggregate_value * count,
+                        merge_key * key)
+{
+    char count_copy[32];
+    unsigned long long n;
+
+    if (!sum->bytes || !count->bytes) {
+        free(sum->bytes);
+        sum->bytes = 0;
+        return 1;
+    }
+    if (!copy_number(count_copy, sizeof(count_copy), count->bytes,
+                     count->length)) {
+        return 0;
+    }
+    n = strtoull(count_copy, 0, 10);
+    if (!n) {
+        free(sum->bytes);
+        sum->bytes = 0;
+        return 1;
+    }
+
+    if (float_column(key)) {
+        char sum_copy[64];
+        if (!copy_number(sum_copy, sizeof(sum_copy), sum->bytes,
+                         sum->length)) {
+            return 0;
+        }
+        return set_float_total(sum, strtod(sum_copy, 0) / n);
+    }
+
+    short negative;
+    const char *whole, *fraction;
+    int whole_length;
+    int scale = split_decimal(sum->bytes, sum->length, &negative, &whole,
+                              &whole_length, &fraction);
+    int quotient_scale = scale + DIV_PRECISION_INCREMENT;
+    if (quotient_scale > DECIMAL_MAX_SCALE) {
+        quotient_scale = (scale > DECIMAL_MAX_SCALE) ? scale :
+            DECIMAL_MAX_SCALE;
+    }
+
+    /* long division, with one more digit to round by, and room in front
+       for rounding to carry into */
+    int digits_count = 1 + whole_length + quotient_scale + 1;
+    unsigned char *digits = malloc(digits_count * 2 + 3);
+    if (!digits) {
+        return 0;
+    }
+    char *out = (char *)digits + digits_count;
+    unsigned long long remainder = 0;
+    digits[0] = 0;
+    for (int i = 0; i < digits_count - 1; ++i) {
+        int digit = (i < whole_length) ? whole[i] - '0' :
+            (i - whole_length < scale) ? fraction[i - whole_length] - '0' :
+            0;
+        remainder = remainder * 10 + digit;
+        digits[i + 1] = (unsigned char)(remainder / n);
+        remainder %= n;
+    }
+    int carry = digits[digits_count - 1] >= 5;
+    for (int i = digits_count - 2; carry; --i) {
+        digits[i] = (unsigned char)((digits[i] + 1) % 10);
+        carry = !digits[i];
+    }
+
+    int ok = set_total(sum, out,
+                       write_decimal(out, negative, digits, digits_count - 1,
+                                     quotient_scale));
+    free(digits);
+    return ok;
+}
+
+/**
+ * Pass a delegate's packet on to the client if nobody else's reply has got
+ * there first; the first delegate to start a reply leads the merged reply.
+ *
+ * @param[in] id the delegate
+ */
+static void forward_first(delegate_id id)
+{
+    if (session->leader == -1) {
+        session->leader = id;
+    }
+    session->delegate_states[id].forward = (session->leader == id);
+}
+
+/**
+ * Read an OK packet.
+ *
+ * @param[in] p the packet
+ * @param[out] ok what it says
+ * @return 1 on success, 0 if it's too short
+ */
+static int read_ok(packet * p, ok_fields * ok)
+{
+    int offset = read_length_encoded(p, HEADER_SIZE + 1, &ok->affected_rows);
+    offset = read_length_encoded(p, offset, &ok->insert_id);
+
+    if (offset + 4 > p->size) {
+        return 0;
+    }
+    ok->status = (unsigned char)p->bytes[offset]
+        | ((unsigned char)p->bytes[offset + 1] << 8);
+    ok->warnings = (unsigned char)p->bytes[offset + 2]
+        | ((unsigned char)p->bytes[offset + 3] << 8);
+    ok->info = p->bytes + offset + 4;
+    ok->info_length = p->size - offset - 4;
+    return 1;
+}
+
+/**
+ * Add up the counts in two OK packets' messages ("Rows matched: 1
+ * Changed: 1  Warnings: 0", say), if they're the same but for the counts.
+ *
+ * @param[out] out the sum
+ * @param[in] size how many bytes out has room for
+ * @param[in] a one message
+ * @param[in] a_length its length
+ * @param[in] b the other
+ * @param[in] b_length its length
+ * @return the length of the sum, or -1 if the messages don't match (or
+ * the sum doesn't fit)
+ */
+static int add_info(char *out, int size, const char *a, int a_length,
+                    const char *b, int b_length)
+{
+    int i = 0, j = 0, length = 0;
+
+    while ((i < a_length) && (j < b_length)) {
+        if (isdigit((unsigned char)a[i]) && isdigit((unsigned char)b[j])) {
+            unsigned long long sum = 0;
+            int a_start = i, b_start = j;
+            for (; (i < a_length) && isdigit((unsigned char)a[i]); ++i) {
+                sum = sum * 10 + (a[i] - '0');
+            }
+            unsigned long long addend = 0;
+            for (; (j < b_length) && isdigit((unsigned char)b[j]); ++j) {
+                addend = addend * 10 + (b[j] - '0');
+            }
+            if ((i - a_start > 18) || (j - b_start > 18)) {
+                return -1;
+            }
+            int written = snprintf(out + length, size - length, "%llu",
+                                   sum + addend);
+            if ((written < 0) || (written >= size - length)) {
+                return -1;
+            }
+            length += written;
+        } else if ((a[i] == b[j]) && (length + 1 < size)) {
+            out[length++] = a[i++];
+            ++j;
+        } else {
+            return -1;
+        }
+    }
+    return ((i == a_length) && (j == b_length)) ? length : -1;
+}
+
+/**
+ * Merge two delegates' OK packets into one which speaks for both: rows
+ * affected, warnings and the counts in the message are added up, the
+ * insert id is the least one generated (as it's the first for a statement
+ * which inserts several rows), and a status flag is set if either's is,
+ * except for autocommit, which has to be on for both.
+ *
+ * @param[in] a one OK packet
+ * @param[in] b the other
+ * @return the merged packet, or 0 on failure
+ */
+static packet *merge_ok(packet * a, packet * b)
+{
+    ok_fields x, y;
+
+    if (!read_ok(a, &x) || !read_ok(b, &y)) {
+        return packet_copy(a);
+    }
+
+    /* a sum has no more digits than its two numbers together, so the sum
+       of the messages is no longer than both, and then snprintf()'s 0 */
+    int info_size = x.info_length + y.info_length + 1;
+    char *info = malloc(info_size);
+    if (!info) {
+        return 0;
+    }
+    int info_length = add_info(info, info_size, x.info, x.info_length,
+                               y.info, y.info_length);
+    if (info_length == -1) {
+        memcpy(info, x.info, x.info_length);
+        info_length = x.info_length;
+    }
+
+    unsigned long long affected_rows = x.affected_rows + y.affected_rows;
+    unsigned long long insert_id = (!y.insert_id
+                                    || (x.insert_id
+                                        && (x.insert_id < y.insert_id))) ?
+        x.insert_id : y.insert_id;
+    int status = ((x.status | y.status) & ~SERVER_STATUS_AUTOCOMMIT)
+        | (x.status & y.status & SERVER_STATUS_AUTOCOMMIT);
+    int warnings = (x.warnings + y.warnings < 0xffff) ?
+        x.warnings + y.warnings : 0xffff;
+
+    packet *p = new_packet((unsigned char)a->bytes[3],
+                           1 + write_length_encoded(0, affected_rows)
+                           + write_length_encoded(0, insert_id) + 4
+                           + info_length);
+    if (p) {
+        char *out = p->bytes + HEADER_SIZE + 1;
+        out += write_length_encoded(out, affected_rows);
+        out += write_length_encoded(out, insert_id);
+        out[0] = (unsigned char)status;
+        out[1] = (unsigned char)(status >> 8);
+        out[2] = (unsigned char)warnings;
+        out[3] = (unsigned char)(warnings >> 8);
+        memcpy(out + 4, info, info_length);
+    }
+    free(info);
+    return p;
+}
+
+/**
+ * Hold back a packet which ends a delegate's reply, to end the merged reply
+ * with once every delegate's has ended. The first is kept, unless it's an
+ * OK and a result set turns up, which has to end with an EOF instead; OKs
+ * are merged, so the client hears about every delegate's rows.
+ *
+ * @param[in] p an OK or EOF packet
+ */
+static void hold_last_reply(packet * p)
+{
+    packet *last = session->last_reply;
+
+    if (last && (session->leader == -1) && !last->bytes[HEADER_SIZE]
+        && !p->bytes[HEADER_SIZE]) {
+        session->last_reply = merge_ok(last, p);
+        packet_delete(last);
+        if (!session->last_reply) {
+            session->lost_reply = 1;
+        }
+        return;
+    }
+
+    if (last && ((session->leader == -1)
+                 || ((unsigned char)last->bytes[4] == 0xfe)
+                 || ((unsigned char)p->bytes[4] != 0xfe))) {
+        return;
+    }
+
+    packet_delete(last);
+    session->last_reply = packet_copy(p);
+    if (!session->last_reply) {
+        session->lost_reply = 1;
+    }
+}
+
+/**
+ * Read the first packet of a delegate's reply to COM_STMT_PREPARE.
+ *
+ * @param[in] p the packet
+ * @param[out] params how many parameters the statement has
+ * @param[out] more how many packets follow: the parameters' definitions,
+ * then the columns', each ended by an EOF
+ * @return 1 on success, 0 if it isn't the OK it should be
+ */
+static int read_prepare_ok(packet * p, int *params, int *more)
+{
+    /* status, statement id, columns, parameters */
+    if ((p->size < HEADER_SIZE + 1 + 4 + 2 + 2) || p->bytes[HEADER_SIZE]) {
+        return 0;
+    }
+    const unsigned char *b =
+        (const unsigned char *)p->bytes + HEADER_SIZE + 1 + 4;
+    int columns = b[0] | (b[1] << 8);
+    *params = b[2] | (b[3] << 8);
+    *more = (*params ? *params + 1 : 0) + (columns ? columns + 1 : 0);
+    return 1;
+}
+
+/**
+ * Take in the first packet of a delegate's reply to the client's
+ * COM_STMT_PREPARE. The client is given pdb's own id for the statement, and
+ * the delegate connection keeps the delegate's.
+ *
+ * @param[in] id the delegate
+ * @param[in,out] p the packet
+ */
+static void statement_prepared(delegate_id id, packet * p)
+{
+    int params;
+
+    if (!read_prepare_ok(p, &params,
+                         &session->delegate_states[id].pending_packets)) {
+        header_mismatch(id, "unexpected reply to COM_STMT_PREPARE");
+        return;
+    }
+
+    client_statement *s = calloc(1, sizeof(client_statement));
+    if (s) {
+        s->sql = strdup(session->prepare_sql);
+    }
+    if (!s || !s->sql) {
+        lo(LOG_ERROR, "mysql_driver: no memory for a prepared statement");
+        free(s);
+        session->lost_reply = 1;
+        return;
+    }
+    s->id = session->next_statement_id++;
+    if (!session->next_statement_id) {
+        session->next_statement_id = 1;
+    }
+    s->params = params;
+    s->next = session->statements;
+    session->statements = s;
+
+    if (session->preparing) {
+        cache_insert(session->preparing, s->sql, p->bytes + HEADER_SIZE + 1);
+    }
+    write_int4(p->bytes + HEADER_SIZE + 1, s->id);
+}
+
+void mysql_driver_reply(delegate_id id, packet * p)
+{
+    delegate_state *state = &session->delegate_states[id];
+
+    state->forward = 0;
+
+    /* have to handle being called unnecessarily */
+    if (state->expect_replies == REP_NONE) {
+        return;
+    }
+
+    /* short-circuit for error packets */
+    if ((unsigned char)(p->bytes[4]) == 0xff) {
+        char *error = malloc(p->size - 7 + 1);
+        if (error) {
+            strncpy(error, p->bytes + 7, p->size - 7);
+            error[p->size - 7] = 0;
+            lo(LOG_INFO, "mysql_driver_reply(%hu): ERROR: %s", id, error);
+            free(error);
+        }
+
+        state->error = 1;
+        state->expect_replies = REP_NONE;
+        state->expecting_rows = 0;
+        if (session->state_pending) {
+            /* not worth replaying */
+            --session->state_command_count;
+            packet_delete(session->state_commands
+                          [session->state_command_count]);
+            session->state_pending = 0;
+        }
+        packet_delete(session->error_packet);
+        /* XX: hacky, will probably need fix */
+        session->error_packet = packet_copy(p);
+        return;
+    }
+
+    switch (state->expect_replies) {
     case REP_GREETING:
-        waiting_for_client_auth = 1;
+        session->waiting_for_client_auth = 1;
         lo(LOG_DEBUG, "mysql_driver_reply(%hu): REP_GREETING -> REP_NONE",
            id);
-        delegate_states[id].expect_replies = REP_NONE;
+        state->expect_replies = REP_NONE;
+        forward_first(id);
         break;
     case REP_SIMPLE:
         if (p->bytes[4] == 0) {
             lo(LOG_DEBUG, "mysql_driver_reply(%hu): REP_SIMPLE -> REP_NONE",
                id);
-            delegate_states[id].expect_replies = REP_NONE;
+            state->expect_replies = REP_NONE;
+            note_transaction(state, p);
+            session->state_pending = 0;
+            hold_last_reply(p);
         } else {
             lo(LOG_DEBUG,
                "mysql_driver_reply(%hu): REP_SIMPLE -> REP_TABLE_FIELDS", id);
-            delegate_states[id].expect_replies = REP_TABLE_FIELDS;
+            state->expect_replies = REP_TABLE_FIELDS;
+            forward_first(id);
+            if (state->expecting_rows) {
+                unsigned long long columns;
+                read_length_encoded(p, HEADER_SIZE, &columns);
+                check_columns(id, columns);
+            } else {
+                /* a field list has no column count */
+                check_field(id, p);
+            }
         }
         break;
     case REP_TABLE_FIELDS:
         if ((unsigned char)(p->bytes[4]) == 0xfe) {
-            if (delegate_states[id].expecting_rows) {
+            check_columns(id, state->fields);
+            if (state->expecting_rows) {
                 lo(LOG_DEBUG,
                    "mysql_driver_reply(%hu): REP_TABLE_FIELDS "
                    "-> REP_TABLE_ROWS", id);
-                delegate_states[id].expect_replies = REP_TABLE_ROWS;
+                state->expect_replies = REP_TABLE_ROWS;
+                state->forward = (id == session->leader);
+                /* an EOF can end the rows as well as the fields */
+                if (state->forward && session->merge && !session->fold
+                    && (session->merge->limit != -1)
+                    && !session->early_reply) {
+                    session->early_reply = packet_copy(p);
+                }
             } else {
                 lo(LOG_DEBUG,
                    "mysql_driver_reply(%hu): REP_TABLE_FIELDS -> REP_NONE",
                    id);
-                delegate_states[id].expect_replies = REP_NONE;
+                state->expect_replies = REP_NONE;
+                note_transaction(state, p);
+                hold_last_reply(p);
             }
         } else {
             lo(LOG_DEBUG, "mysql_driver_reply(%hu): field", id);
+            state->forward = (id == session->leader);
+            check_field(id, p);
         }
         break;
     case REP_TABLE_ROWS:
         if ((unsigned char)(p->bytes[4]) == 0xfe) {
             lo(LOG_DEBUG,
                "mysql_driver_reply(%hu): REP_TABLE_ROWS -> REP_NONE", id);
-            delegate_states[id].expect_replies = REP_NONE;
+            state->expect_replies = REP_NONE;
+            note_transaction(state, p);
+            hold_last_reply(p);
         } else {
             lo(LOG_DEBUG, "mysql_driver_reply(%hu): row", id);
+            if (session->limited) {
+                /* the client has had all the rows it asked for */
+            } else if (session->fold) {
+                if (!failed() && !fold_row(p)) {
+                    lo(LOG_ERROR, "mysql_driver: can't fold rows");
+                    session->lost_reply = 1;
+                }
+            } else if (!failed() && ordering()) {
+                hold_head(id, p);
+            } else {
+                state->forward = !failed() && pass_row();
+            }
+        }
+        break;
+    case REP_PREPARE:
+        forward_first(id);
+        if (state->pending_packets) {
+            --state->pending_packets;
+        } else {
+            statement_prepared(id, p);
+        }
+        if (!state->pending_packets) {
+            lo(LOG_DEBUG, "mysql_driver_reply(%hu): REP_PREPARE -> REP_NONE",
+               id);
+            state->expect_replies = REP_NONE;
         }
         break;
     case REP_NONE:
@@ -353,19 +3772,543 @@ void mysql_driver_reply(delegate_id id, packet * p)
            "any replies!", id);
         break;
     };
+
+    /* a folded result set is only passed on once it's complete */
+    if (session->fold) {
+        state->forward = 0;
+    }
+}
+
+/**
+ * Add a packet to the merged reply, renumbered to follow the packets which
+ * went before it.
+ *
+ * @param[in,out] out the merged reply
+ * @param[in,out] offset where the packet goes in out
+ * @param[in] p the packet
+ */
+static void append_reply(packet * out, int *offset, packet * p)
+{
+    memcpy(out->bytes + *offset, p->bytes, p->size);
+    out->bytes[*offset + 3] = (char)session->sequence++;
+    *offset += p->size;
+}
+
+/**
+ * Does a folded value meet a HAVING condition?
+ *
+ * @param[in] condition the condition
+ * @param[in] value the value
+ * @return 1 if so; 0 otherwise.
+ */
+static short meets(sql_condition * condition, aggregate_value * value)
+{
+    if (!value->bytes) {
+        return 0;
+    }
+
+    int c = compare_values(&session->fold->keys[condition->column],
+                           value->bytes, value->length, condition->value,
+                           strlen(condition->value));
+    switch (condition->comparison) {
+    case SQL_EQUAL:
+        return c == 0;
+    case SQL_NOT_EQUAL:
+        return c != 0;
+    case SQL_LESS:
+        return c < 0;
+    case SQL_LESS_EQUAL:
+        return c <= 0;
+    case SQL_GREATER:
+        return c > 0;
+    case SQL_GREATER_EQUAL:
+        return c >= 0;
+    };
+    return 0;
+}
+
+/**
+ * Compare two finished rows, for qsort().
+ *
+ * @return as compare_bytes()
+ */
+static int compare_merged_rows(const void *a, const void *b)
+{
+    const merged_row *a_row = a;
+    const merged_row *b_row = b;
+    return compare_rows(a_row->row->bytes, a_row->values, b_row->row->bytes,
+                        b_row->values);
+}
+
+/**
+ * Finish the groups in the table: work out their averages, keep those
+ * which meet the HAVING conditions as rows, and put the rows in order.
+ * The table is left empty.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int collect_groups(void)
+{
+    fold_state *fold = session->fold;
+    sql_merge *merge = session->merge;
+    int key_values = session->key_count * 2;
+
+    free_rows(fold);
+    fold->rows = malloc(sizeof(merged_row) * (fold->count + 1));
+    fold->row_values = malloc(sizeof(int) * (key_values * fold->count + 1));
+    if (!fold->rows || !fold->row_values) {
+        return 0;
+    }
+
+    for (int i = 0; i < fold->slots; ++i) {
+        merge_group *group = &fold->groups[i];
+        if (!group->values) {
+            continue;
+        }
+        short keep = 1;
+        for (int c = 0; c < fold->columns; ++c) {
+            int count = merge->aggregates[c].count_column;
+            if ((count != -1)
+                && !divide_total(&group->values[c], &group->values[count],
+                                 &fold->keys[c])) {
+                return 0;
+            }
+        }
+        for (int c = 0; keep && (c < merge->having_count); ++c) {
+            keep = meets(&merge->having[c],
+                         &group->values[merge->having[c].column]);
+        }
+        if (keep) {
+            merged_row *row = &fold->rows[fold->row_count];
+            row->row = group_row(group->values, fold->columns);
+            if (!row->row) {
+                return 0;
+            }
+            row->values = fold->row_values + key_values * fold->row_count++;
+            row_keys(row->row, row->values);
+        }
+        free_group(fold, group);
+    }
+    fold->count = 0;
+    fold->memory = fold->slots * sizeof(merge_group);
+
+    if (session->key_count) {
+        qsort(fold->rows, fold->row_count, sizeof(merged_row),
+              compare_merged_rows);
+    }
+    return 1;
+}
+
+/**
+ * Read a file of spilled groups back into the table, folding together the
+ * parts of each group which were spilled at different times.
+ *
+ * @param[in] partition the file's index
+ * @return 1 on success, 0 on failure
+ */
+static int load_partition(int partition)
+{
+    fold_state *fold = session->fold;
+    FILE *f = fold->spills[partition];
+    packet *p = packet_new();
+    int read = -1;
+
+    if (p && !fseek(f, 0, SEEK_SET)) {
+        fold->loading = 1;
+        while (((read = read_row(f, p)) == 1) && fold_row(p)) {
+        }
+        fold->loading = 0;
+    }
+    packet_delete(p);
+    fclose(f);
+    fold->spills[partition] = 0;
+    return read == 0;
+}
+
+/**
+ * Read a run's next row.
+ *
+ * @param[in] run the run's index
+ * @return 1 on success, 0 on failure
+ */
+static int next_run_row(int run)
+{
+    merged_row *head = &session->fold->heads[run];
+    int read = read_row(session->fold->runs[run], head->row);
+
+    if (read == 1) {
+        row_keys(head->row, head->values);
+    } else {
+        head->row->size = 0;
+    }
+    return read != -1;
+}
+
+/**
+ * Sort each file of spilled groups into a run of rows, ready to be merged.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int write_runs(void)
+{
+    fold_state *fold = session->fold;
+
+    for (int i = 0; i < SPILL_PARTITIONS; ++i) {
+        if (!fold->spills[i]) {
+            continue;
+        }
+        if (!load_partition(i) || !collect_groups()) {
+            return 0;
+        }
+
+        int run = fold->run_count++;
+        merged_row *head = &fold->heads[run];
+        fold->runs[run] = tmpfile();
+        head->row = packet_new();
+        head->values = malloc(sizeof(int) * (session->key_count * 2 + 1));
+        if (!fold->runs[run] || !head->row || !head->values) {
+            return 0;
+        }
+        for (int r = 0; r < fold->row_count; ++r) {
+            if (!write_row(fold->runs[run], fold->rows[r].row)) {
+                return 0;
+            }
+        }
+        free_rows(fold);
+        if (fseek(fold->runs[run], 0, SEEK_SET) || !next_run_row(run)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Finish folding, once every row is in.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int fold_finish(void)
+{
+    fold_state *fold = session->fold;
+
+    if (!fold->started && !fold_start()) {
+        return 0;
+    }
+    if (!fold->spilled) {
+        return collect_groups();
+    }
+
+    /* what's left in the table joins the rest of its group on disk */
+    if (!spill_groups()) {
+        return 0;
+    }
+    return session->key_count ? write_runs() : 1;
+}
+
+/**
+ * Find the next finished row, reading spilled groups back as need be.
+ *
+ * @return the row, or 0 if there are no more (or on failure, when
+ * lost_reply is set)
+ */
+static merged_row *peek_row(void)
+{
+    fold_state *fold = session->fold;
+
+    if (fold->run_count) {
+        merged_row *least = 0;
+        for (int i = 0; i < fold->run_count; ++i) {
+            merged_row *head = &fold->heads[i];
+            if (!head->row->size) {
+                continue;
+            }
+            if (!least || (compare_rows(head->row->bytes, head->values,
+                                        least->row->bytes,
+                                        least->values) < 0)) {
+                least = head;
+                fold->run = i;
+            }
+        }
+        return least;
+    }
+
+    while (fold->next_row == fold->row_count) {
+        if (!fold->spilled || (fold->next_partition == SPILL_PARTITIONS)) {
+            return 0;
+        }
+        int partition = fold->next_partition++;
+        free_rows(fold);
+        if (fold->spills[partition]
+            && (!load_partition(partition) || !collect_groups())) {
+            session->lost_reply = 1;
+            return 0;
+        }
+    }
+    return &fold->rows[fold->next_row];
+}
+
+/**
+ * Move past the row peek_row() found.
+ */
+static void advance_row(void)
+{
+    fold_state *fold = session->fold;
+
+    ++fold->passed;
+    if (!fold->run_count) {
+        ++fold->next_row;
+    } else if (!next_run_row(fold->run)) {
+        session->lost_reply = 1;
+    }
+}
+
+/**
+ * Find the next row to pass on, skipping the OFFSET and stopping at the
+ * LIMIT.
+ *
+ * @return the row, or 0 if there are no more
+ */
+static merged_row *next_row(void)
+{
+    sql_merge *merge = session->merge;
+
+    for (;;) {
+        if ((merge->limit != -1)
+            && (session->fold->passed >= merge->offset + merge->limit)) {
+            return 0;
+        }
+        merged_row *row = peek_row();
+        if (!row || (session->fold->passed >= merge->offset)) {
+            return row;
+        }
+        advance_row();
+    }
+}
+
+/**
+ * Find the end of the columns of a finished row which the client sees.
+ *
+ * @param[in] p the row
+ * @return the offset just past them
+ */
+static int visible_end(packet * p)
+{
+    int offset = HEADER_SIZE;
+
+    for (int i = 0; i < session->merge->visible; ++i) {
+        int start, length;
+        offset = row_value(p, offset, &start, &length);
+    }
+    return offset;
+}
+
+/**
+ * Add the columns of a finished row which the client sees to the merged
+ * reply.
+ *
+ * @param[in,out] out the merged reply
+ * @param[in,out] offset where the row goes in out
+ * @param[in] p the row
+ * @param[in] end what visible_end() says of the row
+ */
+static void append_row(packet * out, int *offset, packet * p, int end)
+{
+    int length = end - HEADER_SIZE;
+
+    out->bytes[*offset] = (unsigned char)(length);
+    out->bytes[*offset + 1] = (unsigned char)(length >> 8);
+    out->bytes[*offset + 2] = (unsigned char)(length >> 16);
+    out->bytes[*offset + 3] = (char)session->sequence++;
+    memcpy(out->bytes + *offset + HEADER_SIZE, p->bytes + HEADER_SIZE,
+           length);
+    *offset += end;
+}
+
+/**
+ * Build the header of a folded result set: the columns the client asked
+ * for, the ones added for the merge left out, and AVG()'s decimal places as
+ * MySQL would give them.
+ *
+ * @return the header, or 0 on failure
+ */
+static packet *folded_header(void)
+{
+    int visible = session->merge->visible;
+    packet *columns = new_packet(0, write_length_encoded(0, visible));
+    int size = session->last_reply->size;
+
+    if (!columns) {
+        return 0;
+    }
+    write_length_encoded(columns->bytes + HEADER_SIZE, visible);
+    size += columns->size;
+
+    for (int i = 0; i < visible; ++i) {
+        packet *field = session->fields[i];
+        int name, length;
+        int type = field_type_offset(field, &name, &length);
+        if ((session->merge->aggregates[i].count_column != -1)
+            && (type != -1) && (type + 3 < field->size)
+            && !float_column(&session->fold->keys[i])) {
+            int decimals = (unsigned char)field->bytes[type + 3]
+                + DIV_PRECISION_INCREMENT;
+            field->bytes[type + 3] = (char)((decimals < DECIMAL_MAX_SCALE) ?
+                                            decimals : DECIMAL_MAX_SCALE);
+        }
+        size += field->size;
+    }
+
+    packet *out = packet_allocate_temporary(size);
+    if (out) {
+        int offset = 0;
+        append_reply(out, &offset, columns);
+        for (int i = 0; i < visible; ++i) {
+            append_reply(out, &offset, session->fields[i]);
+        }
+        append_reply(out, &offset, session->last_reply);
+    }
+    packet_delete(columns);
+    return out;
+}
+
+/**
+ * Pass on the next batch of a folded result set: the header comes first,
+ * and the EOF which ends the delegates' replies comes last.
+ *
+ * @return the batch, or 0 on failure
+ */
+static packet *folded_batch(void)
+{
+    fold_state *fold = session->fold;
+    packet *header = 0;
+    int size = session->last_reply->size;
+
+    if (!fold->emitting) {
+        if (!fold_finish() || !(header = folded_header())) {
+            return 0;
+        }
+        fold->emitting = 1;
+        size += header->size;
+    }
+
+    merged_row *row = next_row();
+    int end = row ? visible_end(row->row) : 0;
+    if (session->lost_reply) {
+        return 0;
+    }
+    if (row) {
+        size += (size + end > FOLD_BATCH_SIZE) ? end : FOLD_BATCH_SIZE;
+    }
+
+    packet *out = packet_allocate_temporary(size);
+    if (!out) {
+        return 0;
+    }
+    int offset = 0;
+    if (header) {
+        memcpy(out->bytes, header->bytes, header->size);
+        offset = header->size;
+    }
+    while (row && (offset + end + session->last_reply->size <= size)) {
+        append_row(out, &offset, row->row, end);
+        advance_row();
+        row = next_row();
+        end = row ? visible_end(row->row) : 0;
+    }
+    if (session->lost_reply) {
+        return 0;
+    }
+    out->size = offset;
+
+    if (!row) {
+        append_reply(out, &offset, session->last_reply);
+        out->size = offset;
+        packet_delete(session->last_reply);
+        session->last_reply = 0;
+        forget_merge(session);
+    }
+    return out;
 }
 
 packet *mysql_driver_reduce_replies(packet_set * replies)
 {
-    lo(LOG_DEBUG, "mysql_driver_reduce_replies: hack hack hack");
-    packet *p;
-    for (delegate_id i = 0; i < delegate_states_count; ++i) {
-        p = packet_set_get(replies, i);
-        if (p && p->size) {
-            break;
+    short finished = !replying();
+    int size = 0;
+
+    if (session->lost_reply) {
+        return 0;
+    }
+
+    if (finished && session->fold && session->last_reply
+        && (session->columns != -1)
+        && (session->field_count >= session->merge->aggregate_count)) {
+        return folded_batch();
+    }
+
+    for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+        packet *p = packet_set_get(replies, i);
+        if (p->size && session->delegate_states[i].forward) {
+            size += p->size;
+        }
+    }
+    int merged = 0;
+    if (session->ordering == 1) {
+        int count = merge_heads();
+        for (int i = 0; i < count; ++i) {
+            if (pass_row()) {
+                session->merged[merged++] = session->merged[i];
+            }
+        }
+    }
+    for (int i = 0; i < merged; ++i) {
+        size += session->delegate_states[session->merged[i]].head.size;
+    }
+    short ending = session->early_reply && !session->limited && !finished
+        && limit_reached();
+    if (ending) {
+        size += session->early_reply->size;
+    }
+    if (finished && session->last_reply && !session->limited) {
+        size += session->last_reply->size;
+    }
+    if (!size) {
+        return packet_new_temporary();
+    }
+
+    /* whatever this round brought, as one run of packets */
+    packet *out = packet_allocate_temporary(size);
+    if (!out) {
+        return 0;
+    }
+    int offset = 0;
+    for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+        packet *p = packet_set_get(replies, i);
+        if (p->size && session->delegate_states[i].forward) {
+            append_reply(out, &offset, p);
+        }
+    }
+    for (int i = 0; i < merged; ++i) {
+        append_reply(out, &offset,
+                     &session->delegate_states[session->merged[i]].head);
+    }
+    if (ending) {
+        append_reply(out, &offset, session->early_reply);
+        end_early();
+    }
+    if (finished && session->last_reply) {
+        if (!session->limited) {
+            append_reply(out, &offset, session->last_reply);
         }
+        packet_delete(session->last_reply);
+        session->last_reply = 0;
     }
-    return packet_copy(p);
+    if ((session->leader != -1)
+        && (session->delegate_states[session->leader].expect_replies ==
+            REP_TABLE_ROWS)) {
+        /* the leader's field EOF went with this round, if not before */
+        session->header_sent = 1;
+    }
+    return out;
 }
 
 static void edit_packet_length(packet * p)
@@ -376,36 +4319,206 @@ static void edit_packet_length(packet * p)
     p->bytes[2] = (unsigned char)(packet_length >> 16);
 }
 
-int mysql_driver_rewrite_command(packet * in, packet * out,
-                                 const char *db_name)
+/**
+ * Rewrite the client's auth packet to use a delegate's database.
+ *
+ * @param[in] in the client's auth packet
+ * @param[in,out] out empty packet to fill
+ * @param[in] db_name the delegate's database
+ * @return 1 on success, 0 on failure
+ */
+static int rewrite_client_auth(packet * in, packet * out,
+                               const char *db_name)
 {
-    if (command_is_client_auth) {
-        int db_name_offset = 36 + strlen(in->bytes + 36) + 2;
-        out->size = out->allocated = db_name_offset + strlen(db_name) + 1;
-        out->bytes = malloc(out->size);
-        if (!out->bytes) {
-            out->size = out->allocated = 0;
-            return 0;
-        }
-        bcopy(in->bytes, out->bytes, db_name_offset);
-        bcopy(db_name, out->bytes + db_name_offset, strlen(db_name) + 1);
+    int db_name_offset = 36 + strlen(in->bytes + 36) + 2;
+    out->size = out->allocated = db_name_offset + strlen(db_name) + 1;
+    out->bytes = malloc(out->size);
+    if (!out->bytes) {
+        out->size = out->allocated = 0;
+        return 0;
+    }
+    bcopy(in->bytes, out->bytes, db_name_offset);
+    bcopy(db_name, out->bytes + db_name_offset, strlen(db_name) + 1);
+    edit_packet_length(out);
+    return 1;
+}
+
+/**
+ * Rewrite the client's COM_STMT_EXECUTE for a delegate connection: the
+ * statement is given the connection's id for it, the parameters' types are
+ * always sent (in case the connection hasn't seen them), and there's no
+ * cursor.
+ *
+ * @param[in] in the client's command
+ * @param[in,out] out empty packet to fill
+ * @param[in,out] cache the connection's statements, or 0
+ * @return 1 on success, 0 on failure
+ */
+static int rewrite_execute(packet * in, packet * out,
+                           statement_cache * cache)
+{
+    client_statement *s = session->executing;
+    int prepared = cache ? cache_find(cache, s->sql) : -1;
+
+    /* id, flags, iteration count and the NULL bitmap, then whether there
+       are new types */
+    int offset = HEADER_SIZE + 1 + 4 + 1 + 4 + (s->params + 7) / 8;
+    short add_types = s->params && s->types && (offset < in->size)
+        && !in->bytes[offset];
+
+    out->size = out->allocated = in->size + (add_types ? 2 * s->params : 0);
+    out->bytes = malloc(out->size);
+    if (!out->bytes) {
+        out->size = out->allocated = 0;
+        return 0;
+    }
+    if (add_types) {
+        memcpy(out->bytes, in->bytes, offset);
+        out->bytes[offset] = 1;
+        memcpy(out->bytes + offset + 1, s->types, 2 * s->params);
+        memcpy(out->bytes + offset + 1 + 2 * s->params,
+               in->bytes + offset + 1, in->size - offset - 1);
         edit_packet_length(out);
     } else {
-        packet *p = packet_copy(in);
-        if (!p) {
+        memcpy(out->bytes, in->bytes, in->size);
+    }
+
+    /* the delegate says so if it couldn't prepare the statement */
+    if (prepared == -1) {
+        write_int4(out->bytes + HEADER_SIZE + 1, 0);
+    } else {
+        memcpy(out->bytes + HEADER_SIZE + 1, cache->statements[prepared].id,
+               4);
+        cache->statements[prepared].used = ++cache->clock;
+    }
+    out->bytes[HEADER_SIZE + 1 + 4] = 0;
+    return 1;
+}
+
+int mysql_driver_rewrite_command(delegate_id id, packet * in, packet * out,
+                                 const char *db_name, void **driver_data)
+{
+    if (session->command_is_client_auth) {
+        if (!rewrite_client_auth(in, out, db_name)) {
             return 0;
         }
-        out->bytes = p->bytes;
-        out->allocated = p->allocated;
-        out->size = p->size;
-        free(p);
+    } else if (session->delegate_commands
+               && session->delegate_commands[id]) {
+        packet_slice(out, session->delegate_commands[id]);
+    } else if (session->partial_command) {
+        packet_slice(out, session->partial_command);
+    } else if (session->prepare_sql) {
+        /* the statement is kept prepared on the delegate connection */
+        if (!*driver_data) {
+            *driver_data = cache_new();
+        }
+        session->preparing = *driver_data;
+        if (!session->preparing
+            || !prepare_packet(session->preparing, session->prepare_sql,
+                               out)) {
+            return 0;
+        }
+    } else if (session->executing) {
+        if (!rewrite_execute(in, out, *driver_data)) {
+            return 0;
+        }
+    } else {
+        if ((unsigned char)in->bytes[4] == COM_RESET_CONNECTION) {
+            /* which closes the connection's statements */
+            mysql_driver_forget_connection(*driver_data);
+            *driver_data = 0;
+        }
+        /* every delegate is sent the same bytes */
+        packet_slice(out, in);
     }
 
     return 1;
 }
 
+packet *mysql_driver_prepare_command(int n, void **driver_data)
+{
+    statement_cache *cache = *driver_data;
+
+    if (cache && cache->command) {
+        return cache->command;
+    }
+    if (n || !session || !session->executing
+        || (cache && (cache_find(cache, session->executing->sql) != -1))) {
+        return 0;
+    }
+
+    if (!cache) {
+        cache = *driver_data = cache_new();
+    }
+    if (cache) {
+        cache->preparing = strdup(session->executing->sql);
+        cache->command = packet_new();
+    }
+    if (!cache || !cache->preparing || !cache->command
+        || !prepare_packet(cache, cache->preparing, cache->command)) {
+        /* the delegate will say it doesn't know the statement */
+        lo(LOG_ERROR, "mysql_driver: no memory to prepare a statement");
+        if (cache) {
+            free(cache->preparing);
+            cache->preparing = 0;
+            packet_delete(cache->command);
+            cache->command = 0;
+        }
+        return 0;
+    }
+    lo(LOG_DEBUG, "mysql_driver_prepare_command: preparing '%s'",
+       cache->preparing);
+    return cache->command;
+}
+
+short mysql_driver_prepare_reply(packet * reply, void **driver_data)
+{
+    statement_cache *cache = *driver_data;
+    int params;
+
+    if (!cache->preparing) {
+        --cache->replying;
+    } else if (read_prepare_ok(reply, &params, &cache->replying)) {
+        cache_insert(cache, cache->preparing,
+                     reply->bytes + HEADER_SIZE + 1);
+    } else if ((reply->size > 7)
+               && ((unsigned char)reply->bytes[4] == 0xff)) {
+        /* the client hears about it when the statement is executed */
+        lo(LOG_INFO, "mysql_driver_prepare_reply: refused: %.*s",
+           reply->size - 7, reply->bytes + 7);
+    }
+    free(cache->preparing);
+    cache->preparing = 0;
+
+    if (cache->replying > 0) {
+        return 1;
+    }
+    packet_delete(cache->command);
+    cache->command = 0;
+    return 0;
+}
+
+void mysql_driver_forget_connection(void *driver_data)
+{
+    statement_cache *cache = driver_data;
+
+    if (cache) {
+        for (int i = 0; i < cache->count; ++i) {
+            free(cache->statements[i].sql);
+        }
+        free(cache->statements);
+        packet_delete(cache->command);
+        free(cache->preparing);
+        free(cache);
+    }
+}
+
 char *mysql_driver_sql_extract(packet * in_command)
 {
+    if (session->executing) {
+        return strdup(session->executing->sql);
+    }
+
     char *sql = malloc(in_command->size - 5 + 1);
     if (sql) {
         strncpy(sql, in_command->bytes + 5, in_command->size - 5);
@@ -414,7 +4527,541 @@ char *mysql_driver_sql_extract(packet * in_command)
     return sql;
 }
 
+/**
+ * Find a parameter's value in a COM_STMT_EXECUTE, written as the binary
+ * protocol has it.
+ *
+ * @param[in] in_command the command
+ * @param[in] offset where the value starts
+ * @param[in] type the parameter's type
+ * @param[out] start where the value proper starts, past any length
+ * @return just past the value, or -1 if it runs off the end of the packet
+ */
+static int param_end(packet * in_command, int offset, int type, int *start)
+{
+    unsigned long long length;
+
+    *start = offset;
+    switch (type) {
+    case MYSQL_TYPE_NULL:
+        length = 0;
+        break;
+    case MYSQL_TYPE_TINY:
+        length = 1;
+        break;
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_YEAR:
+        length = 2;
+        break;
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_FLOAT:
+        length = 4;
+        break;
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_DOUBLE:
+        length = 8;
+        break;
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_TIMESTAMP:
+    case MYSQL_TYPE_TIME:
+        if (offset >= in_command->size) {
+            return -1;
+        }
+        length = (unsigned char)in_command->bytes[offset];
+        *start = offset + 1;
+        break;
+    default:
+        /* strings, decimals and the like */
+        *start = read_length_encoded(in_command, offset, &length);
+        break;
+    }
+
+    if ((*start > in_command->size)
+        || (length > (unsigned long long)(in_command->size - *start))) {
+        return -1;
+    }
+    return *start + (int)length;
+}
+
+/**
+ * Write a parameter's value as text, as it would be written in a query.
+ *
+ * @param[in] value the value, as the binary protocol has it
+ * @param[in] length its length
+ * @param[in] type the parameter's type
+ * @param[in] is_unsigned is it an unsigned integer?
+ * @return allocated text, or 0 if the value is neither a number nor a
+ * string (or there's no memory)
+ */
+static char *param_text(const char *value, int length, int type,
+                        short is_unsigned)
+{
+    /* Flawfinder: ignore */
+    char number[32];
+    unsigned long long bits = 0;
+    char *text;
+
+    for (int i = length - 1; (i >= 0) && (length <= 8); --i) {
+        bits = (bits << 8) | (unsigned char)value[i];
+    }
+
+    switch (type) {
+    case MYSQL_TYPE_TINY:
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_YEAR:
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_LONGLONG:
+        if (is_unsigned) {
+            snprintf(number, sizeof(number), "%llu", bits);
+        } else {
+            /* sign extended */
+            if ((length < 8) && (bits >> (8 * length - 1))) {
+                bits |= ~0ULL << (8 * length);
+            }
+            snprintf(number, sizeof(number), "%lld", (long long)bits);
+        }
+        return strdup(number);
+    case MYSQL_TYPE_FLOAT:
+        {
+            unsigned int float_bits = (unsigned int)bits;
+            float f;
+            memcpy(&f, &float_bits, sizeof(f));
+            snprintf(number, sizeof(number), "%.9g", f);
+            return strdup(number);
+        }
+    case MYSQL_TYPE_DOUBLE:
+        {
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            snprintf(number, sizeof(number), "%.17g", d);
+            return strdup(number);
+        }
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_NEWDECIMAL:
+    case MYSQL_TYPE_VARCHAR:
+    case MYSQL_TYPE_VAR_STRING:
+    case MYSQL_TYPE_STRING:
+    case MYSQL_TYPE_ENUM:
+    case MYSQL_TYPE_SET:
+    case MYSQL_TYPE_TINY_BLOB:
+    case MYSQL_TYPE_MEDIUM_BLOB:
+    case MYSQL_TYPE_LONG_BLOB:
+    case MYSQL_TYPE_BLOB:
+        text = malloc(length + 1);
+        if (text) {
+            memcpy(text, value, length);
+            text[length] = 0;
+        }
+        return text;
+    default:
+        return 0;
+    }
+}
+
+char *mysql_driver_param_extract(packet * in_command, int n)
+{
+    client_statement *s = session->executing;
+
+    if (!s || !s->types || (n < 0) || (n >= s->params)) {
+        return 0;
+    }
+
+    /* id, flags and iteration count, then the NULL bitmap, then whether
+       there are new types (which execute_statement() has kept) */
+    int nulls = HEADER_SIZE + 1 + 4 + 1 + 4;
+    int offset = nulls + (s->params + 7) / 8;
+    if (offset >= in_command->size) {
+        return 0;
+    }
+    offset += 1 + ((in_command->bytes[offset] == 1) ? 2 * s->params : 0);
+
+    for (int i = 0; i <= n; ++i) {
+        int type = (unsigned char)s->types[2 * i];
+        int start;
+        int end;
+
+        /* a NULL has no value, and matches no key */
+        if (in_command->bytes[nulls + i / 8] & (1 << (i % 8))) {
+            if (i == n) {
+                return 0;
+            }
+            continue;
+        }
+        end = param_end(in_command, offset, type, &start);
+        if (end < 0) {
+            return 0;
+        }
+        if (i == n) {
+            return param_text(in_command->bytes + start, end - start, type,
+                              (s->types[2 * i + 1] & 0x80) != 0);
+        }
+        offset = end;
+    }
+    return 0;
+}
+
+void mysql_driver_refuse(const char *message)
+{
+    lo(LOG_INFO, "mysql_driver: refusing a command: %s", message);
+    for (delegate_id i = 0; i < session->delegate_states_count; ++i) {
+        session->delegate_states[i].expect_replies = REP_NONE;
+    }
+    packet_delete(session->local_reply);
+    session->local_reply = error_packet(session->sequence,
+                                        ER_NOT_SUPPORTED_YET, "42000",
+                                        message);
+    if (!session->local_reply) {
+        session->done = 1;
+    }
+}
+
 char *mysql_driver_table_extract(packet * in_command)
 {
     return mysql_driver_sql_extract(in_command);
 }
+
+/**
+ * Compute the mysql_native_password response to a scramble:
+ * SHA1(password) XOR SHA1(scramble + SHA1(SHA1(password))).
+ *
+ * @param[in] scramble the server's SCRAMBLE_LENGTH byte scramble
+ * @param[in] stage1 SHA1(password)
+ * @param[out] response the response
+ */
+static void scramble_password(const unsigned char *scramble,
+                              const unsigned char *stage1,
+                              unsigned char response[SHA1_DIGEST_SIZE])
+{
+    unsigned char stage2[SHA1_DIGEST_SIZE];
+    sha1_context context;
+
+    sha1(stage1, SHA1_DIGEST_SIZE, stage2);
+
+    sha1_init(&context);
+    sha1_update(&context, scramble, SCRAMBLE_LENGTH);
+    sha1_update(&context, stage2, SHA1_DIGEST_SIZE);
+    sha1_final(&context, response);
+
+    for (int i = 0; i < SHA1_DIGEST_SIZE; ++i) {
+        response[i] ^= stage1[i];
+    }
+}
+
+/**
+ * Build a login packet answering a delegate's greeting.
+ *
+ * @param[in] greeting the greeting packet
+ * @param[in,out] login empty packet to fill with the login
+ * @param[in] user the user name
+ * @param[in] stage1 SHA1(password), or 0 for no password
+ * @param[in] database the database to use
+ * @return 1 on success, 0 on failure
+ */
+static int build_login(packet * greeting, packet * login, const char *user,
+                       const unsigned char *stage1, const char *database)
+{
+    /* protocol version, server version, thread id, first 8 bytes of the
+       scramble, filler, capabilities, charset, status, more capabilities,
+       scramble length, 10 reserved bytes, rest of the scramble */
+    if ((greeting->size < 5) || (greeting->bytes[4] != 10)) {
+        lo(LOG_ERROR, "mysql_driver_login_packet: unexpected greeting");
+        return 0;
+    }
+    char *version_end = memchr(greeting->bytes + 5, 0, greeting->size - 5);
+    if (!version_end) {
+        return 0;
+    }
+    int offset = version_end + 1 - greeting->bytes;
+    if (offset + 4 + 8 + 1 + 2 + 1 + 2 + 2 + 1 + 10 + 12 > greeting->size) {
+        lo(LOG_ERROR, "mysql_driver_login_packet: greeting too short");
+        return 0;
+    }
+
+    unsigned char scramble[SCRAMBLE_LENGTH];
+    memcpy(scramble, greeting->bytes + offset + 4, 8);
+    memcpy(scramble + 8, greeting->bytes + offset + 4 + 8 + 1 + 2 + 1 + 2 +
+           2 + 1 + 10, SCRAMBLE_LENGTH - 8);
+    char charset = greeting->bytes[offset + 4 + 8 + 1 + 2];
+
+    int response_length = stage1 ? SHA1_DIGEST_SIZE : 0;
+    login->size = HEADER_SIZE + 4 + 4 + 1 + 23 + strlen(user) + 1 + 1 +
+        response_length + strlen(database) + 1;
+    login->allocated = login->size;
+    login->bytes = malloc(login->allocated);
+    if (!login->bytes) {
+        login->size = login->allocated = 0;
+        return 0;
+    }
+    memset(login->bytes, 0, login->size);
+
+    unsigned long capabilities = CLIENT_LONG_PASSWORD | CLIENT_LONG_FLAG |
+        CLIENT_CONNECT_WITH_DB | CLIENT_PROTOCOL_41 | CLIENT_TRANSACTIONS |
+        CLIENT_SECURE_CONNECTION;
+    char *b = login->bytes + HEADER_SIZE;
+    for (int i = 0; i < 4; ++i) {
+        b[i] = (unsigned char)(capabilities >> (i * 8));
+    }
+    b[7] = 1;                   /* max packet size: 16M */
+    b[8] = charset;
+    b += 4 + 4 + 1 + 23;
+
+    memcpy(b, user, strlen(user) + 1);
+    b += strlen(user) + 1;
+
+    *b++ = (unsigned char)response_length;
+    if (response_length) {
+        scramble_password(scramble, stage1, (unsigned char *)b);
+        b += response_length;
+    }
+
+    memcpy(b, database, strlen(database) + 1);
+
+    edit_packet_length(login);
+    login->bytes[3] = greeting->bytes[3] + 1;
+    return 1;
+}
+
+int mysql_driver_login_packet(packet * greeting, packet * login,
+                              const char *user, const char *password,
+                              const char *database)
+{
+    if (user) {
+        unsigned char stage1[SHA1_DIGEST_SIZE];
+        sha1(password, strlen(password), stage1);
+        return build_login(greeting, login, user, password[0] ? stage1 : 0,
+                           database);
+    }
+
+    /* no login of our own for this delegate, so log in as the client */
+    if (checking_logins()) {
+        if (!session || !session->user) {
+            lo(LOG_ERROR, "mysql_driver_login_packet: nobody logged in");
+            return 0;
+        }
+        return build_login(greeting, login, session->user,
+                           session->has_password ? session->stage1 : 0,
+                           database);
+    }
+
+    if (!session || !session->client_auth) {
+        lo(LOG_ERROR, "mysql_driver_login_packet: no login to replay");
+        return 0;
+    }
+    if (!rewrite_client_auth(session->client_auth, login, database)) {
+        return 0;
+    }
+    login->bytes[3] = greeting->bytes[3] + 1;
+    return 1;
+}
+
+packet *mysql_driver_reset_command(void)
+{
+    static char bytes[] = { 1, 0, 0, 0, COM_RESET_CONNECTION };
+    static packet reset = { bytes, sizeof(bytes), sizeof(bytes) };
+    return &reset;
+}
+
+packet *mysql_driver_query_command(const char *sql)
+{
+    return query_packet(sql);
+}
+
+db_driver_row mysql_driver_query_row(packet * reply, int *stage,
+                                     char **values, int count)
+{
+    unsigned char first;
+    int offset = HEADER_SIZE;
+
+    if (reply->size <= HEADER_SIZE) {
+        return DB_DRIVER_ROW_ERROR;
+    }
+    first = (unsigned char)reply->bytes[HEADER_SIZE];
+    if (first == 0xff) {
+        return DB_DRIVER_ROW_ERROR;
+    }
+    switch (*stage) {
+    case 0:
+        /* OK (no result set), or else the column count */
+        if (first == 0) {
+            return DB_DRIVER_ROW_DONE;
+        }
+        *stage = 1;
+        return DB_DRIVER_ROW_MORE;
+    case 1:
+        /* column definitions, up to an EOF */
+        if ((first == 0xfe) && (reply->size < HEADER_SIZE + 9)) {
+            *stage = 2;
+        }
+        return DB_DRIVER_ROW_MORE;
+    default:
+        if ((first == 0xfe) && (reply->size < HEADER_SIZE + 9)) {
+            return DB_DRIVER_ROW_DONE;
+        }
+        break;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        values[i] = 0;
+    }
+    for (int i = 0; i < count; ++i) {
+        int start, length;
+
+        if (offset >= reply->size) {
+            offset = -1;
+        } else {
+            offset = row_value(reply, offset, &start, &length);
+        }
+        if (offset < 0) {
+            break;
+        }
+        if (length < 0) {
+            length = 0;
+        }
+        values[i] = malloc(length + 1);
+        if (!values[i]) {
+            break;
+        }
+        memcpy(values[i], reply->bytes + start, length);
+        values[i][length] = 0;
+    }
+    if (!values[count - 1]) {
+        for (int i = 0; i < count; ++i) {
+            free(values[i]);
+            values[i] = 0;
+        }
+        return DB_DRIVER_ROW_ERROR;
+    }
+    return DB_DRIVER_ROW;
+}
+
+short mysql_driver_login_ok(packet * reply)
+{
+    if ((reply->size > 4) && (reply->bytes[4] == 0)) {
+        return 1;
+    }
+    if ((reply->size > 7) && ((unsigned char)reply->bytes[4] == 0xff)) {
+        lo(LOG_ERROR, "mysql_driver_login_ok: refused: %.*s",
+           reply->size - 7, reply->bytes + 7);
+    } else {
+        lo(LOG_ERROR, "mysql_driver_login_ok: unsupported login reply");
+    }
+    return 0;
+}
+
+/**
+ * Read how much memory merging may take, how many statements to keep
+ * prepared on each delegate connection, and the client logins which pdb
+ * checks itself. Hashes are written as in the mysql.user table: '*' and the
+ * hex of SHA1(SHA1(password)), or empty for no password.
+ *
+ * @param[in] configuration The current configuration.
+ * @return 1 on success, 0 on failure
+ */
+static int mysql_driver_configure(cfg_t * configuration)
+{
+    long limit = cfg_getint(configuration, CFG_MERGE_MEMORY_LIMIT);
+    if (limit < 0) {
+        lo(LOG_ERROR, "mysql_driver: bad %s", CFG_MERGE_MEMORY_LIMIT);
+        return 0;
+    }
+    merge_memory_limit = (size_t)limit * 1024;
+
+    long statements = cfg_getint(configuration, CFG_STATEMENT_CACHE_SIZE);
+    if ((statements < 1) || (statements > 0xffff)) {
+        lo(LOG_ERROR, "mysql_driver: bad %s", CFG_STATEMENT_CACHE_SIZE);
+        return 0;
+    }
+    statement_cache_size = (int)statements;
+
+    client_user_count = cfg_size(configuration, CFG_CLIENT_USER);
+    if (client_user_count == 0) {
+        return 1;
+    }
+
+    /* zeroed, so that mysql_driver_shutdown() can clean up after a failure */
+    client_users = calloc(client_user_count, sizeof(client_user));
+    if (!client_users) {
+        client_user_count = 0;
+        return 0;
+    }
+
+    for (int i = 0; i < client_user_count; ++i) {
+        cfg_t *user_config = cfg_getnsec(configuration, CFG_CLIENT_USER, i);
+        client_user *u = &client_users[i];
+
+        u->name = strdup(cfg_title(user_config));
+        if (!u->name) {
+            return 0;
+        }
+
+        const char *hash = cfg_getstr(user_config, CFG_PASSWORD_HASH);
+        u->has_password = (hash[0] != 0);
+        if (u->has_password) {
+            short ok = (hash[0] == '*')
+                && (strlen(hash) == 1 + SHA1_DIGEST_SIZE * 2);
+            for (int j = 0; ok && (j < SHA1_DIGEST_SIZE * 2); ++j) {
+                int digit = (unsigned char)hash[1 + j];
+                if (isdigit(digit)) {
+                    digit -= '0';
+                } else if (isxdigit(digit)) {
+                    digit = tolower(digit) - 'a' + 10;
+                } else {
+                    ok = 0;
+                }
+                u->stage2[j / 2] |= digit << ((j % 2) ? 0 : 4);
+            }
+            if (!ok) {
+                lo(LOG_ERROR, "mysql_driver: bad password_hash for %s",
+                   u->name);
+                return 0;
+            }
+        }
+    }
+
+    /* Flawfinder: ignore open */
+    random_fd = open("/dev/urandom", O_RDONLY);
+    if (random_fd == -1) {
+        lo(LOG_ERROR, "mysql_driver: can't open /dev/urandom: %s",
+           strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+static void mysql_driver_shutdown(void)
+{
+    for (int i = 0; i < client_user_count; ++i) {
+        free(client_users[i].name);
+    }
+    free(client_users);
+    client_users = 0;
+    client_user_count = 0;
+
+    if (random_fd != -1) {
+        close(random_fd);
+        random_fd = -1;
+    }
+}
+
+static cfg_opt_t client_user_options[] = {
+    CFG_STR(CFG_PASSWORD_HASH, CFG_PASSWORD_HASH_DEFAULT, 0),
+    CFG_END()
+};
+
+static cfg_opt_t options[] = {
+    CFG_SEC(CFG_CLIENT_USER, client_user_options, CFGF_TITLE | CFGF_MULTI),
+    CFG_INT(CFG_MERGE_MEMORY_LIMIT, CFG_MERGE_MEMORY_LIMIT_DEFAULT, 0),
+    CFG_INT(CFG_STATEMENT_CACHE_SIZE, CFG_STATEMENT_CACHE_SIZE_DEFAULT, 0),
+    CFG_END()
+};
+
+/** @ingroup components */
+component mysql_driver_component = {
+    mysql_driver_configure,
+    mysql_driver_shutdown,
+    options,
+    SUBCOMPONENTS_NONE
+};
@@ -6,14 +6,59 @@
  * @brief MySQL database driver.
  *
  * Implements the db_driver interface for mysql.
+ *
+ * Client logins are normally passed on to the delegates. When client_user
+ * sections are configured, pdb greets clients and checks their logins
+ * itself, then logs in to delegates as the client (or as the delegate's
+ * configured user), recovering SHA1(password) from the client's scramble
+ * response.
+ *
+ * When a query's rows are folded into one per group (see sql_get_merge()),
+ * the groups are kept in a hash table until every delegate's rows are in.
+ * Once a session's groups take up more than merge_memory_limit kilobytes
+ * (65536 unless configured; 0 for no limit) they're spilled to temporary
+ * files, to be read back a file at a time at the end.
+ *
+ * Prepared statements are given pdb's own ids. A statement is prepared on
+ * the delegate which describes it to the client, then on each other
+ * delegate connection the first time it's executed there; each connection
+ * keeps up to statement_cache_size (64 unless configured) statements
+ * prepared, closing the least recently executed to make room. Long data and
+ * cursors aren't supported.
  */
 
+#include "component.h"
 #include "db_driver.h"
 #include "packet.h"
 #include "delegate_filter.h"
 
+/** @cond */
+DECLARE_COMPONENT(mysql_driver);
+/** @endcond */
+
 /**
- * Initialize the mysql driver.
+ * Allocate driver state for a client connection.
+ *
+ * @return opaque session state, or 0 on failure.
+ */
+void *mysql_driver_session_new(void);
+
+/**
+ * Choose the session which subsequent calls work on.
+ *
+ * @param[in] s session state from mysql_driver_session_new()
+ */
+void mysql_driver_session_set(void *s);
+
+/**
+ * Free driver state for a client connection.
+ *
+ * @param[in,out] s session state from mysql_driver_session_new()
+ */
+void mysql_driver_session_delete(void *s);
+
+/**
+ * Initialize the current session for a new connection.
  *
  * @param[in] max_delegate_id the number of delegates, for allocation purposes
  * @return 1 on success; 0 otherwise.
@@ -42,7 +87,8 @@ short mysql_driver_expect_commands(void);
 short mysql_driver_expect_replies(void);
 
 /**
- * Did reply processing encounter any database-level errors?
+ * Did reply processing encounter any database-level errors? Not until the
+ * header of a result set which has been started is complete.
  *
  * @return 1 if an error occurred; 0 otherwise.
  */
@@ -51,10 +97,19 @@ short mysql_driver_got_error(void);
 /**
  * Packetize an error.
  *
- * @return Allocated packet suitable for returning to the client.
+ * @return Allocated packet suitable for returning to the client; it only
+ * lasts until the current arena is reset (see packet_copy_temporary()).
  */
 packet *mysql_driver_error_packet(void);
 
+/**
+ * Get pdb's own reply for the client, such as its greeting or its answer to
+ * the client's login, if it has one.
+ *
+ * @return the reply, which the caller must free, or 0 if there isn't one
+ */
+packet *mysql_driver_local_reply(void);
+
 /**
  * Filters particular delegates' communication based on the driver state.
  *
@@ -64,14 +119,115 @@ packet *mysql_driver_error_packet(void);
 delegate_filter_result mysql_driver_delegate_filter(delegate_id id);
 
 /**
- * Read the next packet from a file descriptor. This function is intended
- * to be called repeatedly until the packet is fully read.
+ * Filters delegates whose connections could be handed back to a pool, i.e.
+ * those with no replies outstanding, no transaction open and no session
+ * state left on them which pdb can't replay.
+ *
+ * @param[in] id the delegate_id
+ * @return DELEGATE_FILTER_USE if the delegate's connection is releasable
+ */
+delegate_filter_result mysql_driver_delegate_releasable(delegate_id id);
+
+/**
+ * Build the packet with which pdb logs itself in to a delegate, in answer
+ * to the delegate's greeting.
+ *
+ * @param[in] greeting the greeting packet
+ * @param[in,out] login empty packet to fill with the login
+ * @param[in] user the user name, or 0 to log in as the client
+ * @param[in] password the password (may be empty)
+ * @param[in] database the database to use
+ * @return 1 on success, 0 on failure
+ */
+int mysql_driver_login_packet(packet * greeting, packet * login,
+                              const char *user, const char *password,
+                              const char *database);
+
+/**
+ * Get one of the commands which set up the current client's session state,
+ * for replaying to a delegate connected part way through the session.
+ *
+ * @param[in] n which command, counting from 0
+ * @return the command, or 0 if there are no more
+ */
+packet *mysql_driver_replay_command(int n);
+
+/**
+ * Get the command which clears a delegate connection's session state, for
+ * a pooled connection last used by another client.
+ *
+ * @return the command, which belongs to the driver
+ */
+packet *mysql_driver_reset_command(void);
+
+/**
+ * Get the nth command to send on a delegate connection before the current
+ * command: COM_STMT_PREPARE, if the statement being executed isn't
+ * prepared there yet.
+ *
+ * @param[in] n which command, counting from 0
+ * @param[in,out] driver_data the connection's prepared statements
+ * @return the command, which belongs to the driver, or 0 if there are no
+ * more
+ */
+packet *mysql_driver_prepare_command(int n, void **driver_data);
+
+/**
+ * Take in a packet of a delegate's reply to a command from
+ * mysql_driver_prepare_command().
+ *
+ * @param[in] reply the packet
+ * @param[in,out] driver_data the connection's prepared statements
+ * @return 1 if more of the reply follows; 0 otherwise.
+ */
+short mysql_driver_prepare_reply(packet * reply, void **driver_data);
+
+/**
+ * Forget the statements prepared on a delegate connection which has been
+ * closed or reset.
+ *
+ * @param[in,out] driver_data the connection's prepared statements, or 0
+ */
+void mysql_driver_forget_connection(void *driver_data);
+
+/**
+ * Build a query of pdb's own, to send to a delegate.
+ *
+ * @param[in] sql the statement
+ * @return the COM_QUERY packet (which the caller must free), or 0 on failure
+ */
+packet *mysql_driver_query_command(const char *sql);
+
+/**
+ * Take in a packet of a delegate's reply to mysql_driver_query_command().
+ * Results are read as text, so a NULL value is read as an empty string.
+ *
+ * @param[in] reply the packet
+ * @param[in,out] stage how far through the reply it is: 0 to begin with
+ * @param[out] values a row's values, which the caller must free
+ * @param[in] count how many values to read from a row
+ * @return DB_DRIVER_ROW if the packet is a row with (at least) count values
+ */
+db_driver_row mysql_driver_query_row(packet * reply, int *stage,
+                                     char **values, int count);
+
+/**
+ * Did a delegate accept pdb's login (or a replayed command)?
+ *
+ * @param[in] reply the delegate's reply to the login packet
+ * @return 1 if so; 0 otherwise.
+ */
+short mysql_driver_login_ok(packet * reply);
+
+/**
+ * Read the next packet from a connection's receive buffer. This function is
+ * intended to be called repeatedly until the packet is fully read.
  *
- * @param[in] fd a connected file descriptor from which to read packet.
- * @param[in,out] p a packet buffer
+ * @param[in,out] in the connection's receive buffer
+ * @param[out] p an empty packet, made a slice of the buffer once read
  * @return the status of the read
  */
-packet_status mysql_driver_get_packet(int fd, packet * p);
+packet_status mysql_driver_get_packet(packet_buffer * in, packet * p);
 
 /**
  * Write a packet to a file descriptor. This function is intended to be called
@@ -102,7 +258,28 @@ db_driver_command_type mysql_driver_command(packet * in_command);
 void mysql_driver_command_done(delegate_filter * filters);
 
 /**
- * Note the receipt of a reply packet from a delegate.
+ * Keep the connections the command is sent to for the rest of the session,
+ * as it leaves state on them which later statements may look for.
+ */
+void mysql_driver_pin_delegates(void);
+
+/**
+ * Say how the delegates' result sets for the current command are to be
+ * merged. Rows are ordered by merging each delegate's (already ordered)
+ * rows: a row is only passed on once every delegate has either sent its next
+ * row or finished, so there's never more than a row per delegate held back.
+ * Columns are compared as MySQL would, by type, and by collation for text
+ * (case and accent insensitive, ignoring trailing spaces, unless binary).
+ * An ORDER BY which doesn't name a column of the result set is ignored.
+ *
+ * @param[in] merge the description, which the driver now owns; or 0
+ */
+void mysql_driver_merge(sql_merge * merge);
+
+/**
+ * Note the receipt of a reply packet from a delegate. Every delegate's
+ * result set has to have the same columns (by name and type) as the first
+ * delegate's; if one doesn't, the client gets an error instead.
  *
  * @param[in] id the delegate which generated the packet.
  * @param[in] in_reply the reply packet
@@ -110,32 +287,73 @@ void mysql_driver_command_done(delegate_filter * filters);
 void mysql_driver_reply(delegate_id id, packet * in_reply);
 
 /**
- * Reduce a set of replies into a single packet.
- * 
+ * Reduce a set of replies into a single packet. Delegates' replies are
+ * merged as they arrive: the first delegate to start a result set has its
+ * header passed on, everyone's rows follow it, and a single EOF (or OK) ends
+ * the reply once every delegate has finished. Packets are renumbered, and
+ * the "packet" returned may hold any number of them, or none.
+ *
  * @param[in] replies a list of replies from all of the delegates.
- * @return the reduced packet.
+ * @return the reduced packet, which only lasts until the current arena is
+ * reset (see packet_copy_temporary()).
  */
 packet *mysql_driver_reduce_replies(packet_set * replies);
 
 /**
- * Rewrite a command for a specific delegate.
+ * Rewrite a command for a specific delegate. Only the client's auth packet,
+ * prepared statement commands and queries given a delegate's own SQL (see
+ * mysql_driver_delegate_sql()) really need rewriting; anything else is
+ * passed on as a slice of the original, rather than copied for each
+ * delegate.
  *
+ * @param[in] id delegate identifier
  * @param[in] in the original command packet
- * @param[in,out] out the rewritten packet
+ * @param[in,out] out the rewritten packet, which may be a slice of in
  * @param[in] db_name the name of the delegate database.
+ * @param[in,out] driver_data the delegate connection's prepared statements
  * @return 1 on success, 0 on failure
  */
-int mysql_driver_rewrite_command(packet * in, packet * out,
-                                 const char *db_name);
+int mysql_driver_rewrite_command(delegate_id id, packet * in, packet * out,
+                                 const char *db_name, void **driver_data);
+
+/**
+ * Send a delegate its own version of the current query, in place of the
+ * client's.
+ *
+ * @param[in] id delegate identifier
+ * @param[in] sql the delegate's statement
+ * @return 1 on success, 0 on failure (no memory)
+ */
+short mysql_driver_delegate_sql(delegate_id id, const char *sql);
 
 /**
- * Extract and return the SQL from a command packet.
+ * Extract and return the SQL from a command packet (for COM_STMT_EXECUTE,
+ * the statement's).
  *
  * @param[in] in the command packet.
  * @return allocated SQL string
  */
 char *mysql_driver_sql_extract(packet * in);
 
+/**
+ * Extract the value a COM_STMT_EXECUTE binds one of its statement's
+ * parameters to, as text.
+ *
+ * @param[in] in the command packet
+ * @param[in] n the parameter's number, from 0
+ * @return allocated value, or 0 if it's NULL, or neither a number nor a
+ * string
+ */
+char *mysql_driver_param_extract(packet * in, int n);
+
+/**
+ * Answer the current command with an error of pdb's own, rather than
+ * sending it to any delegate.
+ *
+ * @param[in] message what the client is told
+ */
+void mysql_driver_refuse(const char *message);
+
 /**
  * Extract and return the table name from a command packet
  *
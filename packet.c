@@ -1,9 +1,127 @@
 /* system includes */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
 /* project includes */
 #include "packet.h"
+#include "uring.h"
+
+/** least room to read into, so that small packets arrive many at a time */
+#define PACKET_BUFFER_READ_SIZE 16384
+
+/** most packets gathered into a single write */
+#define PACKET_QUEUE_IOVECS 256
+
+/** bytes in each block of an arena */
+#define PACKET_ARENA_BLOCK_SIZE 65536
+
+/** bigger allocations come from the heap instead */
+#define PACKET_ARENA_LARGE (PACKET_ARENA_BLOCK_SIZE / 4)
+
+/** alignment of everything allocated from an arena */
+#define PACKET_ARENA_ALIGN 16
+
+typedef struct packet_arena_block packet_arena_block;
+
+/**
+ * A block of memory allocated from by an arena; its header is followed by
+ * PACKET_ARENA_BLOCK_SIZE bytes.
+ */
+struct packet_arena_block {
+    packet_arena_block *next; /**< the block filled before this one */
+    size_t used;              /**< offset of the first free byte */
+};
+
+struct packet_arena {
+    packet_arena_block *blocks;   /**< the block being filled first */
+};
+
+/** offset of the first byte of a block's memory */
+#define PACKET_ARENA_START \
+    ((sizeof(packet_arena_block) + PACKET_ARENA_ALIGN - 1) \
+     & ~(size_t) (PACKET_ARENA_ALIGN - 1))
+
+/** the arena which this thread's temporary packets come from, if any */
+static __thread packet_arena *current_arena = 0;
+
+packet_arena *packet_arena_new(void)
+{
+    packet_arena *a = malloc(sizeof(packet_arena));
+    if (!a) {
+        return 0;
+    }
+    a->blocks = 0;
+    return a;
+}
+
+void packet_arena_reset(packet_arena * a)
+{
+    /* the first block is kept; a conversation which needed more than that
+       shouldn't leave the session holding on to it */
+    while (a->blocks && a->blocks->next) {
+        packet_arena_block *block = a->blocks;
+        a->blocks = block->next;
+        free(block);
+    }
+    if (a->blocks) {
+        a->blocks->used = PACKET_ARENA_START;
+    }
+}
+
+void packet_arena_delete(packet_arena * a)
+{
+    if (a) {
+        if (current_arena == a) {
+            current_arena = 0;
+        }
+        packet_arena_reset(a);
+        free(a->blocks);
+        free(a);
+    }
+}
+
+void packet_arena_set(packet_arena * a)
+{
+    current_arena = a;
+}
+
+/**
+ * Allocate memory from this thread's arena.
+ *
+ * @param[in] size bytes needed
+ * @return the memory, or 0 if there's no arena, the size is too large to
+ * come from one, or on failure
+ */
+static void *packet_arena_allocate(size_t size)
+{
+    if (!current_arena || (size > PACKET_ARENA_LARGE)) {
+        return 0;
+    }
+
+    size = (size + PACKET_ARENA_ALIGN - 1)
+        & ~(size_t) (PACKET_ARENA_ALIGN - 1);
+    packet_arena_block *block = current_arena->blocks;
+    if (!block || (block->used + size > PACKET_ARENA_START +
+                   PACKET_ARENA_BLOCK_SIZE)) {
+        block = malloc(PACKET_ARENA_START + PACKET_ARENA_BLOCK_SIZE);
+        if (!block) {
+            return 0;
+        }
+        block->next = current_arena->blocks;
+        block->used = PACKET_ARENA_START;
+        current_arena->blocks = block;
+    }
+
+    void *memory = (char *)block + block->used;
+    block->used += size;
+    return memory;
+}
 
 /**
  * Initialize a packet to "empty". Will leak memory if you pass a packet with
@@ -25,9 +143,52 @@ packet *packet_new(void)
         return 0;
     }
     packet_initialize(p);
+    p->arena = 0;
     return p;
 }
 
+packet *packet_new_temporary(void)
+{
+    packet *p = packet_arena_allocate(sizeof(packet));
+    if (!p) {
+        return packet_new();
+    }
+    packet_initialize(p);
+    p->arena = 1;
+    return p;
+}
+
+packet *packet_allocate_temporary(int size)
+{
+    packet *p = packet_new_temporary();
+    if (!p) {
+        return 0;
+    }
+    p->bytes = packet_arena_allocate(size);
+    if (p->bytes) {
+        /* the bytes go with the arena, like a slice's with its buffer */
+        p->allocated = 0;
+    } else {
+        p->bytes = malloc(size);
+        if (!p->bytes) {
+            packet_delete(p);
+            return 0;
+        }
+        p->allocated = size;
+    }
+    p->size = size;
+    return p;
+}
+
+packet *packet_copy_temporary(packet * p)
+{
+    packet *copy = packet_allocate_temporary(p->size);
+    if (copy) {
+        memcpy(copy->bytes, p->bytes, p->size);
+    }
+    return copy;
+}
+
 packet *packet_copy(packet * p)
 {
     packet *copy = packet_new();
@@ -45,6 +206,13 @@ packet *packet_copy(packet * p)
     return copy;
 }
 
+void packet_slice(packet * slice, packet * p)
+{
+    slice->bytes = p->bytes;
+    slice->allocated = 0;
+    slice->size = p->size;
+}
+
 /**
  * Free the memory associated with a given packet.
  *
@@ -53,7 +221,10 @@ packet *packet_copy(packet * p)
 static void packet_free_bytes(packet * p)
 {
     if (p->bytes) {
-        free(p->bytes);
+        /* a slice belongs to its buffer */
+        if (p->allocated) {
+            free(p->bytes);
+        }
         packet_initialize(p);
     }
 }
@@ -62,25 +233,295 @@ void packet_delete(packet * p)
 {
     if (p) {
         packet_free_bytes(p);
-        free(p);
+        if (!p->arena) {
+            free(p);
+        }
     }
 }
 
-packet_set *packet_set_new(delegate_id count)
+void packet_buffer_init(packet_buffer * b, int fd)
 {
-    packet_set *p = malloc(sizeof(packet_set));
-    if (!p) {
+    b->bytes = 0;
+    b->allocated = 0;
+    packet_buffer_attach(b, fd);
+}
+
+void packet_buffer_attach(packet_buffer * b, int fd)
+{
+    b->fd = fd;
+    b->start = 0;
+    b->size = 0;
+    b->ready = 0;
+}
+
+void packet_buffer_free(packet_buffer * b)
+{
+    free(b->bytes);
+    packet_buffer_init(b, -1);
+}
+
+/**
+ * Measure the whole packet, if any, at the start of a buffer's unread
+ * bytes.
+ *
+ * @param[in] b the buffer
+ * @param[in] header_size bytes needed to know the size of a packet
+ * @param[in] packet_size gives the size of a packet from its header
+ * @param[out] needed bytes needed to get any further
+ * @return the size of the packet, or 0 if it isn't all there yet
+ */
+static int packet_buffer_whole(packet_buffer * b, int header_size,
+                               int (*packet_size) (const char *),
+                               int *needed)
+{
+    int unread = b->size - b->start;
+
+    *needed = header_size;
+    if (unread < header_size) {
         return 0;
     }
-    p->count = 0;
-    p->packets = malloc(sizeof(packet) * count);
-    if (!p->packets) {
-        packet_set_delete(p);
-        return 0;
+    *needed = packet_size(b->bytes + b->start);
+    return (unread >= *needed) ? *needed : 0;
+}
+
+/**
+ * Make room in a buffer for a packet of a given size, along with a
+ * reasonable amount to read after what's already been received.
+ *
+ * @param[in,out] b the buffer
+ * @param[in] needed bytes needed from the first unread byte
+ * @return 1 on success, 0 on failure
+ */
+static int packet_buffer_reserve(packet_buffer * b, int needed)
+{
+    int unread = b->size - b->start;
+    int wanted = unread + PACKET_BUFFER_READ_SIZE;
+    if (wanted < needed) {
+        wanted = needed;
+    }
+
+    if (b->allocated - b->start >= wanted) {
+        return 1;
+    }
+    if (b->start > 0) {
+        memmove(b->bytes, b->bytes + b->start, unread);
+        b->start = 0;
+        b->size = unread;
+    }
+    if (b->allocated < wanted) {
+        char *bytes = realloc(b->bytes, wanted);
+        if (!bytes) {
+            return 0;
+        }
+        b->bytes = bytes;
+        b->allocated = wanted;
+    }
+    return 1;
+}
+
+packet_status packet_buffer_read(packet_buffer * b, int header_size,
+                                 int (*packet_size) (const char *),
+                                 packet * p)
+{
+    int needed;
+    int whole;
+
+    /* the packets read before are finished with */
+    if (b->start == b->size) {
+        b->start = 0;
+        b->size = 0;
+    }
+
+    while (!(whole = packet_buffer_whole(b, header_size, packet_size,
+                                         &needed))) {
+        b->ready = 0;
+        if (!packet_buffer_reserve(b, needed)) {
+            return PACKET_ERROR;
+        }
+
+        ssize_t len = uring_read(b->fd, b->bytes + b->size,
+                                 b->allocated - b->size);
+        if ((len == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            return PACKET_INCOMPLETE;
+        }
+        if (len <= 0) {
+            return (len == 0) ? PACKET_EOF : PACKET_ERROR;
+        }
+        b->size += len;
+    }
+
+    p->bytes = b->bytes + b->start;
+    p->allocated = 0;
+    p->size = whole;
+    b->start += whole;
+    b->ready = packet_buffer_whole(b, header_size, packet_size, &needed) > 0;
+    return PACKET_COMPLETE;
+}
+
+void packet_queue_init(packet_queue * q, int fd)
+{
+    q->packets = 0;
+    q->allocated = 0;
+    q->count = 0;
+    packet_queue_attach(q, fd);
+}
+
+void packet_queue_attach(packet_queue * q, int fd)
+{
+    for (int i = 0; i < q->count; ++i) {
+        packet_delete(q->packets[q->first + i]);
+    }
+    q->fd = fd;
+    q->first = 0;
+    q->count = 0;
+    q->sent = 0;
+    q->size = 0;
+}
+
+void packet_queue_free(packet_queue * q)
+{
+    packet_queue_attach(q, -1);
+    free(q->packets);
+    packet_queue_init(q, -1);
+}
+
+int packet_queue_add(packet_queue * q, packet * p)
+{
+    if (!p->size) {
+        packet_delete(p);
+        return 1;
+    }
+
+    if (q->first + q->count == q->allocated) {
+        if (q->first > 0) {
+            memmove(q->packets, q->packets + q->first,
+                    sizeof(packet *) * q->count);
+            q->first = 0;
+        } else {
+            int allocated = q->allocated ? q->allocated * 2 : 16;
+            packet **packets = realloc(q->packets,
+                                       sizeof(packet *) * allocated);
+            if (!packets) {
+                return 0;
+            }
+            q->packets = packets;
+            q->allocated = allocated;
+        }
     }
+
+    q->packets[q->first + q->count] = p;
+    ++q->count;
+    q->size += p->size;
+    return 1;
+}
+
+/**
+ * Delete the packets a write has finished with.
+ *
+ * @param[in,out] q the queue
+ * @param[in] written bytes written
+ */
+static void packet_queue_consume(packet_queue * q, ssize_t written)
+{
+    q->size -= written;
+    while (written > 0) {
+        packet *p = q->packets[q->first];
+        int unsent = p->size - q->sent;
+
+        if (written < unsent) {
+            q->sent += written;
+            break;
+        }
+        written -= unsent;
+        q->sent = 0;
+        packet_delete(p);
+        ++q->first;
+        --q->count;
+    }
+    if (!q->count) {
+        q->first = 0;
+    }
+}
+
+/**
+ * Hold back (or let go) partial segments while a flush is in progress.
+ *
+ * @param[in] fd the connection's file descriptor
+ * @param[in] on 1 to cork, 0 to uncork
+ * @return 1 if the connection was (un)corked; 0 otherwise.
+ */
+static short packet_queue_cork(int fd, int on)
+{
+#ifdef TCP_CORK
+    int saved_errno = errno;
+    int ok = setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0;
+    errno = saved_errno;
+    return ok;
+#else
+    return 0;
+#endif
+}
+
+packet_status packet_queue_flush(packet_queue * q)
+{
+    packet_status status = PACKET_COMPLETE;
+    short corked = (q->count > PACKET_QUEUE_IOVECS)
+        && packet_queue_cork(q->fd, 1);
+
+    while (q->count) {
+        struct iovec iov[PACKET_QUEUE_IOVECS];
+        int n;
+
+        for (n = 0; (n < q->count) && (n < PACKET_QUEUE_IOVECS); ++n) {
+            packet *p = q->packets[q->first + n];
+            iov[n].iov_base = p->bytes;
+            iov[n].iov_len = p->size;
+        }
+        iov[0].iov_base = (char *)iov[0].iov_base + q->sent;
+        iov[0].iov_len -= q->sent;
+
+        ssize_t len = writev(q->fd, iov, n);
+        if ((len == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            status = PACKET_INCOMPLETE;
+            break;
+        }
+        if (len <= 0) {
+            status = PACKET_ERROR;
+            break;
+        }
+        packet_queue_consume(q, len);
+    }
+
+    if (corked) {
+        packet_queue_cork(q->fd, 0);
+    }
+    return status;
+}
+
+packet_set *packet_set_new(delegate_id count)
+{
+    packet_set *p = packet_arena_allocate(sizeof(packet_set));
+    packet *packets = p ? packet_arena_allocate(sizeof(packet) * count) : 0;
+    if (packets) {
+        p->arena = 1;
+    } else {
+        p = malloc(sizeof(packet_set));
+        if (!p) {
+            return 0;
+        }
+        p->arena = 0;
+        p->count = 0;
+        packets = malloc(sizeof(packet) * count);
+        if (!packets) {
+            packet_set_delete(p);
+            return 0;
+        }
+    }
+    p->packets = packets;
     p->count = count;
     for (int i = 0; i < p->count; ++i) {
         packet_initialize(&p->packets[i]);
+        p->packets[i].arena = 0;
     }
     return p;
 }
@@ -97,9 +538,13 @@ void packet_set_delete(packet_set * p)
             for (int i = 0; i < p->count; ++i) {
                 packet_free_bytes(&p->packets[i]);
             }
-            free(p->packets);
+            if (!p->arena) {
+                free(p->packets);
+            }
             p->count = 0;
         }
-        free(p);
+        if (!p->arena) {
+            free(p);
+        }
     }
 }
@@ -9,6 +9,10 @@
  *
  * A 'packet' in pdb is the unit of communication. These functions are for
  * dealing with packets in the abstract.
+ *
+ * Packets which only last for a single conversation, and packet sets, can
+ * be allocated from an arena instead of the heap: see packet_arena_set().
+ * They're all freed together when the arena is reset.
  */
 
 /**
@@ -16,16 +20,53 @@
  */
 typedef struct {
     char *bytes;   /**< actual contents of the packet */
-    int allocated; /**< current allocated byte count */
+    int allocated; /**< current allocated byte count; 0 for a slice, or
+                        for bytes in an arena */
     int size;      /**< current used byte count */
+    short arena;   /**< the packet itself belongs to an arena */
 } packet;
 
+/**
+ * Memory for packets which are all finished with at once.
+ */
+typedef struct packet_arena packet_arena;
+
+/**
+ * Bytes received on a connection but not yet read as packets. Each refill
+ * takes as much as the connection has, and as many packets are read out of
+ * it as it holds. Those packets are slices of the buffer, not copies: they
+ * stay valid until the next read from the same buffer.
+ */
+typedef struct {
+    int fd;
+    char *bytes;
+    int start;     /**< first byte not yet read as part of a packet */
+    int size;      /**< one past the last byte received */
+    int allocated;
+    short ready;   /**< holds a whole packet, so don't wait to read it */
+} packet_buffer;
+
+/**
+ * Packets waiting to be written to a connection, in order. Queued packets
+ * are gathered into as few writes as possible (see writev(2)).
+ */
+typedef struct {
+    int fd;
+    packet **packets;
+    int first;     /**< index of the first packet not yet all written */
+    int count;     /**< packets queued from first */
+    int allocated; /**< room in packets */
+    int sent;      /**< bytes of the first packet already written */
+    int size;      /**< bytes queued and not yet written */
+} packet_queue;
+
 /**
  * A set of packets received by delegates.
  */
 typedef struct {
     packet *packets; /**< list of packets in the set */
     int count;       /**< count of packets in the set */
+    short arena;     /**< the set belongs to an arena */
 } packet_set;
 
 /**
@@ -41,7 +82,7 @@ typedef enum {
 /**
  * packet reader function type.
  */
-typedef packet_status(*packet_reader) (int, packet *);
+typedef packet_status(*packet_reader) (packet_buffer *, packet *);
 
 /**
  * packet writer function type.
@@ -63,6 +104,41 @@ packet *packet_new();
  */
 packet *packet_copy(packet * p);
 
+/**
+ * Allocate a new packet object which only has to last until this thread's
+ * arena is reset, from the arena if there is one.
+ *
+ * @return freshly allocated packet, initialized to empty
+ */
+packet *packet_new_temporary(void);
+
+/**
+ * Allocate a packet of a given size, which only has to last until this
+ * thread's arena is reset. Large payloads come from the heap instead.
+ *
+ * @param[in] size the number of bytes
+ * @return freshly allocated packet, of uninitialized bytes
+ */
+packet *packet_allocate_temporary(int size);
+
+/**
+ * Create a copy of a packet which only has to last until this thread's
+ * arena is reset. Large payloads are copied to the heap instead.
+ *
+ * @param[in] p original packet
+ * @return freshly allocated packet, initialized to be identical to original
+ */
+packet *packet_copy_temporary(packet * p);
+
+/**
+ * Make a packet a slice of another packet's bytes rather than a copy of
+ * them, so that it's only valid for as long as the original is.
+ *
+ * @param[out] slice an empty packet
+ * @param[in] p the original packet
+ */
+void packet_slice(packet * slice, packet * p);
+
 /**
  * Delete a packet
  *
@@ -71,7 +147,125 @@ packet *packet_copy(packet * p);
 void packet_delete(packet * p);
 
 /**
- * Allocate a new packet set.
+ * Initialize a receive buffer for a connection (or none, with fd -1).
+ *
+ * @param[out] b the buffer
+ * @param[in] fd the connection's file descriptor
+ */
+void packet_buffer_init(packet_buffer * b, int fd);
+
+/**
+ * Switch a receive buffer to another connection (or none, with fd -1),
+ * throwing away anything it holds.
+ *
+ * @param[in,out] b the buffer
+ * @param[in] fd the connection's file descriptor
+ */
+void packet_buffer_attach(packet_buffer * b, int fd);
+
+/**
+ * Free a receive buffer's memory; it's left initialized, without a
+ * connection.
+ *
+ * @param[in,out] b the buffer
+ */
+void packet_buffer_free(packet_buffer * b);
+
+/**
+ * Read the next packet from a receive buffer, refilling it from the
+ * connection if need be. Whatever was read from the buffer before is
+ * finished with.
+ *
+ * @param[in,out] b the buffer
+ * @param[in] header_size bytes needed to know the size of a packet
+ * @param[in] packet_size gives the size of a packet (header included)
+ * from its header
+ * @param[out] p empty packet, made a slice of the buffer once complete
+ * @return as for a packet_reader; p is only changed on PACKET_COMPLETE
+ */
+packet_status packet_buffer_read(packet_buffer * b, int header_size,
+                                 int (*packet_size) (const char *),
+                                 packet * p);
+
+/**
+ * Initialize a send queue for a connection (or none, with fd -1).
+ *
+ * @param[out] q the queue
+ * @param[in] fd the connection's file descriptor
+ */
+void packet_queue_init(packet_queue * q, int fd);
+
+/**
+ * Switch a send queue to another connection (or none, with fd -1), deleting
+ * any packets still queued.
+ *
+ * @param[in,out] q the queue
+ * @param[in] fd the connection's file descriptor
+ */
+void packet_queue_attach(packet_queue * q, int fd);
+
+/**
+ * Free a send queue's memory, along with any packets still queued; it's
+ * left initialized, without a connection.
+ *
+ * @param[in,out] q the queue
+ */
+void packet_queue_free(packet_queue * q);
+
+/**
+ * Queue a packet to be sent. On success the queue owns the packet, and
+ * deletes it once it has been written.
+ *
+ * @param[in,out] q the queue
+ * @param[in] p a packet which isn't a slice
+ * @return 1 on success, 0 on failure
+ */
+int packet_queue_add(packet_queue * q, packet * p);
+
+/**
+ * Write as much of a send queue as the connection will take without
+ * blocking. A flush too big for a single write is corked, where TCP_CORK is
+ * available, so that the packets still go out in full segments.
+ *
+ * @param[in,out] q the queue
+ * @return PACKET_COMPLETE once the queue is empty, PACKET_INCOMPLETE if the
+ * connection can't take any more yet, or PACKET_ERROR on failure
+ */
+packet_status packet_queue_flush(packet_queue * q);
+
+/**
+ * Allocate a new arena.
+ *
+ * @return freshly allocated, empty, arena, or 0 on failure
+ */
+packet_arena *packet_arena_new(void);
+
+/**
+ * Free everything allocated from an arena, keeping some of its memory to
+ * allocate from again.
+ *
+ * @param[in,out] a an arena
+ */
+void packet_arena_reset(packet_arena * a);
+
+/**
+ * Delete an arena, along with everything allocated from it.
+ *
+ * @param[in,out] a an arena
+ */
+void packet_arena_delete(packet_arena * a);
+
+/**
+ * Choose the arena which this thread's temporary packets and packet sets
+ * are allocated from.
+ *
+ * @param[in] a an arena, or 0 to use the heap
+ */
+void packet_arena_set(packet_arena * a);
+
+/**
+ * Allocate a new packet set, from this thread's arena if there is one; a
+ * set only lasts for a single round of replies or commands.
  *
  * @param[in] delegate_count the number of packets to be contained in the set.
  * @return freshly allocated packet set of 'count' empty packets
@@ -1,4 +1,5 @@
 /* system includes */
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -76,6 +77,7 @@ static int pdb_initialize(cfg_t * configuration)
 
 static component *pdb_subcomponents[] = {
     SUBCOMPONENT(log),
+    SUBCOMPONENT(concurrency),
     SUBCOMPONENT(server),
     SUBCOMPONENT_END()
 };
@@ -87,6 +89,76 @@ static component pdb_component = {
     pdb_subcomponents
 };
 
+/**
+ * Create a socket listening on the configured port.
+ *
+ * @param[in] reuse_port 1 if other sockets will share the port; 0 otherwise
+ * @return the socket, or -1 on failure (after reporting the error)
+ */
+static int listen_socket(short reuse_port)
+{
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        daemon_error("can't create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int one = 1;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one,
+                   sizeof(one)) == -1) {
+        daemon_error("can't set reuseaddr: %s\n", strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+
+    if (reuse_port) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, (char *)&one,
+                       sizeof(one)) == -1) {
+            daemon_error("can't set reuseport: %s\n", strerror(errno));
+            close(socket_fd);
+            return -1;
+        }
+#else
+        daemon_error("can't set reuseport: not supported\n");
+        close(socket_fd);
+        return -1;
+#endif
+    }
+
+    struct sockaddr_in bind_addr;
+    bind_addr.sin_family = AF_INET;
+    bind_addr.sin_port = htons(listen_port);
+    bind_addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(socket_fd, (struct sockaddr *)&bind_addr,
+             sizeof(bind_addr)) == -1) {
+        daemon_error("can't bind socket: %s\n", strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+
+    if (listen(socket_fd, listen_qdepth) == -1) {
+        daemon_error("can't listen to socket: %s\n", strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+/**
+ * Close listening sockets.
+ *
+ * @param[in] socket_fds the sockets
+ * @param[in] count the number of sockets
+ */
+static void listen_close(int *socket_fds, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        close(socket_fds[i]);
+    }
+    free(socket_fds);
+}
+
 int main(int argc, char **argv)
 {
     char *configuration_filename = 0;
@@ -121,55 +193,57 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    /* set up network for listening */
-    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd == -1) {
-        daemon_error("can't create socket: %s\n", strerror(errno));
+    /* set up network for listening: usually a single socket, but one per
+       thread when each thread accepts for itself */
+    int socket_count = concurrency_listen_sockets();
+    int *socket_fds = malloc(sizeof(int) * socket_count);
+    if (!socket_fds) {
+        daemon_error("can't allocate sockets: %s\n", strerror(errno));
         exit(1);
     }
-
-    int one = 1;
-    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one,
-                   sizeof(one)) == -1) {
-        daemon_error("can't set reuseaddr: %s\n", strerror(errno));
-        close(socket_fd);
-        exit(1);
+    for (int i = 0; i < socket_count; ++i) {
+        socket_fds[i] = listen_socket(socket_count > 1);
+        if (socket_fds[i] == -1) {
+            listen_close(socket_fds, i);
+            exit(1);
+        }
     }
+    int socket_fd = socket_fds[0];
 
-    struct sockaddr_in bind_addr;
-    bind_addr.sin_family = AF_INET;
-    bind_addr.sin_port = htons(listen_port);
-    bind_addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(socket_fd, (struct sockaddr *)&bind_addr,
-             sizeof(bind_addr)) == -1) {
-        daemon_error("can't bind socket: %s\n", strerror(errno));
-        close(socket_fd);
-        exit(1);
-    }
+    lo(LOG_DEBUG, "pdb: booting...");
 
-    if (listen(socket_fd, listen_qdepth) == -1) {
-        daemon_error("can't listen to socket: %s\n", strerror(errno));
-        close(socket_fd);
-        exit(1);
+    /* keyed statements go everywhere until the maps are read */
+    if (!server_load_maps()) {
+        lo(LOG_ERROR, "pdb: unable to read the partition maps");
     }
 
-    lo(LOG_DEBUG, "pdb: booting...");
-
     daemon_done();
 
-    concurrency_setup();
+    if (!concurrency_setup(socket_fds, server, server_multiplex)) {
+        lo(LOG_ERROR, "pdb: unable to set up concurrency: %s",
+           strerror(errno));
+        concurrency_teardown();
+        listen_close(socket_fds, socket_count);
+        component_unconfigure(&pdb_component);
+        exit(1);
+    }
 
     /* set up signal handling */
     signal(SIGTERM, sigterm_handler);
     signal(SIGCHLD, sigchld_handler);
 
-    /* wait for connections; child processes handle each connection */
+    /* wait for connections; child processes handle each connection. When
+       the children accept for themselves, a negative fd makes poll() simply
+       wait for a signal. */
     dead = 0;
     lo(LOG_INFO, "pdb: entering main loop");
     while (!dead) {
         struct pollfd socket_poll;
 
-        socket_poll.fd = socket_fd;
+        socket_poll.fd = -1;
+        if (concurrency_parent_accepts()) {
+            socket_poll.fd = socket_fd;
+        }
         socket_poll.events = POLLIN;
         socket_poll.revents = 0;
 
@@ -179,15 +253,18 @@ int main(int argc, char **argv)
 
         if (r > 0) {
             struct sockaddr_in connection_addr;
-            socklen_t connection_addr_length;
+            socklen_t connection_addr_length = sizeof(connection_addr);
             int connection_fd =
                 accept(socket_fd, (struct sockaddr *)&connection_addr,
                        &connection_addr_length);
 
             if (connection_fd > 0) {
+                struct timeval accepted;
+                gettimeofday(&accepted, NULL);
+
                 int child = concurrency_handle_connection(connection_fd,
                                                           &connection_addr,
-                                                          server);
+                                                          &accepted);
                 if (child == -1) {
                     lo(LOG_ERROR, "pdb: unable to handle connection: %s",
                        strerror(errno));
@@ -203,7 +280,7 @@ int main(int argc, char **argv)
 
     lo(LOG_INFO, "pdb: done.");
 
-    close(socket_fd);
+    listen_close(socket_fds, socket_count);
     component_unconfigure(&pdb_component);
     exit(0);
 }
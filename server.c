@@ -1,58 +1,126 @@
 /* system includes */
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <unistd.h>
 
 /* project includes */
 #include "db_driver.h"
 #include "delegate.h"
+#include "event.h"
 #include "log.h"
 #include "map.h"
 #include "server.h"
 #include "sql.h"
 
 /**
- * Synchronously send a single reply.
- *
- * @param[in] fd connected file descriptor
- * @param[in] p packet to send
- * @param[in] put_packet function to use to send packet
- * @return 0 on success, -1 on failure
+ * Where a multiplexed session is up to.
  */
-static int send_reply(int fd, packet * p, packet_writer put_packet)
-{
-    int sent = 0;
-    packet_status status;
+typedef enum {
+    SESSION_CONNECTING,
+    SESSION_READING_COMMAND,
+    SESSION_ACQUIRING,
+    SESSION_PUTTING_COMMAND,
+    SESSION_GETTING_REPLIES,
+    SESSION_SENDING_REPLIES,
+    SESSION_FINISHED
+} session_state;
 
-    do {
-        status = put_packet(fd, p, &sent);
-    } while (status == PACKET_INCOMPLETE);
+/**
+ * Which half of a conversation a multiplexed session should continue with.
+ */
+typedef enum {
+    SESSION_PHASE_COMMANDS,
+    SESSION_PHASE_REPLIES
+} session_phase;
 
-    if (status == PACKET_ERROR) {
-        return -1;
-    }
+typedef struct session_struct session;
+typedef struct multiplexer_struct multiplexer;
 
-    return 0;
-}
+/** session_source id of the client connection */
+#define SESSION_SOURCE_CLIENT -1
+
+/**
+ * A file descriptor belonging to a multiplexed session: the client
+ * connection or the connection to one of the delegates.
+ */
+typedef struct {
+    session *s;
+    int id;       /**< delegate_id, or SESSION_SOURCE_CLIENT */
+    int fd;       /**< registered file descriptor, or -1 */
+    short events; /**< currently registered interest */
+} session_source;
+
+/**
+ * Everything about a single client connection.
+ */
+struct session_struct {
+    int fd;
+    packet_buffer in;         /**< received from the client, not yet read */
+    packet_queue out;         /**< replies not yet sent to the client */
+    packet_arena *arena;      /**< the current conversation's packets */
+    struct timeval accepted;
+    short first_byte_sent;
+
+    delegate_filter_result *command_delegate_mask;
+    delegate_filter put_filters[2];
+    delegate_filter get_filters[3];
+    delegate_filter release_filters[2];
+    short logged_in;          /**< client has sent its login */
+    void *driver_session;
+    delegate_session *delegates;
+
+    /* the rest is only used when multiplexing */
+    multiplexer *m;
+    session_state state;
+    session_source *sources;
+    packet *command;
+    session_phase after_reply;
+    session *next_finished;
+    short woken;
+    session *next_woken;
+};
+
+/**
+ * The sessions being multiplexed by a single event loop.
+ */
+struct multiplexer_struct {
+    event_set *events;
+    int live;
+    session *finished;
+    session *woken;           /**< sessions given a pooled connection, or
+                                   with input waiting in a buffer */
+};
+
+/** queued replies are sent once there are this many bytes of them */
+#define REPLY_BATCH_SIZE 65536
+
+/** the session currently being worked on by this thread */
+static __thread session *current = 0;
 
 /**
  * Synchronously read a single command.
  *
- * @param[in] fd a connected file descriptor
- * @param[in,out] p packet buffer to fill
+ * @param[in,out] in the client's receive buffer
+ * @param[out] p packet to fill
  * @param[in] get_packet function to use to read packet
  * @return 0 on success, -1 on failure
  */
-static int read_command(int fd, packet * p, packet_reader get_packet)
+static int read_command(packet_buffer * in, packet * p,
+                        packet_reader get_packet)
 {
     short read_complete = 0;
     p->bytes = 0;
 
     while (!read_complete) {
-        switch (get_packet(fd, p)) {
+        switch (get_packet(in, p)) {
         case PACKET_EOF:
         case PACKET_ERROR:
             return -1;
@@ -68,244 +136,1717 @@ static int read_command(int fd, packet * p, packet_reader get_packet)
     return 0;
 }
 
-static delegate_filter_result *command_delegate_mask;
-static delegate_filter_result command_delegate_filter(delegate_id id)
+/**
+ * Log the time between accepting a connection and sending the first byte
+ * back to the client.
+ *
+ * @param[in] accepted time at which the connection was accepted
+ */
+static void report_first_byte(struct timeval *accepted)
 {
-    return command_delegate_mask[id];
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    long latency = (now.tv_sec - accepted->tv_sec) * 1000000L +
+        (now.tv_usec - accepted->tv_usec);
+    lo(LOG_INFO, "server: accept-to-first-byte latency %ld usec", latency);
 }
-static void command_delegate_init(void)
+
+/**
+ * Synchronously send every reply queued for the client.
+ *
+ * @param[in,out] s the session
+ * @return 0 on success, -1 on failure
+ */
+static int send_replies(session * s)
 {
-    command_delegate_mask = malloc(sizeof(short) * delegate_get_count());
-    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
-        command_delegate_mask[i] = DELEGATE_FILTER_USE;
+    packet_status status;
+
+    do {
+        status = packet_queue_flush(&s->out);
+    } while (status == PACKET_INCOMPLETE);
+
+    if (status == PACKET_ERROR) {
+        return -1;
+    }
+
+    if (!s->first_byte_sent) {
+        report_first_byte(&s->accepted);
+        s->first_byte_sent = 1;
     }
+    return 0;
+}
+
+static delegate_filter_result command_delegate_filter(delegate_id id)
+{
+    return current->command_delegate_mask[id];
 }
 static void command_delegate_all(void)
 {
     for (delegate_id i = 0; i < delegate_get_count(); ++i) {
-        command_delegate_mask[i] = DELEGATE_FILTER_USE;
+        current->command_delegate_mask[i] = DELEGATE_FILTER_USE;
     }
 }
 static void command_delegate_master(void)
 {
     for (delegate_id i = 0; i < delegate_get_count(); ++i) {
         if (i == delegate_master_id()) {
-            command_delegate_mask[i] = DELEGATE_FILTER_USE;
+            current->command_delegate_mask[i] = DELEGATE_FILTER_USE;
         } else {
-            command_delegate_mask[i] = DELEGATE_FILTER_DONT_USE;
+            current->command_delegate_mask[i] = DELEGATE_FILTER_DONT_USE;
         }
     }
 }
-static void command_delegate_random_partition(void)
+static void command_delegate_connected(void)
+{
+    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
+        if (delegate_fd(i) != -1) {
+            current->command_delegate_mask[i] = DELEGATE_FILTER_USE;
+        } else {
+            current->command_delegate_mask[i] = DELEGATE_FILTER_DONT_USE;
+        }
+    }
+}
+static void command_delegate_connected_or_master(void)
+{
+    command_delegate_connected();
+    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
+        if (current->command_delegate_mask[i] == DELEGATE_FILTER_USE) {
+            return;
+        }
+    }
+    command_delegate_master();
+}
+static void command_delegate_partitions(void)
+{
+    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
+        if (i == delegate_master_id()) {
+            current->command_delegate_mask[i] = DELEGATE_FILTER_DONT_USE;
+        } else {
+            current->command_delegate_mask[i] = DELEGATE_FILTER_USE;
+        }
+    }
+}
+static int command_delegate_count(void)
+{
+    int used = 0;
+
+    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
+        used += current->command_delegate_mask[i] == DELEGATE_FILTER_USE;
+    }
+    return used;
+}
+static void command_delegate_none(void)
+{
+    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
+        current->command_delegate_mask[i] = DELEGATE_FILTER_DONT_USE;
+    }
+}
+static delegate_id random_partition(void)
 {
     delegate_id random_id;
     do {
         /* Flawfinder: ignore random */
         random_id = random() % delegate_get_count();
     } while (random_id == delegate_master_id());
+    return random_id;
+}
+static void command_delegate_random_partition(void)
+{
+    delegate_id random_id = random_partition();
 
     for (delegate_id i = 0; i < delegate_get_count(); ++i) {
         if (i == random_id) {
-            command_delegate_mask[i] = DELEGATE_FILTER_USE;
+            current->command_delegate_mask[i] = DELEGATE_FILTER_USE;
         } else {
-            command_delegate_mask[i] = DELEGATE_FILTER_DONT_USE;
+            current->command_delegate_mask[i] = DELEGATE_FILTER_DONT_USE;
         }
     }
 }
 
-void server(int fd, struct sockaddr_in *addr)
+/**
+ * Route a command to the delegates holding the partitions of the ranges
+ * which each bounded alternative's bounds leave values in.
+ *
+ * @param[in] route the command's route
+ * @return 1 if the key has a range map; 0 otherwise.
+ */
+static int command_delegate_bounds(sql_route * route)
 {
-    delegate_filter put_filters[] = { command_delegate_filter, 0 };
-    delegate_filter get_filters[] =
-        { command_delegate_filter, db_driver_delegate_filter, 0 };
+    int map = map_find_ranges(route->key);
 
-    command_delegate_init();
+    if (map < 0) {
+        return 0;
+    }
+    for (int i = 0; i < route->bound_count;) {
+        int alternative = route->bounds[i].alternative;
+        int first = 0;
+        int last = map_range_count(map) - 1;
 
-    if (!db_driver_initialize(delegate_get_count())) {
-        lo(LOG_ERROR, "server: error initializing database driver");
-        return;
+        for (; (i < route->bound_count)
+             && (route->bounds[i].alternative == alternative); ++i) {
+            map_narrow(map, route->bounds[i].value, route->bounds[i].upper,
+                       route->bounds[i].exclusive, &first, &last);
+        }
+        for (int range = first; range <= last; ++range) {
+            int partition_id = map_range_partition(map, range);
+            int id = delegate_partition(partition_id);
+
+            if (id < 0) {
+                lo(LOG_ERROR, "server: no delegate holds partition %d",
+                   partition_id);
+                return 0;
+            }
+            current->command_delegate_mask[id] = DELEGATE_FILTER_USE;
+        }
     }
+    return 1;
+}
 
-    /* establish network-level connections to all delegate databases */
-    if (delegate_connect() == -1) {
-        lo(LOG_ERROR, "server: error connecting to a delegate: %s",
-           strerror(errno));
-        return;
+/**
+ * Route a command to the delegates holding its keys' partitions, and those
+ * of the ranges its bounds leave values in.
+ *
+ * @param[in] route the command's route
+ * @return each key's delegate (which the caller must free) if every key is
+ * in a map, or is a new key of an INSERT or REPLACE (whose rows all go to a
+ * single partition, picked at random), and there's a range map for any
+ * bounds; 0 otherwise, with no delegate chosen
+ */
+static int *command_delegate_keys(sql_route * route)
+{
+    int *owners = malloc(sizeof(int) * (route->key_count + 1));
+    if (!owners) {
+        return 0;
     }
 
-    /* loop over conversation between client and delegates */
-    while (!db_driver_done()) {
-        /* read commands and delegate them */
-        while (db_driver_expect_commands()) {
-            packet *in_command = packet_new();
-            if (!in_command) {
-                lo(LOG_ERROR, "server: out of memory!");
-                delegate_disconnect();
-                return;
-            }
+    short inserting = (route->statement == SQL_STATEMENT_INSERT)
+        || (route->statement == SQL_STATEMENT_REPLACE);
+    int chosen = -1;
 
-            lo(LOG_DEBUG, "server: waiting for next command...");
-            if (read_command(fd, in_command, db_driver_get_packet) == -1) {
-                if ((errno != ECONNRESET) && (errno != EINPROGRESS)) {
-                    lo(LOG_ERROR, "server: error reading command: %s",
-                       strerror(errno));
-                } else {
-                    lo(LOG_DEBUG, "server: client went away");
-                }
-                packet_delete(in_command);
-                delegate_disconnect();
-                return;
+    command_delegate_none();
+    for (int i = 0; i < route->key_count; ++i) {
+        int partition_id;
+
+        if (!map_partition(route->key, route->keys[i], &partition_id)) {
+            /* a new key's row goes to any partition, the same one as the
+               statement's other new keys' */
+            if (!inserting) {
+                free(owners);
+                return 0;
             }
+            if (chosen < 0) {
+                chosen = random_partition();
+            }
+            owners[i] = chosen;
+            current->command_delegate_mask[owners[i]] = DELEGATE_FILTER_USE;
+            continue;
+        }
+        owners[i] = delegate_partition(partition_id);
+        if (owners[i] < 0) {
+            lo(LOG_ERROR, "server: no delegate holds partition %d",
+               partition_id);
+            free(owners);
+            return 0;
+        }
+        current->command_delegate_mask[owners[i]] = DELEGATE_FILTER_USE;
+    }
+    if (route->bound_count && !command_delegate_bounds(route)) {
+        free(owners);
+        return 0;
+    }
 
-            /* default is to proxy command to all delegates */
-            command_delegate_all();
+    /* bounds no value meets still need an answer (of no rows) */
+    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
+        if (current->command_delegate_mask[i] == DELEGATE_FILTER_USE) {
+            return owners;
+        }
+    }
+    command_delegate_random_partition();
+    return owners;
+}
 
-            switch (db_driver_command(in_command)) {
-            case DB_DRIVER_COMMAND_TYPE_SQL:
-                {
-                    char *sql = db_driver_sql_extract(in_command);
-                    if (!sql) {
-                        lo(LOG_ERROR, "server: error extracting SQL");
-                        packet_delete(in_command);
-                        delegate_disconnect();
-                        return;
-                    }
-
-                    lo(LOG_DEBUG, "server: query '%s'", sql);
-
-                    switch (sql_get_type(sql)) {
-                    case SQL_TYPE_MASTER:
-                        command_delegate_master();
-                        break;
-                    case SQL_TYPE_PARTITIONED:
-                        {
-                            long *foo = sql_get_map_keys(sql);
-                            if (foo) {
-                            } else {
-                                lo(LOG_INFO,
-                                   "server: XX: not doing the right thing");
-                                command_delegate_all();
-                            }
-                            break;
-                        }
-                    }
-
-                    free(sql);
-                    break;
-                }
-            case DB_DRIVER_COMMAND_TYPE_TABLE_META:
-                {
-                    char *table = db_driver_table_extract(in_command);
-                    if (!table) {
-                        lo(LOG_ERROR, "server: error extracting table");
-                        packet_delete(in_command);
-                        delegate_disconnect();
-                        return;
-                    }
-
-                    lo(LOG_ERROR, "server: table '%s'", table);
-
-                    switch (sql_get_table_type(table)) {
-                    case SQL_TABLE_TYPE_MASTER:
-                        command_delegate_master();
-                        break;
-                    case SQL_TABLE_TYPE_PARTITIONED:
-                        command_delegate_random_partition();
-                        break;
-                    }
-
-                    free(table);
-                    break;
-                }
-            case DB_DRIVER_COMMAND_TYPE_UNSUPPORTED:
-                {
-                    lo(LOG_ERROR, "server: got unsupported command");
-                    packet_delete(in_command);
-                    delegate_disconnect();
-                    return;
-                }
-            case DB_DRIVER_COMMAND_TYPE_OTHER:
-                break;
-            };
+/**
+ * When a statement's keys are on several delegates, send each of them the
+ * statement cut down to its own keys, where the statement lists them (see
+ * sql_route_statement()).
+ *
+ * @param[in] sql the statement
+ * @param[in] route its route
+ * @param[in] owners each key's delegate
+ * @return 1 on success, 0 on failure
+ */
+static int command_delegate_statements(const char *sql, sql_route * route,
+                                       const int *owners)
+{
+    if (command_delegate_count() < 2) {
+        return 1;
+    }
 
-            lo(LOG_DEBUG, "server: delegating command...");
-            if (!delegate_put(put_filters, db_driver_put_packet,
-                              db_driver_rewrite_command, in_command)) {
-                lo(LOG_ERROR, "server: error delegating command");
-                packet_delete(in_command);
-                delegate_disconnect();
-                return;
-            }
+    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
+        char *statement;
 
-            packet_delete(in_command);
+        if (current->command_delegate_mask[i] != DELEGATE_FILTER_USE) {
+            continue;
         }
+        statement = sql_route_statement(sql, route, owners, i);
+        if (!statement || !db_driver_delegate_sql(i, statement)) {
+            free(statement);
+            return 0;
+        }
+        free(statement);
+    }
+    return 1;
+}
 
-        db_driver_command_done(put_filters);
+/**
+ * Free a session and everything it owns.
+ *
+ * @param[in,out] s the session
+ */
+static void session_delete(session * s)
+{
+    if (s) {
+        if (current == s) {
+            current = 0;
+        }
+        free(s->command_delegate_mask);
+        db_driver_session_delete(s->driver_session);
+        delegate_session_delete(s->delegates);
+        free(s->sources);
+        packet_delete(s->command);
+        packet_buffer_free(&s->in);
+        packet_queue_free(&s->out);
+        packet_arena_delete(s->arena);
+        free(s);
+    }
+}
 
-        /* read replies from delegates, reduce and return them */
-        while (db_driver_expect_replies()) {
-            lo(LOG_DEBUG, "server: waiting for reply...");
+/**
+ * Allocate a new session.
+ *
+ * @return freshly allocated session, or 0 on failure
+ */
+static session *session_new(void)
+{
+    session *s = malloc(sizeof(session));
+    if (!s) {
+        return 0;
+    }
 
-            packet_set *replies = delegate_get(get_filters,
-                                               db_driver_get_packet);
-            if (!replies) {
-                lo(LOG_ERROR, "server: error getting delegate replies");
-                delegate_disconnect();
-                return;
-            }
+    s->fd = -1;
+    packet_buffer_init(&s->in, -1);
+    packet_queue_init(&s->out, -1);
+    s->first_byte_sent = 0;
+    s->m = 0;
+    s->state = SESSION_FINISHED;
+    s->sources = 0;
+    s->command = 0;
+    s->after_reply = SESSION_PHASE_COMMANDS;
+    s->next_finished = 0;
+    s->woken = 0;
+    s->next_woken = 0;
+    s->logged_in = 0;
 
-            /* let the db driver know about each reply packet */
-            for (delegate_id i = 0; i < delegate_get_count(); ++i) {
-                packet *p = packet_set_get(replies, i);
-                if ((p) && (p->size)) {
-                    db_driver_reply(i, p);
-                }
-            }
+    s->put_filters[0] = command_delegate_filter;
+    s->put_filters[1] = 0;
+    s->get_filters[0] = command_delegate_filter;
+    s->get_filters[1] = db_driver_delegate_filter;
+    s->get_filters[2] = 0;
+    s->release_filters[0] = db_driver_delegate_releasable;
+    s->release_filters[1] = 0;
 
-            /* If there's been a driver-level error in at least one
-               delegate, we still have to remain in the while (expecting
-               replies) loop to keep the other delegates' states consistent.
-               The error will be returned to the client afterwards. */
-            if (!db_driver_got_error()) {
-                packet *final_reply = db_driver_reduce_replies(replies);
+    s->command_delegate_mask = malloc(sizeof(delegate_filter_result) *
+                                      delegate_get_count());
+    s->driver_session = db_driver_session_new();
+    s->delegates = delegate_session_new();
+    s->arena = packet_arena_new();
+    if (!s->command_delegate_mask || !s->driver_session || !s->delegates
+        || !s->arena) {
+        session_delete(s);
+        return 0;
+    }
+    return s;
+}
 
-                lo(LOG_DEBUG, "server: returning reply...");
+/**
+ * Make a session the one that the driver, delegate and routing functions
+ * work on.
+ *
+ * @param[in] s the session
+ */
+static void session_activate(session * s)
+{
+    current = s;
+    db_driver_session_set(s->driver_session);
+    delegate_session_set(s->delegates);
+    packet_arena_set(s->arena);
+}
 
-                if (send_reply(fd, final_reply, db_driver_put_packet) == -1) {
-                    lo(LOG_ERROR, "server: error sending reply: %s",
-                       strerror(errno));
-                    packet_set_delete(replies);
-                    packet_delete(final_reply);
-                    delegate_disconnect();
-                    return;
-                }
+/**
+ * Prepare a session for a new connection, and activate it.
+ *
+ * @param[in,out] s the session
+ * @param[in] fd connected file descriptor
+ * @param[in] accepted time at which the connection was accepted
+ * @return 1 on success, 0 on failure
+ */
+static int session_begin(session * s, int fd, struct timeval *accepted)
+{
+    s->fd = fd;
+    packet_buffer_attach(&s->in, fd);
+    packet_queue_attach(&s->out, fd);
+    packet_arena_reset(s->arena);
+    s->accepted = *accepted;
+    s->first_byte_sent = 0;
+    s->logged_in = 0;
 
-                packet_delete(final_reply);
-            }
+    /* replies are batched, so each flush should go out straight away */
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+        lo(LOG_DEBUG, "server: can't set TCP_NODELAY on fd %d: %s", fd,
+           strerror(errno));
+    }
 
-            packet_set_delete(replies);
+    /* the client logs in to the master alone, unless the driver checks
+       logins itself; other delegates are only connected once a command is
+       routed to them */
+    session_activate(s);
+    command_delegate_master();
+
+    if (!db_driver_initialize(delegate_get_count())) {
+        lo(LOG_ERROR, "server: error initializing database driver");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Stop watching a multiplexed session's delegate connections.
+ *
+ * @param[in,out] s the session
+ */
+static void session_unwatch_delegates(session * s)
+{
+    if (!s->sources) {
+        return;
+    }
+    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
+        session_source *source = &s->sources[i + 1];
+        if (source->fd != -1) {
+            event_set_remove(s->m->events, source->fd);
+            source->fd = -1;
+            source->events = 0;
         }
-        if (db_driver_got_error()) {
-            packet *error = db_driver_error_packet();
-            if (send_reply(fd, error, db_driver_put_packet) == -1) {
-                lo(LOG_ERROR, "server: error sending reply: %s",
-                   strerror(errno));
-                packet_delete(error);
-                return;
+    }
+}
+
+/**
+ * Close all of a session's delegate connections.
+ *
+ * @param[in,out] s the session
+ */
+static void session_drop_delegates(session * s)
+{
+    session_unwatch_delegates(s);
+    delegate_disconnect();
+}
+
+/**
+ * Get the value of a parameter of the prepared statement being executed.
+ *
+ * @param[in] command the COM_STMT_EXECUTE
+ * @param[in] n the parameter's number, from 0
+ * @return freshly allocated value, or 0 if it can't be had
+ */
+static char *command_param(void *command, int n)
+{
+    return db_driver_param_extract((packet *) command, n);
+}
+
+/**
+ * Decide which delegates a statement should be sent to, from its SQL.
+ *
+ * @param[in] in_command the command
+ * @param[in] executing 1 if it executes a prepared statement, whose keys
+ * are its parameters' values, which is sent to every delegate as it is, and
+ * whose (binary) result sets can only be concatenated; 0 if it's a query,
+ * whose result sets are merged
+ * @return 1 on success, 0 if there's no SQL to be had
+ */
+static int route_sql(packet * in_command, short executing)
+{
+    char *sql = db_driver_sql_extract(in_command);
+    if (!sql) {
+        lo(LOG_ERROR, "server: error extracting SQL");
+        return 0;
+    }
+
+    lo(LOG_DEBUG, "server: query '%s'", sql);
+
+    sql_merge *merge = 0;
+    sql_route *route = sql_get_plan(sql, executing ? 0 : &merge);
+    int *owners = 0;
+    if (!route) {
+        lo(LOG_ERROR, "server: error routing SQL");
+        free(sql);
+        return 0;
+    }
+    if (executing) {
+        sql_bind_route(sql, route, command_param, in_command);
+    }
+
+    short inserting = (route->statement == SQL_STATEMENT_INSERT)
+        || (route->statement == SQL_STATEMENT_REPLACE);
+
+    /* a pooled connection can't be handed on with state pdb can't replay */
+    if (route->keeps_state) {
+        db_driver_pin_delegates();
+    }
+
+    switch (route->type) {
+    case SQL_TYPE_MASTER:
+        command_delegate_master();
+        break;
+    case SQL_TYPE_PARTITIONED:
+        if (route->partitioned < 0) {
+            /* not DML on a partitioned table alone */
+            command_delegate_all();
+        } else if (!(route->key_count || route->bound_count)
+                   || !(owners = command_delegate_keys(route))) {
+            /* a new key's row goes to any partition, and a key nobody has
+               mapped could be on any of them; nor does a prepared
+               statement's row with no key go to every partition */
+            if (inserting && (route->key_count || executing)) {
+                command_delegate_random_partition();
+            } else {
+                command_delegate_partitions();
             }
-            packet_delete(error);
+        } else {
+            lo(LOG_DEBUG, "server: %d key(s) and %d bound(s) of %s",
+               route->key_count, route->bound_count,
+               route->tables[route->partitioned]);
         }
+        break;
+    }
 
-        lo(LOG_DEBUG, "server: done with this conversation.");
+    /* one delegate's result set is passed on as it is, and those pdb
+       can't merge aren't asked for from several */
+    if (merge && (merge->unmergeable || (command_delegate_count() < 2))) {
+        if (command_delegate_count() > 1) {
+            db_driver_refuse(merge->unmergeable);
+            command_delegate_none();
+        }
+        sql_merge_delete(merge);
+        merge = 0;
     }
 
-    /* teardown all the delegate connections */
+    /* a prepared statement can't be split between delegates, and its
+       binary result sets can't be merged */
+    if (executing && (command_delegate_count() > 1)) {
+        if (inserting && owners) {
+            db_driver_refuse("pdb can't split a prepared statement's rows "
+                             "between partitions");
+            command_delegate_none();
+        } else if (sql_needs_merge(sql)) {
+            db_driver_refuse("pdb can't merge a prepared statement's "
+                             "results from several delegates");
+            command_delegate_none();
+        }
+    }
+
+    /* how the result sets are put back together, if need be */
+    if (!executing) {
+        /* a statement of pdb's own goes to every delegate as it is */
+        short rewritten = merge && merge->statement;
+
+        db_driver_merge(merge);
+        if (owners && route->list_count && !rewritten
+            && !command_delegate_statements(sql, route, owners)) {
+            lo(LOG_ERROR, "server: no memory to split the keys");
+            free(owners);
+            sql_route_delete(route);
+            free(sql);
+            return 0;
+        }
+    }
+
+    free(owners);
+    sql_route_delete(route);
+    free(sql);
+    return 1;
+}
+
+/**
+ * Decide which delegates a command should be sent to.
+ *
+ * @param[in] in_command the command
+ * @return 1 if the command should be delegated, 0 if the connection should
+ * be dropped
+ */
+static int route_command(packet * in_command)
+{
+    /* default is to proxy command to all delegates */
+    command_delegate_all();
+
+    switch (db_driver_command(in_command)) {
+    case DB_DRIVER_COMMAND_TYPE_SQL:
+        return route_sql(in_command, 0);
+    case DB_DRIVER_COMMAND_TYPE_PREPARE:
+        {
+            char *sql = db_driver_sql_extract(in_command);
+            if (!sql) {
+                lo(LOG_ERROR, "server: error extracting SQL");
+                return 0;
+            }
+
+            lo(LOG_DEBUG, "server: preparing '%s'", sql);
+
+            sql_route *route = sql_get_plan(sql, 0);
+            free(sql);
+            if (!route) {
+                lo(LOG_ERROR, "server: error routing SQL");
+                return 0;
+            }
+
+            /* one delegate describes the statement; the others prepare it
+               when it's first executed on them */
+            switch (route->type) {
+            case SQL_TYPE_MASTER:
+                command_delegate_master();
+                break;
+            case SQL_TYPE_PARTITIONED:
+                command_delegate_random_partition();
+                break;
+            }
+
+            sql_route_delete(route);
+            break;
+        }
+    case DB_DRIVER_COMMAND_TYPE_EXECUTE:
+        /* binary rows are only concatenated */
+        return route_sql(in_command, 1);
+    case DB_DRIVER_COMMAND_TYPE_TABLE_META:
+        {
+            char *table = db_driver_table_extract(in_command);
+            if (!table) {
+                lo(LOG_ERROR, "server: error extracting table");
+                return 0;
+            }
+
+            lo(LOG_ERROR, "server: table '%s'", table);
+
+            switch (sql_get_table_type(table)) {
+            case SQL_TABLE_TYPE_MASTER:
+                command_delegate_master();
+                break;
+            case SQL_TABLE_TYPE_PARTITIONED:
+                command_delegate_random_partition();
+                break;
+            }
+
+            free(table);
+            break;
+        }
+    case DB_DRIVER_COMMAND_TYPE_UNSUPPORTED:
+        lo(LOG_ERROR, "server: got unsupported command");
+        return 0;
+    case DB_DRIVER_COMMAND_TYPE_LOGIN:
+        command_delegate_master();
+        current->logged_in = 1;
+        break;
+    case DB_DRIVER_COMMAND_TYPE_QUIT:
+        /* pooled connections outlive the client */
+        if (delegate_pooled()) {
+            command_delegate_none();
+        } else {
+            command_delegate_connected();
+        }
+        break;
+    case DB_DRIVER_COMMAND_TYPE_SESSION_STATE:
+    case DB_DRIVER_COMMAND_TYPE_RESET:
+        /* delegates connected later have the session's state replayed */
+        command_delegate_connected_or_master();
+        break;
+    case DB_DRIVER_COMMAND_TYPE_LOCAL:
+        command_delegate_none();
+        current->logged_in = 1;
+        break;
+    case DB_DRIVER_COMMAND_TYPE_CHANGE_USER:
+        /* connections made as the old user are no use to the new one */
+        session_drop_delegates(current);
+        command_delegate_none();
+        break;
+    case DB_DRIVER_COMMAND_TYPE_OTHER:
+        break;
+    };
+
+    return 1;
+}
+
+/**
+ * Let the db driver know about each reply packet in a round, then reduce
+ * them to the single reply for the client.
+ *
+ * If there's been a driver-level error in at least one delegate, there's
+ * nothing to send yet: we still have to keep reading replies to keep the
+ * other delegates' states consistent, and the error will be returned to the
+ * client afterwards.
+ *
+ * @param[in] replies a round of replies from the delegates
+ * @param[out] final_reply the reduced reply, or 0 if there isn't one
+ * @return 1 on success, 0 on failure
+ */
+static int reduce_replies(packet_set * replies, packet ** final_reply)
+{
+    *final_reply = 0;
+
+    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
+        packet *p = packet_set_get(replies, i);
+        if ((p) && (p->size)) {
+            db_driver_reply(i, p);
+        }
+    }
+
+    if (!db_driver_got_error()) {
+        *final_reply = db_driver_reduce_replies(replies);
+        if (!*final_reply) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Tell the delegate component how to log in to delegates.
+ */
+static void delegates_login(void)
+{
+    delegate_login login;
+    login.get_packet = db_driver_get_packet;
+    login.put_packet = db_driver_put_packet;
+    login.login_packet = db_driver_login_packet;
+    login.login_ok = db_driver_login_ok;
+    login.replay_command = db_driver_replay_command;
+    login.reset_command = db_driver_reset_command;
+    login.prepare_command = db_driver_prepare_command;
+    login.prepare_reply = db_driver_prepare_reply;
+    login.forget_connection = db_driver_forget_connection;
+    delegate_login_set(&login);
+}
+
+/**
+ * Tell the delegate component how to log in to delegates, and open this
+ * thread's connection pools, if pooling.
+ */
+static void delegates_open(void)
+{
+    delegates_login();
+    if (!delegate_pool_open()) {
+        lo(LOG_ERROR, "server: error opening delegate connection pool");
+    }
+}
+
+/**
+ * Read one map from the master, on the current session's connection.
+ *
+ * @param[in] map which map
+ * @return 1 on success, 0 on failure
+ */
+static int load_map(int map)
+{
+    char *sql = map_query(map);
+    packet *command = sql ? db_driver_query_command(sql) : 0;
+    int stage = 0;
+    int ok = 0;
+
+    free(sql);
+    if (!command) {
+        return 0;
+    }
+    if (!delegate_put(current->put_filters, db_driver_put_packet,
+                      db_driver_rewrite_command, command)) {
+        packet_delete(command);
+        return 0;
+    }
+
+    for (short more = 1; more;) {
+        packet_set *replies = delegate_get(current->put_filters,
+                                           db_driver_get_packet);
+        if (!replies) {
+            break;
+        }
+        for (delegate_id i = 0; more && (i < replies->count); ++i) {
+            char *values[2];
+
+            if (!replies->packets[i].size) {
+                continue;
+            }
+            switch (db_driver_query_row(&replies->packets[i], &stage,
+                                        values, 2)) {
+            case DB_DRIVER_ROW:
+                ok = map_add(map, values[0], values[1]);
+                free(values[0]);
+                free(values[1]);
+                more = ok;
+                break;
+            case DB_DRIVER_ROW_MORE:
+                break;
+            case DB_DRIVER_ROW_DONE:
+                ok = 1;
+                more = 0;
+                break;
+            case DB_DRIVER_ROW_ERROR:
+                ok = 0;
+                more = 0;
+                break;
+            }
+        }
+        packet_set_delete(replies);
+    }
+    packet_delete(command);
+
+    if (ok) {
+        map_loaded(map);
+    }
+    return ok;
+}
+
+int server_load_maps(void)
+{
+    int ok = 1;
+    int read = 0;
+
+    /* range maps are all in the configuration */
+    for (int i = 0; i < map_count(); ++i) {
+        read += !map_ranged(i);
+    }
+    if (!read) {
+        return 1;
+    }
+
+    session *s = session_new();
+    if (!s) {
+        return 0;
+    }
+    session_activate(s);
+    delegates_login();
+
+    command_delegate_master();
+    if (!delegate_acquire(s->put_filters)) {
+        lo(LOG_ERROR, "server: error connecting to the master: %s",
+           strerror(errno));
+        ok = 0;
+    }
+    for (int i = 0; ok && (i < map_count()); ++i) {
+        ok = map_ranged(i) || load_map(i);
+    }
+
+    /* workers will open their own connections, and io_uring */
+    delegate_disconnect();
+    session_delete(s);
+    packet_arena_set(0);
+    delegate_pool_close();
+    return ok;
+}
+
+/**
+ * Hand back any delegate connections a session no longer needs, once its
+ * client has logged in. Connections are kept while a transaction is open.
+ *
+ * @param[in,out] s the session
+ */
+static void session_release(session * s)
+{
+    if (!delegate_pooled() || !s->logged_in) {
+        return;
+    }
+
+    /* whoever gets a connection next will register it themselves */
+    session_unwatch_delegates(s);
+    delegate_release(s->release_filters);
+}
+
+/** session used by server(), kept between connections */
+static __thread session *blocking_session = 0;
+
+void server(int fd, struct sockaddr_in *addr, struct timeval *accepted)
+{
+    if (!blocking_session) {
+        blocking_session = session_new();
+        if (!blocking_session) {
+            lo(LOG_ERROR, "server: out of memory!");
+            return;
+        }
+    }
+
+    session *s = blocking_session;
+    delegates_open();
+    if (!session_begin(s, fd, accepted)) {
+        return;
+    }
+
+    /* establish network-level connections to the delegate databases,
+       unless the driver greets the client itself */
+    if (!db_driver_expect_commands()
+        && (delegate_connect(s->put_filters) == -1)) {
+        lo(LOG_ERROR, "server: error connecting to a delegate: %s",
+           strerror(errno));
+        return;
+    }
+
+    /* loop over conversation between client and delegates */
+    while (!db_driver_done()) {
+        /* read commands and delegate them */
+        while (db_driver_expect_commands()) {
+            /* the driver may have answered the last command itself */
+            packet *local_reply = db_driver_local_reply();
+            if (local_reply && !packet_queue_add(&s->out, local_reply)) {
+                lo(LOG_ERROR, "server: out of memory!");
+                packet_delete(local_reply);
+                delegate_disconnect();
+                return;
+            }
+
+            /* the client waits for everything before its next command */
+            if (s->out.count && (send_replies(s) == -1)) {
+                lo(LOG_ERROR, "server: error sending reply: %s",
+                   strerror(errno));
+                delegate_disconnect();
+                return;
+            }
+
+            /* everything from the last conversation has been sent */
+            packet_arena_reset(s->arena);
+
+            packet *in_command = packet_new_temporary();
+            if (!in_command) {
+                lo(LOG_ERROR, "server: out of memory!");
+                delegate_disconnect();
+                return;
+            }
+
+            lo(LOG_DEBUG, "server: waiting for next command...");
+            if (read_command(&s->in, in_command,
+                             db_driver_get_packet) == -1) {
+                if ((errno != ECONNRESET) && (errno != EINPROGRESS)) {
+                    lo(LOG_ERROR, "server: error reading command: %s",
+                       strerror(errno));
+                } else {
+                    lo(LOG_DEBUG, "server: client went away");
+                }
+                packet_delete(in_command);
+                delegate_disconnect();
+                return;
+            }
+
+            if (!route_command(in_command)) {
+                packet_delete(in_command);
+                delegate_disconnect();
+                return;
+            }
+
+            if (!delegate_acquire(s->put_filters)) {
+                lo(LOG_ERROR, "server: error connecting to a delegate: %s",
+                   strerror(errno));
+                packet_delete(in_command);
+                delegate_disconnect();
+                return;
+            }
+
+            lo(LOG_DEBUG, "server: delegating command...");
+            if (!delegate_put(s->put_filters, db_driver_put_packet,
+                              db_driver_rewrite_command, in_command)) {
+                lo(LOG_ERROR, "server: error delegating command");
+                packet_delete(in_command);
+                delegate_disconnect();
+                return;
+            }
+
+            packet_delete(in_command);
+        }
+
+        db_driver_command_done(s->put_filters);
+
+        /* read replies from delegates, reduce and return them */
+        while (db_driver_expect_replies()) {
+            /* rather than wait for the delegates, send what's ready */
+            if (s->out.count && !delegate_received(s->get_filters)
+                && (send_replies(s) == -1)) {
+                lo(LOG_ERROR, "server: error sending reply: %s",
+                   strerror(errno));
+                delegate_disconnect();
+                return;
+            }
+            if (!s->out.count) {
+                /* nothing temporary is in use between rounds of replies
+                   once those so far have been sent */
+                packet_arena_reset(s->arena);
+            }
+
+            lo(LOG_DEBUG, "server: waiting for reply...");
+
+            packet_set *replies = delegate_get(s->get_filters,
+                                               db_driver_get_packet);
+            if (!replies) {
+                lo(LOG_ERROR, "server: error getting delegate replies");
+                delegate_disconnect();
+                return;
+            }
+
+            packet *final_reply;
+            if (!reduce_replies(replies, &final_reply)) {
+                lo(LOG_ERROR, "server: error reducing replies");
+                packet_set_delete(replies);
+                delegate_disconnect();
+                return;
+            }
+
+            packet_set_delete(replies);
+
+            if (final_reply) {
+                lo(LOG_DEBUG, "server: returning reply...");
+
+                if (!packet_queue_add(&s->out, final_reply)) {
+                    lo(LOG_ERROR, "server: out of memory!");
+                    packet_delete(final_reply);
+                    delegate_disconnect();
+                    return;
+                }
+            }
+
+            /* after an error, the rest of the replies are thrown away */
+            if (((s->out.size >= REPLY_BATCH_SIZE) || db_driver_got_error())
+                && s->out.count && (send_replies(s) == -1)) {
+                lo(LOG_ERROR, "server: error sending reply: %s",
+                   strerror(errno));
+                delegate_disconnect();
+                return;
+            }
+        }
+        if (db_driver_got_error()) {
+            packet *error = db_driver_error_packet();
+            if (!error || !packet_queue_add(&s->out, error)) {
+                lo(LOG_ERROR, "server: out of memory!");
+                packet_delete(error);
+                delegate_disconnect();
+                return;
+            }
+        }
+
+        /* end of the result set */
+        if (s->out.count && (send_replies(s) == -1)) {
+            lo(LOG_ERROR, "server: error sending reply: %s",
+               strerror(errno));
+            delegate_disconnect();
+            return;
+        }
+
+        session_release(s);
+        lo(LOG_DEBUG, "server: done with this conversation.");
+    }
+
+    /* teardown all the delegate connections */
     delegate_disconnect();
 
     lo(LOG_DEBUG, "server: finished work on fd %d", fd);
     return;
 }
 
+/**
+ * Bring the registered interest of a session's file descriptor into line
+ * with what the session is waiting for.
+ *
+ * @param[in,out] s the session
+ * @param[in,out] source the file descriptor's event source
+ * @param[in] fd the file descriptor
+ * @param[in] events poll(2) events the session is now waiting for
+ */
+static void session_watch(session * s, session_source * source, int fd,
+                          short events)
+{
+    if (source->fd != fd) {
+        /* a delegate connection was taken from or given back to the pool */
+        if (source->fd != -1) {
+            event_set_remove(s->m->events, source->fd);
+        }
+        source->fd = fd;
+        source->events = events;
+        if ((fd != -1) && !event_set_add(s->m->events, fd, events, source)) {
+            lo(LOG_ERROR, "server: can't watch fd %d: %s", fd,
+               strerror(errno));
+            source->fd = -1;
+        }
+    } else if ((fd != -1) && (source->events != events)) {
+        if (!event_set_modify(s->m->events, fd, events, source)) {
+            lo(LOG_ERROR, "server: can't watch fd %d: %s", fd,
+               strerror(errno));
+        }
+        source->events = events;
+    }
+}
+
+/**
+ * Update the interest of all of a session's file descriptors after a change
+ * of state. Registrations persist while the session holds a connection; only
+ * changes cost a system call.
+ *
+ * @param[in,out] s the session
+ */
+static void session_update_interest(session * s)
+{
+    short client_events = 0;
+    switch (s->state) {
+    case SESSION_READING_COMMAND:
+        client_events = POLLIN;
+        break;
+    case SESSION_SENDING_REPLIES:
+        client_events = POLLOUT;
+        break;
+    default:
+        break;
+    };
+    session_watch(s, &s->sources[0], s->fd, client_events);
+
+    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
+        session_watch(s, &s->sources[i + 1], delegate_fd(i),
+                      delegate_io_events(i));
+    }
+}
+
+/**
+ * End a multiplexed session. It is freed once the event loop has finished
+ * with the current batch of events.
+ *
+ * @param[in,out] s the session
+ */
+static void session_finish(session * s)
+{
+    if (s->state == SESSION_FINISHED) {
+        return;
+    }
+
+    event_set_remove(s->m->events, s->fd);
+    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
+        if (s->sources[i + 1].fd != -1) {
+            event_set_remove(s->m->events, s->sources[i + 1].fd);
+            s->sources[i + 1].fd = -1;
+        }
+    }
+
+    /* teardown all the delegate connections */
+    delegate_disconnect();
+
+    shutdown(s->fd, SHUT_RDWR);
+    close(s->fd);
+    lo(LOG_DEBUG, "server: finished work on fd %d", s->fd);
+
+    s->state = SESSION_FINISHED;
+    s->next_finished = s->m->finished;
+    s->m->finished = s;
+    --s->m->live;
+}
+
+static void session_client_io(session * s);
+static void session_wake(void *data);
+
+/**
+ * Start writing the command a session has read to its delegates.
+ *
+ * @param[in,out] s the session
+ */
+static void session_put_start(session * s)
+{
+    lo(LOG_DEBUG, "server: delegating command...");
+    if (!delegate_put_start(s->put_filters, db_driver_put_packet,
+                            db_driver_rewrite_command, s->command)) {
+        lo(LOG_ERROR, "server: error delegating command");
+        session_finish(s);
+        return;
+    }
+    s->state = SESSION_PUTTING_COMMAND;
+}
+
+/**
+ * Write as many of a multiplexed session's queued replies as the client will
+ * take without waiting.
+ *
+ * @param[in,out] s the session
+ * @return 1 on success, 0 on failure
+ */
+static int session_write_replies(session * s)
+{
+    int size = s->out.size;
+
+    if (!s->out.count) {
+        return 1;
+    }
+    if (packet_queue_flush(&s->out) == PACKET_ERROR) {
+        return 0;
+    }
+    if ((s->out.size < size) && !s->first_byte_sent) {
+        report_first_byte(&s->accepted);
+        s->first_byte_sent = 1;
+    }
+    return 1;
+}
+
+/**
+ * Start sending the replies queued for a multiplexed session's client.
+ *
+ * @param[in,out] s the session
+ * @param[in] after which half of the conversation to continue with once
+ * they have been sent
+ */
+static void session_send_replies(session * s, session_phase after)
+{
+    s->after_reply = after;
+    s->state = SESSION_SENDING_REPLIES;
+    session_client_io(s);
+}
+
+/**
+ * Move a multiplexed session on once the work of its current state is
+ * complete. This mirrors the loops in server().
+ *
+ * @param[in,out] s the session
+ * @param[in] phase which half of the conversation to continue with
+ */
+static void session_advance(session * s, session_phase phase)
+{
+    while (1) {
+        if (phase == SESSION_PHASE_COMMANDS) {
+            if (db_driver_done()) {
+                session_finish(s);
+                return;
+            }
+
+            /* the driver may have answered the last command itself */
+            packet *local_reply = db_driver_local_reply();
+            if (local_reply && !packet_queue_add(&s->out, local_reply)) {
+                lo(LOG_ERROR, "server: out of memory!");
+                packet_delete(local_reply);
+                session_finish(s);
+                return;
+            }
+
+            /* the client waits for everything before its next command */
+            if (s->out.count) {
+                session_send_replies(s, SESSION_PHASE_COMMANDS);
+                return;
+            }
+
+            if (db_driver_expect_commands()) {
+                /* everything from the last conversation has been sent */
+                packet_arena_reset(s->arena);
+
+                s->command = packet_new_temporary();
+                if (!s->command) {
+                    lo(LOG_ERROR, "server: out of memory!");
+                    session_finish(s);
+                    return;
+                }
+                lo(LOG_DEBUG, "server: waiting for next command...");
+                s->state = SESSION_READING_COMMAND;
+                if (s->in.ready) {
+                    /* the client didn't wait for the last reply */
+                    session_wake(s);
+                }
+                return;
+            }
+
+            db_driver_command_done(s->put_filters);
+        }
+
+        /* read replies from delegates, reduce and return them */
+        if (db_driver_expect_replies()) {
+            if (!s->out.count) {
+                /* nothing temporary is in use between rounds of replies
+                   once those so far have been sent */
+                packet_arena_reset(s->arena);
+            }
+
+            lo(LOG_DEBUG, "server: waiting for reply...");
+            if (!delegate_get_start(s->get_filters, db_driver_get_packet)) {
+                lo(LOG_ERROR, "server: error getting delegate replies");
+                session_finish(s);
+                return;
+            }
+            s->state = SESSION_GETTING_REPLIES;
+            if (delegate_io_done()) {
+                /* the replies had already been received */
+                session_wake(s);
+            } else if (!session_write_replies(s)) {
+                /* rather than wait for the delegates, send what's ready */
+                lo(LOG_ERROR, "server: error sending reply: %s",
+                   strerror(errno));
+                session_finish(s);
+            }
+            return;
+        }
+
+        if (db_driver_got_error()) {
+            packet *error = db_driver_error_packet();
+            if (!error || !packet_queue_add(&s->out, error)) {
+                lo(LOG_ERROR, "server: out of memory!");
+                packet_delete(error);
+                session_finish(s);
+                return;
+            }
+        }
+
+        session_release(s);
+        lo(LOG_DEBUG, "server: done with this conversation.");
+        phase = SESSION_PHASE_COMMANDS;
+    }
+}
+
+/**
+ * Handle the completion of a parallel delegate operation.
+ *
+ * @param[in,out] s the session
+ */
+static void session_delegates_done(session * s)
+{
+    switch (s->state) {
+    case SESSION_CONNECTING:
+        session_advance(s, SESSION_PHASE_COMMANDS);
+        break;
+    case SESSION_ACQUIRING:
+        delegate_acquire_finish();
+        session_put_start(s);
+        if ((s->state == SESSION_PUTTING_COMMAND) && delegate_io_done()) {
+            session_delegates_done(s);
+        }
+        break;
+    case SESSION_PUTTING_COMMAND:
+        delegate_put_finish();
+        packet_delete(s->command);
+        s->command = 0;
+        session_advance(s, SESSION_PHASE_COMMANDS);
+        break;
+    case SESSION_GETTING_REPLIES:
+        {
+            packet_set *replies = delegate_get_finish();
+            packet *final_reply;
+
+            if (!reduce_replies(replies, &final_reply)) {
+                lo(LOG_ERROR, "server: error reducing replies");
+                packet_set_delete(replies);
+                session_finish(s);
+                return;
+            }
+            packet_set_delete(replies);
+
+            if (final_reply) {
+                lo(LOG_DEBUG, "server: returning reply...");
+                if (!packet_queue_add(&s->out, final_reply)) {
+                    lo(LOG_ERROR, "server: out of memory!");
+                    packet_delete(final_reply);
+                    session_finish(s);
+                    return;
+                }
+            }
+
+            /* after an error, the rest of the replies are thrown away */
+            if (((s->out.size >= REPLY_BATCH_SIZE) || db_driver_got_error())
+                && s->out.count) {
+                session_send_replies(s, SESSION_PHASE_REPLIES);
+                return;
+            }
+            session_advance(s, SESSION_PHASE_REPLIES);
+            break;
+        }
+    default:
+        break;
+    };
+}
+
+/**
+ * Work on the client connection of a multiplexed session. Replies are
+ * written optimistically, without waiting to hear that the client is
+ * writable.
+ *
+ * @param[in,out] s the session
+ */
+static void session_client_io(session * s)
+{
+    switch (s->state) {
+    case SESSION_READING_COMMAND:
+        switch (db_driver_get_packet(&s->in, s->command)) {
+        case PACKET_EOF:
+            lo(LOG_DEBUG, "server: client went away");
+            session_finish(s);
+            return;
+        case PACKET_ERROR:
+            if ((errno != ECONNRESET) && (errno != EINPROGRESS)) {
+                lo(LOG_ERROR, "server: error reading command: %s",
+                   strerror(errno));
+            } else {
+                lo(LOG_DEBUG, "server: client went away");
+            }
+            session_finish(s);
+            return;
+        case PACKET_INCOMPLETE:
+            return;
+        case PACKET_COMPLETE:
+            break;
+        };
+
+        if (!route_command(s->command)) {
+            session_finish(s);
+            return;
+        }
+
+        if (!delegate_acquire_start(s->put_filters)) {
+            lo(LOG_ERROR, "server: error connecting to a delegate: %s",
+               strerror(errno));
+            session_finish(s);
+            return;
+        }
+        s->state = SESSION_ACQUIRING;
+        if (delegate_io_done()) {
+            session_delegates_done(s);
+        }
+        break;
+    case SESSION_SENDING_REPLIES:
+        switch (packet_queue_flush(&s->out)) {
+        case PACKET_EOF:
+        case PACKET_ERROR:
+            lo(LOG_ERROR, "server: error sending reply: %s",
+               strerror(errno));
+            session_finish(s);
+            return;
+        case PACKET_INCOMPLETE:
+            return;
+        case PACKET_COMPLETE:
+            break;
+        };
+
+        if (!s->first_byte_sent) {
+            report_first_byte(&s->accepted);
+            s->first_byte_sent = 1;
+        }
+        session_advance(s, s->after_reply);
+        break;
+    default:
+        break;
+    };
+}
+
+/**
+ * Work on a delegate connection of a multiplexed session.
+ *
+ * @param[in,out] s the session
+ * @param[in] id the delegate
+ */
+static void session_delegate_io(session * s, delegate_id id)
+{
+    switch (delegate_io_ready(id)) {
+    case PACKET_ERROR:
+    case PACKET_EOF:
+        switch (s->state) {
+        case SESSION_CONNECTING:
+            lo(LOG_ERROR, "server: error connecting to a delegate: %s",
+               strerror(errno));
+            break;
+        case SESSION_ACQUIRING:
+            lo(LOG_ERROR, "server: error connecting to a delegate: %s",
+               strerror(errno));
+            break;
+        case SESSION_PUTTING_COMMAND:
+            lo(LOG_ERROR, "server: error delegating command");
+            break;
+        default:
+            lo(LOG_ERROR, "server: error getting delegate replies");
+            break;
+        };
+        session_finish(s);
+        return;
+    case PACKET_INCOMPLETE:
+        return;
+    case PACKET_COMPLETE:
+        break;
+    };
+
+    if (delegate_io_done()) {
+        session_delegates_done(s);
+    }
+}
+
+/**
+ * Dispatch an event to the session which owns the file descriptor.
+ *
+ * @param[in] source the event source
+ * @param[in] revents the poll(2) events which occurred
+ */
+static void session_io(session_source * source, short revents)
+{
+    session *s = source->s;
+
+    if (s->state == SESSION_FINISHED) {
+        return;
+    }
+    session_activate(s);
+
+    if (revents & source->events) {
+        if (source->id == SESSION_SOURCE_CLIENT) {
+            session_client_io(s);
+        } else {
+            session_delegate_io(s, source->id);
+        }
+    } else if (revents & (POLLERR | POLLHUP)) {
+        /* a connection went away while we weren't expecting to use it */
+        if (source->id == SESSION_SOURCE_CLIENT) {
+            lo(LOG_DEBUG, "server: client went away");
+        } else {
+            lo(LOG_ERROR, "server: delegate %d went away", source->id);
+        }
+        session_finish(s);
+    }
+
+    if (s->state != SESSION_FINISHED) {
+        session_update_interest(s);
+    }
+}
+
+/**
+ * Note that a session queued for a pooled connection has been given one.
+ * It's picked up once the current batch of events has been dispatched.
+ *
+ * @param[in,out] data the session
+ */
+static void session_wake(void *data)
+{
+    session *s = (session *) data;
+
+    if (!s->woken) {
+        s->woken = 1;
+        s->next_woken = s->m->woken;
+        s->m->woken = s;
+    }
+}
+
+/**
+ * Start a multiplexed session on a newly accepted connection.
+ *
+ * @param[in,out] m the multiplexer
+ * @param[in] fd connected, non-blocking, file descriptor
+ * @param[in] accepted time at which the connection was accepted
+ * @return 1 on success, 0 on failure
+ */
+static int session_start(multiplexer * m, int fd, struct timeval *accepted)
+{
+    session *s = session_new();
+    if (!s) {
+        lo(LOG_ERROR, "server: out of memory!");
+        return 0;
+    }
+
+    s->sources = malloc(sizeof(session_source) * (delegate_get_count() + 1));
+    if (!s->sources) {
+        lo(LOG_ERROR, "server: out of memory!");
+        session_delete(s);
+        return 0;
+    }
+
+    if (!session_begin(s, fd, accepted)) {
+        session_delete(s);
+        return 0;
+    }
+
+    /* establish network-level connections to the delegate databases,
+       unless the driver greets the client itself */
+    if (!db_driver_expect_commands()
+        && (delegate_connect_start(s->put_filters) == -1)) {
+        lo(LOG_ERROR, "server: error connecting to a delegate: %s",
+           strerror(errno));
+        session_delete(s);
+        return 0;
+    }
+    s->m = m;
+    delegate_session_wake(s->delegates, session_wake, s);
+
+    /* the client's descriptor stays registered for the life of the session,
+       and each delegate's for as long as the session holds a connection */
+    s->sources[0].s = s;
+    s->sources[0].id = SESSION_SOURCE_CLIENT;
+    s->sources[0].fd = fd;
+    s->sources[0].events = 0;
+    if (!event_set_add(m->events, fd, 0, &s->sources[0])) {
+        lo(LOG_ERROR, "server: can't watch fd %d: %s", fd, strerror(errno));
+        session_delete(s);
+        return 0;
+    }
+    for (delegate_id i = 0; i < delegate_get_count(); ++i) {
+        session_source *source = &s->sources[i + 1];
+        source->s = s;
+        source->id = i;
+        source->fd = -1;
+        source->events = 0;
+    }
+
+    ++m->live;
+    s->state = SESSION_CONNECTING;
+    if (delegate_io_done()) {
+        session_delegates_done(s);
+    }
+    if (s->state != SESSION_FINISHED) {
+        session_update_interest(s);
+    }
+    return 1;
+}
+
+/**
+ * Accept all pending connections on the listening socket.
+ *
+ * @param[in,out] m the multiplexer
+ * @param[in] listen_fd non-blocking listening socket
+ */
+static void multiplexer_accept(multiplexer * m, int listen_fd)
+{
+    while (1) {
+        struct sockaddr_in connection_addr;
+        socklen_t connection_addr_length = sizeof(connection_addr);
+        int fd = accept(listen_fd, (struct sockaddr *)&connection_addr,
+                        &connection_addr_length);
+        if (fd == -1) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)
+                && (errno != EINTR) && (errno != ECONNABORTED)) {
+                lo(LOG_ERROR, "server: can't accept: %s", strerror(errno));
+            }
+            return;
+        }
+
+        struct timeval accepted;
+        gettimeofday(&accepted, NULL);
+
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+            lo(LOG_ERROR, "server: can't make fd %d non-blocking: %s", fd,
+               strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        lo(LOG_DEBUG, "server: handling connection on fd %d", fd);
+        if (!session_start(m, fd, &accepted)) {
+            shutdown(fd, SHUT_RDWR);
+            close(fd);
+        }
+    }
+}
+
+/**
+ * Carry on with sessions which were given a pooled connection during the
+ * last batch of events.
+ *
+ * @param[in,out] m the multiplexer
+ */
+static void multiplexer_wake(multiplexer * m)
+{
+    while (m->woken) {
+        session *s = m->woken;
+        m->woken = s->next_woken;
+        s->woken = 0;
+
+        if (s->state == SESSION_FINISHED) {
+            continue;
+        }
+        session_activate(s);
+        if (s->state == SESSION_READING_COMMAND) {
+            session_client_io(s);
+        } else if (delegate_io_done()) {
+            session_delegates_done(s);
+        }
+        if (s->state != SESSION_FINISHED) {
+            session_update_interest(s);
+        }
+    }
+}
+
+/**
+ * Free sessions which finished during the last batch of events.
+ *
+ * @param[in,out] m the multiplexer
+ */
+static void multiplexer_reap(multiplexer * m)
+{
+    while (m->finished) {
+        session *s = m->finished;
+        m->finished = s->next_finished;
+        session_delete(s);
+    }
+}
+
+#define MULTIPLEX_EVENTS 256
+
+void server_multiplex(int listen_fd, int stop_fd)
+{
+    multiplexer m;
+    event ready[MULTIPLEX_EVENTS];
+    short listening = 1;
+
+    m.live = 0;
+    m.finished = 0;
+    m.woken = 0;
+    m.events = event_set_new(MULTIPLEX_EVENTS);
+    if (!m.events) {
+        lo(LOG_ERROR, "server: can't create event set: %s", strerror(errno));
+        return;
+    }
+    /* the listening socket is tagged with 0 and the stop fd with the
+       multiplexer itself; everything else is a session source */
+    if (!event_set_add(m.events, listen_fd, POLLIN, 0)
+        || !event_set_add(m.events, stop_fd, POLLIN, &m)) {
+        lo(LOG_ERROR, "server: can't watch listening socket: %s",
+           strerror(errno));
+        event_set_delete(m.events);
+        return;
+    }
+    delegates_open();
+
+    /* once asked to stop, stop accepting but let live sessions finish */
+    while (listening || m.live) {
+        int n = event_set_wait(m.events, ready, MULTIPLEX_EVENTS,
+                               delegate_pool_timeout());
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            lo(LOG_ERROR, "server: error waiting for events: %s",
+               strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            if (!ready[i].data) {
+                if (listening) {
+                    multiplexer_accept(&m, listen_fd);
+                }
+            } else if (ready[i].data == &m) {
+                if (listening) {
+                    event_set_remove(m.events, listen_fd);
+                    event_set_remove(m.events, stop_fd);
+                    listening = 0;
+                    lo(LOG_DEBUG, "server: waiting for %d sessions to finish",
+                       m.live);
+                }
+            } else {
+                session_io((session_source *) ready[i].data,
+                           ready[i].events);
+            }
+        }
+
+        multiplexer_wake(&m);
+        multiplexer_reap(&m);
+        delegate_pool_reap();
+    }
+
+    delegate_pool_close();
+    sql_plans_close();
+    event_set_delete(m.events);
+}
+
 static component *server_subcomponents[] = {
     SUBCOMPONENT(db_driver),
     SUBCOMPONENT(delegate),
@@ -7,7 +7,8 @@
  *
  * This API implements the basic network-level db-server masquerading logic,
  * i.e. the function server() which handles a single connection from beginning
- * to end.
+ * to end, and server_multiplex() which handles many connections at once in a
+ * single event loop, driving each one's conversation as a state machine.
  *
  * The server component should be exclusively used by the main component.
  *
@@ -15,6 +16,7 @@
  * and is responsible for the relationship between those two components.
  */
 
+#include <sys/time.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 
@@ -24,12 +26,36 @@
 DECLARE_COMPONENT(server);
 /** @endcond */
 
+/**
+ * Read the partition maps from the master (see map.h), before any
+ * connections are handled. Until they're read, keyed statements go to every
+ * delegate.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int server_load_maps(void);
+
 /**
  * Top-level sequencing of a single connection.
  *
  * @param[in] fd connected file descriptor.
  * @param[in] addr information about the connection.
+ * @param[in] accepted time at which the connection was accepted.
+ */
+void server(int fd, struct sockaddr_in *addr, struct timeval *accepted);
+
+/**
+ * Accept and handle connections until told to stop, multiplexing all of them
+ * (and all of their delegate connections) in a single event loop. Once told
+ * to stop, no more connections are accepted, but those in progress are
+ * allowed to finish.
+ *
+ * Each call keeps its sessions to itself, so several threads may run
+ * server_multiplex() at once, each with its own listening socket.
+ *
+ * @param[in] listen_fd non-blocking listening socket.
+ * @param[in] stop_fd becomes readable when it's time to stop.
  */
-void server(int fd, struct sockaddr_in *addr);
+void server_multiplex(int listen_fd, int stop_fd);
 
 #endif
@@ -0,0 +1,124 @@
+/* system includes */
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+
+/* project includes */
+#include "sha1.h"
+
+#define ROTATE(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/**
+ * Digest one 64 byte block.
+ *
+ * @param[in,out] state the digest state
+ * @param[in] block the block
+ */
+static void sha1_block(uint32_t state[5], const unsigned char *block)
+{
+    uint32_t w[80];
+
+    for (int i = 0; i < 16; ++i) {
+        w[i] = ((uint32_t) block[i * 4] << 24) |
+            ((uint32_t) block[i * 4 + 1] << 16) |
+            ((uint32_t) block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; ++i) {
+        w[i] = ROTATE(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4];
+    for (int i = 0; i < 80; ++i) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+
+        uint32_t t = ROTATE(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROTATE(b, 30);
+        b = a;
+        a = t;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void sha1_init(sha1_context * context)
+{
+    context->state[0] = 0x67452301;
+    context->state[1] = 0xefcdab89;
+    context->state[2] = 0x98badcfe;
+    context->state[3] = 0x10325476;
+    context->state[4] = 0xc3d2e1f0;
+    context->length = 0;
+}
+
+void sha1_update(sha1_context * context, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+
+    while (length > 0) {
+        size_t used = context->length % 64;
+        size_t n = 64 - used;
+        if (n > length) {
+            n = length;
+        }
+
+        memcpy(context->block + used, bytes, n);
+        context->length += n;
+        bytes += n;
+        length -= n;
+
+        if (context->length % 64 == 0) {
+            sha1_block(context->state, context->block);
+        }
+    }
+}
+
+void sha1_final(sha1_context * context,
+                unsigned char digest[SHA1_DIGEST_SIZE])
+{
+    uint64_t bits = context->length * 8;
+    unsigned char length[8];
+    for (int i = 0; i < 8; ++i) {
+        length[i] = (unsigned char)(bits >> (56 - i * 8));
+    }
+
+    /* pad with a one bit, then zeros up to 8 bytes short of a block */
+    sha1_update(context, "\x80", 1);
+    while (context->length % 64 != 56) {
+        sha1_update(context, "", 1);
+    }
+    sha1_update(context, length, 8);
+
+    for (int i = 0; i < SHA1_DIGEST_SIZE; ++i) {
+        digest[i] = (unsigned char)(context->state[i / 4] >>
+                                    (24 - (i % 4) * 8));
+    }
+}
+
+void sha1(const void *data, size_t length,
+          unsigned char digest[SHA1_DIGEST_SIZE])
+{
+    sha1_context context;
+    sha1_init(&context);
+    sha1_update(&context, data, length);
+    sha1_final(&context, digest);
+}
@@ -0,0 +1,61 @@
+#ifndef __SHA1_H
+#define __SHA1_H
+
+/**
+ * @file sha1.h
+ * @brief SHA-1 message digest.
+ *
+ * Just enough SHA-1 (FIPS 180-1) for database authentication handshakes.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/** size of a SHA-1 digest, in bytes */
+#define SHA1_DIGEST_SIZE 20
+
+/**
+ * State of a digest in progress.
+ */
+typedef struct {
+    uint32_t state[5];
+    uint64_t length;          /**< bytes digested so far */
+    unsigned char block[64];  /**< partial block awaiting more input */
+} sha1_context;
+
+/**
+ * Start a new digest.
+ *
+ * @param[out] context the digest state
+ */
+void sha1_init(sha1_context * context);
+
+/**
+ * Add data to a digest.
+ *
+ * @param[in,out] context the digest state
+ * @param[in] data the data
+ * @param[in] length the number of bytes of data
+ */
+void sha1_update(sha1_context * context, const void *data, size_t length);
+
+/**
+ * Finish a digest.
+ *
+ * @param[in,out] context the digest state
+ * @param[out] digest the digest
+ */
+void sha1_final(sha1_context * context,
+                unsigned char digest[SHA1_DIGEST_SIZE]);
+
+/**
+ * Digest a single buffer.
+ *
+ * @param[in] data the data
+ * @param[in] length the number of bytes of data
+ * @param[out] digest the digest
+ */
+void sha1(const void *data, size_t length,
+          unsigned char digest[SHA1_DIGEST_SIZE]);
+
+#endif
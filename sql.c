@@ -1,7 +1,10 @@
 
 /* system includes */
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
 /* project includes */
 #include "sql.h"
@@ -17,11 +20,172 @@ typedef struct {
 #define CFG_KEY "key"
 #define CFG_KEY_DEFAULT "id"
 
+#define CFG_PLAN_CACHE_SIZE "plan_cache_size"
+#define CFG_PLAN_CACHE_SIZE_DEFAULT 1024
+
+/** how often (in seconds) to log each thread's plan counters */
+#define PLAN_REPORT_INTERVAL 60
+
+/** what a constant becomes in a statement's fingerprint */
+#define FINGERPRINT_CONSTANT '\001'
+
+/** FNV-1a, for hashing fingerprints */
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/** why a GROUP BY which can't be folded is unmergeable */
+#define GROUPS_UNMERGEABLE \
+    "pdb can't fold this GROUP BY's groups from several delegates"
+
+/** why an ORDER BY of something the select list hasn't got is
+    unmergeable */
+#define ORDER_UNMERGEABLE \
+    "pdb can't merge rows in order of a column they haven't got"
+
+/** a LIMIT of more rows than any table holds, yet small enough that an
+    OFFSET can be added to it */
+#define LIMIT_ALL 1000000000000000000LL
+
 static partitioned_table *partitioned_tables = 0;
 static int partitioned_table_count = 0;
 
+/** how many plans each thread keeps, or 0 for none */
+static int plan_cache_size = 0;
+
+/**
+ * What a word does in a statement, as far as routing it goes.
+ */
+typedef enum {
+    ROUTE_NAME,      /**< an identifier, or a keyword of no interest */
+    ROUTE_RESERVED,  /**< a keyword which can't be a table's name */
+    ROUTE_STATEMENT, /**< starts a statement which changes rows */
+    ROUTE_SELECT,
+    ROUTE_FROM,
+    ROUTE_JOIN,
+    ROUTE_USING,
+    ROUTE_AS,
+    ROUTE_INTO,
+    ROUTE_SET,
+    ROUTE_VALUES,
+    ROUTE_ON,
+    ROUTE_WHERE,
+    ROUTE_AND,
+    ROUTE_OR,
+    ROUTE_BETWEEN,
+    ROUTE_UNION,
+    ROUTE_END_WHERE  /**< starts a clause which can follow WHERE */
+} route_word;
+
+/** @cond */
+#define ROUTE_WORD(word, kind) { word, sizeof(word) - 1, kind }
+/** @endcond */
+
+/** in order, grouped by first letter */
+static const struct {
+    const char *word;
+    size_t length;
+    route_word kind;
+} route_words[] = {
+    ROUTE_WORD("all", ROUTE_RESERVED),
+    ROUTE_WORD("and", ROUTE_AND),
+    ROUTE_WORD("any", ROUTE_RESERVED),
+    ROUTE_WORD("as", ROUTE_AS),
+    ROUTE_WORD("between", ROUTE_BETWEEN),
+    ROUTE_WORD("case", ROUTE_RESERVED),
+    ROUTE_WORD("cross", ROUTE_RESERVED),
+    ROUTE_WORD("delayed", ROUTE_RESERVED),
+    ROUTE_WORD("delete", ROUTE_STATEMENT),
+    ROUTE_WORD("distinct", ROUTE_RESERVED),
+    ROUTE_WORD("dual", ROUTE_RESERVED),
+    ROUTE_WORD("except", ROUTE_UNION),
+    ROUTE_WORD("exists", ROUTE_RESERVED),
+    ROUTE_WORD("for", ROUTE_END_WHERE),
+    ROUTE_WORD("force", ROUTE_RESERVED),
+    ROUTE_WORD("from", ROUTE_FROM),
+    ROUTE_WORD("group", ROUTE_END_WHERE),
+    ROUTE_WORD("having", ROUTE_END_WHERE),
+    ROUTE_WORD("high_priority", ROUTE_RESERVED),
+    ROUTE_WORD("ignore", ROUTE_RESERVED),
+    ROUTE_WORD("in", ROUTE_RESERVED),
+    ROUTE_WORD("inner", ROUTE_RESERVED),
+    ROUTE_WORD("insert", ROUTE_STATEMENT),
+    ROUTE_WORD("intersect", ROUTE_UNION),
+    ROUTE_WORD("into", ROUTE_INTO),
+    ROUTE_WORD("is", ROUTE_RESERVED),
+    ROUTE_WORD("join", ROUTE_JOIN),
+    ROUTE_WORD("lateral", ROUTE_RESERVED),
+    ROUTE_WORD("left", ROUTE_RESERVED),
+    ROUTE_WORD("like", ROUTE_RESERVED),
+    ROUTE_WORD("limit", ROUTE_END_WHERE),
+    ROUTE_WORD("lock", ROUTE_END_WHERE),
+    ROUTE_WORD("low_priority", ROUTE_RESERVED),
+    ROUTE_WORD("natural", ROUTE_RESERVED),
+    ROUTE_WORD("not", ROUTE_RESERVED),
+    ROUTE_WORD("null", ROUTE_RESERVED),
+    ROUTE_WORD("on", ROUTE_ON),
+    ROUTE_WORD("or", ROUTE_OR),
+    ROUTE_WORD("order", ROUTE_END_WHERE),
+    ROUTE_WORD("outer", ROUTE_RESERVED),
+    ROUTE_WORD("partition", ROUTE_RESERVED),
+    ROUTE_WORD("procedure", ROUTE_END_WHERE),
+    ROUTE_WORD("quick", ROUTE_RESERVED),
+    ROUTE_WORD("recursive", ROUTE_RESERVED),
+    ROUTE_WORD("replace", ROUTE_STATEMENT),
+    ROUTE_WORD("returning", ROUTE_END_WHERE),
+    ROUTE_WORD("right", ROUTE_RESERVED),
+    ROUTE_WORD("select", ROUTE_SELECT),
+    ROUTE_WORD("set", ROUTE_SET),
+    ROUTE_WORD("some", ROUTE_RESERVED),
+    ROUTE_WORD("straight_join", ROUTE_JOIN),
+    ROUTE_WORD("union", ROUTE_UNION),
+    ROUTE_WORD("update", ROUTE_STATEMENT),
+    ROUTE_WORD("use", ROUTE_RESERVED),
+    ROUTE_WORD("using", ROUTE_USING),
+    ROUTE_WORD("value", ROUTE_VALUES),
+    ROUTE_WORD("values", ROUTE_VALUES),
+    ROUTE_WORD("where", ROUTE_WHERE),
+    ROUTE_WORD("window", ROUTE_END_WHERE),
+    ROUTE_WORD("with", ROUTE_RESERVED),
+    ROUTE_WORD("xor", ROUTE_OR)
+};
+
+/** where each letter's words start in route_words, and where the last
+    letter's end */
+static int route_letters[27];
+
+/** which characters can be part of a word */
+static char word_characters[256];
+
+/**
+ * Index the words which matter to routing by their first letter.
+ */
+static void index_route_words(void)
+{
+    int count = sizeof(route_words) / sizeof(route_words[0]);
+    int i = 0;
+
+    for (int c = 0; c < 256; ++c) {
+        word_characters[c] = isalnum(c) || (c == '_') || (c == '$')
+            || (c >= 0x80);
+    }
+    for (int letter = 0; letter <= 26; ++letter) {
+        while ((i < count) && (route_words[i].word[0] - 'a' < letter)) {
+            ++i;
+        }
+        route_letters[letter] = i;
+    }
+}
+
 static int sql_initialize(cfg_t * configuration)
 {
+    index_route_words();
+
+    plan_cache_size = cfg_getint(configuration, CFG_PLAN_CACHE_SIZE);
+    if (plan_cache_size < 0) {
+        lo(LOG_ERROR, "sql: %s can't be negative", CFG_PLAN_CACHE_SIZE);
+        return 0;
+    }
+
     partitioned_table_count = cfg_size(configuration, CFG_PARTITIONED_TABLE);
     partitioned_tables =
         malloc(sizeof(partitioned_table) * partitioned_table_count);
@@ -48,93 +212,3407 @@ static int sql_initialize(cfg_t * configuration)
     return 1;
 }
 
-sql_type sql_get_type(char *sql)
+static char *sql_get_table_key(const char *table)
+{
+    for (int i = 0; i < partitioned_table_count; ++i) {
+        lo(LOG_DEBUG, "sql_get_table_key(): %s == %s?", table,
+           partitioned_tables[i].name);
+        if (strcmp(table, partitioned_tables[i].name) == 0) {
+            return partitioned_tables[i].key;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Skip whitespace and comments.
+ *
+ * @param[in] p somewhere in a statement
+ * @return the start of the next token, or the end of the statement
+ */
+static const char *skip_space(const char *p)
+{
+    for (;;) {
+        if ((*p == ' ') || ((*p >= '\t') && (*p <= '\r'))) {
+            ++p;
+        } else if ((*p == '#') || ((p[0] == '-') && (p[1] == '-')
+                                   && isspace((unsigned char)p[2]))) {
+            p += strcspn(p, "\n");
+        } else if ((p[0] == '/') && (p[1] == '*')) {
+            const char *end = strstr(p + 2, "*/");
+            p = end ? end + 2 : p + strlen(p);
+        } else {
+            return p;
+        }
+    }
+}
+
+/**
+ * Does a statement have an executable comment (one opening with "!") in it?
+ * MySQL runs what's inside one, which skip_space() skips; so pdb can't
+ * tell which keys, tables or clauses the statement really has. (A string
+ * which merely looks like one is taken for one.)
+ *
+ * @param[in] sql the statement
+ * @return 1 if so; 0 otherwise.
+ */
+static short executable_comment(const char *sql)
 {
-    if (strncmp(sql, "update", 6) == 0) {
-        char *p = sql + 7;
+    return strstr(sql, "/*!") != 0;
+}
 
-        if (strcspn(p, " ")) {
-            size_t end_of_table = strcspn(p, " ");
-            char save = p[end_of_table];
-            p[end_of_table] = 0;
-            sql_table_type table_type = sql_get_table_type(p);
-            p[end_of_table] = save;
+/**
+ * Is a character part of a word (a keyword, identifier or number)?
+ *
+ * @param[in] c the character
+ * @return 1 if so; 0 otherwise.
+ */
+static short word_character(char c)
+{
+    return word_characters[(unsigned char)c];
+}
 
-            switch (table_type) {
-            case SQL_TABLE_TYPE_MASTER:
-                return SQL_TYPE_MASTER;
-            case SQL_TABLE_TYPE_PARTITIONED:
-                return SQL_TYPE_PARTITIONED;
-            };
+/**
+ * Find the end of a token: a word, a quoted string or identifier, or a
+ * single punctuation character.
+ *
+ * @param[in] p the start of the token
+ * @return just past the end of the token
+ */
+static const char *token_end(const char *p)
+{
+    if ((*p == '\'') || (*p == '"') || (*p == '`')) {
+        char quote = *p++;
+        /* a doubled quote stands for itself */
+        while (*p && ((*p != quote) || (p[1] == quote))) {
+            if ((((*p == '\\') && (quote != '`')) || (*p == quote))
+                && p[1]) {
+                ++p;
+            }
+            ++p;
+        }
+        return *p ? p + 1 : p;
+    }
+    if (word_character(*p)) {
+        while (word_character(*p)) {
+            ++p;
         }
+        return p;
     }
-    return SQL_TYPE_PARTITIONED;
+    return *p ? p + 1 : p;
 }
 
-static char *sql_get_table_key(char *table)
+/**
+ * Is a token a particular keyword?
+ *
+ * @param[in] p the start of the token
+ * @param[in] end just past its end
+ * @param[in] word the keyword, in lower case
+ * @return 1 if so; 0 otherwise.
+ */
+static short is_word(const char *p, const char *end, const char *word)
 {
-    for (int i = 0; i < partitioned_table_count; ++i) {
-        lo(LOG_DEBUG, "sql_get_table_key(): %s == %s?", table,
-           partitioned_tables[i].name);
-        if (strcmp(table, partitioned_tables[i].name) == 0) {
-            return partitioned_tables[i].key;
+    size_t length = strlen(word);
+    return ((size_t)(end - p) == length) && !strncasecmp(p, word, length);
+}
+
+/**
+ * Does a token end an ORDER BY clause?
+ *
+ * @param[in] p the start of the token
+ * @param[in] end just past its end
+ * @return 1 if so; 0 otherwise.
+ */
+static short ends_order(const char *p, const char *end)
+{
+    return (*p == ',') || (*p == ';') || (*p == ')') || !*p
+        || is_word(p, end, "limit") || is_word(p, end, "for")
+        || is_word(p, end, "lock") || is_word(p, end, "procedure")
+        || is_word(p, end, "into") || is_word(p, end, "union");
+}
+
+/**
+ * Name the column an ORDER BY item refers to: a (possibly qualified, and
+ * possibly quoted) column name comes down to the column's own name, and
+ * anything else is kept as written, to match an expression column's name.
+ *
+ * @param[in,out] order where to put the name (or position)
+ * @param[in] p the start of the item
+ * @param[in] end just past its end
+ * @return 1 on success, 0 on failure
+ */
+static int order_column(sql_order * order, const char *p, const char *end)
+{
+    const char *name = p;
+    const char *name_end = end;
+
+    order->name = 0;
+    order->position = 0;
+
+    if (strspn(p, "0123456789") == (size_t)(end - p)) {
+        order->position = atoi(p);
+        return 1;
+    }
+
+    /* name(.name)* */
+    for (const char *q = p; q < end;) {
+        const char *e = token_end(q);
+        if (!((*q == '`') || word_character(*q))) {
+            name = p;
+            name_end = end;
+            break;
         }
+        name = q;
+        name_end = e;
+        if (*name == '`') {
+            ++name;
+            --name_end;
+        }
+        if ((e < end) && (*e != '.')) {
+            name = p;
+            name_end = end;
+            break;
+        }
+        q = (e < end) ? e + 1 : e;
+    }
+
+    order->name = malloc(name_end - name + 1);
+    if (!order->name) {
+        return 0;
+    }
+    memcpy(order->name, name, name_end - name);
+    order->name[name_end - name] = 0;
+    return 1;
+}
+
+/**
+ * Does a token end a select list?
+ *
+ * @param[in] p the start of the token
+ * @param[in] end just past its end
+ * @return 1 if so; 0 otherwise.
+ */
+static short ends_select_list(const char *p, const char *end)
+{
+    return (*p == ';') || (*p == ')') || !*p
+        || is_word(p, end, "from") || is_word(p, end, "into")
+        || is_word(p, end, "where") || is_word(p, end, "group")
+        || is_word(p, end, "having") || is_word(p, end, "window")
+        || is_word(p, end, "order") || is_word(p, end, "limit")
+        || is_word(p, end, "for") || is_word(p, end, "lock")
+        || is_word(p, end, "union");
+}
+
+/**
+ * Find the select list of a query's outermost SELECT.
+ *
+ * @param[in] p the start of the query
+ * @param[out] modified is there a modifier (DISTINCT, say) which would
+ * change what the aggregates work out?
+ * @return the start of the list, or 0 if it's empty
+ */
+static const char *select_list(const char *p, short *modified)
+{
+    int depth = 0;
+
+    /* past any common table expressions */
+    while (*p) {
+        const char *end = token_end(p);
+        if (*p == '(') {
+            ++depth;
+        } else if (*p == ')') {
+            --depth;
+        } else if ((depth == 0) && is_word(p, end, "select")) {
+            p = skip_space(end);
+            break;
+        }
+        p = skip_space(end);
+    }
+
+    *modified = 0;
+    for (;;) {
+        const char *end = token_end(p);
+        if (is_word(p, end, "distinct") || is_word(p, end, "distinctrow")
+            || is_word(p, end, "sql_calc_found_rows")) {
+            *modified = 1;
+        } else if (!is_word(p, end, "all")
+                   && !is_word(p, end, "high_priority")
+                   && !is_word(p, end, "straight_join")
+                   && !is_word(p, end, "sql_small_result")
+                   && !is_word(p, end, "sql_big_result")
+                   && !is_word(p, end, "sql_buffer_result")
+                   && !is_word(p, end, "sql_cache")
+                   && !is_word(p, end, "sql_no_cache")) {
+            return *p ? p : 0;
+        }
+        p = skip_space(end);
+    }
+}
+
+/**
+ * Which aggregate function, if any, is a word the name of?
+ *
+ * @param[in] p the start of the word
+ * @param[in] end just past its end
+ * @param[out] function the function, if it's one pdb can fold
+ * @return 1 if it's one pdb can fold, -1 if it's another aggregate function,
+ * 0 if it isn't one
+ */
+static int aggregate_name(const char *p, const char *end,
+                          sql_aggregate_function * function)
+{
+    static const char *others[] = {
+        "group_concat", "std", "stddev", "stddev_pop", "stddev_samp",
+        "variance", "var_pop", "var_samp", "bit_and", "bit_or", "bit_xor",
+        "json_arrayagg", "json_objectagg", 0
+    };
+
+    if (is_word(p, end, "count")) {
+        *function = SQL_AGGREGATE_COUNT;
+    } else if (is_word(p, end, "sum")) {
+        *function = SQL_AGGREGATE_SUM;
+    } else if (is_word(p, end, "min")) {
+        *function = SQL_AGGREGATE_MIN;
+    } else if (is_word(p, end, "max")) {
+        *function = SQL_AGGREGATE_MAX;
+    } else if (is_word(p, end, "avg")) {
+        *function = SQL_AGGREGATE_AVG;
+    } else {
+        for (int i = 0; others[i]; ++i) {
+            if (is_word(p, end, others[i])) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * A column of the result set the delegates are asked for: one of the select
+ * list's, or one added to the end of it.
+ */
+typedef struct {
+    sql_aggregate_function function;
+    const char *start;     /**< the expression, as written */
+    const char *end;
+    const char *alias;     /**< its alias, or 0 if it hasn't one */
+    const char *alias_end;
+    const char *name_end;  /**< for an aggregate: the end of its name */
+    const char *arguments; /**< ...and what's in its brackets */
+    const char *arguments_end;
+    int count_column;      /**< for AVG(): its COUNT() column */
+    short hidden;          /**< added to the end of the select list */
+    short counted;         /**< the COUNT() for an AVG() */
+} select_column;
+
+/**
+ * The columns of the result set the delegates are asked for.
+ */
+typedef struct {
+    select_column *columns;
+    int count;
+    int visible;           /**< how many the client asked for */
+} select_columns;
+
+/**
+ * Read an aggregate function call.
+ *
+ * @param[out] column the aggregate's column
+ * @param[in] p the start of the call
+ * @return just past the call, or 0 if it isn't a call of an aggregate pdb
+ * can fold
+ */
+static const char *read_aggregate(select_column * column, const char *p)
+{
+    const char *end = token_end(p);
+    int depth = 1;
+
+    if (aggregate_name(p, end, &column->function) != 1) {
+        return 0;
+    }
+    column->start = p;
+    column->name_end = end;
+
+    p = skip_space(end);
+    if (*p != '(') {
+        return 0;
+    }
+    column->arguments = p = skip_space(p + 1);
+
+    /* the shards' distinct values may overlap */
+    end = token_end(p);
+    if (is_word(p, end, "distinct")
+        && (column->function != SQL_AGGREGATE_MIN)
+        && (column->function != SQL_AGGREGATE_MAX)) {
+        return 0;
+    }
+
+    for (;;) {
+        if (!*p) {
+            return 0;
+        }
+        end = token_end(p);
+        if (*p == '(') {
+            ++depth;
+        } else if ((*p == ')') && !--depth) {
+            break;
+        }
+        column->arguments_end = end;
+        p = skip_space(end);
+    }
+    if (p == column->arguments) {
+        return 0;
+    }
+    column->end = p + 1;
+    return column->end;
+}
+
+/**
+ * Find the end of a (possibly qualified, and possibly quoted) name.
+ *
+ * @param[in] p the start of the name
+ * @return just past the name, or 0 if it isn't one
+ */
+static const char *name_end(const char *p)
+{
+    for (;;) {
+        if (!((*p == '`') || word_character(*p))) {
+            return 0;
+        }
+        p = token_end(p);
+        if (*p != '.') {
+            return p;
+        }
+        ++p;
+    }
+}
+
+/**
+ * Read an item of a select list: an aggregate pdb can fold, or an
+ * expression with no aggregate in it.
+ *
+ * @param[out] column the item's column
+ * @param[in] p the start of the item
+ * @return the start of the token after the item, or 0 if the item can't be
+ * folded (or is *)
+ */
+static const char *read_column(select_column * column, const char *p)
+{
+    const char *item = p;
+    const char *last = 0;
+    const char *last_end = 0;
+    const char *before_last = 0;
+    const char *before_last_end = 0;
+    const char *expression_end = 0;
+    int depth = 0;
+
+    column->alias = 0;
+    column->count_column = -1;
+    column->hidden = 0;
+    column->counted = 0;
+
+    const char *call_end = read_aggregate(column, p);
+    if (!call_end) {
+        column->function = SQL_AGGREGATE_ANY;
+        column->start = p;
+    }
+
+    for (;;) {
+        const char *end = token_end(p);
+        if ((depth == 0) && ((*p == ',') || ends_select_list(p, end))) {
+            break;
+        }
+        if (*p == '(') {
+            ++depth;
+        } else if (*p == ')') {
+            --depth;
+        } else if (!call_end || (p >= call_end)) {
+            sql_aggregate_function function;
+            if (aggregate_name(p, end, &function)
+                && (*skip_space(end) == '(')) {
+                /* an aggregate within an expression */
+                return 0;
+            }
+        }
+        expression_end = before_last_end;
+        before_last = last;
+        before_last_end = last_end;
+        last = p;
+        last_end = end;
+        p = skip_space(end);
+    }
+    if (!last
+        || ((*last == '*') && (!before_last || (*before_last == '.')))) {
+        return 0;
+    }
+
+    if (before_last && is_word(before_last, before_last_end, "as")) {
+        column->alias = last;
+        column->alias_end = last_end;
+        column->end = expression_end;
+    } else if (before_last && ((*last == '`') || word_character(*last))
+               && ((name_end(item) == before_last_end)
+                   || (call_end == before_last_end))) {
+        /* a column name (or an aggregate), then its alias */
+        column->alias = last;
+        column->alias_end = last_end;
+        column->end = before_last_end;
+    } else {
+        column->end = last_end;
+    }
+
+    if (call_end && (column->end != call_end)) {
+        /* an aggregate, then something more */
+        return 0;
+    }
+    if (!column->end) {
+        return 0;
+    }
+    return p;
+}
+
+/**
+ * Add a column to the result set the delegates are asked for.
+ *
+ * @param[in,out] s the columns
+ * @param[in] column the column
+ * @return its index, or -1 on failure
+ */
+static int add_column(select_columns * s, select_column * column)
+{
+    select_column *grown = realloc(s->columns,
+                                   sizeof(select_column) * (s->count + 1));
+    if (!grown) {
+        return -1;
+    }
+    s->columns = grown;
+    s->columns[s->count] = *column;
+    return s->count++;
+}
+
+/**
+ * Take the quotes off a quoted identifier.
+ *
+ * @param[in,out] p the start of the identifier
+ * @param[in,out] end just past its end
+ */
+static void unquote_identifier(const char **p, const char **end)
+{
+    if ((**p == '`') && (token_end(*p) == *end) && (*end - *p >= 2)) {
+        ++*p;
+        --*end;
+    }
+}
+
+/**
+ * Is some text the same as other text, as far as naming a column goes
+ * (ignoring case and spacing)?
+ *
+ * @return 1 if so; 0 otherwise.
+ */
+static short same_text(const char *a, const char *a_end, const char *b,
+                       const char *b_end)
+{
+    unquote_identifier(&a, &a_end);
+    unquote_identifier(&b, &b_end);
+    for (;;) {
+        while ((a < a_end) && isspace((unsigned char)*a)) {
+            ++a;
+        }
+        while ((b < b_end) && isspace((unsigned char)*b)) {
+            ++b;
+        }
+        if ((a == a_end) || (b == b_end)) {
+            return (a == a_end) && (b == b_end);
+        }
+        if (tolower((unsigned char)*a++) != tolower((unsigned char)*b++)) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Find the column some text (from a GROUP BY, HAVING or ORDER BY) refers
+ * to, by alias or by its expression.
+ *
+ * @param[in] s the columns
+ * @param[in] p the start of the text
+ * @param[in] end just past its end
+ * @return the column's index, or -1 if there isn't one
+ */
+static int find_text_column(select_columns * s, const char *p,
+                            const char *end)
+{
+    for (int i = 0; i < s->count; ++i) {
+        select_column *c = &s->columns[i];
+        if (c->alias && same_text(c->alias, c->alias_end, p, end)) {
+            return i;
+        }
+    }
+    for (int i = 0; i < s->count; ++i) {
+        select_column *c = &s->columns[i];
+        if (!c->counted && same_text(c->start, c->end, p, end)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Might a query's result set have a column of some name (from an ORDER
+ * BY)? It might if an item of the select list has the name as its text, or
+ * has it outside any brackets (as its alias, or the name of the column it
+ * selects, say), or is *.
+ *
+ * @param[in] p the start of the select list
+ * @param[in] name the name
+ * @return 1 if so; 0 otherwise.
+ */
+static short selected(const char *p, const char *name)
+{
+    const char *name_end = name + strlen(name);
+
+    for (;;) {
+        const char *item = p;
+        const char *item_end = p;
+        int depth = 0;
+
+        while (*p) {
+            const char *end = token_end(p);
+            if ((depth == 0) && ((*p == ',') || ends_select_list(p, end))) {
+                break;
+            }
+            if (*p == '(') {
+                ++depth;
+            } else if (*p == ')') {
+                --depth;
+            } else if ((depth == 0) && ((*p == '*')
+                                        || same_text(p, end, name,
+                                                     name_end))) {
+                return 1;
+            }
+            item_end = end;
+            p = skip_space(end);
+        }
+        if (same_text(item, item_end, name, name_end)) {
+            return 1;
+        }
+        if (*p != ',') {
+            return 0;
+        }
+        p = skip_space(p + 1);
     }
-    return NULL;
 }
 
-long *sql_get_map_keys(char *sql)
+/**
+ * Find the column an aggregate (from a HAVING or ORDER BY) refers to,
+ * adding it to the end of the select list if it isn't there already.
+ *
+ * @param[in,out] s the columns
+ * @param[in] p the start of the aggregate
+ * @param[in] end just past its end
+ * @return the column's index, -1 if the text isn't an aggregate pdb can
+ * fold, or -2 on failure
+ */
+static int aggregate_column(select_columns * s, const char *p,
+                            const char *end)
 {
-    if (strncmp(sql, "update", 6) == 0) {
-        char *p = sql + 7;
+    select_column column;
+    int i = find_text_column(s, p, end);
 
-        if (strcspn(p, " ")) {
-            size_t end_of_table = strcspn(p, " ");
-            char save = p[end_of_table];
-            p[end_of_table] = '\0';
-            char *key = sql_get_table_key(p);
-            p[end_of_table] = save;
+    if (i != -1) {
+        return i;
+    }
+    if (read_aggregate(&column, p) != end) {
+        return -1;
+    }
+    column.alias = 0;
+    column.count_column = -1;
+    column.hidden = 1;
+    column.counted = 0;
+    i = add_column(s, &column);
+    return (i == -1) ? -2 : i;
+}
 
-            /* slide p past the table name and following space */
-            p += end_of_table;
-            p += strspn(p, " ");
+/**
+ * Does a token end a GROUP BY clause?
+ *
+ * @param[in] p the start of the token
+ * @param[in] end just past its end
+ * @return 1 if so; 0 otherwise.
+ */
+static short ends_group(const char *p, const char *end)
+{
+    return (*p == ';') || (*p == ')') || !*p
+        || is_word(p, end, "having") || is_word(p, end, "window")
+        || is_word(p, end, "order") || is_word(p, end, "limit")
+        || is_word(p, end, "with") || is_word(p, end, "for")
+        || is_word(p, end, "lock") || is_word(p, end, "into")
+        || is_word(p, end, "procedure") || is_word(p, end, "union");
+}
 
-            lo(LOG_DEBUG, "sql_get_map_keys: after finding table: %s", p);
+/**
+ * Mark the columns rows are grouped by, adding any which aren't in the select
+ * list to the end of it.
+ *
+ * @param[in,out] s the columns
+ * @param[in] p the GROUP BY items
+ * @return 1 on success, 0 if they can't be folded, -1 on failure
+ */
+static int group_columns(select_columns * s, const char *p)
+{
+    for (;;) {
+        const char *item = p;
+        const char *item_end = p;
+        const char *last = p;
+        int depth = 0;
 
-            char *w = strstr(p, "where");
-            if (w != NULL) {
-                /* slide p past the 'where' token and following space */
-                p = w;
-                p += strspn(p, " ");
+        while (*p) {
+            const char *end = token_end(p);
+            if ((depth == 0) && ((*p == ',') || ends_group(p, end))) {
+                break;
+            }
+            if (*p == '(') {
+                ++depth;
+            } else if (*p == ')') {
+                --depth;
+            }
+            last = p;
+            item_end = end;
+            p = skip_space(end);
+        }
+        if (is_word(last, item_end, "asc")
+            || is_word(last, item_end, "desc")) {
+            item_end = last;
+            while ((item_end > item)
+                   && isspace((unsigned char)item_end[-1])) {
+                --item_end;
+            }
+        }
+        if (item_end == item) {
+            return 0;
+        }
 
-                lo(LOG_DEBUG, "sql_get_map_keys: after finding where: %s", p);
+        int i;
+        if (strspn(item, "0123456789") == (size_t)(item_end - item)) {
+            i = atoi(item) - 1;
+            if ((i < 0) || (i >= s->visible)) {
+                return 0;
+            }
+        } else {
+            i = find_text_column(s, item, item_end);
+        }
+        if (i == -1) {
+            select_column column = { SQL_AGGREGATE_GROUP, item, item_end,
+                0, 0, 0, 0, 0, -1, 1, 0
+            };
+            if (add_column(s, &column) == -1) {
+                return -1;
+            }
+        } else if ((s->columns[i].function == SQL_AGGREGATE_ANY)
+                   || (s->columns[i].function == SQL_AGGREGATE_GROUP)) {
+            s->columns[i].function = SQL_AGGREGATE_GROUP;
+        } else {
+            return 0;
+        }
 
-                char *k = strstr(p, key);
-                if (k != NULL) {
-                    /* slide p past the key */
-                    p = k + strlen(key);
-                    p += strspn(p, " ");
+        if (*p != ',') {
+            /* WITH ROLLUP adds rows of its own */
+            return !is_word(p, token_end(p), "with");
+        }
+        p = skip_space(p + 1);
+    }
+}
 
-                    lo(LOG_DEBUG, "sql_get_map_keys: after finding %s: %s",
-                       key, p);
+/**
+ * Read the constant a HAVING condition compares with.
+ *
+ * @param[out] condition where to put it
+ * @param[in] p its start
+ * @param[in] end just past its end
+ * @return 1 on success, 0 if it isn't a constant, -1 on failure
+ */
+static int condition_value(sql_condition * condition, const char *p,
+                           const char *end)
+{
+    const char *start = p;
+    char quote = 0;
 
-                    if (*p == '=') {
-                        ++p;
-                        p += strspn(p, " ");
+    if ((*p == '\'') || (*p == '"')) {
+        quote = *p++;
+        if ((token_end(start) != end) || (end - start < 2)
+            || (end[-1] != quote)) {
+            return 0;
+        }
+        --end;
+    } else {
+        if (*p == '-') {
+            p = skip_space(p + 1);
+        }
+        for (const char *q = p; q < end; ++q) {
+            if (!isdigit((unsigned char)*q) && (*q != '.')) {
+                return 0;
+            }
+        }
+        if (p == end) {
+            return 0;
+        }
+    }
 
-                        lo(LOG_DEBUG, "sql_get_map_keys: after finding =: %s",
-                           p);
+    char *value = malloc(end - p + 2);
+    if (!value) {
+        return -1;
+    }
+    int length = 0;
+    if (!quote && (*start == '-')) {
+        value[length++] = '-';
+    }
+    for (; p < end; ++p) {
+        if (quote && ((*p == '\\') || (*p == quote)) && (p + 1 < end)) {
+            ++p;
+        }
+        value[length++] = *p;
+    }
+    value[length] = 0;
+    condition->value = value;
+    return 1;
+}
 
-                        long map_key = atol(p);
+/**
+ * Read a HAVING clause, which pdb checks the merged groups against: a column
+ * compared with a constant, or several ANDed together.
+ *
+ * @param[in,out] merge where to put the conditions
+ * @param[in,out] s the columns
+ * @param[in] p the start of the clause
+ * @return 1 on success, 0 if it can't be checked, -1 on failure
+ */
+static int having_conditions(sql_merge * merge, select_columns * s,
+                             const char *p)
+{
+    for (;;) {
+        const char *item = p;
+        const char *operator = 0;
+        const char *operator_end = 0;
+        const char *last = p;
+        const char *item_end = p;
+        int depth = 0;
 
-                        lo(LOG_DEBUG, "sql_get_map_keys: XX: %ld", map_key);
-                    }
+        while (*p) {
+            const char *end = token_end(p);
+            if ((depth == 0)
+                && (is_word(p, end, "and") || ends_order(p, end)
+                    || is_word(p, end, "order") || is_word(p, end, "window"))
+                && (*p != ',')) {
+                break;
+            }
+            if (*p == '(') {
+                ++depth;
+            } else if (*p == ')') {
+                --depth;
+            } else if ((depth == 0) && !operator
+                       && ((*p == '=') || (*p == '<') || (*p == '>')
+                           || ((*p == '!') && (p[1] == '=')))) {
+                operator = p;
+                operator_end = end;
+                while ((*operator_end == '=') || (*operator_end == '>')) {
+                    ++operator_end;
                 }
+                end = operator_end;
+            }
+            last = p;
+            item_end = end;
+            p = skip_space(end);
+        }
+        if (!operator || (skip_space(operator_end) > last)) {
+            return 0;
+        }
+
+        sql_condition condition;
+        size_t length = operator_end - operator;
+        if ((length == 1) && (*operator == '=')) {
+            condition.comparison = SQL_EQUAL;
+        } else if ((length == 2) && (operator[1] == '=')
+                   && (*operator != '=')) {
+            condition.comparison = (*operator == '<') ? SQL_LESS_EQUAL :
+                (*operator == '>') ? SQL_GREATER_EQUAL : SQL_NOT_EQUAL;
+        } else if ((length == 2) && !strncmp(operator, "<>", 2)) {
+            condition.comparison = SQL_NOT_EQUAL;
+        } else if (length == 1) {
+            condition.comparison = (*operator == '<') ? SQL_LESS :
+                SQL_GREATER;
+        } else {
+            return 0;
+        }
+
+        const char *left_end = operator;
+        while ((left_end > item) && isspace((unsigned char)left_end[-1])) {
+            --left_end;
+        }
+        condition.column = find_text_column(s, item, left_end);
+        if (condition.column == -1) {
+            condition.column = aggregate_column(s, item, left_end);
+            if (condition.column < 0) {
+                return (condition.column == -1) ? 0 : -1;
             }
         }
+
+        int read = condition_value(&condition,
+                                   skip_space(operator_end), item_end);
+        if (read != 1) {
+            return read;
+        }
+        sql_condition *grown = realloc(merge->having, sizeof(sql_condition)
+                                       * (merge->having_count + 1));
+        if (!grown) {
+            free(condition.value);
+            return -1;
+        }
+        merge->having = grown;
+        merge->having[merge->having_count++] = condition;
+
+        if (!is_word(p, token_end(p), "and")) {
+            return 1;
+        }
+        p = skip_space(token_end(p));
+    }
+}
+
+/**
+ * Read a number in a LIMIT clause. One of more than 18 digits (such as the
+ * 18446744073709551615 MySQL suggests for "every row after the OFFSET") is
+ * read as LIMIT_ALL.
+ *
+ * @param[in] p the start of the number
+ * @param[out] value the number
+ * @return just past it, or 0 if it isn't one
+ */
+static const char *limit_number(const char *p, long long *value)
+{
+    const char *end = token_end(p);
+
+    if ((end == p) || (strspn(p, "0123456789") != (size_t)(end - p))) {
+        return 0;
     }
+    *value = (end - p > 18) ? LIMIT_ALL : atoll(p);
+    return skip_space(end);
+}
 
-    return NULL;
+/**
+ * Does a locking clause start here: FOR UPDATE, FOR SHARE or LOCK IN SHARE
+ * MODE (with whatever options follow)?
+ *
+ * @param[in] p the start of a token
+ * @return 1 if so; 0 otherwise.
+ */
+static short locking_clause(const char *p)
+{
+    const char *end = token_end(p);
+    const char *next = skip_space(end);
+    const char *next_end = token_end(next);
+
+    if (is_word(p, end, "for")) {
+        return is_word(next, next_end, "update")
+            || is_word(next, next_end, "share");
+    }
+    return is_word(p, end, "lock") && is_word(next, next_end, "in");
+}
+
+/**
+ * Read a LIMIT clause: LIMIT count, LIMIT offset, count or LIMIT count
+ * OFFSET offset, followed by nothing but a locking clause, if any.
+ *
+ * @param[in,out] merge where to put the limit
+ * @param[in] p the start of the clause
+ * @return where the locking clause (or the end of the statement) is, or 0
+ * if it isn't one of those
+ */
+static const char *read_limit(sql_merge * merge, const char *p)
+{
+    p = limit_number(p, &merge->limit);
+    if (p && (*p == ',')) {
+        merge->offset = merge->limit;
+        p = limit_number(skip_space(p + 1), &merge->limit);
+    } else if (p && is_word(p, token_end(p), "offset")) {
+        p = limit_number(skip_space(token_end(p)), &merge->offset);
+    }
+    return (p && ((*p == ';') || !*p || locking_clause(p))) ? p : 0;
+}
+
+/**
+ * Copy part of a statement.
+ *
+ * @param[in,out] out where to copy it to, moved past the copy
+ * @param[in] p the start of the part
+ * @param[in] end just past its end
+ */
+static void copy_part(char **out, const char *p, const char *end)
+{
+    memcpy(*out, p, end - p);
+    *out += end - p;
+}
+
+/**
+ * Copy an expression as a quoted alias.
+ *
+ * @param[in,out] out where to copy it to, moved past the copy
+ * @param[in] p the start of the expression
+ * @param[in] end just past its end
+ */
+static void copy_alias(char **out, const char *p, const char *end)
+{
+    copy_part(out, " AS `", " AS `" + 5);
+    for (; p < end; ++p) {
+        if (*p == '`') {
+            *(*out)++ = '`';
+        }
+        *(*out)++ = *p;
+    }
+    *(*out)++ = '`';
+}
+
+/**
+ * Write the statement which works out a query's aggregates on each delegate:
+ * each AVG() becomes a SUM(), named as the AVG() would have been, and the
+ * columns pdb needs which weren't asked for go on the end of the select
+ * list, each named as written.
+ *
+ * @param[in] sql the query
+ * @param[in] s the columns
+ * @param[in] cut where to end the statement (leaving out clauses pdb sees to
+ * itself), or 0 to keep the rest of the query
+ * @return the statement, or 0 on failure
+ */
+static char *partial_statement(const char *sql, select_columns * s,
+                               const char *cut)
+{
+    select_column *last = &s->columns[s->visible - 1];
+    const char *list_end = last->alias ? last->alias_end : last->end;
+    size_t length = strlen(sql);
+
+    if (!cut) {
+        cut = sql + length;
+    }
+    for (int i = 0; i < s->count; ++i) {
+        select_column *c = &s->columns[i];
+        length += sizeof(", COUNT() AS ``") + 3 * (c->end - c->start);
+    }
+
+    char *statement = malloc(length + 1);
+    if (!statement) {
+        return 0;
+    }
+
+    char *out = statement;
+    const char *p = sql;
+    for (int i = 0; i < s->visible; ++i) {
+        select_column *c = &s->columns[i];
+        if (c->function != SQL_AGGREGATE_AVG) {
+            continue;
+        }
+        copy_part(&out, p, c->start);
+        copy_part(&out, "SUM", "SUM" + 3);
+        copy_part(&out, c->name_end, c->end);
+        if (!c->alias) {
+            copy_alias(&out, c->start, c->end);
+        }
+        p = c->end;
+    }
+    copy_part(&out, p, list_end);
+
+    for (int i = s->visible; i < s->count; ++i) {
+        select_column *c = &s->columns[i];
+        copy_part(&out, ", ", ", " + 2);
+        if (c->counted) {
+            copy_part(&out, "COUNT(", "COUNT(" + 6);
+            copy_part(&out, c->arguments, c->arguments_end);
+            *out++ = ')';
+            continue;
+        }
+        if (c->function == SQL_AGGREGATE_AVG) {
+            copy_part(&out, "SUM", "SUM" + 3);
+            copy_part(&out, c->name_end, c->end);
+        } else {
+            copy_part(&out, c->start, c->end);
+        }
+        copy_alias(&out, c->start, c->end);
+    }
+    copy_part(&out, list_end, cut);
+    *out = 0;
+    return statement;
+}
+
+/**
+ * Where the clauses of a query's outermost SELECT are.
+ */
+typedef struct {
+    const char *group;     /**< the GROUP BY items, or 0 */
+    const char *having;    /**< the HAVING condition, or 0 */
+    const char *order;     /**< the ORDER BY items, or 0 */
+    const char *limit;     /**< the LIMIT, or 0 */
+    const char *limit_start;  /**< ...and its keyword */
+    const char *cut;       /**< the first of HAVING, ORDER BY and LIMIT */
+    short unioned;
+    short other;           /**< a clause pdb can't see to (FOR UPDATE, or
+                                WINDOW, say) follows the GROUP BY */
+} select_clauses;
+
+/**
+ * Work out how to fold the delegates' rows, if the query's select list is
+ * nothing but aggregates, or it has a GROUP BY.
+ *
+ * @param[in,out] merge where to put the description
+ * @param[in] sql the query
+ * @param[in] clauses where its clauses are
+ * @return 1 on success (whether or not there's anything to fold), 0 on
+ * failure
+ */
+static int get_aggregates(sql_merge * merge, const char *sql,
+                          select_clauses * clauses)
+{
+    short modified;
+    const char *p = select_list(sql, &modified);
+    select_columns s = { 0, 0, 0 };
+    int ok = 1;
+
+    if (modified) {
+        p = 0;
+    }
+
+    if (clauses->unioned || (clauses->having && !clauses->group)
+        || (clauses->group && clauses->other)) {
+        if (clauses->group) {
+            merge->unmergeable = GROUPS_UNMERGEABLE;
+        }
+        return 1;
+    }
+
+    while (p) {
+        select_column column;
+        p = read_column(&column, p);
+        if (!p) {
+            break;
+        }
+        if (add_column(&s, &column) == -1) {
+            free(s.columns);
+            return 0;
+        }
+        if (*p != ',') {
+            break;
+        }
+        p = skip_space(p + 1);
+    }
+    s.visible = s.count;
+    if (p && !clauses->group) {
+        for (int i = 0; i < s.count; ++i) {
+            if (s.columns[i].function == SQL_AGGREGATE_ANY) {
+                p = 0;
+            }
+        }
+    }
+
+    /* pdb applies HAVING, ORDER BY and LIMIT to the merged groups */
+    if (clauses->group) {
+        merge->grouped = 1;
+        ok = p ? group_columns(&s, clauses->group) : 0;
+        if ((ok == 1) && clauses->having) {
+            ok = having_conditions(merge, &s, clauses->having);
+        }
+        for (int k = 0; (ok == 1) && (k < merge->order_count); ++k) {
+            const char *name = merge->order[k].name;
+            if (name && (aggregate_column(&s, name, name + strlen(name))
+                         == -2)) {
+                ok = -1;
+            }
+        }
+        if ((ok == 1) && clauses->limit
+            && !read_limit(merge, clauses->limit)) {
+            ok = 0;
+        }
+        if (ok != 1) {
+            p = 0;
+        }
+    }
+
+    /* each AVG() needs a COUNT() to divide by */
+    for (int i = 0, count = s.count; p && (i < count); ++i) {
+        if (s.columns[i].function == SQL_AGGREGATE_AVG) {
+            select_column column = s.columns[i];
+            column.function = SQL_AGGREGATE_COUNT;
+            column.hidden = 1;
+            column.counted = 1;
+            int count_column = add_column(&s, &column);
+            if (count_column == -1) {
+                ok = -1;
+                p = 0;
+            } else {
+                s.columns[i].count_column = count_column;
+            }
+        }
+    }
+
+    if (p) {
+        short rewrite = merge->grouped && clauses->cut;
+        for (int i = 0; i < s.count; ++i) {
+            if ((s.columns[i].function == SQL_AGGREGATE_AVG)
+                || s.columns[i].hidden) {
+                rewrite = 1;
+            }
+        }
+        merge->aggregates = malloc(sizeof(sql_aggregate) * s.count);
+        if (!merge->aggregates
+            || (rewrite
+                && !(merge->statement =
+                     partial_statement(sql, &s,
+                                       merge->grouped ? clauses->cut : 0)))) {
+            ok = -1;
+        } else {
+            merge->aggregate_count = s.count;
+            merge->visible = s.visible;
+            for (int i = 0; i < s.count; ++i) {
+                merge->aggregates[i].function = s.columns[i].function;
+                merge->aggregates[i].count_column = s.columns[i].count_column;
+            }
+        }
+    }
+
+    if (ok != 1) {
+        /* leave the query alone; but each delegate has its own groups */
+        if ((ok == 0) && clauses->group) {
+            merge->unmergeable = GROUPS_UNMERGEABLE;
+        }
+        for (int i = 0; i < merge->having_count; ++i) {
+            free(merge->having[i].value);
+        }
+        free(merge->having);
+        merge->having = 0;
+        merge->having_count = 0;
+        merge->grouped = 0;
+        merge->offset = 0;
+        merge->limit = -1;
+        free(merge->aggregates);
+        merge->aggregates = 0;
+        merge->aggregate_count = 0;
+    }
+    free(s.columns);
+    return ok != -1;
+}
+
+/**
+ * Push a query's LIMIT down to the delegates: each is asked for as many
+ * rows as the OFFSET and LIMIT come to together, and pdb applies both to
+ * the merged rows.
+ *
+ * @param[in,out] merge where to put the limit
+ * @param[in] sql the query
+ * @param[in] clauses where its clauses are
+ * @return 1 on success (whether or not there's a LIMIT), 0 on failure
+ */
+static int push_limit(sql_merge * merge, const char *sql,
+                      select_clauses * clauses)
+{
+    /* a UNION's LIMIT is its whole result's, and a DISTINCT query's is
+       its distinct rows', so either is pushed down as it is; nor does
+       FOUND_ROWS() depend on the LIMIT */
+    if (!clauses->limit) {
+        return 1;
+    }
+    const char *locking = read_limit(merge, clauses->limit);
+    if (!locking) {
+        merge->offset = 0;
+        merge->limit = -1;
+        return 1;
+    }
+    if (!merge->offset) {
+        return 1;
+    }
+
+    /* a locking clause is kept, after the new LIMIT */
+    if (*locking == ';') {
+        locking = "";
+    }
+    size_t length = clauses->limit_start - sql;
+    size_t size = length + sizeof("LIMIT 1234567890123456789 ")
+        + strlen(locking);
+    merge->statement = malloc(size);
+    if (!merge->statement) {
+        return 0;
+    }
+    memcpy(merge->statement, sql, length);
+    snprintf(merge->statement + length, size - length, "LIMIT %lld%s%s",
+             merge->offset + merge->limit, *locking ? " " : "", locking);
+    return 1;
+}
+
+/**
+ * Find a clause keyword's items: just past the keyword, or past BY after it.
+ *
+ * @param[in] end just past the keyword
+ * @param[in] by is it followed by BY?
+ * @return where the items start, or 0 if BY was missing
+ */
+static const char *clause_items(const char *end, short by)
+{
+    const char *p = skip_space(end);
+    if (!by) {
+        return p;
+    }
+    return is_word(p, token_end(p), "by") ? skip_space(token_end(p)) : 0;
+}
+
+/**
+ * Find a query's clauses.
+ *
+ * @param[in] sql the query
+ * @param[out] clauses where they are
+ * @return 1 on success, 0 if it isn't a SELECT
+ */
+static int read_clauses(const char *sql, select_clauses * clauses)
+{
+    const char *p = skip_space(sql);
+    int depth = 0;
+
+    memset(clauses, 0, sizeof(*clauses));
+
+    /* common table expressions are all in brackets */
+    if (!is_word(p, token_end(p), "select")
+        && !is_word(p, token_end(p), "with")) {
+        return 0;
+    }
+
+    /* the last ORDER BY outside any brackets orders the whole result */
+    while (*p) {
+        const char *end = token_end(p);
+        const char **clause = 0;
+        short by = 0;
+
+        if (*p == '(') {
+            ++depth;
+        } else if (*p == ')') {
+            --depth;
+        } else if (depth == 0) {
+            if (is_word(p, end, "order")) {
+                clause = &clauses->order;
+                by = 1;
+            } else if (is_word(p, end, "group")) {
+                clause = &clauses->group;
+                by = 1;
+            } else if (is_word(p, end, "having")) {
+                clause = &clauses->having;
+            } else if (is_word(p, end, "limit")) {
+                clause = &clauses->limit;
+            } else if (is_word(p, end, "union")) {
+                clauses->order = 0;
+                clauses->unioned = 1;
+            } else if (clauses->group
+                       && (is_word(p, end, "for") || is_word(p, end, "lock")
+                           || is_word(p, end, "into")
+                           || is_word(p, end, "procedure")
+                           || is_word(p, end, "window"))) {
+                clauses->other = 1;
+            }
+        }
+        if (clause && (*clause = clause_items(end, by))) {
+            if ((clause != &clauses->group) && !clauses->cut) {
+                clauses->cut = p;
+            }
+            if (clause == &clauses->limit) {
+                clauses->limit_start = p;
+            }
+            end = token_end(by ? skip_space(end) : p);
+        }
+        p = skip_space(end);
+    }
+    return 1;
+}
+
+sql_merge *sql_get_merge(const char *sql)
+{
+    select_clauses clauses;
+    const char *p;
+    int depth;
+
+    /* there's no merging a result set whose clauses pdb can't see */
+    if (executable_comment(sql) || !read_clauses(sql, &clauses)) {
+        return 0;
+    }
+
+    sql_merge *merge = calloc(1, sizeof(sql_merge));
+    if (!merge) {
+        return 0;
+    }
+    merge->limit = -1;
+
+    for (p = clauses.order; p;) {
+        const char *item = p;
+        const char *item_end = p;
+        const char *last = p;
+        const char *last_end = p;
+        short descending;
+
+        depth = 0;
+        while (*p) {
+            const char *end = token_end(p);
+            if ((depth == 0) && ends_order(p, end)) {
+                break;
+            }
+            if (*p == '(') {
+                ++depth;
+            } else if (*p == ')') {
+                --depth;
+            }
+            last = p;
+            last_end = end;
+            item_end = end;
+            p = skip_space(end);
+        }
+
+        descending = is_word(last, last_end, "desc");
+        if (descending || is_word(last, last_end, "asc")) {
+            item_end = last;
+            while ((item_end > item)
+                   && isspace((unsigned char)item_end[-1])) {
+                --item_end;
+            }
+        }
+        if (item_end == item) {
+            break;
+        }
+
+        sql_order *grown = realloc(merge->order, sizeof(sql_order)
+                                   * (merge->order_count + 1));
+        if (!grown) {
+            sql_merge_delete(merge);
+            return 0;
+        }
+        merge->order = grown;
+        if (!order_column(&merge->order[merge->order_count], item,
+                          item_end)) {
+            sql_merge_delete(merge);
+            return 0;
+        }
+        merge->order[merge->order_count++].descending = descending;
+
+        if (*p != ',') {
+            break;
+        }
+        p = skip_space(p + 1);
+    }
+
+    /* aggregates come to a single row, or a row per group */
+    if (!get_aggregates(merge, sql, &clauses)
+        || (!merge->aggregate_count && !push_limit(merge, sql, &clauses))) {
+        sql_merge_delete(merge);
+        return 0;
+    }
+
+    /* rows are only merged in order of columns they have */
+    if (merge->order_count && !merge->aggregate_count) {
+        short modified;
+        const char *list = select_list(sql, &modified);
+        for (int k = 0; list && (k < merge->order_count); ++k) {
+            if (merge->order[k].name
+                && !selected(list, merge->order[k].name)) {
+                merge->unmergeable = ORDER_UNMERGEABLE;
+            }
+        }
+    }
+
+    if (!merge->order_count && !merge->aggregate_count
+        && (merge->limit == -1) && !merge->unmergeable) {
+        sql_merge_delete(merge);
+        return 0;
+    }
+    return merge;
+}
+
+short sql_needs_merge(const char *sql)
+{
+    select_clauses clauses;
+    sql_merge *merge;
+    short needs;
+
+    if (!read_clauses(sql, &clauses)) {
+        return 0;
+    }
+    if (clauses.order || clauses.group || clauses.limit) {
+        return 1;
+    }
+    /* which leaves aggregates */
+    merge = sql_get_merge(sql);
+    needs = merge != 0;
+    sql_merge_delete(merge);
+    return needs;
+}
+
+void sql_merge_delete(sql_merge * merge)
+{
+    if (merge) {
+        for (int i = 0; i < merge->order_count; ++i) {
+            free(merge->order[i].name);
+        }
+        free(merge->order);
+        for (int i = 0; i < merge->having_count; ++i) {
+            free(merge->having[i].value);
+        }
+        free(merge->having);
+        free(merge->statement);
+        free(merge->aggregates);
+        free(merge);
+    }
+}
+
+/**
+ * What does a word do in a statement?
+ *
+ * @param[in] p the start of the word
+ * @param[in] end just past its end
+ * @return what it does
+ */
+static route_word word_kind(const char *p, const char *end)
+{
+    size_t length = end - p;
+    int letter = (*p | ('a' - 'A')) - 'a';
+
+    if ((letter < 0) || (letter >= 26)) {
+        return ROUTE_NAME;
+    }
+
+    /* statements are mostly words, so no strncasecmp() */
+    for (int i = route_letters[letter]; i < route_letters[letter + 1]; ++i) {
+        const char *word = route_words[i].word;
+        size_t j = 1;
+
+        if (route_words[i].length != length) {
+            continue;
+        }
+        while ((j < length) && ((p[j] == word[j])
+                                || ((p[j] | ('a' - 'A')) == word[j]))) {
+            ++j;
+        }
+        if (j == length) {
+            return route_words[i].kind;
+        }
+    }
+    return ROUTE_NAME;
+}
+
+typedef enum {
+    INSERT_NONE,
+    INSERT_TABLE,    /**< just after the table's name */
+    INSERT_COLUMNS,
+    INSERT_VALUES,
+    INSERT_SET
+} insert_clause;
+
+/**
+ * Where a statement being routed is up to.
+ */
+typedef struct {
+    sql_route *route;
+    const char *sql;
+    int depth;                 /**< how deep in brackets */
+    unsigned long long calls;  /**< bit n: are brackets n deep a call's? */
+    unsigned long long lists;  /**< bit n: is there a table list n deep? */
+    short started;             /**< past the statement's first keyword */
+    short naming;              /**< is a WITH table's name due? */
+    const char **ctes;         /**< ...their names' starts and ends */
+    int cte_count;
+    short table;               /**< is a table's name due? */
+    short name;                /**< was the last token a name? */
+    short where;               /**< in the outermost WHERE clause... */
+    short term;                /**< ...at the start of a term */
+    short keyed_term;          /**< ...has a key term since the last OR */
+    short bounded_term;        /**< ...or a term bounding the key */
+    int alternative;           /**< ...how many ORs there have been */
+    int alternative_bounds;    /**< ...and how many bounds before the last */
+    short between;             /**< ...past BETWEEN, short of its AND */
+    short unkeyed;             /**< keys can't pick out the rows */
+    short loose;               /**< is there a constant outside the
+                                    outermost WHERE clause? */
+    short failed;              /**< no memory */
+    int partitioned;           /**< how many partitioned tables are named */
+    const char *alias;         /**< ...and the table's alias, if any */
+    const char *alias_end;
+    insert_clause clause;
+    int key_column;            /**< INSERT: the key's place in the columns */
+    int column;                /**< ...the place of the item in hand */
+    short row_key;             /**< ...has the row in hand a key? */
+    const char *row;           /**< ...where it starts */
+    int rows;                  /**< ...how many rows there are... */
+    int keyed_rows;            /**< ...and how many have keys */
+} route_reader;
+
+/**
+ * The bit for a depth of brackets, in a reader's sets of them.
+ *
+ * @param[in] depth how deep
+ * @return the bit, or 0 for brackets too deep to keep track of
+ */
+static unsigned long long depth_bit(int depth)
+{
+    return ((depth >= 0) && (depth < 64)) ? 1ULL << depth : 0;
+}
+
+/**
+ * Add a table to a statement's route.
+ *
+ * @param[in,out] r the reader
+ * @param[in] p the start of the table's (unqualified) name
+ * @param[in] end just past its end
+ * @return 1 on success, 0 on failure
+ */
+static int add_table(route_reader * r, const char *p, const char *end)
+{
+    sql_route *route = r->route;
+    char **grown;
+    char *table;
+
+    unquote_identifier(&p, &end);
+    table = malloc(end - p + 1);
+    if (!table) {
+        return 0;
+    }
+    memcpy(table, p, end - p);
+    table[end - p] = 0;
+
+    grown = realloc(route->tables, sizeof(char *) * (route->table_count + 1));
+    if (!grown) {
+        free(table);
+        return 0;
+    }
+    route->tables = grown;
+    route->tables[route->table_count] = table;
+
+    if (sql_get_table_type(table) == SQL_TABLE_TYPE_PARTITIONED) {
+        /* a subquery's rows can be anywhere */
+        if (r->partitioned++ || r->depth) {
+            r->unkeyed = 1;
+        } else {
+            route->partitioned = route->table_count;
+            route->key = sql_get_table_key(table);
+        }
+    }
+    ++route->table_count;
+    return 1;
+}
+
+/**
+ * Add a common table expression's name to those a statement's tables can't
+ * have.
+ *
+ * @param[in,out] r the reader
+ * @param[in] p the start of the name
+ * @param[in] end just past its end
+ * @return 1 on success, 0 on failure
+ */
+static int add_cte(route_reader * r, const char *p, const char *end)
+{
+    const char **grown = realloc(r->ctes, sizeof(char *) * 2
+                                 * (r->cte_count + 1));
+    if (!grown) {
+        return 0;
+    }
+    r->ctes = grown;
+    r->ctes[2 * r->cte_count] = p;
+    r->ctes[2 * r->cte_count++ + 1] = end;
+    return 1;
+}
+
+/**
+ * Is a name a common table expression's?
+ *
+ * @param[in] r the reader
+ * @param[in] p the start of the name
+ * @param[in] end just past its end
+ * @return 1 if so; 0 otherwise.
+ */
+static short is_cte(route_reader * r, const char *p, const char *end)
+{
+    for (int i = 0; i < r->cte_count; ++i) {
+        if (same_text(p, end, r->ctes[2 * i], r->ctes[2 * i + 1])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read a table reference: a (possibly qualified) name, and its alias.
+ *
+ * @param[in,out] r the reader
+ * @param[in] p the start of the reference
+ * @return the start of the token after it
+ */
+static const char *read_table(route_reader * r, const char *p)
+{
+    const char *end = token_end(p);
+    const char *alias;
+    short keyed;
+
+    short qualified = 0;
+
+    /* the table's own name is the last part */
+    while ((*end == '.') && ((end[1] == '`') || word_character(end[1]))) {
+        p = end + 1;
+        end = token_end(p);
+        qualified = 1;
+    }
+    keyed = !r->partitioned;
+    if (qualified || !is_cte(r, p, end)) {
+        if (!add_table(r, p, end)) {
+            r->failed = 1;
+        }
+    }
+    keyed = keyed && (r->partitioned == 1) && r->route->key;
+    r->table = 0;
+
+    p = skip_space(end);
+    end = token_end(p);
+    if (word_character(*p) && (word_kind(p, end) == ROUTE_AS)) {
+        p = skip_space(end);
+        end = token_end(p);
+    }
+    if ((*p == '`')
+        || (word_character(*p) && !isdigit((unsigned char)*p)
+            && (word_kind(p, end) == ROUTE_NAME))) {
+        if (keyed) {
+            alias = p;
+            unquote_identifier(&alias, &end);
+            r->alias = alias;
+            r->alias_end = end;
+        }
+        p = skip_space(token_end(p));
+    }
+    return p;
+}
+
+/**
+ * Find the end of a constant: a number, or a string (or a prepared
+ * statement's placeholder, which stands for one).
+ *
+ * @param[in] p the start of the constant
+ * @return just past its end, or 0 if it isn't one
+ */
+static const char *constant_end(const char *p)
+{
+    const char *end;
+
+    if (*p == '?') {
+        return p + 1;
+    }
+    if ((*p == '\'') || (*p == '"')) {
+        end = token_end(p);
+        return ((end - p >= 2) && (end[-1] == *p)) ? end : 0;
+    }
+    if ((*p == '-') || (*p == '+')) {
+        p = skip_space(p + 1);
+    }
+    if (!isdigit((unsigned char)*p)) {
+        return 0;
+    }
+    end = token_end(p);
+    if ((*end == '.') && isdigit((unsigned char)end[1])) {
+        end = token_end(end + 1);
+    }
+    return end;
+}
+
+/**
+ * Copy a constant: a string without its quotes (and escapes), or a number
+ * without spaces.
+ *
+ * @param[in] p the start of the constant
+ * @param[in] end just past its end
+ * @return freshly allocated value, or 0 on failure (no memory)
+ */
+static char *copy_constant(const char *p, const char *end)
+{
+    char *value = malloc(end - p + 1);
+    char *out = value;
+
+    if (!value) {
+        return 0;
+    }
+    if ((*p == '\'') || (*p == '"')) {
+        char quote = *p++;
+        for (--end; p < end; ++p) {
+            if ((*p == '\\') && (p + 1 < end)) {
+                ++p;
+            } else if ((*p == quote) && (p + 1 < end)) {
+                ++p;
+            }
+            *out++ = *p;
+        }
+    } else {
+        for (; p < end; ++p) {
+            if (!isspace((unsigned char)*p)) {
+                *out++ = *p;
+            }
+        }
+    }
+    *out = 0;
+    return value;
+}
+
+/**
+ * Add a constant to a statement's keys. The constant is the key's item, to
+ * begin with.
+ *
+ * @param[in,out] r the reader
+ * @param[in] p the start of the constant
+ * @param[in] end just past its end
+ * @return 1 on success, 0 on failure
+ */
+static int add_key(route_reader * r, const char *p, const char *end)
+{
+    sql_route *route = r->route;
+    char *key = copy_constant(p, end);
+    char **grown;
+    int *items;
+
+    if (!key) {
+        return 0;
+    }
+    items = realloc(route->key_constants, sizeof(int) * 2
+                    * (route->key_count + 1));
+    if (!items) {
+        free(key);
+        return 0;
+    }
+    route->key_constants = items;
+    items[2 * route->key_count] = p - r->sql;
+    items[2 * route->key_count + 1] = end - p;
+
+    items = realloc(route->key_items, sizeof(int) * 2
+                    * (route->key_count + 1));
+    if (!items) {
+        free(key);
+        return 0;
+    }
+    route->key_items = items;
+    items[2 * route->key_count] = p - r->sql;
+    items[2 * route->key_count + 1] = end - p;
+
+    grown = realloc(route->keys, sizeof(char *) * (route->key_count + 1));
+    if (!grown) {
+        free(key);
+        return 0;
+    }
+    route->keys = grown;
+    route->keys[route->key_count++] = key;
+    return 1;
+}
+
+/**
+ * Add a bound on the key to the alternative in hand.
+ *
+ * @param[in,out] r the reader
+ * @param[in] p the start of the constant
+ * @param[in] end just past its end
+ * @param[in] upper is it an upper bound (or a lower one)?
+ * @param[in] exclusive ...which leaves the constant itself out?
+ * @return 1 on success, 0 on failure
+ */
+static int add_bound(route_reader * r, const char *p, const char *end,
+                     short upper, short exclusive)
+{
+    sql_route *route = r->route;
+    char *value = copy_constant(p, end);
+    sql_key_bound *grown;
+
+    if (!value) {
+        return 0;
+    }
+    grown = realloc(route->bounds, sizeof(sql_key_bound)
+                    * (route->bound_count + 1));
+    if (!grown) {
+        free(value);
+        return 0;
+    }
+    route->bounds = grown;
+    grown[route->bound_count].value = value;
+    grown[route->bound_count].offset = p - r->sql;
+    grown[route->bound_count].length = end - p;
+    grown[route->bound_count].upper = upper;
+    grown[route->bound_count].exclusive = exclusive;
+    grown[route->bound_count++].alternative = r->alternative;
+    r->bounded_term = 1;
+    return 1;
+}
+
+/**
+ * Add a list of keys to a statement's route: the last few keys added.
+ *
+ * @param[in,out] r the reader
+ * @param[in] p the start of the list's first item
+ * @param[in] end just past its last
+ * @param[in] first_key the first item's key
+ * @return 1 on success, 0 on failure
+ */
+static int add_list(route_reader * r, const char *p, const char *end,
+                    int first_key)
+{
+    sql_route *route = r->route;
+    sql_key_list *grown = realloc(route->lists, sizeof(sql_key_list)
+                                  * (route->list_count + 1));
+    if (!grown) {
+        return 0;
+    }
+    route->lists = grown;
+    grown[route->list_count].start = p - r->sql;
+    grown[route->list_count].end = end - r->sql;
+    grown[route->list_count].first_key = first_key;
+    grown[route->list_count++].key_count = route->key_count - first_key;
+    return 1;
+}
+
+/**
+ * Find the end of a (possibly qualified) name of the partitioned table's
+ * key column.
+ *
+ * @param[in] r the reader
+ * @param[in] p the start of the name
+ * @return just past its end, or 0 if it isn't the key column's name
+ */
+static const char *key_column_end(route_reader * r, const char *p)
+{
+    const char *qualifier = 0;
+    const char *qualifier_end = 0;
+    const char *key = r->route->key;
+    const char *end;
+
+    if (!key) {
+        return 0;
+    }
+    for (;;) {
+        if (!((*p == '`')
+              || (word_character(*p) && !isdigit((unsigned char)*p)))) {
+            return 0;
+        }
+        end = token_end(p);
+        if (*end != '.') {
+            break;
+        }
+        qualifier = p;
+        qualifier_end = end;
+        p = end + 1;
+    }
+    if (!same_text(p, end, key, key + strlen(key))) {
+        return 0;
+    }
+
+    /* the table's own name, or its alias */
+    if (qualifier) {
+        const char *table = r->route->tables[r->route->partitioned];
+        size_t length;
+
+        unquote_identifier(&qualifier, &qualifier_end);
+        length = qualifier_end - qualifier;
+        if (!((strlen(table) == length)
+              && !strncmp(table, qualifier, length))
+            && !(r->alias && (r->alias_end - r->alias == (long)length)
+                 && !strncmp(r->alias, qualifier, length))) {
+            return 0;
+        }
+    }
+    return end;
+}
+
+/**
+ * Does a token end a term of a WHERE clause (or an assignment of INSERT's
+ * SET)?
+ *
+ * @param[in] p the start of the token
+ * @param[in] assignment is it an assignment?
+ * @return 1 if so; 0 otherwise.
+ */
+static short ends_term(const char *p, short assignment)
+{
+    if (!*p || (*p == ';') || (*p == ')')) {
+        return 1;
+    }
+    if (*p == ',') {
+        return assignment;
+    }
+    if (!word_character(*p)) {
+        return 0;
+    }
+    switch (word_kind(p, token_end(p))) {
+    case ROUTE_AND:
+    case ROUTE_OR:
+    case ROUTE_INTO:
+    case ROUTE_UNION:
+    case ROUTE_END_WHERE:
+        return 1;
+    case ROUTE_ON:
+        return assignment;
+    default:
+        return 0;
+    };
+}
+
+/**
+ * Read the IN list of constants of a term, adding them to the keys.
+ *
+ * @param[in,out] r the reader
+ * @param[in] p the list's opening bracket
+ * @return the start of the token after the term, or 0 if it isn't one
+ */
+static const char *key_list(route_reader * r, const char *p)
+{
+    int first_key = r->route->key_count;
+    const char *start;
+    const char *end;
+
+    if (*p != '(') {
+        return 0;
+    }
+    start = p = skip_space(p + 1);
+    for (;;) {
+        end = constant_end(p);
+        if (!end) {
+            return 0;
+        }
+        p = skip_space(end);
+        if (*p == ')') {
+            break;
+        }
+        if (*p != ',') {
+            return 0;
+        }
+        p = skip_space(p + 1);
+    }
+    if (!ends_term(skip_space(p + 1), 0)) {
+        return 0;
+    }
+
+    /* it's all constants, so take them */
+    for (p = start; p < end; p = skip_space(p + 1)) {
+        const char *item_end = constant_end(p);
+        if (!add_key(r, p, item_end)) {
+            r->failed = 1;
+            return 0;
+        }
+        p = skip_space(item_end);
+    }
+    if (!add_list(r, start, end, first_key)) {
+        r->failed = 1;
+        return 0;
+    }
+    r->keyed_term = 1;
+    return skip_space(skip_space(end) + 1);
+}
+
+/**
+ * Read an inequality: <, <=, > or >=.
+ *
+ * @param[in] p the start of the operator
+ * @param[out] upper does it bound what's on its left from above?
+ * @param[out] exclusive ...leaving out what's on its right?
+ * @return just past its end, or 0 if it isn't one
+ */
+static const char *inequality_end(const char *p, short *upper,
+                                  short *exclusive)
+{
+    if ((*p != '<') && (*p != '>')) {
+        return 0;
+    }
+    *upper = (*p == '<');
+    if (p[1] == '=') {
+        /* but not <=> */
+        *exclusive = 0;
+        return (p[2] == '>') ? 0 : p + 2;
+    }
+    /* nor <>, << or >> */
+    *exclusive = 1;
+    return ((p[1] == '<') || (p[1] == '>')) ? 0 : p + 1;
+}
+
+/**
+ * Read the rest of a term bounding the key column: an inequality and a
+ * constant, or BETWEEN two of them.
+ *
+ * @param[in,out] r the reader
+ * @param[in] p the token after the key column
+ * @return the start of the token after the term, or 0 if it isn't one
+ */
+static const char *bounding_term(route_reader * r, const char *p)
+{
+    const char *end = token_end(p);
+    const char *value;
+    const char *value_end;
+    short upper;
+    short exclusive;
+
+    if (word_character(*p) && is_word(p, end, "between")) {
+        const char *high;
+        const char *high_end;
+
+        value = skip_space(end);
+        value_end = constant_end(value);
+        if (!value_end) {
+            return 0;
+        }
+        p = skip_space(value_end);
+        if (!word_character(*p) || !is_word(p, token_end(p), "and")) {
+            return 0;
+        }
+        high = skip_space(token_end(p));
+        high_end = constant_end(high);
+        if (!high_end || !ends_term(skip_space(high_end), 0)) {
+            return 0;
+        }
+        if (!add_bound(r, value, value_end, 0, 0)
+            || !add_bound(r, high, high_end, 1, 0)) {
+            r->failed = 1;
+        }
+        return skip_space(high_end);
+    }
+
+    end = inequality_end(p, &upper, &exclusive);
+    if (!end) {
+        return 0;
+    }
+    value = skip_space(end);
+    value_end = constant_end(value);
+    if (!value_end || !ends_term(skip_space(value_end), 0)) {
+        return 0;
+    }
+    if (!add_bound(r, value, value_end, upper, exclusive)) {
+        r->failed = 1;
+    }
+    return skip_space(value_end);
+}
+
+/**
+ * Read a term which compares the key column with a constant (either way
+ * round), or with an IN list of them, adding the constants to the keys; or
+ * which bounds the key column, adding the bounds.
+ *
+ * @param[in,out] r the reader
+ * @param[in] p the start of the term
+ * @param[in] assignment is it an assignment of INSERT's SET?
+ * @return the start of the token after the term, or 0 if it isn't one
+ */
+static const char *key_term(route_reader * r, const char *p,
+                            short assignment)
+{
+    const char *value = p;
+    const char *value_end = constant_end(p);
+    const char *end;
+    short upper;
+    short exclusive;
+
+    if (value_end) {
+        p = skip_space(value_end);
+        if (assignment) {
+            return 0;
+        }
+        if (*p != '=') {
+            /* the other way round: 1 < key bounds it from below */
+            end = inequality_end(p, &upper, &exclusive);
+            end = end ? key_column_end(r, skip_space(end)) : 0;
+            if (!end || !ends_term(skip_space(end), 0)) {
+                return 0;
+            }
+            if (!add_bound(r, value, value_end, !upper, exclusive)) {
+                r->failed = 1;
+            }
+            return skip_space(end);
+        }
+        end = key_column_end(r, skip_space(p + 1));
+    } else {
+        end = key_column_end(r, p);
+        if (!end) {
+            return 0;
+        }
+        p = skip_space(end);
+        end = token_end(p);
+        if (!assignment && word_character(*p) && is_word(p, end, "in")) {
+            return key_list(r, skip_space(end));
+        }
+        if (*p != '=') {
+            return assignment ? 0 : bounding_term(r, p);
+        }
+        value = skip_space(p + 1);
+        end = value_end = constant_end(value);
+    }
+    if (!end) {
+        return 0;
+    }
+
+    p = skip_space(end);
+    if (!ends_term(p, assignment)) {
+        return 0;
+    }
+    if (!add_key(r, value, value_end)) {
+        r->failed = 1;
+    }
+    r->keyed_rows = assignment;
+    r->keyed_term = !assignment;
+    return p;
+}
+
+/**
+ * Look at an item of an INSERT's column list, or of one of its rows.
+ *
+ * @param[in,out] r the reader
+ * @param[in] p the start of the item
+ */
+static void insert_item(route_reader * r, const char *p)
+{
+    const char *end;
+
+    if (r->clause == INSERT_COLUMNS) {
+        end = key_column_end(r, p);
+        if (end && ends_term(skip_space(end), 1)) {
+            r->key_column = r->column;
+        }
+    } else if (r->column == r->key_column) {
+        end = constant_end(p);
+        if (end && ends_term(skip_space(end), 1)) {
+            if (!add_key(r, p, end)) {
+                r->failed = 1;
+            }
+            r->row_key = 1;
+        }
+    }
+}
+
+/**
+ * Make a row of an INSERT's VALUES its key's item, in the list of them all.
+ *
+ * @param[in,out] r the reader
+ * @param[in] p the row's opening bracket
+ * @param[in] end just past its closing one
+ * @return 1 on success, 0 on failure
+ */
+static int add_row(route_reader * r, const char *p, const char *end)
+{
+    sql_route *route = r->route;
+    int key = route->key_count - 1;
+
+    route->key_items[2 * key] = p - r->sql;
+    route->key_items[2 * key + 1] = end - p;
+    if (!route->list_count) {
+        return add_list(r, p, end, key);
+    }
+    route->lists[0].end = end - r->sql;
+    ++route->lists[0].key_count;
+    return 1;
+}
+
+/**
+ * End an alternative of the outermost WHERE clause, which has to have a key
+ * term of its own (or else a bound) for there to be keys.
+ *
+ * @param[in,out] r the reader
+ */
+static void end_alternative(route_reader * r)
+{
+    sql_route *route = r->route;
+
+    if (r->keyed_term) {
+        /* its keys pick out its rows better than its bounds */
+        for (int i = r->alternative_bounds; i < route->bound_count; ++i) {
+            free(route->bounds[i].value);
+        }
+        route->bound_count = r->alternative_bounds;
+    } else if (!r->bounded_term) {
+        r->unkeyed = 1;
+    }
+    r->keyed_term = 0;
+    r->bounded_term = 0;
+    ++r->alternative;
+    r->alternative_bounds = route->bound_count;
+}
+
+/**
+ * Take in a keyword.
+ *
+ * @param[in,out] r the reader
+ * @param[in] kind what it does
+ * @param[in] p the start of the keyword
+ * @param[in] end just past its end
+ */
+static void route_keyword(route_reader * r, route_word kind, const char *p,
+                          const char *end)
+{
+    sql_route *route = r->route;
+    unsigned long long bit = depth_bit(r->depth);
+
+    /* after WITH's common table expressions, if there are any */
+    if (!r->started && !r->depth
+        && ((kind == ROUTE_STATEMENT) || (kind == ROUTE_SELECT))) {
+        r->started = 1;
+        if (kind == ROUTE_SELECT) {
+            route->statement = SQL_STATEMENT_SELECT;
+        } else if (is_word(p, end, "delete")) {
+            route->statement = SQL_STATEMENT_DELETE;
+        } else {
+            route->statement = is_word(p, end, "update")
+                ? SQL_STATEMENT_UPDATE : is_word(p, end, "insert")
+                ? SQL_STATEMENT_INSERT : SQL_STATEMENT_REPLACE;
+            r->table = 1;
+            if (route->statement == SQL_STATEMENT_UPDATE) {
+                r->lists |= bit;
+            }
+        }
+        return;
+    }
+
+    switch (kind) {
+    case ROUTE_SELECT:
+        r->lists &= ~bit;
+        if (!r->depth && r->clause) {
+            r->unkeyed = 1;
+        }
+        break;
+    case ROUTE_FROM:
+        if (!(r->calls & bit)) {
+            r->table = 1;
+            r->lists |= bit;
+        }
+        break;
+    case ROUTE_JOIN:
+        r->table = 1;
+        break;
+    case ROUTE_USING:
+        if (!r->depth && (route->statement == SQL_STATEMENT_DELETE)) {
+            r->table = 1;
+            r->lists |= bit;
+        }
+        break;
+    case ROUTE_SET:
+        r->lists &= ~bit;
+        if (!r->depth && r->clause) {
+            r->clause = INSERT_SET;
+            r->term = 1;
+            r->rows = 1;
+        }
+        break;
+    case ROUTE_VALUES:
+        if (!r->depth && r->clause) {
+            r->clause = INSERT_VALUES;
+        }
+        break;
+    case ROUTE_ON:
+        /* ON DUPLICATE KEY UPDATE */
+        if (!r->depth) {
+            r->clause = INSERT_NONE;
+        }
+        break;
+    case ROUTE_WHERE:
+        r->lists &= ~bit;
+        if (!r->depth) {
+            r->where = 1;
+            r->term = 1;
+        }
+        break;
+    case ROUTE_AND:
+        if (!r->depth && r->where) {
+            r->term = !r->between;
+            r->between = 0;
+        }
+        break;
+    case ROUTE_OR:
+        if (!r->depth && r->where) {
+            /* XOR isn't one or the other */
+            end_alternative(r);
+            if (is_word(p, end, "xor")) {
+                r->unkeyed = 1;
+            }
+            r->term = 1;
+            r->between = 0;
+        }
+        break;
+    case ROUTE_BETWEEN:
+        if (!r->depth && r->where) {
+            r->between = 1;
+        }
+        break;
+    case ROUTE_UNION:
+        if (!r->depth) {
+            r->unkeyed = 1;
+        }
+        /* fall through */
+    case ROUTE_INTO:
+    case ROUTE_END_WHERE:
+        r->lists &= ~bit;
+        if (!r->depth && r->where) {
+            end_alternative(r);
+            r->where = 0;
+        }
+        break;
+    default:
+        break;
+    };
+}
+
+/**
+ * Take in a bracket or comma.
+ *
+ * @param[in,out] r the reader
+ * @param[in] p the token
+ * @param[in] end just past its end
+ */
+static void route_punctuation(route_reader * r, const char *p,
+                              const char *end)
+{
+    if (*p == '(') {
+        unsigned long long bit = depth_bit(++r->depth);
+
+        r->calls = r->name ? (r->calls | bit) : (r->calls & ~bit);
+        r->lists &= ~bit;
+        if (r->depth == 1) {
+            if (r->clause == INSERT_TABLE) {
+                r->clause = INSERT_COLUMNS;
+            }
+            if ((r->clause == INSERT_COLUMNS)
+                || (r->clause == INSERT_VALUES)) {
+                r->column = 0;
+                r->row_key = 0;
+                r->row = p;
+                insert_item(r, skip_space(end));
+            }
+        }
+    } else if (*p == ')') {
+        if ((r->depth == 1) && (r->clause == INSERT_VALUES)) {
+            ++r->rows;
+            r->keyed_rows += r->row_key;
+            if (r->row_key && !add_row(r, r->row, end)) {
+                r->failed = 1;
+            }
+        }
+        --r->depth;
+    } else if (*p == ',') {
+        if ((r->depth == 1) && ((r->clause == INSERT_COLUMNS)
+                                || (r->clause == INSERT_VALUES))) {
+            ++r->column;
+            insert_item(r, skip_space(end));
+        } else if (!r->depth && (r->clause == INSERT_SET)) {
+            r->term = 1;
+        } else if (!r->depth && !r->started) {
+            r->naming = 1;
+        } else if (r->lists & depth_bit(r->depth)) {
+            r->table = 1;
+        }
+    } else if ((*p == '|') && !r->depth && r->where) {
+        r->unkeyed = 1;
+    }
+}
+
+/**
+ * Free a route's keys, their lists, and its bounds.
+ *
+ * @param[in,out] route the route
+ */
+static void forget_keys(sql_route * route)
+{
+    for (int i = 0; i < route->key_count; ++i) {
+        free(route->keys[i]);
+    }
+    free(route->keys);
+    route->keys = 0;
+    route->key_count = 0;
+    free(route->key_constants);
+    route->key_constants = 0;
+    free(route->key_items);
+    route->key_items = 0;
+    free(route->lists);
+    route->lists = 0;
+    route->list_count = 0;
+    for (int i = 0; i < route->bound_count; ++i) {
+        free(route->bounds[i].value);
+    }
+    free(route->bounds);
+    route->bounds = 0;
+    route->bound_count = 0;
+}
+
+/**
+ * Is a token a constant: a (whole) string, or a number?
+ *
+ * @param[in] p the start of the token
+ * @param[in] end just past its end
+ * @return 1 if so; 0 otherwise.
+ */
+static short constant_token(const char *p, const char *end)
+{
+    if ((*p == '\'') || (*p == '"')) {
+        return (end - p >= 2) && (end[-1] == *p);
+    }
+    return isdigit((unsigned char)*p) != 0;
+}
+
+/**
+ * Does a statement leave state on the connection it's run on, for the
+ * session's later statements: a temporary table, a lock, a prepared
+ * statement or a user variable, or the rows it found or the id it inserted
+ * (as far as a later statement asks about them)?
+ *
+ * @param[in] sql the statement
+ * @return 1 if so; 0 otherwise.
+ */
+static short keeps_state(const char *sql)
+{
+    const char *p = skip_space(sql);
+    const char *previous = p;
+    const char *previous_end = p;
+
+    if (is_word(p, token_end(p), "prepare") || executable_comment(sql)) {
+        return 1;
+    }
+    while (*p) {
+        const char *end = token_end(p);
+
+        if (word_character(*p)) {
+            if (is_word(p, end, "temporary") || is_word(p, end, "get_lock")
+                || is_word(p, end, "sql_calc_found_rows")
+                || is_word(p, end, "found_rows")
+                || is_word(p, end, "row_count")
+                || is_word(p, end, "last_insert_id")
+                || ((is_word(p, end, "table") || is_word(p, end, "tables"))
+                    && is_word(previous, previous_end, "lock"))) {
+                return 1;
+            }
+        } else if (((*p == '=') && (*previous == ':')
+                    && (previous_end == p))
+                   || ((*p == '@')
+                       && is_word(previous, previous_end, "into"))) {
+            return 1;
+        }
+        previous = p;
+        previous_end = end;
+        p = skip_space(end);
+    }
+    return 0;
+}
+
+/**
+ * Read a statement's route.
+ *
+ * @param[in] sql the statement
+ * @param[out] loose is there a constant outside its outermost WHERE clause
+ * (which the way its result sets are merged might depend on)?
+ * @return freshly allocated route, or 0 on failure (no memory)
+ */
+static sql_route *read_route(const char *sql, short *loose)
+{
+    sql_route *route = calloc(1, sizeof(sql_route));
+    route_reader r;
+    const char *p = skip_space(sql);
+    short hidden;
+
+    if (!route) {
+        return 0;
+    }
+    route->statement = SQL_STATEMENT_OTHER;
+    route->type = SQL_TYPE_PARTITIONED;
+    route->partitioned = -1;
+    route->keeps_state = keeps_state(sql);
+
+    memset(&r, 0, sizeof(r));
+    r.route = route;
+    r.sql = sql;
+    r.key_column = -1;
+
+    /* anything but DML goes everywhere */
+    if (is_word(p, token_end(p), "with")) {
+        r.naming = 1;
+    } else {
+        const char *end = token_end(p);
+        route_word kind = word_character(*p) ? word_kind(p, end) : ROUTE_NAME;
+        if ((kind != ROUTE_STATEMENT) && (kind != ROUTE_SELECT)) {
+            *loose = 0;
+            return route;
+        }
+    }
+
+    while (*p && !r.failed) {
+        const char *end = token_end(p);
+        route_word kind = ROUTE_RESERVED;
+        short name = (*p == '`');
+
+        if (r.term) {
+            const char *next = key_term(&r, p, r.clause == INSERT_SET);
+            r.term = 0;
+            if (next) {
+                p = next;
+                continue;
+            }
+        }
+
+        if (word_character(*p) && !isdigit((unsigned char)*p)) {
+            kind = word_kind(p, end);
+            name = (kind == ROUTE_NAME);
+        } else if (!r.where && constant_token(p, end)) {
+            r.loose = 1;
+        }
+        if (r.naming && name) {
+            if (!add_cte(&r, p, end)) {
+                r.failed = 1;
+            }
+            r.naming = 0;
+        }
+        if (r.table && name) {
+            short inserting = r.started && !r.depth
+                && ((route->statement == SQL_STATEMENT_INSERT)
+                    || (route->statement == SQL_STATEMENT_REPLACE));
+
+            p = read_table(&r, p);
+            if (inserting) {
+                r.clause = INSERT_TABLE;
+            }
+            r.name = 0;
+            continue;
+        }
+        if ((kind != ROUTE_RESERVED) && (kind != ROUTE_INTO)) {
+            r.table = 0;
+        }
+
+        if (word_character(*p)) {
+            route_keyword(&r, kind, p, end);
+        } else {
+            route_punctuation(&r, p, end);
+        }
+        r.name = name;
+        p = skip_space(end);
+    }
+    free(r.ctes);
+    if (r.where) {
+        end_alternative(&r);
+    }
+    if (r.failed) {
+        sql_route_delete(route);
+        return 0;
+    }
+
+    /* an executable comment could hold any other key, or table */
+    hidden = executable_comment(sql);
+    if (hidden || r.unkeyed
+        || (((route->statement == SQL_STATEMENT_INSERT)
+             || (route->statement == SQL_STATEMENT_REPLACE))
+            && (!r.rows || (r.keyed_rows != r.rows)))) {
+        forget_keys(route);
+    }
+
+    if (route->table_count && !r.partitioned && !hidden) {
+        route->type = SQL_TYPE_MASTER;
+    }
+    *loose = r.loose || hidden;
+    return route;
+}
+
+sql_route *sql_get_route(const char *sql)
+{
+    short loose;
+    return read_route(sql, &loose);
+}
+
+/**
+ * Replace a constant of a route with the value of the parameter it is, if
+ * it's a placeholder.
+ *
+ * @param[in] sql the prepared statement
+ * @param[in] placeholders the offset of each placeholder in it
+ * @param[in] count how many there are
+ * @param[in] offset the constant's offset in the statement
+ * @param[in,out] value the constant's value
+ * @param[in] param gets a parameter's value (see sql_bind_route())
+ * @param[in] data passed to param
+ * @return 1 on success, 0 if the parameter's value can't be had
+ */
+static int bind_constant(const char *sql, const int *placeholders,
+                         int count, int offset, char **value,
+                         char *(*param) (void *, int), void *data)
+{
+    int low = 0;
+    int high = count;
+
+    if (sql[offset] != '?') {
+        return 1;
+    }
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (placeholders[middle] < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if ((low == count) || (placeholders[low] != offset)) {
+        return 0;
+    }
+
+    char *bound = param(data, low);
+    if (!bound) {
+        return 0;
+    }
+    free(*value);
+    *value = bound;
+    return 1;
+}
+
+void sql_bind_route(const char *sql, sql_route * route,
+                    char *(*param) (void *, int), void *data)
+{
+    int *placeholders = 0;
+    int count = 0;
+    int allocated = 0;
+    short bound = 1;
+
+    if (!route->key_count && !route->bound_count) {
+        return;
+    }
+
+    /* parameters are numbered in the order their placeholders come in */
+    for (const char *p = skip_space(sql); bound && *p;
+         p = skip_space(token_end(p))) {
+        if (*p != '?') {
+            continue;
+        }
+        if (count == allocated) {
+            int *grown = realloc(placeholders,
+                                 sizeof(int) * (allocated * 2 + 8));
+            if (!grown) {
+                bound = 0;
+                break;
+            }
+            placeholders = grown;
+            allocated = allocated * 2 + 8;
+        }
+        placeholders[count++] = p - sql;
+    }
+
+    for (int i = 0; bound && (i < route->key_count); ++i) {
+        bound = bind_constant(sql, placeholders, count,
+                              route->key_constants[2 * i], &route->keys[i],
+                              param, data);
+    }
+    for (int i = 0; bound && (i < route->bound_count); ++i) {
+        bound = bind_constant(sql, placeholders, count,
+                              route->bounds[i].offset,
+                              &route->bounds[i].value, param, data);
+    }
+    free(placeholders);
+    if (!bound) {
+        forget_keys(route);
+    }
+}
+
+void sql_route_delete(sql_route * route)
+{
+    if (route) {
+        for (int i = 0; i < route->table_count; ++i) {
+            free(route->tables[i]);
+        }
+        free(route->tables);
+        forget_keys(route);
+        free(route);
+    }
+}
+
+char *sql_route_statement(const char *sql, const sql_route * route,
+                          const int *owners, int owner)
+{
+    /* lists only shrink, but for NULL */
+    char *statement = malloc(strlen(sql) + 4 * route->list_count + 1);
+    char *out = statement;
+    const char *p = sql;
+
+    if (!statement) {
+        return 0;
+    }
+    for (int i = 0; i < route->list_count; ++i) {
+        const sql_key_list *list = &route->lists[i];
+        short kept = 0;
+
+        memcpy(out, p, sql + list->start - p);
+        out += sql + list->start - p;
+        for (int k = list->first_key;
+             k < list->first_key + list->key_count; ++k) {
+            if (owners[k] != owner) {
+                continue;
+            }
+            if (kept++) {
+                *out++ = ',';
+            }
+            memcpy(out, sql + route->key_items[2 * k],
+                   route->key_items[2 * k + 1]);
+            out += route->key_items[2 * k + 1];
+        }
+        if (!kept) {
+            memcpy(out, "NULL", 4);
+            out += 4;
+        }
+        p = sql + list->end;
+    }
+    memcpy(out, p, strlen(p) + 1);
+    return statement;
+}
+
+/**
+ * A place in a statement, given as a place in its fingerprint, which is the
+ * same for every statement of the same shape.
+ */
+typedef struct {
+    int offset;                /**< where it is in the fingerprint */
+    int constants;             /**< how many constants come before it */
+} plan_place;
+
+/**
+ * How to route (and perhaps merge) every statement of one shape.
+ */
+typedef struct sql_plan {
+    char *fingerprint;
+    size_t length;
+    unsigned long long hash;
+    sql_route route;           /**< less its keys, and its bounds' values */
+    plan_place *places;        /**< where each key's constant and item
+                                    start and end, then each list, then
+                                    each bound's constant */
+    short loose;               /**< are there constants outside the
+                                    outermost WHERE clause? */
+    short merge_read;          /**< has how to merge been worked out... */
+    short merge_kept;          /**< ...and kept, being the same for every
+                                    statement of the shape... */
+    sql_merge *merge;          /**< ...as this (which may be 0) */
+    struct sql_plan *next;     /**< the next plan in its bucket */
+    struct sql_plan *newer;    /**< the plan used next after this one... */
+    struct sql_plan *older;    /**< ...and the one used last before it */
+} sql_plan;
+
+/**
+ * A thread's plans, and the fingerprint of the statement in hand.
+ */
+typedef struct {
+    sql_plan **buckets;
+    unsigned long long bucket_mask;
+    int count;
+    sql_plan *newest;
+    sql_plan *oldest;
+    char *fingerprint;
+    size_t fingerprint_size;
+    int *starts;               /**< where each constant starts in the
+                                    statement */
+    int *shifts;               /**< how much longer the statement is than
+                                    its fingerprint, before each constant
+                                    (and after the last) */
+    int constant_count;
+    int constant_size;
+    long hits;
+    long misses;
+    long evictions;
+    time_t reported;
+} plan_cache;
+
+/** this thread's plans */
+static __thread plan_cache *plans = 0;
+
+/**
+ * Get this thread's plans, starting them if need be.
+ *
+ * @return the plans, or 0 on failure (no memory)
+ */
+static plan_cache *plans_open(void)
+{
+    int buckets = 1;
+
+    if (plans) {
+        return plans;
+    }
+    while (buckets < plan_cache_size) {
+        buckets *= 2;
+    }
+    plans = calloc(1, sizeof(plan_cache));
+    if (!plans) {
+        return 0;
+    }
+    plans->buckets = calloc(buckets, sizeof(sql_plan *));
+    if (!plans->buckets) {
+        free(plans);
+        plans = 0;
+        return 0;
+    }
+    plans->bucket_mask = buckets - 1;
+    plans->reported = time(0);
+    return plans;
+}
+
+/**
+ * Log how well a thread's plans are doing.
+ *
+ * @param[in,out] c the plans
+ */
+static void plans_report(plan_cache * c)
+{
+    long lookups = c->hits + c->misses;
+    long hit_rate = lookups ? c->hits * 100 / lookups : 0;
+
+    lo(LOG_INFO, "sql: %ld plan lookups, %ld%% hits, %ld misses, "
+       "%ld evicted, %d kept", lookups, hit_rate, c->misses, c->evictions,
+       c->count);
+    c->reported = time(0);
+}
+
+/**
+ * Make room for more constants of the statement in hand.
+ *
+ * @param[in,out] c the plans
+ * @return 1 on success, 0 on failure (no memory)
+ */
+static int grow_constants(plan_cache * c)
+{
+    int size = c->constant_size ? 2 * c->constant_size : 16;
+    int *starts = realloc(c->starts, sizeof(int) * size);
+    int *shifts;
+
+    if (!starts) {
+        return 0;
+    }
+    c->starts = starts;
+    shifts = realloc(c->shifts, sizeof(int) * size);
+    if (!shifts) {
+        return 0;
+    }
+    c->shifts = shifts;
+    c->constant_size = size;
+    return 1;
+}
+
+/**
+ * Note where a constant of the statement in hand is.
+ *
+ * @param[in,out] c the plans
+ * @param[in] start its offset in the statement
+ * @param[in] length its length
+ * @return 1 on success, 0 on failure (no memory)
+ */
+static int add_constant(plan_cache * c, int start, int length)
+{
+    if ((c->constant_count + 2 > c->constant_size) && !grow_constants(c)) {
+        return 0;
+    }
+    c->starts[c->constant_count] = start;
+    c->shifts[c->constant_count + 1] =
+        c->shifts[c->constant_count] + length - 1;
+    ++c->constant_count;
+    return 1;
+}
+
+/**
+ * Work out the fingerprint of a statement: the statement with each constant
+ * replaced by FINGERPRINT_CONSTANT, hashed as it's written.
+ *
+ * @param[in,out] c the plans, which get the fingerprint and where the
+ * statement's constants are
+ * @param[in] sql the statement
+ * @param[out] length the fingerprint's length
+ * @param[out] hash its hash
+ * @return 1 on success, 0 if the statement can't have a fingerprint (no
+ * memory, or a FINGERPRINT_CONSTANT of its own)
+ */
+static int fingerprint(plan_cache * c, const char *sql, size_t *length,
+                       unsigned long long *hash)
+{
+    size_t size = strlen(sql) + 1;
+    unsigned long long h = FNV_OFFSET_BASIS;
+    const char *p = sql;
+    char *out;
+
+    if (size > c->fingerprint_size) {
+        char *grown = realloc(c->fingerprint, size);
+        if (!grown) {
+            return 0;
+        }
+        c->fingerprint = grown;
+        c->fingerprint_size = size;
+    }
+    if (!c->constant_size && !grow_constants(c)) {
+        return 0;
+    }
+    c->constant_count = 0;
+    c->shifts[0] = 0;
+
+    out = c->fingerprint;
+    while (*p) {
+        const char *token = skip_space(p);
+        const char *end = token_end(token);
+        short constant = *token && constant_token(token, end);
+        const char *copied = constant ? token : end;
+
+        for (; p < copied; ++p) {
+            if (*p == FINGERPRINT_CONSTANT) {
+                return 0;
+            }
+            *out++ = *p;
+            h = (h ^ (unsigned char)*p) * FNV_PRIME;
+        }
+        if (constant) {
+            if (!add_constant(c, token - sql, end - token)) {
+                return 0;
+            }
+            *out++ = FINGERPRINT_CONSTANT;
+            h = (h ^ FINGERPRINT_CONSTANT) * FNV_PRIME;
+            p = end;
+        }
+    }
+    *length = out - c->fingerprint;
+    *hash = h;
+    return 1;
+}
+
+/**
+ * Find where a place in the statement in hand is in its fingerprint.
+ *
+ * @param[in] c the plans
+ * @param[in] offset the place in the statement, which isn't inside a
+ * constant
+ * @return the place in the fingerprint
+ */
+static plan_place place_of(const plan_cache * c, int offset)
+{
+    int low = 0;
+    int high = c->constant_count;
+    plan_place place;
+
+    /* the constants starting before it */
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (c->starts[middle] < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    place.offset = offset - c->shifts[low];
+    place.constants = low;
+    return place;
+}
+
+/**
+ * Find where a place in a fingerprint is in the statement in hand.
+ *
+ * @param[in] c the plans
+ * @param[in] place the place in the fingerprint
+ * @return the place in the statement
+ */
+static int offset_of(const plan_cache * c, plan_place place)
+{
+    return place.offset + c->shifts[place.constants];
+}
+
+/**
+ * Free a plan.
+ *
+ * @param[in] plan the plan
+ */
+static void plan_delete(sql_plan * plan)
+{
+    for (int i = 0; i < plan->route.table_count; ++i) {
+        free(plan->route.tables[i]);
+    }
+    free(plan->route.tables);
+    free(plan->route.lists);
+    free(plan->route.bounds);
+    free(plan->places);
+    sql_merge_delete(plan->merge);
+    free(plan->fingerprint);
+    free(plan);
+}
+
+/**
+ * Take a plan out of the order in which plans were used.
+ *
+ * @param[in,out] c the plans
+ * @param[in] plan the plan
+ */
+static void plan_unlink(plan_cache * c, sql_plan * plan)
+{
+    if (plan->newer) {
+        plan->newer->older = plan->older;
+    } else {
+        c->newest = plan->older;
+    }
+    if (plan->older) {
+        plan->older->newer = plan->newer;
+    } else {
+        c->oldest = plan->newer;
+    }
+}
+
+/**
+ * Make a plan the one used most lately.
+ *
+ * @param[in,out] c the plans
+ * @param[in] plan the plan
+ */
+static void plan_link(plan_cache * c, sql_plan * plan)
+{
+    plan->newer = 0;
+    plan->older = c->newest;
+    if (c->newest) {
+        c->newest->newer = plan;
+    } else {
+        c->oldest = plan;
+    }
+    c->newest = plan;
+}
+
+/**
+ * Find the plan for the fingerprint in hand.
+ *
+ * @param[in] c the plans
+ * @param[in] length the fingerprint's length
+ * @param[in] hash its hash
+ * @return the plan, or 0 if there isn't one
+ */
+static sql_plan *plan_find(const plan_cache * c, size_t length,
+                           unsigned long long hash)
+{
+    sql_plan *plan = c->buckets[hash & c->bucket_mask];
+
+    for (; plan; plan = plan->next) {
+        if ((plan->hash == hash) && (plan->length == length)
+            && !memcmp(plan->fingerprint, c->fingerprint, length)) {
+            return plan;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Throw out the plan used least lately.
+ *
+ * @param[in,out] c the plans
+ */
+static void plan_evict(plan_cache * c)
+{
+    sql_plan *plan = c->oldest;
+    sql_plan **link = &c->buckets[plan->hash & c->bucket_mask];
+
+    while (*link != plan) {
+        link = &(*link)->next;
+    }
+    *link = plan->next;
+    plan_unlink(c, plan);
+    plan_delete(plan);
+    --c->count;
+    ++c->evictions;
+}
+
+/**
+ * Make a plan of a statement's route, for the fingerprint in hand.
+ *
+ * @param[in,out] c the plans
+ * @param[in] route the route
+ * @param[in] length the fingerprint's length
+ * @param[in] hash its hash
+ * @param[in] loose are there constants outside the outermost WHERE clause?
+ * @return the plan, or 0 on failure (no memory)
+ */
+static sql_plan *plan_add(plan_cache * c, const sql_route * route,
+                          size_t length, unsigned long long hash,
+                          short loose)
+{
+    int place_count = 4 * route->key_count + 2 * route->list_count
+        + 2 * route->bound_count;
+    sql_plan *plan = calloc(1, sizeof(sql_plan));
+    plan_place *place;
+
+    if (!plan) {
+        return 0;
+    }
+    plan->fingerprint = malloc(length);
+    plan->route.tables = calloc(route->table_count + 1, sizeof(char *));
+    plan->places = malloc(sizeof(plan_place) * (place_count + 1));
+    plan->route.lists = malloc(sizeof(sql_key_list)
+                               * (route->list_count + 1));
+    plan->route.bounds = malloc(sizeof(sql_key_bound)
+                                * (route->bound_count + 1));
+    if (!plan->fingerprint || !plan->route.tables || !plan->places
+        || !plan->route.lists || !plan->route.bounds) {
+        plan_delete(plan);
+        return 0;
+    }
+    for (; plan->route.table_count < route->table_count;
+         ++plan->route.table_count) {
+        plan->route.tables[plan->route.table_count] =
+            strdup(route->tables[plan->route.table_count]);
+        if (!plan->route.tables[plan->route.table_count]) {
+            plan_delete(plan);
+            return 0;
+        }
+    }
+    memcpy(plan->fingerprint, c->fingerprint, length);
+    plan->length = length;
+    plan->hash = hash;
+    plan->loose = loose;
+
+    plan->route.statement = route->statement;
+    plan->route.type = route->type;
+    plan->route.partitioned = route->partitioned;
+    plan->route.key = route->key;
+    plan->route.keeps_state = route->keeps_state;
+    plan->route.key_count = route->key_count;
+    plan->route.list_count = route->list_count;
+    plan->route.bound_count = route->bound_count;
+    if (route->list_count) {
+        memcpy(plan->route.lists, route->lists,
+               sizeof(sql_key_list) * route->list_count);
+    }
+    if (route->bound_count) {
+        memcpy(plan->route.bounds, route->bounds,
+               sizeof(sql_key_bound) * route->bound_count);
+    }
+
+    place = plan->places;
+    for (int i = 0; i < route->key_count; ++i) {
+        const int *constant = &route->key_constants[2 * i];
+        const int *item = &route->key_items[2 * i];
+
+        *place++ = place_of(c, constant[0]);
+        *place++ = place_of(c, constant[0] + constant[1]);
+        *place++ = place_of(c, item[0]);
+        *place++ = place_of(c, item[0] + item[1]);
+    }
+    for (int i = 0; i < route->list_count; ++i) {
+        *place++ = place_of(c, route->lists[i].start);
+        *place++ = place_of(c, route->lists[i].end);
+    }
+    for (int i = 0; i < route->bound_count; ++i) {
+        plan->route.bounds[i].value = 0;
+        *place++ = place_of(c, route->bounds[i].offset);
+        *place++ = place_of(c, route->bounds[i].offset
+                            + route->bounds[i].length);
+    }
+
+    if (c->count >= plan_cache_size) {
+        plan_evict(c);
+    }
+    plan->next = c->buckets[hash & c->bucket_mask];
+    c->buckets[hash & c->bucket_mask] = plan;
+    plan_link(c, plan);
+    ++c->count;
+    return plan;
+}
+
+/**
+ * Route the statement in hand by its plan, reading its keys and bounds.
+ *
+ * @param[in] c the plans
+ * @param[in] plan the statement's plan
+ * @param[in] sql the statement
+ * @return freshly allocated route, or 0 on failure (no memory)
+ */
+static sql_route *plan_route(const plan_cache * c, const sql_plan * plan,
+                             const char *sql)
+{
+    const sql_route *template = &plan->route;
+    const plan_place *place = plan->places;
+    sql_route *route = calloc(1, sizeof(sql_route));
+
+    if (!route) {
+        return 0;
+    }
+    route->statement = template->statement;
+    route->type = template->type;
+    route->partitioned = template->partitioned;
+    route->key = template->key;
+    route->keeps_state = template->keeps_state;
+
+    route->tables = malloc(sizeof(char *) * (template->table_count + 1));
+    route->keys = calloc(template->key_count + 1, sizeof(char *));
+    route->key_constants = malloc(sizeof(int) * 2
+                                  * (template->key_count + 1));
+    route->key_items = malloc(sizeof(int) * 2 * (template->key_count + 1));
+    route->lists = malloc(sizeof(sql_key_list)
+                          * (template->list_count + 1));
+    route->bounds = calloc(template->bound_count + 1,
+                           sizeof(sql_key_bound));
+    if (!route->tables || !route->keys || !route->key_constants
+        || !route->key_items || !route->lists || !route->bounds) {
+        sql_route_delete(route);
+        return 0;
+    }
+    route->key_count = template->key_count;
+    route->list_count = template->list_count;
+    route->bound_count = template->bound_count;
+
+    for (; route->table_count < template->table_count;
+         ++route->table_count) {
+        route->tables[route->table_count] =
+            strdup(template->tables[route->table_count]);
+        if (!route->tables[route->table_count]) {
+            sql_route_delete(route);
+            return 0;
+        }
+    }
+    for (int i = 0; i < route->key_count; ++i, place += 4) {
+        int start = offset_of(c, place[0]);
+        int end = offset_of(c, place[1]);
+
+        route->keys[i] = copy_constant(sql + start, sql + end);
+        if (!route->keys[i]) {
+            sql_route_delete(route);
+            return 0;
+        }
+        route->key_constants[2 * i] = start;
+        route->key_constants[2 * i + 1] = end - start;
+        route->key_items[2 * i] = offset_of(c, place[2]);
+        route->key_items[2 * i + 1] =
+            offset_of(c, place[3]) - route->key_items[2 * i];
+    }
+    for (int i = 0; i < route->list_count; ++i, place += 2) {
+        route->lists[i] = template->lists[i];
+        route->lists[i].start = offset_of(c, place[0]);
+        route->lists[i].end = offset_of(c, place[1]);
+    }
+    for (int i = 0; i < route->bound_count; ++i, place += 2) {
+        int start = offset_of(c, place[0]);
+        int end = offset_of(c, place[1]);
+
+        route->bounds[i] = template->bounds[i];
+        route->bounds[i].value = copy_constant(sql + start, sql + end);
+        route->bounds[i].offset = start;
+        route->bounds[i].length = end - start;
+        if (!route->bounds[i].value) {
+            sql_route_delete(route);
+            return 0;
+        }
+    }
+    return route;
+}
+
+/**
+ * Copy how to merge a statement's result sets.
+ *
+ * @param[in] merge how to merge them
+ * @return freshly allocated copy, or 0 on failure (no memory)
+ */
+static sql_merge *merge_copy(const sql_merge * merge)
+{
+    sql_merge *copy = malloc(sizeof(sql_merge));
+
+    if (!copy) {
+        return 0;
+    }
+    *copy = *merge;
+    copy->order = calloc(merge->order_count + 1, sizeof(sql_order));
+    copy->aggregates = malloc(sizeof(sql_aggregate)
+                              * (merge->aggregate_count + 1));
+    copy->having = calloc(merge->having_count + 1, sizeof(sql_condition));
+    copy->statement = merge->statement ? strdup(merge->statement) : 0;
+    if (!copy->order || !copy->aggregates || !copy->having
+        || (merge->statement && !copy->statement)) {
+        copy->order_count = 0;
+        copy->having_count = 0;
+        sql_merge_delete(copy);
+        return 0;
+    }
+    if (merge->aggregate_count) {
+        memcpy(copy->aggregates, merge->aggregates,
+               sizeof(sql_aggregate) * merge->aggregate_count);
+    }
+    for (int i = 0; i < merge->order_count; ++i) {
+        copy->order[i] = merge->order[i];
+        copy->order[i].name = 0;
+        if (merge->order[i].name
+            && !(copy->order[i].name = strdup(merge->order[i].name))) {
+            sql_merge_delete(copy);
+            return 0;
+        }
+    }
+    for (int i = 0; i < merge->having_count; ++i) {
+        copy->having[i] = merge->having[i];
+        copy->having[i].value = strdup(merge->having[i].value);
+        if (!copy->having[i].value) {
+            sql_merge_delete(copy);
+            return 0;
+        }
+    }
+    return copy;
+}
+
+sql_route *sql_get_plan(const char *sql, sql_merge ** merge)
+{
+    plan_cache *c = plan_cache_size ? plans_open() : 0;
+    sql_plan *plan = 0;
+    sql_route *route;
+    size_t length;
+    unsigned long long hash;
+
+    if (!c || !fingerprint(c, sql, &length, &hash)) {
+        route = sql_get_route(sql);
+        if (merge) {
+            *merge = route ? sql_get_merge(sql) : 0;
+        }
+        return route;
+    }
+
+    plan = plan_find(c, length, hash);
+    if (plan) {
+        ++c->hits;
+        plan_unlink(c, plan);
+        plan_link(c, plan);
+        route = plan_route(c, plan, sql);
+    } else {
+        short loose;
+
+        ++c->misses;
+        route = read_route(sql, &loose);
+        if (route) {
+            plan = plan_add(c, route, length, hash, loose);
+        }
+    }
+
+    if (merge) {
+        *merge = 0;
+        if (route && plan && plan->merge_read && plan->merge_kept) {
+            *merge = plan->merge ? merge_copy(plan->merge) : 0;
+        } else if (route) {
+            *merge = sql_get_merge(sql);
+            if (plan && !plan->merge_read) {
+                /* a rewritten statement has every constant in it */
+                plan->merge_read = 1;
+                plan->merge_kept = !plan->loose
+                    && !(*merge && (*merge)->statement);
+                if (plan->merge_kept && *merge) {
+                    plan->merge = merge_copy(*merge);
+                    plan->merge_kept = plan->merge != 0;
+                }
+            }
+        }
+    }
+
+    if (time(0) - c->reported >= PLAN_REPORT_INTERVAL) {
+        plans_report(c);
+    }
+    return route;
+}
+
+void sql_plans_close(void)
+{
+    if (!plans) {
+        return;
+    }
+    if (plans->hits || plans->misses) {
+        plans_report(plans);
+    }
+    while (plans->oldest) {
+        sql_plan *plan = plans->oldest;
+        plan_unlink(plans, plan);
+        plan_delete(plan);
+    }
+    free(plans->buckets);
+    free(plans->fingerprint);
+    free(plans->starts);
+    free(plans->shifts);
+    free(plans);
+    plans = 0;
 }
 
 sql_table_type sql_get_table_type(char *table)
@@ -161,6 +3639,7 @@ static cfg_opt_t partitioned_table_options[] = {
 static cfg_opt_t options[] = {
     CFG_SEC(CFG_PARTITIONED_TABLE, partitioned_table_options,
             CFGF_TITLE | CFGF_MULTI),
+    CFG_INT(CFG_PLAN_CACHE_SIZE, CFG_PLAN_CACHE_SIZE_DEFAULT, 0),
     CFG_END()
 };
 
@@ -5,7 +5,9 @@
  * @file sql.h
  * @brief SQL parsing
  * 
- * The sql component should be exclusively used by the server component.
+ * The sql component should be exclusively used by the server component,
+ * which hands the database driver a description of how to merge the result
+ * sets of a query sent to several delegates (see sql_get_merge()).
  */
 
 #include "component.h"
@@ -25,15 +27,260 @@ typedef enum {
     SQL_TYPE_PARTITIONED
 } sql_type;
 
+typedef enum {
+    SQL_STATEMENT_SELECT,
+    SQL_STATEMENT_INSERT,
+    SQL_STATEMENT_UPDATE,
+    SQL_STATEMENT_DELETE,
+    SQL_STATEMENT_REPLACE,
+    SQL_STATEMENT_OTHER
+} sql_statement;
+
+/**
+ * A list of a statement's keys, each of which can be left out of what's sent
+ * to a delegate which doesn't hold it: the constants of an IN list, or the
+ * rows of an INSERT's VALUES.
+ */
+typedef struct {
+    int start;        /**< offset of the list's first item in the statement */
+    int end;          /**< ...and just past its last */
+    int first_key;    /**< which of the route's keys is the first item's */
+    int key_count;
+} sql_key_list;
+
+/**
+ * A bound on the key, from a term comparing it with a constant (<, <=, >,
+ * >=, or BETWEEN's two).
+ */
+typedef struct {
+    char *value;      /**< the constant, as written (less quotes) */
+    int offset;       /**< ...its offset in the statement */
+    int length;       /**< ...and its length there */
+    short upper;      /**< does it bound the key from above (or below)? */
+    short exclusive;  /**< ...leaving out the value itself? */
+    int alternative;  /**< which alternative OR'd together it's a term of,
+                           all of whose bounds the rows meet */
+} sql_key_bound;
+
+/**
+ * Where a statement should go.
+ */
+typedef struct {
+    sql_statement statement;
+    sql_type type;    /**< master if it names tables, and none of them is
+                           partitioned */
+    char **tables;    /**< every table it names, without any qualifier or
+                           quotes */
+    int table_count;
+    int partitioned;  /**< which of them the keys are of, or -1 */
+    const char *key;  /**< that table's key column */
+    char **keys;      /**< values of its key, as written (less quotes): the
+                           statement touches no row without one */
+    int key_count;    /**< or 0 if it may touch any row */
+    int *key_constants; /**< each key's constant: its offset and length in
+                             the statement */
+    int *key_items;   /**< each key's item of a list: its offset and length
+                           in the statement */
+    sql_key_list *lists;
+    int list_count;
+    sql_key_bound *bounds; /**< bounds of the alternatives without keys: the
+                                statement touches no row outside those of
+                                one of them (or with one of the keys) */
+    int bound_count;
+    short keeps_state; /**< does it leave state on the connection it's run
+                            on, for the session's later statements? */
+} sql_route;
+
+/**
+ * A column which a result set is ordered by.
+ */
+typedef struct {
+    char *name;       /**< the column's name (or the expression, as written),
+                           or 0 to go by position */
+    int position;     /**< the column's number, from 1, if there's no name */
+    short descending;
+} sql_order;
+
+typedef enum {
+    SQL_AGGREGATE_COUNT,
+    SQL_AGGREGATE_SUM,
+    SQL_AGGREGATE_MIN,
+    SQL_AGGREGATE_MAX,
+    SQL_AGGREGATE_AVG,
+    SQL_AGGREGATE_GROUP, /**< a column the rows are grouped by */
+    SQL_AGGREGATE_ANY    /**< any of the group's rows' values will do */
+} sql_aggregate_function;
+
+/**
+ * How a column of the delegates' rows is folded into the final row.
+ */
+typedef struct {
+    sql_aggregate_function function;
+    int count_column; /**< for AVG, which is sent as SUM: the column holding
+                           the COUNT its sum is divided by */
+} sql_aggregate;
+
+typedef enum {
+    SQL_EQUAL,
+    SQL_NOT_EQUAL,
+    SQL_LESS,
+    SQL_LESS_EQUAL,
+    SQL_GREATER,
+    SQL_GREATER_EQUAL
+} sql_comparison;
+
 /**
- * Determine the type of a given query
+ * A condition (from a HAVING clause) on a column of the merged rows.
+ */
+typedef struct {
+    int column;
+    sql_comparison comparison;
+    char *value;      /**< the constant the column is compared with */
+} sql_condition;
+
+/**
+ * How to merge the delegates' result sets for a query into one, beyond
+ * passing on every delegate's rows as they come.
+ */
+typedef struct {
+    sql_order *order; /**< what to order rows by, most significant first */
+    int order_count;
+    char *statement;  /**< what to send the delegates instead of the query,
+                           or 0 to send it as it is */
+    sql_aggregate *aggregates; /**< how to fold each column of the
+                                    delegates' rows into one, or 0 */
+    int aggregate_count;
+    int visible;      /**< how many of those columns the client sees; the
+                           rest were only added to the statement */
+    short grouped;    /**< fold rows into one per group, rather than all
+                           into one */
+    sql_condition *having; /**< which groups to keep: those meeting every
+                                condition */
+    int having_count;
+    long long offset; /**< how many rows (or groups) to skip... */
+    long long limit;  /**< ...and how many to pass on after that, or -1 for
+                           all of them */
+    const char *unmergeable; /**< why the result sets can't be merged, if
+                                  there's more than one, or 0 */
+} sql_merge;
+
+/**
+ * Work out how to route a statement: which tables it works on, and which
+ * values of a partitioned table's key, if any, pick out every row it
+ * touches. The statement is read once, token by token, with keywords in any
+ * case, and quoted names, strings and comments taken for what they are.
+ * Keys come from the terms of the outermost WHERE clause which compare the
+ * key column with a constant, or with an IN list of them, or from the key
+ * column of each row an INSERT or REPLACE gives VALUES (or SET) for. An
+ * alternative OR'd together with others which has no such term can be
+ * bounded instead, by terms comparing the key column with a constant using
+ * <, <=, >, >= or BETWEEN; but every alternative needs one or the other. A
+ * statement which names one partitioned table (outside any subquery) can
+ * have keys and bounds.
+ *
+ * @param[in] sql the incoming statement
+ * @return freshly allocated route, or 0 on failure (no memory)
+ */
+sql_route *sql_get_route(const char *sql);
+
+/**
+ * Work out how to route a statement, as sql_get_route() does, and how to
+ * merge its result sets, as sql_get_merge() does, using this thread's cache
+ * of plans. A plan is kept for each shape of statement seen lately, which
+ * is the statement less the values of its constants; a statement of a
+ * known shape only has its constants read, to get its keys and bounds. How
+ * to merge is kept too, unless the statement has constants outside its
+ * WHERE clause, or has to be rewritten.
+ *
+ * @param[in] sql the incoming statement
+ * @param[out] merge where to put how to merge the result sets (which may be
+ * 0, as with sql_get_merge()), or 0 if they needn't be merged
+ * @return freshly allocated route, or 0 on failure (no memory)
+ */
+sql_route *sql_get_plan(const char *sql, sql_merge ** merge);
+
+/**
+ * Fill in the keys and bounds of a prepared statement's route which are
+ * its parameters (its placeholders, which routing takes for constants),
+ * with the values they're bound to. If any of them can't be had, the route
+ * is left with no keys or bounds at all.
+ *
+ * @param[in] sql the prepared statement
+ * @param[in,out] route its route
+ * @param[in] param gets a parameter's value, by its number from 0, as
+ * text: freshly allocated, or 0 if it can't be had (being NULL, say)
+ * @param[in] data passed to param
+ */
+void sql_bind_route(const char *sql, sql_route * route,
+                    char *(*param) (void *, int), void *data);
+
+/**
+ * Free this thread's cache of plans, logging how well it did.
+ */
+void sql_plans_close(void);
+
+/**
+ * Free a statement's route.
+ *
+ * @param[in] route the route, or 0
+ */
+void sql_route_delete(sql_route * route);
+
+/**
+ * Cut a statement down to the keys one delegate holds: each of its lists
+ * keeps just the items whose keys are that delegate's, and an IN list with
+ * none left is given NULL instead.
+ *
+ * @param[in] sql the statement
+ * @param[in] route its route
+ * @param[in] owners each key's delegate
+ * @param[in] owner the delegate
+ * @return freshly allocated SQL, or 0 on failure (no memory)
+ */
+char *sql_route_statement(const char *sql, const sql_route * route,
+                          const int *owners, int owner);
+
+/**
+ * Work out how the delegates' result sets for a query have to be merged. A
+ * SELECT with an ORDER BY is sent to every delegate as it is, so each
+ * delegate's rows come back in order, and only need merging; but one
+ * ordered by something it doesn't select is unmergeable. A SELECT of
+ * nothing but COUNT(), SUM(), MIN(), MAX() and AVG() (with no GROUP BY) has
+ * each delegate work out its part of every aggregate, to be folded into a
+ * single row; AVG() is sent as SUM(), with a COUNT() added to the end of
+ * the select list. A SELECT with a GROUP BY (and only foldable aggregates)
+ * is folded into a row per group instead: the delegates are sent it without
+ * its HAVING, ORDER BY and LIMIT, which pdb applies to the merged groups,
+ * and with any group columns or aggregates those need which weren't asked
+ * for added to the end of the select list. Any other SELECT with a LIMIT
+ * has each delegate send no more rows than the OFFSET and LIMIT together,
+ * and pdb passes on only the rows the client asked for. A GROUP BY which
+ * can't be folded (a HAVING with OR in it, COUNT(DISTINCT), GROUP_CONCAT(),
+ * WITH ROLLUP, or a clause pdb can't see to, say) is described as
+ * unmergeable, since every delegate would have its own rows for a group.
  *
  * @param[in] sql the incoming query string
- * @return table type
+ * @return freshly allocated description, or 0 if there's nothing to do but
+ * concatenate the result sets (or no memory)
+ */
+sql_merge *sql_get_merge(const char *sql);
+
+/**
+ * Do the delegates' result sets for a query need more than concatenating:
+ * has it an ORDER BY, a GROUP BY, a LIMIT or aggregates (whether or not
+ * sql_get_merge() could merge them)?
+ *
+ * @param[in] sql the incoming query string
+ * @return 1 if so; 0 otherwise.
  */
-sql_type sql_get_type(char *sql);
+short sql_needs_merge(const char *sql);
 
-long *sql_get_map_keys(char *sql);
+/**
+ * Free a description of how to merge result sets.
+ *
+ * @param[in] merge the description, or 0
+ */
+void sql_merge_delete(sql_merge * merge);
 
 /**
  * Determine the type of a given table (master or partitioned)
@@ -0,0 +1,92 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+
+require('test/PDBTest.pm');
+
+## boot with a prefork worker pool, and check the workers answer
+eval {
+    unlink('test/prefork.log');
+    my $pid = PDBTest::startup_with_inline_configuration(<<'ENDCFG');
+log_level = DEBUG
+log_file = test/prefork.log
+listen_port = 5033
+concurrency_model = prefork
+prefork_workers = 2
+ENDCFG
+
+    for (1 .. 4) {
+        socket(SH, PF_INET, SOCK_STREAM, getprotobyname('tcp')) or die;
+        connect(SH, sockaddr_in(5033, inet_aton("localhost"))) or die;
+        close(SH) or die;
+    }
+
+    PDBTest::shutdown();
+};
+ok($@ eq '', "test failed: $@");
+like(`cat test/prefork.log`, qr/worker started/, "no workers started");
+like(`cat test/prefork.log`, qr/worker exiting/, "workers didn't exit");
+unlink('test/prefork.log');
+
+## boot a single event loop worker, and check it accepts connections
+eval {
+    unlink('test/event.log');
+    my $pid = PDBTest::startup_with_inline_configuration(<<'ENDCFG');
+log_level = DEBUG
+log_file = test/event.log
+listen_port = 5034
+concurrency_model = event
+ENDCFG
+
+    for (1 .. 4) {
+        socket(SH, PF_INET, SOCK_STREAM, getprotobyname('tcp')) or die;
+        connect(SH, sockaddr_in(5034, inet_aton("localhost"))) or die;
+        close(SH) or die;
+    }
+
+    PDBTest::shutdown();
+};
+ok($@ eq '', "test failed: $@");
+like(`cat test/event.log`, qr/worker started/, "event worker didn't start");
+like(`cat test/event.log`, qr/worker exiting/, "event worker didn't exit");
+unlink('test/event.log');
+
+## boot a pair of reactor threads, each with its own listening socket
+eval {
+    unlink('test/thread.log');
+    my $pid = PDBTest::startup_with_inline_configuration(<<'ENDCFG');
+log_level = DEBUG
+log_file = test/thread.log
+listen_port = 5035
+concurrency_model = thread
+thread_workers = 2
+ENDCFG
+
+    for (1 .. 4) {
+        socket(SH, PF_INET, SOCK_STREAM, getprotobyname('tcp')) or die;
+        connect(SH, sockaddr_in(5035, inet_aton("localhost"))) or die;
+        close(SH) or die;
+    }
+
+    PDBTest::shutdown();
+};
+ok($@ eq '', "test failed: $@");
+like(`cat test/thread.log`, qr/reactor 1 started/, "reactors didn't start");
+like(`cat test/thread.log`, qr/reactor 1 exiting/, "reactors didn't exit");
+unlink('test/thread.log');
+
+## a prefork pool needs at least one worker
+eval {
+    my $pid = PDBTest::startup_with_inline_configuration(<<'ENDCFG');
+log_level = NONE
+concurrency_model = prefork
+prefork_workers = 0
+ENDCFG
+
+    PDBTest::shutdown();
+};
+like($@, qr/error/, "pdb booted with an empty prefork pool");
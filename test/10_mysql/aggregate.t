@@ -0,0 +1,53 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+use DBI;
+use DBD::mysql;
+
+use lib qw(test);
+use MySQLTest;
+use PDBTest;
+
+my $port = 2139;
+
+PDBTest::startup_with_inline_configuration(<<"ENDCFG");
+log_file = test/pdb.log
+log_level = DEBUG
+
+listen_port = $port
+
+$MySQLTest::database_configuration
+ENDCFG
+
+eval {
+    my $dbh_pdb = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'root', '', { RaiseError => 1 });
+
+    my $n = "IF(DATABASE() = 'master', 10, 2)";
+
+    ## every delegate's aggregates, folded into a single row
+    my $rows = $dbh_pdb->selectall_arrayref("SELECT COUNT(*), SUM($n), MIN($n), MAX($n) FROM DUAL");
+    ok(@$rows == 1);
+    is(join(',', @{$rows->[0]}), '3,14,2,10');
+
+    ## AVG() is worked out from every delegate's SUM() and COUNT()
+    my $sth = $dbh_pdb->prepare("SELECT AVG($n) AS a FROM DUAL");
+    $sth->execute();
+    ok($sth->{NUM_OF_FIELDS} == 1);
+    is($sth->{NAME}->[0], 'a');
+    $rows = $sth->fetchall_arrayref();
+    ok(@$rows == 1);
+    is($rows->[0]->[0], '4.6667');
+
+    ## delegates with no rows still count
+    $rows = $dbh_pdb->selectall_arrayref("SELECT COUNT(*), SUM($n) FROM DUAL WHERE DATABASE() = 'partition_1'");
+    is(join(',', @{$rows->[0]}), '1,2');
+
+    $dbh_pdb->disconnect();
+};
+ok($@ eq '');
+
+PDBTest::shutdown();
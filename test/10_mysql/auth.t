@@ -0,0 +1,54 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+use DBI;
+use DBD::mysql;
+
+use lib qw(test);
+use MySQLTest;
+use PDBTest;
+
+my $port = 2139;
+
+# pdb checks logins itself; the password for app is 'secret'
+PDBTest::startup_with_inline_configuration(<<"ENDCFG");
+log_file = test/pdb.log
+log_level = DEBUG
+
+listen_port = $port
+
+client_user app
+{
+    password_hash = "*14E65567ABDB5135D0CFD9A70B3032C179A49EE7"
+}
+
+$MySQLTest::database_configuration
+ENDCFG
+
+eval {
+    my $dbh_pdb = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'app', 'secret', { RaiseError => 1 });
+
+    # delegates are logged in to as their configured user
+    my $row = $dbh_pdb->selectall_arrayref('SELECT DATABASE(),USER()')->[0];
+    ok($row);
+    ok($row->[0] eq 'master');
+    ok($row->[1] =~ /^root/);
+
+    $dbh_pdb->disconnect();
+};
+ok($@ eq '');
+
+my $dbh_bad = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'app', 'wrong', { PrintError => 0 });
+ok(!$dbh_bad);
+like($DBI::errstr, qr/Access denied/);
+
+$dbh_bad = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'root', '', { PrintError => 0 });
+ok(!$dbh_bad);
+
+PDBTest::shutdown();
+
+like(`cat test/pdb.log`, qr/logged in app/, "login wasn't checked locally");
@@ -0,0 +1,63 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+use DBI;
+use DBD::mysql;
+
+use lib qw(test);
+use MySQLTest;
+use PDBTest;
+
+my $port = 2139;
+
+PDBTest::startup_with_inline_configuration(<<"ENDCFG");
+log_file = test/pdb.log
+log_level = DEBUG
+
+listen_port = $port
+
+$MySQLTest::database_configuration
+ENDCFG
+
+sub rows ($$) {
+    my ($dbh, $sql) = @_;
+    return join(';', map { join(',', @$_) } @{$dbh->selectall_arrayref($sql)});
+}
+
+eval {
+    my $dbh_pdb = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'root', '', { RaiseError => 1 });
+
+    my $k = "IF(DATABASE() = 'master', 'm', 'p')";
+    my $n = "IF(DATABASE() = 'partition_2', 5, 1)";
+
+    ## every delegate's groups, folded into one row per group
+    is(rows($dbh_pdb, "SELECT $k AS k, COUNT(*), SUM($n) FROM DUAL GROUP BY k ORDER BY k"),
+       'm,1,1;p,2,6');
+
+    ## HAVING is checked against the folded groups
+    is(rows($dbh_pdb, "SELECT $k AS k FROM DUAL GROUP BY k HAVING COUNT(*) > 1"),
+       'p');
+
+    ## as are ORDER BY and LIMIT, on a column the client didn't ask for
+    is(rows($dbh_pdb, "SELECT $k AS k FROM DUAL GROUP BY k ORDER BY SUM($n) DESC LIMIT 1"),
+       'p');
+
+    ## groups which can't be folded aren't merged wrongly, but refused
+    for my $clause ("HAVING COUNT(*) > 1 OR k = 'm'", 'WITH ROLLUP') {
+        ok(!eval { $dbh_pdb->selectall_arrayref("SELECT $k AS k, COUNT(*) FROM DUAL GROUP BY k $clause"); 1 });
+    }
+    ok(!eval { $dbh_pdb->selectall_arrayref("SELECT $k AS k, GROUP_CONCAT($n) FROM DUAL GROUP BY k"); 1 });
+
+    ## unless they come from a single delegate
+    is(rows($dbh_pdb, 'SELECT widget_id, GROUP_CONCAT(widget_information) FROM widget WHERE widget_id = 1 GROUP BY widget_id'),
+       '1,widget one');
+
+    $dbh_pdb->disconnect();
+};
+ok($@ eq '');
+
+PDBTest::shutdown();
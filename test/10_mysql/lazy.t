@@ -0,0 +1,46 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+use DBI;
+use DBD::mysql;
+
+use lib qw(test);
+use MySQLTest;
+use PDBTest;
+
+my $port = 2139;
+
+PDBTest::startup_with_inline_configuration(<<"ENDCFG");
+log_file = test/pdb.log
+log_level = DEBUG
+
+listen_port = $port
+
+$MySQLTest::database_configuration
+ENDCFG
+
+eval {
+    my $dbh_pdb = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'root', '', { RaiseError => 1 });
+
+    # only the master is connected so far
+    $dbh_pdb->do("SET SESSION sql_mode = 'ANSI_QUOTES'");
+    my $row = $dbh_pdb->selectall_arrayref("LISTFIELDS whatsit");
+    ok($row);
+
+    # the partitions are connected now, and given the client's sql_mode
+    $row = $dbh_pdb->selectall_arrayref('SELECT @@SESSION.sql_mode')->[0];
+    ok($row);
+    ok($row->[0] eq 'ANSI_QUOTES');
+
+    $dbh_pdb->disconnect();
+};
+ok($@ eq '');
+
+PDBTest::shutdown();
+
+like(`cat test/pdb.log`, qr/partition_1: replayed 1 commands/,
+     "session state wasn't replayed");
@@ -0,0 +1,70 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+use DBI;
+use DBD::mysql;
+
+use lib qw(test);
+use MySQLTest;
+use PDBTest;
+
+my $port = 2139;
+
+PDBTest::startup_with_inline_configuration(<<"ENDCFG");
+log_file = test/pdb.log
+log_level = DEBUG
+
+listen_port = $port
+
+$MySQLTest::database_configuration
+ENDCFG
+
+sub column ($$) {
+    my ($dbh, $sql) = @_;
+    return join(',', map { $_->[0] } @{$dbh->selectall_arrayref($sql)});
+}
+
+eval {
+    my $dbh_pdb = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'root', '', { RaiseError => 1 });
+
+    ## LIMIT counts every delegate's rows, not each one's
+    is(column($dbh_pdb, 'SELECT DATABASE() AS db ORDER BY db LIMIT 2'),
+       'master,partition_1');
+
+    ## as does OFFSET
+    is(column($dbh_pdb, 'SELECT DATABASE() AS db ORDER BY db LIMIT 1, 1'),
+       'partition_1');
+    is(column($dbh_pdb, 'SELECT DATABASE() AS db ORDER BY db DESC LIMIT 5 OFFSET 2'),
+       'master');
+
+    ## a locking clause after the LIMIT stays with it
+    is(column($dbh_pdb, 'SELECT widget_id FROM widget ORDER BY widget_id LIMIT 1, 2 FOR UPDATE'),
+       '2,3');
+    is(column($dbh_pdb, 'SELECT widget_id FROM widget ORDER BY widget_id LIMIT 2 OFFSET 1 LOCK IN SHARE MODE'),
+       '2,3');
+
+    ## a count too big to be one is every row after the OFFSET
+    is(column($dbh_pdb, 'SELECT widget_id FROM widget ORDER BY widget_id LIMIT 1, 18446744073709551615'),
+       '2,3,4');
+
+    ## a UNION's LIMIT is its whole result's
+    is(column($dbh_pdb, 'SELECT widget_id FROM widget WHERE widget_id < 3 UNION ALL SELECT widget_id FROM widget WHERE widget_id > 2 ORDER BY widget_id LIMIT 1, 2'),
+       '2,3');
+
+    ## rows in no particular order are cut short too
+    my $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE() LIMIT 1');
+    ok(@$rows == 1);
+
+    ## and the connection is still in step afterwards
+    $rows = $dbh_pdb->selectall_arrayref('SELECT 2');
+    ok(@$rows == 3);
+
+    $dbh_pdb->disconnect();
+};
+ok($@ eq '');
+
+PDBTest::shutdown();
@@ -0,0 +1,46 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+use DBI;
+use DBD::mysql;
+
+use lib qw(test);
+use MySQLTest;
+use PDBTest;
+
+my $port = 2139;
+
+PDBTest::startup_with_inline_configuration(<<"ENDCFG");
+log_file = test/pdb.log
+log_level = DEBUG
+
+listen_port = $port
+
+$MySQLTest::database_configuration
+ENDCFG
+
+eval {
+    my $dbh_pdb = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'root', '', { RaiseError => 1 });
+
+    ## every delegate's rows, under a single header
+    my $sth = $dbh_pdb->prepare('SELECT DATABASE() AS db, 1 AS one');
+    $sth->execute();
+    ok($sth->{NUM_OF_FIELDS} == 2);
+    my $rows = $sth->fetchall_arrayref();
+    ok(@$rows == 3);
+    is(join(',', sort map { $_->[0] } @$rows), 'master,partition_1,partition_2');
+    ok(!grep { $_->[1] != 1 } @$rows);
+
+    ## and the connection is still in step afterwards
+    my $row = $dbh_pdb->selectall_arrayref('SELECT 2');
+    ok(@$row == 3);
+
+    $dbh_pdb->disconnect();
+};
+ok($@ eq '');
+
+PDBTest::shutdown();
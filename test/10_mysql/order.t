@@ -0,0 +1,58 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+use DBI;
+use DBD::mysql;
+
+use lib qw(test);
+use MySQLTest;
+use PDBTest;
+
+my $port = 2139;
+
+PDBTest::startup_with_inline_configuration(<<"ENDCFG");
+log_file = test/pdb.log
+log_level = DEBUG
+
+listen_port = $port
+
+$MySQLTest::database_configuration
+ENDCFG
+
+sub column ($$) {
+    my ($dbh, $sql) = @_;
+    return join(',', map { $_->[0] } @{$dbh->selectall_arrayref($sql)});
+}
+
+eval {
+    my $dbh_pdb = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'root', '', { RaiseError => 1 });
+
+    ## every delegate's rows, merged in order
+    is(column($dbh_pdb, 'SELECT DATABASE() AS db ORDER BY db DESC'),
+       'partition_2,partition_1,master');
+
+    ## numbers compare as numbers
+    is(column($dbh_pdb, "SELECT IF(DATABASE() = 'master', 10, IF(DATABASE() = 'partition_1', 2, 7)) AS n ORDER BY 1"),
+       '2,7,10');
+
+    ## text compares as the collation does
+    is(column($dbh_pdb, "SELECT CASE DATABASE() WHEN 'master' THEN 'b' WHEN 'partition_1' THEN 'A' ELSE 'C' END AS t ORDER BY t"),
+       'A,b,C');
+
+    ## rows can't be merged in order of something they haven't got
+    ok(!eval { $dbh_pdb->selectall_arrayref('SELECT widget_id FROM widget ORDER BY widget_information LIMIT 2'); 1 });
+    ok(!eval { $dbh_pdb->selectall_arrayref('SELECT widget_id FROM widget ORDER BY widget_id + 1 LIMIT 2'); 1 });
+
+    ## unless they come from a single delegate
+    is(column($dbh_pdb, 'SELECT widget_id FROM widget WHERE widget_id IN (1, 2) ORDER BY widget_information DESC'),
+       '2,1');
+
+    $dbh_pdb->disconnect();
+};
+ok($@ eq '');
+
+PDBTest::shutdown();
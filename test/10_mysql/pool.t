@@ -0,0 +1,75 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+use DBI;
+use DBD::mysql;
+
+use lib qw(test);
+use MySQLTest;
+use PDBTest;
+
+my $port = 2139;
+
+PDBTest::startup_with_inline_configuration(<<"ENDCFG");
+log_file = test/pdb.log
+log_level = DEBUG
+
+listen_port = $port
+
+concurrency_model = event
+event_workers = 1
+
+pool_min = 1
+pool_max = 1
+
+$MySQLTest::database_configuration
+ENDCFG
+
+eval {
+    my $dbh_pdb = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'root', '', { RaiseError => 1 });
+
+    my $row = $dbh_pdb->selectall_arrayref('SELECT DATABASE(),USER()')->[0];
+    ok($row);
+    ok($row->[0] eq 'master');
+    ok($row->[1] =~ /^root/);
+
+    $row = $dbh_pdb->selectall_arrayref("LISTFIELDS whatsit");
+    ok($row);
+
+    # a second client shares the pool's single connection per delegate
+    my $dbh_other = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'root', '', { RaiseError => 1 });
+    $row = $dbh_other->selectall_arrayref('SELECT DATABASE()')->[0];
+    ok($row->[0] eq 'master');
+    $dbh_other->disconnect();
+
+    # the connection is held for the length of a transaction
+    $dbh_pdb->do('BEGIN');
+    my $rv = $dbh_pdb->do("UPDATE whatsit SET description = 'pooled' WHERE whatsit_id = 1");
+    ok($rv == 1);
+    $dbh_pdb->do('COMMIT');
+
+    # and for the rest of the session once it's left state there which
+    # can't be replayed, even though the session's SET makes pdb reset a
+    # connection it gives back
+    $dbh_pdb->do('CREATE TABLE counter (counter_id INTEGER NOT NULL AUTO_INCREMENT PRIMARY KEY, note VARCHAR(16) NOT NULL)');
+    $dbh_pdb->do('SET @pooled = 1');
+    $rv = $dbh_pdb->do("INSERT INTO counter (note) VALUES ('pooled')");
+    ok($rv == 1);
+    my $id = $dbh_pdb->{mysql_insertid};
+    ok($id > 0);
+    my %ids = map { $_->[0] => $_->[1] } @{$dbh_pdb->selectall_arrayref('SELECT DATABASE(), LAST_INSERT_ID()')};
+    ok($ids{master} == $id);
+    $dbh_pdb->do('DROP TABLE counter');
+
+    $dbh_pdb->disconnect();
+};
+ok($@ eq '');
+
+PDBTest::shutdown();
+
+like(`cat test/pdb.log`, qr/delegate_pool: master: \d+ acquired/,
+     "pool counters weren't logged");
@@ -0,0 +1,85 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+use DBI;
+use DBD::mysql;
+
+use lib qw(test);
+use MySQLTest;
+use PDBTest;
+
+my $port = 2139;
+
+PDBTest::startup_with_inline_configuration(<<"ENDCFG");
+log_file = test/pdb.log
+log_level = DEBUG
+
+listen_port = $port
+
+statement_cache_size = 2
+
+$MySQLTest::database_configuration
+ENDCFG
+
+eval {
+    my $dbh_pdb = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port;mysql_server_prepare=1", 'root', '', { RaiseError => 1 });
+
+    ## every delegate's rows, from a statement prepared on each of them
+    my $sth = $dbh_pdb->prepare('SELECT DATABASE() AS db, ? AS n');
+    $sth->execute(5);
+    my $rows = $sth->fetchall_arrayref();
+    is(join(',', sort map { $_->[0] } @$rows), 'master,partition_1,partition_2');
+    ok(!grep { $_->[1] != 5 } @$rows);
+
+    ## executed again, with the types the client already sent
+    $sth->execute(7);
+    $rows = $sth->fetchall_arrayref();
+    ok(@$rows == 3);
+    ok(!grep { $_->[1] != 7 } @$rows);
+
+    ## on the master alone
+    my $rv = $dbh_pdb->do('update whatsit set description = ? where whatsit_id = ?', undef, 'poot', 1);
+    ok($rv == 1);
+
+    ## on the partition holding the key bound
+    $sth = $dbh_pdb->prepare('SELECT DATABASE() FROM widget WHERE widget_id = ?');
+    $sth->execute(3);
+    is(join(',', map { $_->[0] } @{$sth->fetchall_arrayref()}), 'partition_2');
+
+    ## a new key's row goes to one partition, as does a keyless one's
+    $sth = $dbh_pdb->prepare('INSERT INTO widget (widget_id, widget_information) VALUES (?, ?)');
+    $sth->execute(9, 'prepared');
+    $dbh_pdb->prepare("INSERT INTO widget (widget_information, widget_id) VALUES ('prepared', 10 + ?)")->execute(0);
+    $rows = $dbh_pdb->selectall_arrayref(q{SELECT DATABASE() FROM widget WHERE widget_information = 'prepared'});
+    ok(@$rows == 2);
+    ok(!grep { $_->[0] eq 'master' } @$rows);
+    $dbh_pdb->do(q{DELETE FROM widget WHERE widget_information = 'prepared'});
+
+    ## results which would have to be merged are refused
+    $sth = $dbh_pdb->prepare('SELECT COUNT(*) FROM widget');
+    ok(!eval { $sth->execute(); 1 });
+
+    ## more statements than each delegate connection keeps prepared
+    my @statements = map { $dbh_pdb->prepare("SELECT $_ + ? AS n") } (0 .. 3);
+    for my $round (0 .. 1) {
+        for my $n (0 .. 3) {
+            $statements[$n]->execute(1);
+            $rows = $statements[$n]->fetchall_arrayref();
+            is(join(',', map { $_->[0] } @$rows), join(',', ($n + 1) x 3));
+        }
+    }
+
+    ## and the connection is still in step afterwards
+    $sth->finish();
+    my $row = $dbh_pdb->selectall_arrayref('SELECT 2');
+    ok(@$row == 3);
+
+    $dbh_pdb->disconnect();
+};
+ok($@ eq '');
+
+PDBTest::shutdown();
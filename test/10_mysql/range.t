@@ -0,0 +1,79 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+use DBI;
+use DBD::mysql;
+
+use lib qw(test);
+use MySQLTest;
+use PDBTest;
+
+my $port = 2139;
+
+PDBTest::startup_with_inline_configuration(<<"ENDCFG");
+log_file = test/pdb.log
+log_level = DEBUG
+
+listen_port = $port
+
+$MySQLTest::database_configuration
+
+partitioned_table gadget
+{
+    key = gadget_id
+}
+
+map_table gadget_ranges
+{
+    key = gadget_id
+    range_bounds = {10, 20}
+    range_partition_ids = {1, 2, 1}
+}
+ENDCFG
+
+eval {
+    my $dbh_pdb = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'root', '', { RaiseError => 1 });
+
+    my $rows;
+    my $rv;
+
+    $dbh_pdb->do('DROP TABLE IF EXISTS gadget');
+    $dbh_pdb->do('CREATE TABLE gadget (gadget_id INTEGER NOT NULL PRIMARY KEY, gadget_information VARCHAR(256) NOT NULL)');
+
+    ## each row goes to the partition holding its key's range
+    $rv = $dbh_pdb->do('INSERT INTO gadget VALUES (5, \'five\'), (15, \'fifteen\'), (25, \'twenty-five\')');
+    ok($rv == 3);
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE(), gadget_id FROM gadget ORDER BY gadget_id');
+    is(join(',', map { "$_->[0]:$_->[1]" } @$rows), 'partition_1:5,partition_2:15,partition_1:25');
+
+    ## bounded statements go to the partitions holding the ranges they span
+    ## (each partition asked answering with a row of its own)
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE(), COUNT(*) FROM gadget WHERE gadget_id < 10');
+    is(join(',', map { "$_->[0]:$_->[1]" } @$rows), 'partition_1:1');
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE(), COUNT(*) FROM gadget WHERE gadget_id >= 10 AND 20 > gadget_id');
+    is(join(',', map { "$_->[0]:$_->[1]" } @$rows), 'partition_2:1');
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE(), COUNT(*) FROM gadget WHERE gadget_id BETWEEN 8 AND 12');
+    is(join(',', sort map { "$_->[0]:$_->[1]" } @$rows), 'partition_1:0,partition_2:0');
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE(), COUNT(*) FROM gadget WHERE gadget_id >= 20 OR gadget_id = 5');
+    is(join(',', map { "$_->[0]:$_->[1]" } @$rows), 'partition_1:2');
+    $rv = $dbh_pdb->do('UPDATE gadget SET gadget_information = gadget_information WHERE gadget_id > 12');
+    like($dbh_pdb->{mysql_info}, qr/^Rows matched: 2 /);
+
+    ## and any others to every partition
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE(), COUNT(*) FROM gadget WHERE gadget_id <> 15');
+    is(join(',', sort map { "$_->[0]:$_->[1]" } @$rows), 'partition_1:2,partition_2:0');
+    $rows = $dbh_pdb->selectall_arrayref("SELECT DATABASE(), COUNT(*) FROM gadget WHERE gadget_id = '5 '");
+    is(join(',', sort map { "$_->[0]:$_->[1]" } @$rows), 'partition_1:1,partition_2:0');
+    $rows = $dbh_pdb->selectall_arrayref("SELECT DATABASE(), COUNT(*) FROM gadget WHERE gadget_id > 'x'");
+    ok(@$rows == 2);
+
+    $dbh_pdb->do('DROP TABLE gadget');
+    $dbh_pdb->disconnect();
+};
+ok($@ eq '');
+
+PDBTest::shutdown();
@@ -0,0 +1,98 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+use DBI;
+use DBD::mysql;
+
+use lib qw(test);
+use MySQLTest;
+use PDBTest;
+
+my $port = 2139;
+
+PDBTest::startup_with_inline_configuration(<<"ENDCFG");
+log_file = test/pdb.log
+log_level = DEBUG
+
+listen_port = $port
+
+$MySQLTest::database_configuration
+ENDCFG
+
+eval {
+    my $dbh_pdb = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'root', '', { RaiseError => 1 });
+
+    my $rows;
+    my $rv;
+
+    ## master tables are only on the master, whatever the case or comments
+    $rows = $dbh_pdb->selectall_arrayref('/* count */ SELECT COUNT(*) FROM whatsit');
+    is($rows->[0][0], 1);
+    $rows = $dbh_pdb->selectall_arrayref("select description from `whatsit` -- one row\n where whatsit_id = 1");
+    ok(@$rows == 1);
+    $rv = $dbh_pdb->do('UPDATE whatsit SET description = \'update widget\' WHERE whatsit_id = 1');
+    ok($rv == 1);
+
+    ## joined master tables
+    $rows = $dbh_pdb->selectall_arrayref('SELECT m.partition_id FROM widget_map AS m JOIN whatsit w ON w.whatsit_id = m.widget_id');
+    ok(@$rows == 1);
+    is($rows->[0][0], 1);
+
+    ## a statement naming no table still goes everywhere
+    $rows = $dbh_pdb->selectall_arrayref('WITH t AS (SELECT DATABASE() AS db) SELECT db FROM t');
+    is(join(',', sort map { $_->[0] } @$rows), 'master,partition_1,partition_2');
+
+    ## keyed statements go to the partition widget_map has the key on
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE(), widget_id FROM widget WHERE widget_id = 3');
+    ok(@$rows == 1);
+    is($rows->[0][0], 'partition_2');
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE() FROM widget WHERE widget_id = \'1\' AND widget_information IS NOT NULL');
+    is(join(',', map { $_->[0] } @$rows), 'partition_1');
+    $rows = $dbh_pdb->selectall_arrayref("SELECT DATABASE() FROM widget WHERE widget_information <> 'it''s, or widget_id = 1' AND widget_id = 3");
+    is(join(',', map { $_->[0] } @$rows), 'partition_2');
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE() FROM widget WHERE widget_id = \'003\'');
+    is(join(',', map { $_->[0] } @$rows), 'partition_2');
+
+    ## IN lists and OR'd keys go to the partitions holding them, each
+    ## partition being asked for its own keys
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE(), widget_id FROM widget WHERE widget_id IN (1, 3, 4) ORDER BY widget_id');
+    is(join(',', map { "$_->[0]:$_->[1]" } @$rows), 'partition_1:1,partition_2:3,partition_2:4');
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE() FROM widget WHERE widget_id = 2 OR widget_id = 1');
+    is(join(',', map { $_->[0] } @$rows), 'partition_1,partition_1');
+    $rv = $dbh_pdb->do('UPDATE widget SET widget_information = widget_information WHERE widget_id IN (2, 3)');
+    like($dbh_pdb->{mysql_info}, qr/^Rows matched: 2 /);
+
+    ## a new key's row goes to a single partition, with the other new keys'
+    ## rows, while each known key's row goes to its own
+    $rv = $dbh_pdb->do("REPLACE INTO widget (widget_id, widget_information) VALUES (1, 'widget one'), (7, 'seven'), (3, 'widget three'), (8, 'eight')");
+    ok($rv >= 4);
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE(), widget_id FROM widget WHERE widget_id IN (1, 3) ORDER BY widget_id');
+    is(join(',', map { "$_->[0]:$_->[1]" } @$rows), 'partition_1:1,partition_2:3');
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DISTINCT DATABASE() FROM widget WHERE widget_id IN (7, 8)');
+    ok(@$rows == 1);
+    $rv = $dbh_pdb->do('DELETE FROM widget WHERE widget_id IN (7, 8)');
+    ok($rv == 2);
+
+    ## statements of a shape already seen go by their own keys
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE(), widget_id FROM widget WHERE widget_id = 1');
+    is($rows->[0][0], 'partition_1');
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE(), widget_id FROM widget WHERE widget_id IN (2, 3, 1) ORDER BY widget_id');
+    is(join(',', map { "$_->[0]:$_->[1]" } @$rows), 'partition_1:1,partition_1:2,partition_2:3');
+
+    ## and any others to every partition
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DISTINCT DATABASE() FROM widget WHERE widget_id > 0');
+    is(join(',', sort map { $_->[0] } @$rows), 'partition_1,partition_2');
+
+    ## including any with keys MySQL runs in an executable comment
+    $rows = $dbh_pdb->selectall_arrayref('SELECT DATABASE() FROM widget WHERE widget_id = 1 /*! OR widget_id = 3 */');
+    is(join(',', sort map { $_->[0] } @$rows), 'partition_1,partition_2');
+
+    $dbh_pdb->disconnect();
+};
+ok($@ eq '');
+
+PDBTest::shutdown();
@@ -0,0 +1,65 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+use Socket;
+use DBI;
+use DBD::mysql;
+
+use lib qw(test);
+use MySQLTest;
+use PDBTest;
+
+my $port = 2139;
+my $clients = 4;
+my $rounds = 20;
+
+PDBTest::startup_with_inline_configuration(<<"ENDCFG");
+log_file = test/pdb.log
+log_level = DEBUG
+
+listen_port = $port
+
+concurrency_model = thread
+thread_workers = 2
+
+$MySQLTest::database_configuration
+ENDCFG
+
+## several clients at once, spread over the reactor threads, each sending
+## keyed statements and statements for every partition
+my @pids;
+for my $client (1 .. $clients) {
+    my $pid = fork();
+    die "can't fork: $!" unless defined $pid;
+    if (!$pid) {
+        my $failed = 0;
+        eval {
+            my $dbh_pdb = DBI->connect("DBI:mysql:database=irrelevant;host=127.0.0.1;port=$port", 'root', '', { RaiseError => 1 });
+            for my $round (1 .. $rounds) {
+                my $key = ($client + $round) % 4 + 1;
+                my $rows = $dbh_pdb->selectall_arrayref("SELECT DATABASE(), widget_id FROM widget WHERE widget_id = $key");
+                $failed ||= !(@$rows == 1 && $rows->[0][1] == $key
+                              && $rows->[0][0] eq ($key <= 2 ? 'partition_1' : 'partition_2'));
+                $rows = $dbh_pdb->selectall_arrayref('SELECT COUNT(*) FROM widget');
+                $failed ||= $rows->[0][0] != 4;
+                $rows = $dbh_pdb->selectall_arrayref('SELECT widget_id FROM widget ORDER BY widget_id');
+                $failed ||= join(',', map { $_->[0] } @$rows) ne '1,2,3,4';
+            }
+            $dbh_pdb->disconnect();
+        };
+        exit(($failed || $@) ? 1 : 0);
+    }
+    push(@pids, $pid);
+}
+
+for my $pid (@pids) {
+    waitpid($pid, 0);
+    ok($? == 0, "client $pid");
+}
+
+PDBTest::shutdown();
+
+like(`cat test/pdb.log`, qr/reactor 1 started/, "reactors didn't start");
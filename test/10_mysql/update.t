@@ -49,6 +49,7 @@ eval {
     ## update partitions without specifying key (parallel)
     $rv = $dbh_pdb->do('update widget set widget_information = \'boot\' where widget_information = \'poot\'');
     ok($rv == 2);
+    like($dbh_pdb->{mysql_info}, qr/^Rows matched: 2 /);
 
     $dbh_pdb->disconnect();
 };
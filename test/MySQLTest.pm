@@ -39,6 +39,7 @@ delegate $server->{'name'}
     hostname = 127.0.0.1
     port = $server->{'port'}
     name = $server->{'name'}
+    user = root
 }
 
 partitioned_table widget
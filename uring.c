@@ -0,0 +1,828 @@
+/* system includes */
+#ifdef __linux__
+/* syscall() and MAP_POPULATE are GNU extensions */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+#include <sys/types.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#endif
+
+/* project includes */
+#include "uring.h"
+
+/* multishot receives arrived in 6.0, along with IORING_RECV_MULTISHOT */
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+
+/** submission queue entries per ring (completions get twice as many) */
+#define RING_ENTRIES 64
+
+/** provided buffers per ring; a power of two */
+#define BUFFER_COUNT 32
+/** bytes per provided buffer */
+#define BUFFER_SIZE 8192
+/** the group all of a ring's provided buffers belong to */
+#define BUFFER_GROUP 0
+/** unread bytes an inbox may hold before receiving on its socket pauses,
+    leaving the rest to wait in the kernel (and the sender) */
+#define INBOX_WINDOW (BUFFER_COUNT * BUFFER_SIZE)
+
+/** what a completion's user_data refers to, in its low byte */
+#define TAG_SEND 1    /**< a send slot */
+#define TAG_POLL 2    /**< a poll linked to a send slot */
+#define TAG_RECEIVE 3 /**< a socket's inbox */
+#define TAG_CANCEL 4
+#define TAG_BITS 8
+
+/**
+ * Data received on a socket, not yet read.
+ */
+typedef struct {
+    char *bytes;
+    int start;     /**< first unread byte */
+    int size;      /**< one past the last unread byte */
+    int allocated;
+    short armed;   /**< a multishot receive is outstanding */
+    short pausing; /**< ...and is being cancelled, the inbox being full */
+    short ended;   /**< end of file or an error follows the bytes */
+    int error;     /**< ...the errno, if an error */
+    void *data;
+} inbox;
+
+/**
+ * A queued send, kept until it has all been written.
+ */
+typedef struct {
+    short used;
+    short cancelled; /**< the socket is being forgotten */
+    int fd;
+    const char *bytes;
+    int size;
+    int sent;
+    void *data;
+} send_slot;
+
+/**
+ * A thread's ring.
+ */
+typedef struct {
+    int fd;
+
+    void *sq_map;
+    size_t sq_map_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned queued; /**< entries written but not yet submitted */
+
+    void *cq_map;
+    size_t cq_map_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buffer_ring;
+    size_t buffer_ring_size;
+    char *buffers;
+    unsigned short buffer_tail;
+
+    inbox *inboxes;  /**< indexed by file descriptor */
+    int inbox_count;
+    send_slot *slots;
+    int slot_count;
+
+    uring_completion *reports;  /**< completions not yet handed out */
+    int report_count;
+    int reports_allocated;
+} ring;
+
+/** this thread's ring, if open */
+static __thread ring *r = 0;
+
+static int ring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(unsigned submit, unsigned wait)
+{
+    return (int)syscall(__NR_io_uring_enter, r->fd, submit, wait,
+                        wait ? IORING_ENTER_GETEVENTS : 0, (void *)0, 0);
+}
+
+static int ring_register(unsigned op, void *arg, unsigned count)
+{
+    return (int)syscall(__NR_io_uring_register, r->fd, op, arg, count);
+}
+
+/**
+ * Give a provided buffer (back) to the kernel.
+ *
+ * @param[in] id the buffer
+ */
+static void buffer_provide(unsigned short id)
+{
+    struct io_uring_buf *b =
+        &r->buffer_ring->bufs[r->buffer_tail & (BUFFER_COUNT - 1)];
+    b->addr = (unsigned long)(r->buffers + (size_t)id * BUFFER_SIZE);
+    b->len = BUFFER_SIZE;
+    b->bid = id;
+    ++r->buffer_tail;
+    __atomic_store_n(&r->buffer_ring->tail, r->buffer_tail,
+                     __ATOMIC_RELEASE);
+}
+
+/**
+ * Undo as much of uring_open() as got done.
+ */
+static void ring_free(void)
+{
+    if (r->fd != -1) {
+        close(r->fd);
+    }
+    if (r->sqes && (r->sqes != MAP_FAILED)) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_map && (r->cq_map != MAP_FAILED) && (r->cq_map != r->sq_map)) {
+        munmap(r->cq_map, r->cq_map_size);
+    }
+    if (r->sq_map && (r->sq_map != MAP_FAILED)) {
+        munmap(r->sq_map, r->sq_map_size);
+    }
+    if (r->buffer_ring && ((void *)r->buffer_ring != MAP_FAILED)) {
+        munmap(r->buffer_ring, r->buffer_ring_size);
+    }
+    for (int fd = 0; fd < r->inbox_count; ++fd) {
+        free(r->inboxes[fd].bytes);
+    }
+    free(r->inboxes);
+    free(r->buffers);
+    free(r->slots);
+    free(r->reports);
+    free(r);
+    r = 0;
+}
+
+int uring_open(void)
+{
+    if (r) {
+        return 1;
+    }
+
+    r = calloc(1, sizeof(ring));
+    if (!r) {
+        return 0;
+    }
+
+    /* single issuer (6.0) doubles as a check for multishot receives */
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    r->fd = ring_setup(RING_ENTRIES, &params);
+    if ((r->fd == -1)
+        || !(params.features & IORING_FEAT_FAST_POLL)
+        || !(params.features & IORING_FEAT_NODROP)) {
+        int error = (r->fd == -1) ? errno : ENOSYS;
+        ring_free();
+        errno = error;
+        return 0;
+    }
+
+    r->sq_map_size = params.sq_off.array + params.sq_entries *
+        sizeof(unsigned);
+    r->cq_map_size = params.cq_off.cqes + params.cq_entries *
+        sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_size > r->sq_map_size) {
+            r->sq_map_size = r->cq_map_size;
+        }
+        r->cq_map_size = r->sq_map_size;
+    }
+    r->sq_map = mmap(0, r->sq_map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        goto failed;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(0, r->cq_map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd,
+                         IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            goto failed;
+        }
+    }
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(0, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        goto failed;
+    }
+
+    char *sq = r->sq_map;
+    r->sq_head = (unsigned *)(sq + params.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    r->sq_entries = params.sq_entries;
+    r->sq_array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < r->sq_entries; ++i) {
+        r->sq_array[i] = i;
+    }
+    char *cq = r->cq_map;
+    r->cq_head = (unsigned *)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    /* the buffer ring must be page aligned */
+    r->buffer_ring_size = BUFFER_COUNT * sizeof(struct io_uring_buf);
+    r->buffer_ring = mmap(0, r->buffer_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->buffers = malloc((size_t)BUFFER_COUNT * BUFFER_SIZE);
+    if (((void *)r->buffer_ring == MAP_FAILED) || !r->buffers) {
+        goto failed;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)r->buffer_ring;
+    reg.ring_entries = BUFFER_COUNT;
+    reg.bgid = BUFFER_GROUP;
+    if (ring_register(IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        goto failed;
+    }
+    for (unsigned short id = 0; id < BUFFER_COUNT; ++id) {
+        buffer_provide(id);
+    }
+    return 1;
+
+  failed:
+    {
+        int error = errno;
+        ring_free();
+        errno = error;
+    }
+    return 0;
+}
+
+short uring_active(void)
+{
+    return r != 0;
+}
+
+/**
+ * Find a socket's inbox.
+ *
+ * @param[in] fd the socket
+ * @param[in] create make one if need be?
+ * @return the inbox, or 0 if there isn't one (or no memory for it)
+ */
+static inbox *inbox_find(int fd, short create)
+{
+    if (!r || (fd < 0)) {
+        return 0;
+    }
+    if (fd >= r->inbox_count) {
+        if (!create) {
+            return 0;
+        }
+        int count = (fd + 1 > r->inbox_count * 2) ? fd + 1 :
+            r->inbox_count * 2;
+        inbox *inboxes = realloc(r->inboxes, sizeof(inbox) * count);
+        if (!inboxes) {
+            return 0;
+        }
+        memset(inboxes + r->inbox_count, 0,
+               sizeof(inbox) * (count - r->inbox_count));
+        r->inboxes = inboxes;
+        r->inbox_count = count;
+    }
+    return &r->inboxes[fd];
+}
+
+/**
+ * Add received bytes to an inbox.
+ *
+ * @param[in,out] b the inbox
+ * @param[in] bytes the data
+ * @param[in] size the number of bytes of data
+ * @return 1 on success, 0 on failure
+ */
+static int inbox_append(inbox * b, const char *bytes, int size)
+{
+    if (b->start == b->size) {
+        b->start = b->size = 0;
+    }
+    if (b->size + size > b->allocated) {
+        if (b->start > 0) {
+            memmove(b->bytes, b->bytes + b->start, b->size - b->start);
+            b->size -= b->start;
+            b->start = 0;
+        }
+        if (b->size + size > b->allocated) {
+            int allocated = b->allocated ? b->allocated : BUFFER_SIZE;
+            while (allocated < b->size + size) {
+                allocated *= 2;
+            }
+            char *grown = realloc(b->bytes, allocated);
+            if (!grown) {
+                return 0;
+            }
+            b->bytes = grown;
+            b->allocated = allocated;
+        }
+    }
+    memcpy(b->bytes + b->size, bytes, size);
+    b->size += size;
+    return 1;
+}
+
+/**
+ * Pass a completion on to the next uring_wait().
+ *
+ * @param[in] kind the kind of completion
+ * @param[in] fd the socket
+ * @param[in] data the caller's data
+ * @param[in] result the result
+ * @return 1 on success, 0 on failure
+ */
+static int report(uring_kind kind, int fd, void *data, int result)
+{
+    if (r->report_count == r->reports_allocated) {
+        int allocated = r->reports_allocated ? r->reports_allocated * 2 :
+            RING_ENTRIES;
+        uring_completion *reports =
+            realloc(r->reports, sizeof(uring_completion) * allocated);
+        if (!reports) {
+            return 0;
+        }
+        r->reports = reports;
+        r->reports_allocated = allocated;
+    }
+
+    uring_completion *c = &r->reports[r->report_count++];
+    c->kind = kind;
+    c->fd = fd;
+    c->data = data;
+    c->result = result;
+    return 1;
+}
+
+/**
+ * Get a submission queue entry, submitting what's queued if the queue is
+ * full.
+ *
+ * @return a zeroed entry, or 0 on failure
+ */
+static struct io_uring_sqe *sqe_get(void)
+{
+    unsigned tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+        r->sq_entries) {
+        int submitted = ring_enter(r->queued, 0);
+        if (submitted <= 0) {
+            return 0;
+        }
+        r->queued -= submitted;
+    }
+
+    struct io_uring_sqe *sqe = &r->sqes[tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->queued;
+    return sqe;
+}
+
+/**
+ * Queue (the rest of) a send slot's data, after a poll if it would block.
+ *
+ * @param[in] slot the slot's index
+ * @param[in] poll_first wait for the socket to be writable first?
+ * @return 1 on success, 0 on failure
+ */
+static int slot_queue(int slot, short poll_first)
+{
+    send_slot *s = &r->slots[slot];
+    struct io_uring_sqe *sqe;
+
+    if (poll_first) {
+        sqe = sqe_get();
+        if (!sqe) {
+            return 0;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = s->fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = ((unsigned long long)slot << TAG_BITS) | TAG_POLL;
+    }
+
+    sqe = sqe_get();
+    if (!sqe) {
+        return 0;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = s->fd;
+    sqe->addr = (unsigned long)(s->bytes + s->sent);
+    sqe->len = s->size - s->sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ((unsigned long long)slot << TAG_BITS) | TAG_SEND;
+    return 1;
+}
+
+int uring_send(int fd, const char *bytes, int size, void *data)
+{
+    int slot = 0;
+    while ((slot < r->slot_count) && r->slots[slot].used) {
+        ++slot;
+    }
+    if (slot == r->slot_count) {
+        int count = r->slot_count ? r->slot_count * 2 : RING_ENTRIES;
+        send_slot *slots = realloc(r->slots, sizeof(send_slot) * count);
+        if (!slots) {
+            return 0;
+        }
+        memset(slots + r->slot_count, 0,
+               sizeof(send_slot) * (count - r->slot_count));
+        r->slots = slots;
+        r->slot_count = count;
+    }
+
+    send_slot *s = &r->slots[slot];
+    s->used = 1;
+    s->cancelled = 0;
+    s->fd = fd;
+    s->bytes = bytes;
+    s->size = size;
+    s->sent = 0;
+    s->data = data;
+    if (!slot_queue(slot, 0)) {
+        s->used = 0;
+        return 0;
+    }
+    return 1;
+}
+
+int uring_receive(int fd, void *data)
+{
+    inbox *b = inbox_find(fd, 1);
+    if (!b) {
+        return 0;
+    }
+
+    b->data = data;
+    if (b->armed || b->ended || (b->size - b->start >= INBOX_WINDOW)) {
+        return 1;
+    }
+
+    struct io_uring_sqe *sqe = sqe_get();
+    if (!sqe) {
+        return 0;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = ((unsigned long long)fd << TAG_BITS) | TAG_RECEIVE;
+    b->armed = 1;
+    return 1;
+}
+
+int uring_buffered(int fd)
+{
+    inbox *b = inbox_find(fd, 0);
+    if (!b) {
+        return 0;
+    }
+    return (b->size - b->start) + (b->ended ? 1 : 0);
+}
+
+/**
+ * Deal with a send's completion.
+ *
+ * @param[in] slot the send slot
+ * @param[in] result the completion's result
+ * @return 1 on success, 0 on failure
+ */
+static int send_completed(int slot, int result)
+{
+    send_slot *s = &r->slots[slot];
+
+    if (s->cancelled) {
+        s->used = 0;
+        return 1;
+    }
+    if (result == -EAGAIN) {
+        return slot_queue(slot, 1);
+    }
+    if (result > 0) {
+        s->sent += result;
+        if (s->sent < s->size) {
+            return slot_queue(slot, 0);
+        }
+        result = s->size;
+    } else if (result == 0) {
+        result = -EPIPE;
+    }
+
+    s->used = 0;
+    return report(URING_SENT, s->fd, s->data, result);
+}
+
+/**
+ * Stop receiving on a socket whose inbox is full; uring_receive() starts
+ * again once it has been read.
+ *
+ * @param[in] fd the socket
+ * @param[in,out] b its inbox
+ */
+static void inbox_pause(int fd, inbox * b)
+{
+    if (!b->armed || b->pausing || (b->size - b->start < INBOX_WINDOW)) {
+        return;
+    }
+
+    /* if there's no room to cancel now, the next completion will try */
+    struct io_uring_sqe *sqe = sqe_get();
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = ((unsigned long long)fd << TAG_BITS) | TAG_RECEIVE;
+        sqe->user_data = TAG_CANCEL;
+        b->pausing = 1;
+    }
+}
+
+/**
+ * Deal with a receive's completion.
+ *
+ * @param[in] fd the socket
+ * @param[in] result the completion's result
+ * @param[in] flags the completion's flags
+ * @return 1 on success, 0 on failure
+ */
+static int receive_completed(int fd, int result, unsigned flags)
+{
+    inbox *b = inbox_find(fd, 0);
+    int ok = 1;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned short id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (result > 0) {
+            ok = inbox_append(b, r->buffers + (size_t)id * BUFFER_SIZE,
+                              result);
+        }
+        buffer_provide(id);
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        b->armed = 0;
+        b->pausing = 0;
+    }
+    inbox_pause(fd, b);
+
+    if ((result == -ENOBUFS) || (result == -ECANCELED)) {
+        /* stopped, but nothing's wrong with the socket */
+        return ok;
+    }
+    if (result <= 0) {
+        b->ended = 1;
+        b->error = -result;
+    }
+    return ok && report(URING_RECEIVED, fd, b->data, result);
+}
+
+/**
+ * Deal with every completion which has arrived.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int reap(void)
+{
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    int ok = 1;
+
+    for (; head != tail; ++head) {
+        struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+        int value = (int)(cqe->user_data >> TAG_BITS);
+
+        switch (cqe->user_data & ((1 << TAG_BITS) - 1)) {
+        case TAG_SEND:
+            ok = send_completed(value, cqe->res) && ok;
+            break;
+        case TAG_RECEIVE:
+            ok = receive_completed(value, cqe->res, cqe->flags) && ok;
+            break;
+        case TAG_POLL:
+            /* a failed poll cancels its send, which reports it */
+        case TAG_CANCEL:
+        default:
+            break;
+        };
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return ok;
+}
+
+int uring_wait(uring_completion * done, int max)
+{
+    if (!reap()) {
+        return -1;
+    }
+    while ((r->report_count == 0) || (r->queued > 0)) {
+        int submitted = ring_enter(r->queued, r->report_count == 0);
+        if (submitted == -1) {
+            return -1;
+        }
+        r->queued -= submitted;
+        if (!reap()) {
+            return -1;
+        }
+    }
+
+    int n = (r->report_count < max) ? r->report_count : max;
+    memcpy(done, r->reports, sizeof(uring_completion) * n);
+    r->report_count -= n;
+    memmove(r->reports, r->reports + n,
+            sizeof(uring_completion) * r->report_count);
+    return n;
+}
+
+/**
+ * Is anything still outstanding for a socket?
+ *
+ * @param[in] fd the socket
+ * @return 1 if so; 0 otherwise.
+ */
+static short busy(int fd)
+{
+    inbox *b = inbox_find(fd, 0);
+    if (b && b->armed) {
+        return 1;
+    }
+    for (int slot = 0; slot < r->slot_count; ++slot) {
+        if (r->slots[slot].used && (r->slots[slot].fd == fd)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void uring_forget(int fd)
+{
+    if (!r || (fd < 0) || !busy(fd)) {
+        inbox *b = inbox_find(fd, 0);
+        if (b) {
+            b->start = b->size = 0;
+            b->ended = 0;
+            b->error = 0;
+            b->data = 0;
+        }
+        return;
+    }
+
+    for (int slot = 0; slot < r->slot_count; ++slot) {
+        if (r->slots[slot].used && (r->slots[slot].fd == fd)) {
+            r->slots[slot].cancelled = 1;
+        }
+    }
+
+    struct io_uring_sqe *sqe = sqe_get();
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = TAG_CANCEL;
+    }
+
+    /* the buffers belong to the caller again once everything has finished */
+    while (busy(fd)) {
+        int submitted = ring_enter(r->queued, 1);
+        if (submitted > 0) {
+            r->queued -= submitted;
+        } else if ((submitted == -1) && (errno != EINTR)) {
+            break;
+        }
+        reap();
+    }
+
+    int kept = 0;
+    for (int i = 0; i < r->report_count; ++i) {
+        if (r->reports[i].fd != fd) {
+            r->reports[kept++] = r->reports[i];
+        }
+    }
+    r->report_count = kept;
+
+    uring_forget(fd);
+}
+
+void uring_close(void)
+{
+    if (!r) {
+        return;
+    }
+    for (int fd = 0; fd < r->inbox_count; ++fd) {
+        uring_forget(fd);
+    }
+    for (int slot = 0; slot < r->slot_count; ++slot) {
+        if (r->slots[slot].used) {
+            uring_forget(r->slots[slot].fd);
+        }
+    }
+    ring_free();
+}
+
+ssize_t uring_read(int fd, void *buffer, size_t count)
+{
+    inbox *b = inbox_find(fd, 0);
+
+    if (b && (b->size > b->start)) {
+        size_t n = b->size - b->start;
+        if (n > count) {
+            n = count;
+        }
+        memcpy(buffer, b->bytes + b->start, n);
+        b->start += n;
+        return n;
+    }
+    if (b && b->ended) {
+        if (b->error) {
+            errno = b->error;
+            return -1;
+        }
+        return 0;
+    }
+    if (b && b->armed) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return read(fd, buffer, count);
+}
+
+#else
+
+int uring_open(void)
+{
+    errno = ENOSYS;
+    return 0;
+}
+
+void uring_close(void)
+{
+}
+
+short uring_active(void)
+{
+    return 0;
+}
+
+int uring_send(int fd, const char *bytes, int size, void *data)
+{
+    errno = ENOSYS;
+    return 0;
+}
+
+int uring_receive(int fd, void *data)
+{
+    errno = ENOSYS;
+    return 0;
+}
+
+int uring_buffered(int fd)
+{
+    return 0;
+}
+
+int uring_wait(uring_completion * done, int max)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_forget(int fd)
+{
+}
+
+ssize_t uring_read(int fd, void *buffer, size_t count)
+{
+    return read(fd, buffer, count);
+}
+
+#endif
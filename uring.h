@@ -0,0 +1,124 @@
+#ifndef __URING_H
+#define __URING_H
+
+/**
+ * @file uring.h
+ * @brief Batched socket I/O through io_uring(7).
+ *
+ * Each thread may open one ring. Sends to any number of sockets are queued,
+ * then submitted together by a single uring_wait(), which also collects
+ * every completion that is ready. Sockets can be armed for reception: the
+ * kernel then keeps receiving into a ring of buffers provided up front
+ * (without a system call per read), and the engine moves what arrives into a
+ * per-socket inbox, which uring_read() drains before falling back to read(2).
+ * An inbox only holds so much: receiving pauses once it's full, until it has
+ * been read and the socket is armed again.
+ *
+ * A send which would block is retried as a poll linked to the send, so the
+ * retry is still a single submission.
+ *
+ * Without io_uring (other systems, or kernels older than 6.0) uring_open()
+ * fails, and the caller carries on with poll(2) style readiness instead;
+ * uring_read() is then just read(2).
+ */
+
+#include <sys/types.h>
+
+/**
+ * Kinds of completion.
+ */
+typedef enum {
+    URING_SENT,    /**< a queued send finished; result is bytes or -errno */
+    URING_RECEIVED /**< data (result bytes), end of file (0) or an error
+                        (-errno) was added to a socket's inbox */
+} uring_kind;
+
+/**
+ * A single completion.
+ */
+typedef struct {
+    uring_kind kind;
+    int fd;
+    void *data;   /**< as given to uring_send() or uring_receive() */
+    int result;
+} uring_completion;
+
+/**
+ * Open this thread's ring, if it hasn't been already.
+ *
+ * @return 1 on success, 0 if io_uring isn't available (and errno will be set)
+ */
+int uring_open(void);
+
+/**
+ * Close this thread's ring, forgetting every socket.
+ */
+void uring_close(void);
+
+/**
+ * Has this thread opened a ring?
+ *
+ * @return 1 if so; 0 otherwise.
+ */
+short uring_active(void);
+
+/**
+ * Queue a send. The buffer must stay put until it completes.
+ *
+ * @param[in] fd a connected socket
+ * @param[in] bytes the data
+ * @param[in] size the number of bytes of data
+ * @param[in] data returned with the completion
+ * @return 1 on success, 0 on failure
+ */
+int uring_send(int fd, const char *bytes, int size, void *data);
+
+/**
+ * Make sure a socket is armed for reception, unless its inbox is full. Until
+ * uring_forget(), the socket must only be read with uring_read(), and
+ * readiness must come from uring_wait() rather than poll(2).
+ *
+ * @param[in] fd a connected socket
+ * @param[in] data returned with each completion
+ * @return 1 on success, 0 on failure
+ */
+int uring_receive(int fd, void *data);
+
+/**
+ * How many bytes are waiting in a socket's inbox?
+ *
+ * @param[in] fd a socket
+ * @return the byte count; end of file or an error counts as 1
+ */
+int uring_buffered(int fd);
+
+/**
+ * Submit everything queued, then wait for at least one completion.
+ *
+ * @param[out] done array to fill with completions
+ * @param[in] max size of the done array
+ * @return the number of completions, or -1 on failure (and errno will be
+ * set)
+ */
+int uring_wait(uring_completion * done, int max);
+
+/**
+ * Stop receiving on a socket and throw away its inbox; call this before the
+ * socket is closed or handed to someone else.
+ *
+ * @param[in] fd a socket
+ */
+void uring_forget(int fd);
+
+/**
+ * read(2), taking data from the socket's inbox first. A socket armed for
+ * reception with nothing in its inbox fails with EAGAIN.
+ *
+ * @param[in] fd a file descriptor
+ * @param[out] buffer where to put the data
+ * @param[in] count the size of buffer
+ * @return as read(2)
+ */
+ssize_t uring_read(int fd, void *buffer, size_t count);
+
+#endif